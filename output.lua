@@ -0,0 +1,30 @@
+local A__f
+function A()
+	local __obj={x=1}
+	__obj.f=function()
+		print("A.f")
+	end
+	__obj.g=function()
+		print("A.g")
+	end
+	return __obj
+end
+function A__f(__obj)
+	print("A.f")
+end
+function B()
+	local __obj={x=1}
+	__obj.f=function()
+		A__f(__obj)
+		print("B.f")
+	end
+	__obj.g=function()
+		print("A.g")
+	end
+	return __obj
+end
+b=B()
+b.f()
+b.g()
+a=A()
+a.f()
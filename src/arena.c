@@ -0,0 +1,93 @@
+#include "./internal.h"
+#include <stdlib.h>
+#include <assert.h>
+#define SCRATCH_CHUNK_SIZE 4096 // Default size in bytes of a chunk in the scratch arena
+static List *chunks;            // List of Chunks owned by the scratch arena
+static int chunk;               // Index of the chunk currently being allocated from
+static int used;                // Number of bytes used in the current chunk
+
+/*
+  Chunk: a block of memory in the scratch arena
+*/
+typedef struct
+{
+  char *data;
+  int size;
+} Chunk;
+
+/*
+  Initializes the scratch arena
+*/
+void init_scratch()
+{
+  chunks = new_default_list();
+  chunk = 0;
+  used = 0;
+}
+
+/*
+  Deallocates every chunk owned by the scratch arena
+  Every scratch allocation should have been released by the time we get here
+*/
+void dealloc_scratch()
+{
+  assert(!chunk && !used);
+  for (int a = 0; a < chunks->n; a++)
+  {
+    Chunk *c = (Chunk *)get_from_list(chunks, a);
+    free(c->data);
+    free(c);
+  }
+  dealloc_list(chunks);
+}
+
+/*
+  Allocates some transient memory from the scratch arena
+  The memory stays valid until a mark taken before this call is released
+  Chunks are kept after a release, so allocations only hit the heap while the arena is growing
+*/
+void *scratch_alloc(int size)
+{
+  size = (size + 7) & ~7;
+  while (chunk < chunks->n)
+  {
+    Chunk *c = (Chunk *)get_from_list(chunks, chunk);
+    if (used + size <= c->size)
+    {
+      void *e = c->data + used;
+      used += size;
+      return e;
+    }
+    chunk++;
+    used = 0;
+  }
+  Chunk *c = (Chunk *)malloc(sizeof(Chunk));
+  c->size = size > SCRATCH_CHUNK_SIZE ? size : SCRATCH_CHUNK_SIZE;
+  c->data = (char *)malloc(c->size);
+  add_to_list(chunks, c);
+  chunk = chunks->n - 1;
+  used = size;
+  return c->data;
+}
+
+/*
+  Returns the current position of the scratch arena
+  Pass it to scratch_release to free everything allocated after this point
+*/
+ScratchMark scratch_mark()
+{
+  ScratchMark mark;
+  mark.chunk = chunk;
+  mark.used = used;
+  return mark;
+}
+
+/*
+  Releases every scratch allocation made since mark was taken
+*/
+void scratch_release(ScratchMark mark)
+{
+  assert(mark.chunk < chunk || (mark.chunk == chunk && mark.used <= used));
+  chunk = mark.chunk;
+  used = mark.used;
+}
@@ -0,0 +1,92 @@
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Instantiates a new Buffer object with some initial max capacity in bytes
+*/
+Buffer *new_buffer(int max)
+{
+  Buffer *b = (Buffer *)malloc(sizeof(Buffer));
+  b->data = (char *)malloc(sizeof(char) * max);
+  b->max = max;
+  b->n = 0;
+  return b;
+}
+
+/*
+  Instantiates a Buffer with the default initial max capacity
+*/
+Buffer *new_default_buffer()
+{
+  return new_buffer(256);
+}
+
+/*
+  Appends n characters of str to a buffer
+  Doubles the buffer's capacity until the characters fit
+*/
+void append_to_buffer(Buffer *b, const char *str, int n)
+{
+  if (b->n + n > b->max)
+  {
+    while (b->n + n > b->max)
+      b->max *= 2;
+    char *data = (char *)malloc(sizeof(char) * b->max);
+    memcpy(data, b->data, b->n);
+    free(b->data);
+    b->data = data;
+  }
+  memcpy(b->data + b->n, str, n);
+  b->n += n;
+}
+
+/*
+  Inserts n characters of str into a buffer at position at
+  The characters after at are moved back to make room
+*/
+void insert_into_buffer(Buffer *b, int at, const char *str, int n)
+{
+  int tail = b->n - at;
+  append_to_buffer(b, str, n);
+  memmove(b->data + at + n, b->data + at, tail);
+  memcpy(b->data + at, str, n);
+}
+
+/*
+  Appends a null-terminated string to a buffer
+*/
+void append_string_to_buffer(Buffer *b, const char *str)
+{
+  append_to_buffer(b, str, strlen(str));
+}
+
+/*
+  Returns a null-terminated copy of a buffer's contents
+*/
+char *copy_buffer(Buffer *b)
+{
+  char *copy = (char *)malloc(sizeof(char) * (b->n + 1));
+  memcpy(copy, b->data, b->n);
+  copy[b->n] = 0;
+  return copy;
+}
+
+/*
+  Writes a buffer's contents to a stream and empties the buffer
+*/
+void flush_buffer(Buffer *b, FILE *f)
+{
+  if (b->n && f)
+    fwrite(b->data, sizeof(char), b->n, f);
+  b->n = 0;
+}
+
+/*
+  Deallocates a buffer and its contents
+*/
+void dealloc_buffer(Buffer *b)
+{
+  free(b->data);
+  free(b);
+}
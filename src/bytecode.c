@@ -0,0 +1,3269 @@
+#include "./internal.h"
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#define MAX_REGISTERS 255        // Most registers a Lua function can use
+#define MAX_LOCALS 200           // Most locals a Lua function can have active at once
+#define MAX_UPVALUES 255         // Most upvalues a Lua function can capture
+#define MAX_LEVELS 200           // Most nested syntax levels, to keep the compiler's C stack bounded
+#define FIELDS_PER_FLUSH 50      // Array items a table constructor stores with each SETLIST
+#define MAX_SHORT_STRING 40      // Longest string Lua 5.3 stores as a short string
+#define NO_JUMP -1               // Marks the end of a list of jumps
+#define NO_REGISTER 255          // Marks a TESTSET whose result isn't kept
+#define MULTIPLE_RESULTS -1      // Result count of calls that keep every value
+#define SIZE_B 9                 // Bits in the B argument of an instruction
+#define SIZE_BX 18               // Bits in the Bx argument of an instruction
+#define POSITION_A 6             // Position of the A argument in an instruction
+#define POSITION_C 14            // Position of the C argument in an instruction
+#define POSITION_B 23            // Position of the B argument in an instruction
+#define MAX_BX ((1 << SIZE_BX) - 1)
+#define MAX_SBX (MAX_BX >> 1)
+#define MAX_C ((1 << SIZE_B) - 1)
+#define MAX_AX ((1 << 26) - 1)
+#define CONSTANT_BIT (1 << (SIZE_B - 1))
+#define MAX_RK_INDEX (CONSTANT_BIT - 1)
+#define UNARY_PRIORITY 12
+
+// Lua 5.3 opcodes, in the order the virtual machine numbers them
+enum LUA_OPCODES
+{
+  OP_MOVE,
+  OP_LOADK,
+  OP_LOADKX,
+  OP_LOADBOOL,
+  OP_LOADNIL,
+  OP_GETUPVAL,
+  OP_GETTABUP,
+  OP_GETTABLE,
+  OP_SETTABUP,
+  OP_SETUPVAL,
+  OP_SETTABLE,
+  OP_NEWTABLE,
+  OP_SELF,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_MOD,
+  OP_POW,
+  OP_DIV,
+  OP_IDIV,
+  OP_BAND,
+  OP_BOR,
+  OP_BXOR,
+  OP_SHL,
+  OP_SHR,
+  OP_UNM,
+  OP_BNOT,
+  OP_NOT,
+  OP_LEN,
+  OP_CONCAT,
+  OP_JMP,
+  OP_EQ,
+  OP_LT,
+  OP_LE,
+  OP_TEST,
+  OP_TESTSET,
+  OP_CALL,
+  OP_TAILCALL,
+  OP_RETURN,
+  OP_FORLOOP,
+  OP_FORPREP,
+  OP_TFORCALL,
+  OP_TFORLOOP,
+  OP_SETLIST,
+  OP_CLOSURE,
+  OP_VARARG,
+  OP_EXTRAARG
+};
+
+// Kinds of expressions while their code is being generated
+enum EXPRESSIONS
+{
+  EXP_VOID,      // Empty expression list
+  EXP_NIL,       // Constant nil
+  EXP_TRUE,      // Constant true
+  EXP_FALSE,     // Constant false
+  EXP_CONSTANT,  // Constant in the constant table, at info
+  EXP_FLOAT,     // Float constant in nval
+  EXP_INTEGER,   // Integer constant in ival
+  EXP_REGISTER,  // Value in the register at info
+  EXP_LOCAL,     // Local variable in the register at info
+  EXP_UPVALUE,   // Upvalue at info
+  EXP_INDEXED,   // Table field, with the table at table and the R/K key at key
+  EXP_JUMP,      // Comparison, whose jump is at info
+  EXP_RELOCABLE, // Instruction at info, which can put its result in any register
+  EXP_CALL,      // Call instruction at info
+  EXP_VARARG     // Vararg instruction at info
+};
+
+// Binary operators, in the order of their arithmetic opcodes and then their comparisons
+enum BINARY_OPERATORS
+{
+  BIN_ADD,
+  BIN_SUB,
+  BIN_MUL,
+  BIN_MOD,
+  BIN_POW,
+  BIN_DIV,
+  BIN_IDIV,
+  BIN_BAND,
+  BIN_BOR,
+  BIN_BXOR,
+  BIN_SHL,
+  BIN_SHR,
+  BIN_CONCAT,
+  BIN_EQ,
+  BIN_LT,
+  BIN_LE,
+  BIN_NE,
+  BIN_GT,
+  BIN_GE,
+  BIN_AND,
+  BIN_OR,
+  BIN_NONE
+};
+
+// Unary operators fold_constants takes besides the arithmetic and bitwise BIN_* ones
+#define FOLD_UNM BIN_NONE
+#define FOLD_BNOT (BIN_NONE + 1)
+
+// Unary operators, in the order of their opcodes
+enum UNARY_OPERATORS
+{
+  UN_MINUS,
+  UN_BNOT,
+  UN_NOT,
+  UN_LEN,
+  UN_NONE
+};
+
+// Type tags of constants in a binary chunk
+enum CONSTANT_TYPES
+{
+  CONSTANT_NIL = 0,
+  CONSTANT_BOOL = 1,
+  CONSTANT_FLOAT = 3,
+  CONSTANT_SHORT_STRING = 4,
+  CONSTANT_INTEGER = 19,
+  CONSTANT_LONG_STRING = 20
+};
+
+// Binary operator tokens, in BIN_* order
+static const char *binary_operators[] = {
+    "+", "-", "*", "%", "^", "/", "//", "&", "|", "~", "<<", ">>", "..", "==", "<", "<=", "~=", ">", ">=",
+    "and", "or"};
+
+// Left and right priority of each binary operator, in BIN_* order
+static const int priorities[][2] = {
+    {10, 10}, {10, 10}, {11, 11}, {11, 11}, {14, 13}, {11, 11}, {11, 11}, {6, 6}, {4, 4}, {5, 5}, {7, 7},
+    {7, 7}, {9, 8}, {3, 3}, {3, 3}, {3, 3}, {3, 3}, {3, 3}, {3, 3}, {2, 2}, {1, 1}};
+
+/*
+  Lexeme: a token of the Lua code being compiled, with its value
+*/
+typedef struct
+{
+  int kind;        // LUA_* kind of the token, or -1 for the end of the code
+  char *text;      // Text of names, keywords and symbols, or the contents of strings
+  int length;      // Length of text, since strings can contain zeros
+  int integer;     // 1 if a number is an integer
+  long long ival;  // Value of an integer
+  double nval;     // Value of a float
+  int line;        // Line the token ends on
+} Lexeme;
+
+/*
+  Constant: a value in the constant table of a function
+*/
+typedef struct
+{
+  int type;       // CONSTANT_* type tag
+  long long ival; // Value of an integer or boolean
+  double nval;    // Value of a float
+  char *text;     // Contents of a string
+  int length;     // Length of a string
+} Constant;
+
+/*
+  Upvalue: a variable a function captures from the function around it
+*/
+typedef struct
+{
+  char *name;  // Name of the variable
+  int instack; // 1 if it's a local of the enclosing function, 0 if it's one of its upvalues
+  int index;   // Register or upvalue index in the enclosing function
+} Upvalue;
+
+/*
+  LocalVar: debug information about a local variable
+*/
+typedef struct
+{
+  char *name;  // Name of the variable
+  int startpc; // First instruction where the variable is active
+  int endpc;   // First instruction where the variable is dead
+} LocalVar;
+
+/*
+  Prototype: a compiled function
+*/
+typedef struct
+{
+  uint32_t *code;    // Instructions
+  int *lines;        // Source line of each instruction
+  int ncode;         // Number of instructions
+  int maxcode;       // Capacity of code and lines
+  List *constants;   // Constants used by the instructions
+  List *protos;      // Prototypes of the functions defined within this one
+  List *upvalues;    // Upvalues the function captures
+  List *locals;      // Debug information of every local variable
+  int numparams;     // Number of fixed parameters
+  int vararg;        // 1 if the function takes varargs
+  int maxstack;      // Number of registers the function needs
+  int linedefined;   // Line where the function starts
+  int lastline;      // Line where the function ends
+} Prototype;
+
+/*
+  Expression: an expression whose code is being generated
+*/
+typedef struct
+{
+  int k;          // EXP_* kind
+  int info;       // Register, constant, instruction or upvalue, depending on k
+  int table;      // Register or upvalue of the table of an indexed expression
+  int key;        // R/K key of an indexed expression
+  int table_kind; // EXP_LOCAL or EXP_UPVALUE, for where the table of an indexed expression is
+  long long ival; // Value of an integer constant
+  double nval;    // Value of a float constant
+  int t;          // Jumps to patch when the expression is true
+  int f;          // Jumps to patch when it's false
+} Expression;
+
+/*
+  Label: a label, or a pending goto or break
+*/
+typedef struct
+{
+  char *name;  // Name of the label, or "break"
+  int pc;      // Position of the label, or of the goto's jump
+  int line;    // Line the label or goto is on
+  int nactive; // Number of active locals at that point
+} Label;
+
+/*
+  Block: a block of the function being compiled
+*/
+typedef struct Block
+{
+  struct Block *previous; // Enclosing block
+  int firstlabel;         // Index of the block's first label
+  int firstgoto;          // Index of the block's first pending goto
+  int nactive;            // Number of active locals outside of the block
+  int upvalue;            // 1 if a local of the block is captured by a function
+  int loop;               // 1 if the block is a loop that can be broken out of
+} Block;
+
+/*
+  FunctionState: the state of a function being compiled
+*/
+typedef struct FunctionState
+{
+  Prototype *f;                  // Prototype being built
+  struct FunctionState *prev;    // Function around this one
+  Block *block;                  // Innermost block
+  List *active;                  // Indexes in f->locals of the declared locals, active or about to be
+  int pc;                        // Next instruction position
+  int lasttarget;                // Position of the last jump target
+  int jpc;                       // Jumps to the next instruction
+  int nactive;                   // Number of active locals
+  int freereg;                   // First free register
+} FunctionState;
+
+/*
+  Compiler: the state of a compilation from Lua code to a binary chunk
+*/
+typedef struct
+{
+  Lexeme *lexemes;     // Tokens of the code
+  int nlexemes;        // Number of tokens
+  int at;              // Index of the current token
+  FunctionState *fs;   // Function being compiled
+  List *labels;        // Active Labels
+  List *gotos;         // Pending gotos and breaks
+  List *functions;     // Every FunctionState, which is freed when compilation ends
+  List *prototypes;    // Every Prototype, which is freed when compilation ends
+  int levels;          // Number of syntax levels being parsed
+  jmp_buf failure;     // Where compilation returns to when it fails
+} Compiler;
+
+/*
+  Reports a compilation error on a line and stops compiling
+*/
+static void fail_on_line(Compiler *c, int line, const char *msg)
+{
+  add_error(line, "cannot compile the Lua code to bytecode, %s", msg);
+  longjmp(c->failure, 1);
+}
+
+/*
+  Reports a compilation error at the current token and stops compiling
+*/
+static void fail(Compiler *c, const char *msg)
+{
+  fail_on_line(c, c->lexemes[c->at].line, msg);
+}
+
+/*
+  Reads the value of a numeral the way Lua does
+  Integers that overflow become floats, except hexadecimal ones, which wrap around
+*/
+static void read_numeral(Lexeme *lx, const char *text, int n)
+{
+  char *copy = (char *)malloc(sizeof(char) * (n + 1));
+  memcpy(copy, text, n);
+  copy[n] = 0;
+  int hex = n > 1 && copy[0] == '0' && (copy[1] == 'x' || copy[1] == 'X');
+  int a = hex ? 2 : 0;
+  uint64_t value = 0;
+  int overflow = 0;
+  lx->integer = a < n;
+  for (; a < n; a++)
+  {
+    char c = copy[a];
+    int digit;
+    if ('0' <= c && c <= '9')
+      digit = c - '0';
+    else if (hex && 'a' <= (c | 32) && (c | 32) <= 'f')
+      digit = (c | 32) - 'a' + 10;
+    else
+    {
+      lx->integer = 0;
+      break;
+    }
+    if (hex)
+      value = value * 16 + digit;
+    else
+    {
+      if (value > (UINT64_MAX - digit) / 10 || value * 10 + digit > (uint64_t)INT64_MAX)
+        overflow = 1;
+      value = value * 10 + digit;
+    }
+  }
+  if (lx->integer && !overflow)
+    lx->ival = (long long)value;
+  else
+  {
+    lx->integer = 0;
+    lx->nval = strtod(copy, NULL);
+  }
+  free(copy);
+}
+
+/*
+  Returns the value of a hexadecimal digit, or -1 if c isn't one
+*/
+static int hex_digit(char c)
+{
+  if ('0' <= c && c <= '9')
+    return c - '0';
+  if ('a' <= (c | 32) && (c | 32) <= 'f')
+    return (c | 32) - 'a' + 10;
+  return -1;
+}
+
+/*
+  Appends a code point to a buffer as UTF-8
+*/
+static void append_utf8(Buffer *b, unsigned long x)
+{
+  char bytes[8];
+  int n = 0;
+  if (x < 0x80)
+    bytes[n++] = (char)x;
+  else
+  {
+    char tail[8];
+    int t = 0;
+    unsigned long limit = 0x3f;
+    do
+    {
+      tail[t++] = (char)(0x80 | (x & 0x3f));
+      x >>= 6;
+      limit >>= 1;
+    } while (x > limit);
+    bytes[n++] = (char)((~limit << 1) | x);
+    while (t)
+      bytes[n++] = tail[--t];
+  }
+  append_to_buffer(b, bytes, n);
+}
+
+/*
+  Reads the contents of a string literal, resolving its escape sequences
+*/
+static void read_string(Lexeme *lx, const char *text, int n)
+{
+  Buffer *b = new_default_buffer();
+  if (text[0] == '[')
+  {
+    int open = 1;
+    while (text[open] != '[')
+      open++;
+    open++;
+    int start = open;
+    if (text[start] == '\r' || text[start] == '\n')
+    {
+      int pair = start + 1 < n && (text[start + 1] == '\r' || text[start + 1] == '\n') && text[start + 1] != text[start];
+      start += pair ? 2 : 1;
+    }
+    int end = n - open;
+    if (end > start)
+      append_to_buffer(b, text + start, end - start);
+  }
+  else
+  {
+    for (int a = 1; a < n - 1; a++)
+    {
+      char c = text[a];
+      if (c != '\\')
+      {
+        append_to_buffer(b, &c, 1);
+        continue;
+      }
+      char e = text[++a];
+      char out;
+      switch (e)
+      {
+      case 'a':
+        out = '\a';
+        break;
+      case 'b':
+        out = '\b';
+        break;
+      case 'f':
+        out = '\f';
+        break;
+      case 'n':
+        out = '\n';
+        break;
+      case 'r':
+        out = '\r';
+        break;
+      case 't':
+        out = '\t';
+        break;
+      case 'v':
+        out = '\v';
+        break;
+      case 'x':
+        out = (char)(hex_digit(text[a + 1]) * 16 + hex_digit(text[a + 2]));
+        a += 2;
+        break;
+      case 'z':
+        while (a + 1 < n - 1 && (text[a + 1] == ' ' || text[a + 1] == '\t' || text[a + 1] == '\n' || text[a + 1] == '\r'))
+          a++;
+        continue;
+      case 'u':
+      {
+        unsigned long x = 0;
+        for (a += 2; text[a] != '}'; a++)
+          x = x * 16 + hex_digit(text[a]);
+        append_utf8(b, x);
+        continue;
+      }
+      default:
+        if ('0' <= e && e <= '9')
+        {
+          int x = 0;
+          for (int d = 0; d < 3 && '0' <= text[a] && text[a] <= '9'; d++)
+            x = x * 10 + (text[a++] - '0');
+          a--;
+          out = (char)x;
+        }
+        else
+          out = e;
+      }
+      append_to_buffer(b, &out, 1);
+    }
+  }
+  lx->length = b->n;
+  lx->text = (char *)malloc(sizeof(char) * (b->n + 1));
+  memcpy(lx->text, b->data, b->n);
+  lx->text[b->n] = 0;
+  dealloc_buffer(b);
+}
+
+/*
+  Splits Lua code into Lexemes, ending with one that marks the end of the code
+  Each Lexeme gets the line it ends on, which is the line Lua's own lexer is on after reading it
+*/
+static void read_lexemes(Compiler *c, const char *code, int n)
+{
+  int max = 256;
+  c->lexemes = (Lexeme *)malloc(sizeof(Lexeme) * max);
+  c->nlexemes = 0;
+  int line = 1;
+  int a = 0;
+  while (1)
+  {
+    int kind = -1;
+    int l = a < n ? scan_lua_token(code, a, n, &kind) : 0;
+    for (int b = a; b < a + (l ? l : 1) && b < n; b++)
+    {
+      if (code[b] == '\n')
+        line++;
+    }
+    if (c->nlexemes == max)
+    {
+      max *= 2;
+      c->lexemes = (Lexeme *)realloc(c->lexemes, sizeof(Lexeme) * max);
+    }
+    if (a >= n || (l && kind >= 0))
+    {
+      Lexeme *lx = c->lexemes + c->nlexemes++;
+      lx->kind = a < n ? kind : -1;
+      lx->line = line;
+      lx->text = NULL;
+      lx->length = 0;
+      if (a >= n)
+        break;
+      if (kind == LUA_NUMBER)
+        read_numeral(lx, code + a, l);
+      else if (kind == LUA_STRING)
+        read_string(lx, code + a, l);
+      else
+      {
+        lx->text = (char *)malloc(sizeof(char) * (l + 1));
+        memcpy(lx->text, code + a, l);
+        lx->text[l] = 0;
+        lx->length = l;
+      }
+    }
+    a += l ? l : 1;
+  }
+}
+
+/*
+  Returns the current token
+*/
+static Lexeme *current(Compiler *c)
+{
+  return c->lexemes + c->at;
+}
+
+/*
+  Returns the line of the last token that was read
+*/
+static int last_line(Compiler *c)
+{
+  return c->at ? c->lexemes[c->at - 1].line : 1;
+}
+
+/*
+  Returns 1 if the current token is the given keyword or symbol
+*/
+static int at_token(Compiler *c, const char *text)
+{
+  Lexeme *lx = current(c);
+  return (lx->kind == LUA_KEYWORD || lx->kind == LUA_SYMBOL) && !strcmp(lx->text, text);
+}
+
+/*
+  Moves on to the next token
+*/
+static void next(Compiler *c)
+{
+  if (c->at < c->nlexemes - 1)
+    c->at++;
+}
+
+/*
+  Skips the current token if it's the given keyword or symbol, and returns 1 if it was
+*/
+static int test_next(Compiler *c, const char *text)
+{
+  if (!at_token(c, text))
+    return 0;
+  next(c);
+  return 1;
+}
+
+/*
+  Skips the current token, which has to be the given keyword or symbol
+*/
+static void check_next(Compiler *c, const char *text)
+{
+  if (!test_next(c, text))
+    fail(c, "unexpected symbol");
+}
+
+/*
+  Reads a name and returns it
+*/
+static char *check_name(Compiler *c)
+{
+  Lexeme *lx = current(c);
+  if (lx->kind != LUA_NAME)
+    fail(c, "name expected");
+  next(c);
+  return lx->text;
+}
+
+/*
+  Returns 1 if the current token ends a block
+*/
+static int block_follows(Compiler *c, int until)
+{
+  if (current(c)->kind < 0)
+    return 1;
+  return at_token(c, "else") || at_token(c, "elseif") || at_token(c, "end") || (until && at_token(c, "until"));
+}
+
+/*
+  Enters a nested syntax level
+*/
+static void enter_level(Compiler *c)
+{
+  if (++c->levels > MAX_LEVELS)
+    fail(c, "the chunk has too many syntax levels");
+}
+
+/*
+  Allocates a Prototype that's freed when compilation ends
+*/
+static Prototype *new_prototype(Compiler *c)
+{
+  Prototype *f = (Prototype *)malloc(sizeof(Prototype));
+  f->maxcode = 64;
+  f->code = (uint32_t *)malloc(sizeof(uint32_t) * f->maxcode);
+  f->lines = (int *)malloc(sizeof(int) * f->maxcode);
+  f->ncode = 0;
+  f->constants = new_default_list();
+  f->protos = new_default_list();
+  f->upvalues = new_default_list();
+  f->locals = new_default_list();
+  f->numparams = 0;
+  f->vararg = 0;
+  f->maxstack = 2;
+  f->linedefined = 0;
+  f->lastline = 0;
+  add_to_list(c->prototypes, f);
+  return f;
+}
+
+/*
+  Deallocates a Prototype, but not the prototypes within it
+*/
+static void dealloc_prototype(Prototype *f)
+{
+  for (int a = 0; a < f->constants->n; a++)
+    free(get_from_list(f->constants, a));
+  for (int a = 0; a < f->upvalues->n; a++)
+    free(get_from_list(f->upvalues, a));
+  for (int a = 0; a < f->locals->n; a++)
+    free(get_from_list(f->locals, a));
+  dealloc_list(f->constants);
+  dealloc_list(f->protos);
+  dealloc_list(f->upvalues);
+  dealloc_list(f->locals);
+  free(f->code);
+  free(f->lines);
+  free(f);
+}
+
+// Instruction encoding
+static uint32_t create_abc(int op, int a, int b, int c)
+{
+  return (uint32_t)op | ((uint32_t)a << POSITION_A) | ((uint32_t)b << POSITION_B) | ((uint32_t)c << POSITION_C);
+}
+static uint32_t create_abx(int op, int a, int bx)
+{
+  return (uint32_t)op | ((uint32_t)a << POSITION_A) | ((uint32_t)bx << POSITION_C);
+}
+static int get_opcode(uint32_t i)
+{
+  return i & 0x3f;
+}
+static int get_a(uint32_t i)
+{
+  return (i >> POSITION_A) & 0xff;
+}
+static int get_b(uint32_t i)
+{
+  return (i >> POSITION_B) & MAX_C;
+}
+static int get_c(uint32_t i)
+{
+  return (i >> POSITION_C) & MAX_C;
+}
+static int get_sbx(uint32_t i)
+{
+  return (int)((i >> POSITION_C) & MAX_BX) - MAX_SBX;
+}
+static void set_argument(uint32_t *i, int position, int size, int value)
+{
+  uint32_t mask = ((1u << size) - 1) << position;
+  *i = (*i & ~mask) | (((uint32_t)value << position) & mask);
+}
+static void set_a(uint32_t *i, int value)
+{
+  set_argument(i, POSITION_A, 8, value);
+}
+static void set_b(uint32_t *i, int value)
+{
+  set_argument(i, POSITION_B, SIZE_B, value);
+}
+static void set_c(uint32_t *i, int value)
+{
+  set_argument(i, POSITION_C, SIZE_B, value);
+}
+static void set_sbx(uint32_t *i, int value)
+{
+  set_argument(i, POSITION_C, SIZE_BX, value + MAX_SBX);
+}
+static int is_constant(int rk)
+{
+  return rk >= 0 && (rk & CONSTANT_BIT);
+}
+
+/*
+  Returns 1 if an opcode is a test, which is followed by the jump it controls
+*/
+static int is_test(int op)
+{
+  return op == OP_EQ || op == OP_LT || op == OP_LE || op == OP_TEST || op == OP_TESTSET;
+}
+
+/*
+  Sets up an Expression
+*/
+static void init_expression(Expression *e, int k, int info)
+{
+  memset(e, 0, sizeof(Expression));
+  e->k = k;
+  e->info = info;
+  e->t = NO_JUMP;
+  e->f = NO_JUMP;
+}
+
+/*
+  Returns 1 if an expression has pending jumps
+*/
+static int has_jumps(Expression *e)
+{
+  return e->t != NO_JUMP || e->f != NO_JUMP;
+}
+
+/*
+  Returns 1 if an expression can return any number of values
+*/
+static int has_multiple_results(int k)
+{
+  return k == EXP_CALL || k == EXP_VARARG;
+}
+
+/*
+  Returns the instruction that computes an expression
+*/
+static uint32_t *get_instruction(FunctionState *fs, Expression *e)
+{
+  return fs->f->code + e->info;
+}
+
+// Jump lists, which are threaded through the offsets of the pending jumps
+
+/*
+  Returns the destination of a jump, or NO_JUMP if it's the end of a list
+*/
+static int get_jump(FunctionState *fs, int pc)
+{
+  int offset = get_sbx(fs->f->code[pc]);
+  return offset == NO_JUMP ? NO_JUMP : pc + 1 + offset;
+}
+
+/*
+  Points the jump at pc to dest
+*/
+static void fix_jump(Compiler *c, FunctionState *fs, int pc, int dest)
+{
+  int offset = dest - (pc + 1);
+  if (offset > MAX_SBX || -offset > MAX_SBX)
+    fail(c, "a control structure is too long");
+  set_sbx(fs->f->code + pc, offset);
+}
+
+/*
+  Appends the jump list l2 to the jump list at l1
+*/
+static void concat_jumps(Compiler *c, FunctionState *fs, int *l1, int l2)
+{
+  if (l2 == NO_JUMP)
+    return;
+  if (*l1 == NO_JUMP)
+  {
+    *l1 = l2;
+    return;
+  }
+  int list = *l1;
+  int next_jump;
+  while ((next_jump = get_jump(fs, list)) != NO_JUMP)
+    list = next_jump;
+  fix_jump(c, fs, list, l2);
+}
+
+/*
+  Returns the instruction that controls a jump, which is the test before it if there is one
+*/
+static uint32_t *get_jump_control(FunctionState *fs, int pc)
+{
+  if (pc >= 1 && is_test(get_opcode(fs->f->code[pc - 1])))
+    return fs->f->code + pc - 1;
+  return fs->f->code + pc;
+}
+
+/*
+  Makes the TESTSET controlling a jump put its value in reg, or turns it into a TEST if reg is NO_REGISTER
+  Returns 0 if the jump isn't controlled by a TESTSET
+*/
+static int patch_test_register(FunctionState *fs, int node, int reg)
+{
+  uint32_t *i = get_jump_control(fs, node);
+  if (get_opcode(*i) != OP_TESTSET)
+    return 0;
+  if (reg != NO_REGISTER && reg != get_b(*i))
+    set_a(i, reg);
+  else
+    *i = create_abc(OP_TEST, get_b(*i), 0, get_c(*i));
+  return 1;
+}
+
+/*
+  Keeps the jumps in a list from producing values
+*/
+static void remove_values(FunctionState *fs, int list)
+{
+  for (; list != NO_JUMP; list = get_jump(fs, list))
+    patch_test_register(fs, list, NO_REGISTER);
+}
+
+/*
+  Points the jumps in a list at vtarget if they produce a value in reg, and at dtarget otherwise
+*/
+static void patch_list_aux(Compiler *c, FunctionState *fs, int list, int vtarget, int reg, int dtarget)
+{
+  while (list != NO_JUMP)
+  {
+    int next_jump = get_jump(fs, list);
+    if (patch_test_register(fs, list, reg))
+      fix_jump(c, fs, list, vtarget);
+    else
+      fix_jump(c, fs, list, dtarget);
+    list = next_jump;
+  }
+}
+
+/*
+  Points the jumps to the next instruction at it, now that it's being written
+*/
+static void discharge_jpc(Compiler *c, FunctionState *fs)
+{
+  patch_list_aux(c, fs, fs->jpc, fs->pc, NO_REGISTER, fs->pc);
+  fs->jpc = NO_JUMP;
+}
+
+/*
+  Marks the next instruction as a jump target and returns its position
+*/
+static int get_label(FunctionState *fs)
+{
+  fs->lasttarget = fs->pc;
+  return fs->pc;
+}
+
+/*
+  Points a jump list at the next instruction
+*/
+static void patch_to_here(Compiler *c, FunctionState *fs, int list)
+{
+  get_label(fs);
+  concat_jumps(c, fs, &fs->jpc, list);
+}
+
+/*
+  Points a jump list at target
+*/
+static void patch_list(Compiler *c, FunctionState *fs, int list, int target)
+{
+  if (target == fs->pc)
+    patch_to_here(c, fs, list);
+  else
+    patch_list_aux(c, fs, list, target, NO_REGISTER, target);
+}
+
+/*
+  Makes the jumps in a list close the upvalues of the locals from level up
+*/
+static void patch_close(FunctionState *fs, int list, int level)
+{
+  for (; list != NO_JUMP; list = get_jump(fs, list))
+    set_a(fs->f->code + list, level + 1);
+}
+
+// Code generation
+
+/*
+  Appends an instruction to the function and returns its position
+*/
+static int code(Compiler *c, FunctionState *fs, uint32_t i)
+{
+  Prototype *f = fs->f;
+  discharge_jpc(c, fs);
+  if (f->ncode == f->maxcode)
+  {
+    f->maxcode *= 2;
+    f->code = (uint32_t *)realloc(f->code, sizeof(uint32_t) * f->maxcode);
+    f->lines = (int *)realloc(f->lines, sizeof(int) * f->maxcode);
+  }
+  f->code[fs->pc] = i;
+  f->lines[fs->pc] = last_line(c);
+  f->ncode = ++fs->pc;
+  return fs->pc - 1;
+}
+static int code_abc(Compiler *c, FunctionState *fs, int op, int a, int b, int cc)
+{
+  return code(c, fs, create_abc(op, a, b, cc));
+}
+static int code_abx(Compiler *c, FunctionState *fs, int op, int a, int bx)
+{
+  return code(c, fs, create_abx(op, a, bx));
+}
+static int code_asbx(Compiler *c, FunctionState *fs, int op, int a, int sbx)
+{
+  return code(c, fs, create_abx(op, a, sbx + MAX_SBX));
+}
+static void code_extra(Compiler *c, FunctionState *fs, int ax)
+{
+  code(c, fs, (uint32_t)OP_EXTRAARG | ((uint32_t)ax << POSITION_A));
+}
+
+/*
+  Sets the line of the last instruction
+*/
+static void fix_line(FunctionState *fs, int line)
+{
+  fs->f->lines[fs->pc - 1] = line;
+}
+
+/*
+  Writes a jump and returns its position
+  The jumps pending to the next instruction are chained onto it instead
+*/
+static int jump(Compiler *c, FunctionState *fs)
+{
+  int jpc = fs->jpc;
+  fs->jpc = NO_JUMP;
+  int j = code_asbx(c, fs, OP_JMP, 0, NO_JUMP);
+  concat_jumps(c, fs, &j, jpc);
+  return j;
+}
+
+/*
+  Writes a jump back to target
+*/
+static void jump_to(Compiler *c, FunctionState *fs, int target)
+{
+  patch_list(c, fs, jump(c, fs), target);
+}
+
+/*
+  Writes a return of nret values starting at first
+*/
+static void code_return(Compiler *c, FunctionState *fs, int first, int nret)
+{
+  code_abc(c, fs, OP_RETURN, first, nret + 1, 0);
+}
+
+/*
+  Writes a test and the jump it controls, and returns the jump
+*/
+static int conditional_jump(Compiler *c, FunctionState *fs, int op, int a, int b, int cc)
+{
+  code_abc(c, fs, op, a, b, cc);
+  return jump(c, fs);
+}
+
+/*
+  Sets n registers from from to nil, merging with the instruction before if it did the same
+*/
+static void code_nil(Compiler *c, FunctionState *fs, int from, int n)
+{
+  int l = from + n - 1;
+  if (fs->pc > fs->lasttarget && fs->pc > 0)
+  {
+    uint32_t *previous = fs->f->code + fs->pc - 1;
+    if (get_opcode(*previous) == OP_LOADNIL)
+    {
+      int pfrom = get_a(*previous);
+      int pl = pfrom + get_b(*previous);
+      if ((pfrom <= from && from <= pl + 1) || (from <= pfrom && pfrom <= l + 1))
+      {
+        if (pfrom < from)
+          from = pfrom;
+        if (pl > l)
+          l = pl;
+        set_a(previous, from);
+        set_b(previous, l - from);
+        return;
+      }
+    }
+  }
+  code_abc(c, fs, OP_LOADNIL, from, n - 1, 0);
+}
+
+/*
+  Makes sure the function has room for n more registers
+*/
+static void check_stack(Compiler *c, FunctionState *fs, int n)
+{
+  int size = fs->freereg + n;
+  if (size > fs->f->maxstack)
+  {
+    if (size >= MAX_REGISTERS)
+      fail(c, "a function or expression needs too many registers");
+    fs->f->maxstack = size;
+  }
+}
+
+/*
+  Reserves n registers
+*/
+static void reserve_registers(Compiler *c, FunctionState *fs, int n)
+{
+  check_stack(c, fs, n);
+  fs->freereg += n;
+}
+
+/*
+  Frees a register if it's a temporary one
+*/
+static void free_register(FunctionState *fs, int reg)
+{
+  if (reg >= 0 && !is_constant(reg) && reg >= fs->nactive)
+    fs->freereg--;
+}
+
+/*
+  Frees the register an expression is in, if it's a temporary one
+*/
+static void free_expression(FunctionState *fs, Expression *e)
+{
+  if (e->k == EXP_REGISTER)
+    free_register(fs, e->info);
+}
+
+/*
+  Frees the registers of two expressions, in the order they were reserved
+*/
+static void free_expressions(FunctionState *fs, Expression *e1, Expression *e2)
+{
+  int r1 = e1->k == EXP_REGISTER ? e1->info : -1;
+  int r2 = e2->k == EXP_REGISTER ? e2->info : -1;
+  if (r1 > r2)
+  {
+    free_register(fs, r1);
+    free_register(fs, r2);
+  }
+  else
+  {
+    free_register(fs, r2);
+    free_register(fs, r1);
+  }
+}
+
+/*
+  Adds a constant to the function, reusing an equal one, and returns its index
+*/
+static int add_constant(Compiler *c, FunctionState *fs, Constant *k)
+{
+  List *ls = fs->f->constants;
+  for (int a = 0; a < ls->n; a++)
+  {
+    Constant *other = (Constant *)get_from_list(ls, a);
+    if (other->type != k->type)
+      continue;
+    if (k->type == CONSTANT_NIL)
+      return a;
+    if ((k->type == CONSTANT_BOOL || k->type == CONSTANT_INTEGER) && other->ival == k->ival)
+      return a;
+    if (k->type == CONSTANT_FLOAT && !memcmp(&other->nval, &k->nval, sizeof(double)))
+      return a;
+    if ((k->type == CONSTANT_SHORT_STRING || k->type == CONSTANT_LONG_STRING) && other->length == k->length &&
+        !memcmp(other->text, k->text, k->length))
+      return a;
+  }
+  if (ls->n > MAX_AX)
+    fail(c, "a function has too many constants");
+  Constant *copy = (Constant *)malloc(sizeof(Constant));
+  *copy = *k;
+  add_to_list(ls, copy);
+  return ls->n - 1;
+}
+static int string_constant(Compiler *c, FunctionState *fs, char *text, int length)
+{
+  Constant k = {length > MAX_SHORT_STRING ? CONSTANT_LONG_STRING : CONSTANT_SHORT_STRING, 0, 0, text, length};
+  return add_constant(c, fs, &k);
+}
+static int integer_constant(Compiler *c, FunctionState *fs, long long ival)
+{
+  Constant k = {CONSTANT_INTEGER, ival, 0, NULL, 0};
+  return add_constant(c, fs, &k);
+}
+static int float_constant(Compiler *c, FunctionState *fs, double nval)
+{
+  Constant k = {CONSTANT_FLOAT, 0, nval, NULL, 0};
+  return add_constant(c, fs, &k);
+}
+static int bool_constant(Compiler *c, FunctionState *fs, int b)
+{
+  Constant k = {CONSTANT_BOOL, b, 0, NULL, 0};
+  return add_constant(c, fs, &k);
+}
+static int nil_constant(Compiler *c, FunctionState *fs)
+{
+  Constant k = {CONSTANT_NIL, 0, 0, NULL, 0};
+  return add_constant(c, fs, &k);
+}
+
+/*
+  Loads constant k into reg
+*/
+static int code_constant(Compiler *c, FunctionState *fs, int reg, int k)
+{
+  if (k <= MAX_BX)
+    return code_abx(c, fs, OP_LOADK, reg, k);
+  int p = code_abx(c, fs, OP_LOADKX, reg, 0);
+  code_extra(c, fs, k);
+  return p;
+}
+
+/*
+  Makes a call or vararg expression return nresults values
+*/
+static void set_returns(Compiler *c, FunctionState *fs, Expression *e, int nresults)
+{
+  if (e->k == EXP_CALL)
+    set_c(get_instruction(fs, e), nresults + 1);
+  else if (e->k == EXP_VARARG)
+  {
+    uint32_t *i = get_instruction(fs, e);
+    set_b(i, nresults + 1);
+    set_a(i, fs->freereg);
+    reserve_registers(c, fs, 1);
+  }
+}
+
+/*
+  Makes a call or vararg expression return one value
+*/
+static void set_one_return(FunctionState *fs, Expression *e)
+{
+  if (e->k == EXP_CALL)
+  {
+    e->k = EXP_REGISTER;
+    e->info = get_a(*get_instruction(fs, e));
+  }
+  else if (e->k == EXP_VARARG)
+  {
+    set_b(get_instruction(fs, e), 2);
+    e->k = EXP_RELOCABLE;
+  }
+}
+
+/*
+  Writes the code to read a variable, so the expression becomes a value
+*/
+static void discharge_variables(Compiler *c, FunctionState *fs, Expression *e)
+{
+  switch (e->k)
+  {
+  case EXP_LOCAL:
+    e->k = EXP_REGISTER;
+    break;
+  case EXP_UPVALUE:
+    e->info = code_abc(c, fs, OP_GETUPVAL, 0, e->info, 0);
+    e->k = EXP_RELOCABLE;
+    break;
+  case EXP_INDEXED:
+  {
+    int op = OP_GETTABUP;
+    free_register(fs, e->key);
+    if (e->table_kind == EXP_LOCAL)
+    {
+      free_register(fs, e->table);
+      op = OP_GETTABLE;
+    }
+    e->info = code_abc(c, fs, op, 0, e->table, e->key);
+    e->k = EXP_RELOCABLE;
+    break;
+  }
+  case EXP_VARARG:
+  case EXP_CALL:
+    set_one_return(fs, e);
+    break;
+  }
+}
+
+/*
+  Puts the value of an expression in reg, leaving comparisons as they are
+*/
+static void discharge_to_register(Compiler *c, FunctionState *fs, Expression *e, int reg)
+{
+  discharge_variables(c, fs, e);
+  switch (e->k)
+  {
+  case EXP_NIL:
+    code_nil(c, fs, reg, 1);
+    break;
+  case EXP_FALSE:
+  case EXP_TRUE:
+    code_abc(c, fs, OP_LOADBOOL, reg, e->k == EXP_TRUE, 0);
+    break;
+  case EXP_CONSTANT:
+    code_constant(c, fs, reg, e->info);
+    break;
+  case EXP_FLOAT:
+    code_constant(c, fs, reg, float_constant(c, fs, e->nval));
+    break;
+  case EXP_INTEGER:
+    code_constant(c, fs, reg, integer_constant(c, fs, e->ival));
+    break;
+  case EXP_RELOCABLE:
+    set_a(get_instruction(fs, e), reg);
+    break;
+  case EXP_REGISTER:
+    if (reg != e->info)
+      code_abc(c, fs, OP_MOVE, reg, e->info, 0);
+    break;
+  default:
+    return;
+  }
+  e->info = reg;
+  e->k = EXP_REGISTER;
+}
+
+/*
+  Puts the value of an expression in a register, if it isn't in one already
+*/
+static void discharge_to_any_register(Compiler *c, FunctionState *fs, Expression *e)
+{
+  if (e->k != EXP_REGISTER)
+  {
+    reserve_registers(c, fs, 1);
+    discharge_to_register(c, fs, e, fs->freereg - 1);
+  }
+}
+
+/*
+  Writes a LOADBOOL, which can be the target of jumps
+*/
+static int code_load_bool(Compiler *c, FunctionState *fs, int a, int b, int skip)
+{
+  get_label(fs);
+  return code_abc(c, fs, OP_LOADBOOL, a, b, skip);
+}
+
+/*
+  Returns 1 if a jump in a list doesn't produce its own value
+*/
+static int needs_value(FunctionState *fs, int list)
+{
+  for (; list != NO_JUMP; list = get_jump(fs, list))
+  {
+    if (get_opcode(*get_jump_control(fs, list)) != OP_TESTSET)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Puts the value of an expression in reg, including the values of its pending jumps
+*/
+static void expression_to_register(Compiler *c, FunctionState *fs, Expression *e, int reg)
+{
+  discharge_to_register(c, fs, e, reg);
+  if (e->k == EXP_JUMP)
+    concat_jumps(c, fs, &e->t, e->info);
+  if (has_jumps(e))
+  {
+    int load_false = NO_JUMP;
+    int load_true = NO_JUMP;
+    if (needs_value(fs, e->t) || needs_value(fs, e->f))
+    {
+      int fj = e->k == EXP_JUMP ? NO_JUMP : jump(c, fs);
+      load_false = code_load_bool(c, fs, reg, 0, 1);
+      load_true = code_load_bool(c, fs, reg, 1, 0);
+      patch_to_here(c, fs, fj);
+    }
+    int final = get_label(fs);
+    patch_list_aux(c, fs, e->f, final, reg, load_false);
+    patch_list_aux(c, fs, e->t, final, reg, load_true);
+  }
+  e->f = e->t = NO_JUMP;
+  e->info = reg;
+  e->k = EXP_REGISTER;
+}
+
+/*
+  Puts the value of an expression in the next free register
+*/
+static void expression_to_next_register(Compiler *c, FunctionState *fs, Expression *e)
+{
+  discharge_variables(c, fs, e);
+  free_expression(fs, e);
+  reserve_registers(c, fs, 1);
+  expression_to_register(c, fs, e, fs->freereg - 1);
+}
+
+/*
+  Puts the value of an expression in some register and returns it
+*/
+static int expression_to_any_register(Compiler *c, FunctionState *fs, Expression *e)
+{
+  discharge_variables(c, fs, e);
+  if (e->k == EXP_REGISTER)
+  {
+    if (!has_jumps(e))
+      return e->info;
+    if (e->info >= fs->nactive)
+    {
+      expression_to_register(c, fs, e, e->info);
+      return e->info;
+    }
+  }
+  expression_to_next_register(c, fs, e);
+  return e->info;
+}
+
+/*
+  Puts the value of an expression in a register unless it's an upvalue
+*/
+static void expression_to_any_register_or_upvalue(Compiler *c, FunctionState *fs, Expression *e)
+{
+  if (e->k != EXP_UPVALUE || has_jumps(e))
+    expression_to_any_register(c, fs, e);
+}
+
+/*
+  Makes an expression a value, in a register if it has jumps
+*/
+static void expression_to_value(Compiler *c, FunctionState *fs, Expression *e)
+{
+  if (has_jumps(e))
+    expression_to_any_register(c, fs, e);
+  else
+    discharge_variables(c, fs, e);
+}
+
+/*
+  Returns the R/K operand for an expression, which is a constant index if it fits or a register otherwise
+*/
+static int expression_to_rk(Compiler *c, FunctionState *fs, Expression *e)
+{
+  expression_to_value(c, fs, e);
+  int k = -1;
+  switch (e->k)
+  {
+  case EXP_TRUE:
+    k = bool_constant(c, fs, 1);
+    break;
+  case EXP_FALSE:
+    k = bool_constant(c, fs, 0);
+    break;
+  case EXP_NIL:
+    k = nil_constant(c, fs);
+    break;
+  case EXP_INTEGER:
+    k = integer_constant(c, fs, e->ival);
+    break;
+  case EXP_FLOAT:
+    k = float_constant(c, fs, e->nval);
+    break;
+  case EXP_CONSTANT:
+    k = e->info;
+    break;
+  }
+  if (k >= 0)
+  {
+    e->k = EXP_CONSTANT;
+    e->info = k;
+    if (k <= MAX_RK_INDEX)
+      return k | CONSTANT_BIT;
+  }
+  return expression_to_any_register(c, fs, e);
+}
+
+/*
+  Stores the value of ex in the variable var
+*/
+static void store_variable(Compiler *c, FunctionState *fs, Expression *var, Expression *ex)
+{
+  if (var->k == EXP_LOCAL)
+  {
+    free_expression(fs, ex);
+    expression_to_register(c, fs, ex, var->info);
+    return;
+  }
+  if (var->k == EXP_UPVALUE)
+    code_abc(c, fs, OP_SETUPVAL, expression_to_any_register(c, fs, ex), var->info, 0);
+  else
+  {
+    int op = var->table_kind == EXP_LOCAL ? OP_SETTABLE : OP_SETTABUP;
+    code_abc(c, fs, op, var->table, var->key, expression_to_rk(c, fs, ex));
+  }
+  free_expression(fs, ex);
+}
+
+/*
+  Writes a SELF, which puts the method key of e and e itself in two registers for a method call
+*/
+static void code_self(Compiler *c, FunctionState *fs, Expression *e, Expression *key)
+{
+  expression_to_any_register(c, fs, e);
+  int reg = e->info;
+  free_expression(fs, e);
+  e->info = fs->freereg;
+  e->k = EXP_REGISTER;
+  reserve_registers(c, fs, 2);
+  code_abc(c, fs, OP_SELF, e->info, reg, expression_to_rk(c, fs, key));
+  free_expression(fs, key);
+}
+
+/*
+  Flips the condition of a comparison
+*/
+static void negate_condition(FunctionState *fs, Expression *e)
+{
+  uint32_t *i = get_jump_control(fs, e->info);
+  set_a(i, !get_a(*i));
+}
+
+/*
+  Writes a jump that's taken if e is truthy when cond is 1, or falsy when it's 0
+*/
+static int jump_on_condition(Compiler *c, FunctionState *fs, Expression *e, int cond)
+{
+  if (e->k == EXP_RELOCABLE)
+  {
+    uint32_t i = *get_instruction(fs, e);
+    if (get_opcode(i) == OP_NOT)
+    {
+      fs->pc--;
+      fs->f->ncode--;
+      return conditional_jump(c, fs, OP_TEST, get_b(i), 0, !cond);
+    }
+  }
+  discharge_to_any_register(c, fs, e);
+  free_expression(fs, e);
+  return conditional_jump(c, fs, OP_TESTSET, NO_REGISTER, e->info, cond);
+}
+
+/*
+  Writes the code to skip ahead when e is falsy, and falls through when it's truthy
+*/
+static void go_if_true(Compiler *c, FunctionState *fs, Expression *e)
+{
+  int pc;
+  discharge_variables(c, fs, e);
+  switch (e->k)
+  {
+  case EXP_JUMP:
+    negate_condition(fs, e);
+    pc = e->info;
+    break;
+  case EXP_CONSTANT:
+  case EXP_FLOAT:
+  case EXP_INTEGER:
+  case EXP_TRUE:
+    pc = NO_JUMP;
+    break;
+  default:
+    pc = jump_on_condition(c, fs, e, 0);
+  }
+  concat_jumps(c, fs, &e->f, pc);
+  patch_to_here(c, fs, e->t);
+  e->t = NO_JUMP;
+}
+
+/*
+  Writes the code to skip ahead when e is truthy, and falls through when it's falsy
+*/
+static void go_if_false(Compiler *c, FunctionState *fs, Expression *e)
+{
+  int pc;
+  discharge_variables(c, fs, e);
+  switch (e->k)
+  {
+  case EXP_JUMP:
+    pc = e->info;
+    break;
+  case EXP_NIL:
+  case EXP_FALSE:
+    pc = NO_JUMP;
+    break;
+  default:
+    pc = jump_on_condition(c, fs, e, 1);
+  }
+  concat_jumps(c, fs, &e->t, pc);
+  patch_to_here(c, fs, e->f);
+  e->f = NO_JUMP;
+}
+
+/*
+  Writes the code for the not operator
+*/
+static void code_not(Compiler *c, FunctionState *fs, Expression *e)
+{
+  discharge_variables(c, fs, e);
+  switch (e->k)
+  {
+  case EXP_NIL:
+  case EXP_FALSE:
+    e->k = EXP_TRUE;
+    break;
+  case EXP_CONSTANT:
+  case EXP_FLOAT:
+  case EXP_INTEGER:
+  case EXP_TRUE:
+    e->k = EXP_FALSE;
+    break;
+  case EXP_JUMP:
+    negate_condition(fs, e);
+    break;
+  default:
+    discharge_to_any_register(c, fs, e);
+    free_expression(fs, e);
+    e->info = code_abc(c, fs, OP_NOT, 0, e->info, 0);
+    e->k = EXP_RELOCABLE;
+  }
+  int t = e->f;
+  e->f = e->t;
+  e->t = t;
+  remove_values(fs, e->f);
+  remove_values(fs, e->t);
+}
+
+/*
+  Makes t an indexed expression of the table t and the key k
+*/
+static void code_indexed(Compiler *c, FunctionState *fs, Expression *t, Expression *k)
+{
+  t->table = t->info;
+  t->key = expression_to_rk(c, fs, k);
+  t->table_kind = t->k == EXP_UPVALUE ? EXP_UPVALUE : EXP_LOCAL;
+  t->k = EXP_INDEXED;
+}
+
+/*
+  Returns 1 if an expression is a numeral without pending jumps
+*/
+static int is_numeral(Expression *e)
+{
+  return !has_jumps(e) && (e->k == EXP_INTEGER || e->k == EXP_FLOAT);
+}
+
+/*
+  Returns the value of a numeral as a float
+*/
+static double numeral_to_float(Expression *e)
+{
+  return e->k == EXP_INTEGER ? (double)e->ival : e->nval;
+}
+
+/*
+  Converts a numeral to an integer the way bitwise operators do, returning 0 if it has no exact integer value
+*/
+static int numeral_to_integer(Expression *e, long long *i)
+{
+  if (e->k == EXP_INTEGER)
+  {
+    *i = e->ival;
+    return 1;
+  }
+  if (floor(e->nval) != e->nval || e->nval < -9223372036854775808.0 || e->nval >= 9223372036854775808.0)
+    return 0;
+  *i = (long long)e->nval;
+  return 1;
+}
+
+/*
+  Shifts an integer left, or right for negative shifts, filling with zeros
+*/
+static long long shift_left(long long x, long long y)
+{
+  if (y <= -64 || y >= 64)
+    return 0;
+  return (long long)(y < 0 ? (uint64_t)x >> -y : (uint64_t)x << y);
+}
+
+/*
+  Evaluates an arithmetic or bitwise operator on two numerals into e1, the way Lua's own compiler does
+  op is a BIN_* operator up to BIN_SHR, or FOLD_UNM or FOLD_BNOT with e2 as the integer 0
+  Returns 0 and leaves e1 alone if the operation would raise an error or give NaN or a float zero
+*/
+static int fold_constants(int op, Expression *e1, Expression *e2)
+{
+  long long i1, i2;
+  if (!is_numeral(e1) || !is_numeral(e2))
+    return 0;
+  if ((op >= BIN_BAND && op <= BIN_SHR) || op == FOLD_BNOT)
+  {
+    if (!numeral_to_integer(e1, &i1) || !numeral_to_integer(e2, &i2))
+      return 0;
+    uint64_t a = (uint64_t)i1, b = (uint64_t)i2;
+    e1->ival = op == BIN_BAND ? (long long)(a & b)
+               : op == BIN_BOR ? (long long)(a | b)
+               : op == BIN_BXOR ? (long long)(a ^ b)
+               : op == BIN_SHL ? shift_left(i1, i2)
+               : op == BIN_SHR ? shift_left(i1, (long long)(0 - b))
+                               : (long long)~a;
+    e1->k = EXP_INTEGER;
+    return 1;
+  }
+  if ((op == BIN_DIV || op == BIN_IDIV || op == BIN_MOD) && numeral_to_float(e2) == 0)
+    return 0;
+  if (e1->k == EXP_INTEGER && e2->k == EXP_INTEGER && op != BIN_DIV && op != BIN_POW)
+  {
+    long long m = e1->ival, n = e2->ival;
+    uint64_t a = (uint64_t)m, b = (uint64_t)n;
+    if (op == BIN_ADD)
+      e1->ival = (long long)(a + b);
+    else if (op == BIN_SUB)
+      e1->ival = (long long)(a - b);
+    else if (op == BIN_MUL)
+      e1->ival = (long long)(a * b);
+    else if (op == FOLD_UNM)
+      e1->ival = (long long)(0 - a);
+    else if (n == -1)
+      e1->ival = op == BIN_MOD ? 0 : (long long)(0 - a);
+    else if (op == BIN_MOD)
+      e1->ival = m % n != 0 && ((m ^ n) < 0) ? m % n + n : m % n;
+    else
+      e1->ival = m / n - (m % n != 0 && ((m ^ n) < 0));
+    return 1;
+  }
+  double a = numeral_to_float(e1), b = numeral_to_float(e2), r;
+  if (op == BIN_ADD)
+    r = a + b;
+  else if (op == BIN_SUB)
+    r = a - b;
+  else if (op == BIN_MUL)
+    r = a * b;
+  else if (op == BIN_DIV)
+    r = a / b;
+  else if (op == BIN_POW)
+    r = b == 2 ? a * a : pow(a, b);
+  else if (op == BIN_IDIV)
+    r = floor(a / b);
+  else if (op == FOLD_UNM)
+    r = -a;
+  else
+  {
+    r = fmod(a, b);
+    if (r > 0 ? b < 0 : (r < 0 && b != r))
+      r += b;
+  }
+  if (r != r || r == 0)
+    return 0;
+  e1->k = EXP_FLOAT;
+  e1->nval = r;
+  return 1;
+}
+
+/*
+  Writes the code for a unary operator with operand e
+*/
+static void code_prefix(Compiler *c, FunctionState *fs, int op, Expression *e, int line)
+{
+  if (op == UN_NOT)
+  {
+    code_not(c, fs, e);
+    return;
+  }
+  Expression zero;
+  init_expression(&zero, EXP_INTEGER, 0);
+  if ((op == UN_MINUS || op == UN_BNOT) && fold_constants(op == UN_MINUS ? FOLD_UNM : FOLD_BNOT, e, &zero))
+    return;
+  int r = expression_to_any_register(c, fs, e);
+  free_expression(fs, e);
+  e->info = code_abc(c, fs, OP_UNM + op, 0, r, 0);
+  e->k = EXP_RELOCABLE;
+  fix_line(fs, line);
+}
+
+/*
+  Prepares the left operand of a binary operator before the right one is read
+*/
+static void code_infix(Compiler *c, FunctionState *fs, int op, Expression *v)
+{
+  if (op == BIN_AND)
+    go_if_true(c, fs, v);
+  else if (op == BIN_OR)
+    go_if_false(c, fs, v);
+  else if (op == BIN_CONCAT)
+    expression_to_next_register(c, fs, v);
+  else if (op > BIN_SHR || !is_numeral(v))
+    expression_to_rk(c, fs, v);
+}
+
+/*
+  Writes an instruction that computes a binary operation into a relocable result
+*/
+static void code_binary(Compiler *c, FunctionState *fs, int op, Expression *e1, Expression *e2, int line)
+{
+  int rk2 = expression_to_rk(c, fs, e2);
+  int rk1 = expression_to_rk(c, fs, e1);
+  free_expressions(fs, e1, e2);
+  e1->info = code_abc(c, fs, op, 0, rk1, rk2);
+  e1->k = EXP_RELOCABLE;
+  fix_line(fs, line);
+}
+
+/*
+  Writes a comparison, which becomes a jump taken when it holds
+*/
+static void code_comparison(Compiler *c, FunctionState *fs, int op, Expression *e1, Expression *e2)
+{
+  int rk1 = e1->k == EXP_CONSTANT ? (e1->info | CONSTANT_BIT) : e1->info;
+  int rk2 = expression_to_rk(c, fs, e2);
+  free_expressions(fs, e1, e2);
+  if (op == BIN_NE)
+    e1->info = conditional_jump(c, fs, OP_EQ, 0, rk1, rk2);
+  else if (op == BIN_GT || op == BIN_GE)
+    e1->info = conditional_jump(c, fs, op - BIN_NE + OP_EQ, 1, rk2, rk1);
+  else
+    e1->info = conditional_jump(c, fs, op - BIN_EQ + OP_EQ, 1, rk1, rk2);
+  e1->k = EXP_JUMP;
+}
+
+/*
+  Finishes a binary operation once both operands have been read
+*/
+static void code_postfix(Compiler *c, FunctionState *fs, int op, Expression *e1, Expression *e2, int line)
+{
+  switch (op)
+  {
+  case BIN_AND:
+    discharge_variables(c, fs, e2);
+    concat_jumps(c, fs, &e2->f, e1->f);
+    *e1 = *e2;
+    break;
+  case BIN_OR:
+    discharge_variables(c, fs, e2);
+    concat_jumps(c, fs, &e2->t, e1->t);
+    *e1 = *e2;
+    break;
+  case BIN_CONCAT:
+    expression_to_value(c, fs, e2);
+    if (e2->k == EXP_RELOCABLE && get_opcode(*get_instruction(fs, e2)) == OP_CONCAT)
+    {
+      // Chained concatenations share one instruction over consecutive registers
+      free_expression(fs, e1);
+      set_b(get_instruction(fs, e2), e1->info);
+      e1->k = EXP_RELOCABLE;
+      e1->info = e2->info;
+    }
+    else
+    {
+      expression_to_next_register(c, fs, e2);
+      code_binary(c, fs, OP_CONCAT, e1, e2, line);
+    }
+    break;
+  case BIN_EQ:
+  case BIN_LT:
+  case BIN_LE:
+  case BIN_NE:
+  case BIN_GT:
+  case BIN_GE:
+    code_comparison(c, fs, op, e1, e2);
+    break;
+  default:
+    if (!fold_constants(op, e1, e2))
+      code_binary(c, fs, op + OP_ADD, e1, e2, line);
+  }
+}
+
+/*
+  Writes a SETLIST that stores tostore items into the table at base
+*/
+static void code_set_list(Compiler *c, FunctionState *fs, int base, int nitems, int tostore)
+{
+  int cc = (nitems - 1) / FIELDS_PER_FLUSH + 1;
+  int b = tostore == MULTIPLE_RESULTS ? 0 : tostore;
+  if (cc <= MAX_C)
+    code_abc(c, fs, OP_SETLIST, base, b, cc);
+  else
+  {
+    code_abc(c, fs, OP_SETLIST, base, b, 0);
+    code_extra(c, fs, cc);
+  }
+  fs->freereg = base + 1;
+}
+
+// Variables and scopes
+
+/*
+  Returns the debug information of the i-th declared local of a function
+*/
+static LocalVar *get_local(FunctionState *fs, int i)
+{
+  return (LocalVar *)get_from_list(fs->f->locals, (int)(intptr_t)get_from_list(fs->active, i));
+}
+
+/*
+  Declares a local, which becomes active once adjust_locals is called
+*/
+static void new_local(Compiler *c, char *name)
+{
+  FunctionState *fs = c->fs;
+  if (fs->active->n + 1 > MAX_LOCALS)
+    fail(c, "a function has too many local variables");
+  LocalVar *var = (LocalVar *)malloc(sizeof(LocalVar));
+  var->name = name;
+  var->startpc = 0;
+  var->endpc = 0;
+  add_to_list(fs->f->locals, var);
+  add_to_list(fs->active, (void *)(intptr_t)(fs->f->locals->n - 1));
+}
+
+/*
+  Activates the last n declared locals
+*/
+static void adjust_locals(Compiler *c, int n)
+{
+  FunctionState *fs = c->fs;
+  fs->nactive += n;
+  for (; n; n--)
+    get_local(fs, fs->nactive - n)->startpc = fs->pc;
+}
+
+/*
+  Deactivates the locals from level up
+*/
+static void remove_locals(FunctionState *fs, int level)
+{
+  while (fs->nactive > level)
+    get_local(fs, --fs->nactive)->endpc = fs->pc;
+  fs->active->n = level;
+}
+
+/*
+  Returns the register of an active local, or -1 if there isn't one with that name
+*/
+static int search_local(FunctionState *fs, char *name)
+{
+  for (int a = fs->nactive - 1; a >= 0; a--)
+  {
+    if (!strcmp(name, get_local(fs, a)->name))
+      return a;
+  }
+  return -1;
+}
+
+/*
+  Marks the block that declares the local at level as having a captured local
+*/
+static void mark_upvalue(FunctionState *fs, int level)
+{
+  Block *bl = fs->block;
+  while (bl->nactive > level)
+    bl = bl->previous;
+  bl->upvalue = 1;
+}
+
+/*
+  Returns the index of an upvalue of a function, or -1 if there isn't one with that name
+*/
+static int search_upvalue(FunctionState *fs, char *name)
+{
+  for (int a = 0; a < fs->f->upvalues->n; a++)
+  {
+    if (!strcmp(name, ((Upvalue *)get_from_list(fs->f->upvalues, a))->name))
+      return a;
+  }
+  return -1;
+}
+
+/*
+  Adds an upvalue for a variable of the enclosing function and returns its index
+*/
+static int new_upvalue(Compiler *c, FunctionState *fs, char *name, Expression *v)
+{
+  if (fs->f->upvalues->n >= MAX_UPVALUES)
+    fail(c, "a function has too many upvalues");
+  Upvalue *up = (Upvalue *)malloc(sizeof(Upvalue));
+  up->name = name;
+  up->instack = v->k == EXP_LOCAL;
+  up->index = v->info;
+  add_to_list(fs->f->upvalues, up);
+  return fs->f->upvalues->n - 1;
+}
+
+/*
+  Finds a variable in a function or the functions around it
+  var becomes EXP_VOID if the variable is a global
+*/
+static void find_variable(Compiler *c, FunctionState *fs, char *name, Expression *var, int base)
+{
+  if (!fs)
+  {
+    init_expression(var, EXP_VOID, 0);
+    return;
+  }
+  int v = search_local(fs, name);
+  if (v >= 0)
+  {
+    init_expression(var, EXP_LOCAL, v);
+    if (!base)
+      mark_upvalue(fs, v);
+    return;
+  }
+  int index = search_upvalue(fs, name);
+  if (index < 0)
+  {
+    find_variable(c, fs->prev, name, var, 0);
+    if (var->k == EXP_VOID)
+      return;
+    index = new_upvalue(c, fs, name, var);
+  }
+  init_expression(var, EXP_UPVALUE, index);
+}
+
+/*
+  Reads a variable name, which is a local, an upvalue, or a field of _ENV
+*/
+static void single_variable(Compiler *c, Expression *var)
+{
+  char *name = check_name(c);
+  FunctionState *fs = c->fs;
+  find_variable(c, fs, name, var, 1);
+  if (var->k == EXP_VOID)
+  {
+    Expression key;
+    find_variable(c, fs, "_ENV", var, 1);
+    init_expression(&key, EXP_CONSTANT, string_constant(c, fs, name, strlen(name)));
+    code_indexed(c, fs, var, &key);
+  }
+}
+
+/*
+  Adds a Label or pending goto to a list and returns its index
+*/
+static int new_label(Compiler *c, List *ls, char *name, int line, int pc)
+{
+  Label *l = (Label *)malloc(sizeof(Label));
+  l->name = name;
+  l->line = line;
+  l->pc = pc;
+  l->nactive = c->fs->nactive;
+  add_to_list(ls, l);
+  return ls->n - 1;
+}
+
+/*
+  Points the pending goto at index g to a label and removes it from the pending list
+*/
+static void close_goto(Compiler *c, int g, Label *label)
+{
+  Label *gt = (Label *)get_from_list(c->gotos, g);
+  if (gt->nactive < label->nactive)
+    fail(c, "a goto jumps into the scope of a local");
+  patch_list(c, c->fs, gt->pc, label->pc);
+  free(remove_from_list(c->gotos, g));
+}
+
+/*
+  Resolves the pending goto at index g with a label of the current block
+  Returns 1 if there was one
+*/
+static int find_label(Compiler *c, int g)
+{
+  Block *bl = c->fs->block;
+  Label *gt = (Label *)get_from_list(c->gotos, g);
+  for (int a = bl->firstlabel; a < c->labels->n; a++)
+  {
+    Label *lb = (Label *)get_from_list(c->labels, a);
+    if (!strcmp(lb->name, gt->name))
+    {
+      if (gt->nactive > lb->nactive && (bl->upvalue || c->labels->n > bl->firstlabel))
+        patch_close(c->fs, gt->pc, lb->nactive);
+      close_goto(c, g, lb);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Resolves the pending gotos of the current block that jump to a new label
+*/
+static void find_gotos(Compiler *c, Label *lb)
+{
+  int a = c->fs->block->firstgoto;
+  while (a < c->gotos->n)
+  {
+    if (!strcmp(((Label *)get_from_list(c->gotos, a))->name, lb->name))
+      close_goto(c, a, lb);
+    else
+      a++;
+  }
+}
+
+/*
+  Moves the pending gotos of a block that's ending out to the block around it
+*/
+static void move_gotos_out(Compiler *c, FunctionState *fs, Block *bl)
+{
+  int a = bl->firstgoto;
+  while (a < c->gotos->n)
+  {
+    Label *gt = (Label *)get_from_list(c->gotos, a);
+    if (gt->nactive > bl->nactive)
+    {
+      if (bl->upvalue)
+        patch_close(fs, gt->pc, bl->nactive);
+      gt->nactive = bl->nactive;
+    }
+    if (!find_label(c, a))
+      a++;
+  }
+}
+
+/*
+  Enters a block
+*/
+static void enter_block(FunctionState *fs, Compiler *c, Block *bl, int loop)
+{
+  bl->loop = loop;
+  bl->nactive = fs->nactive;
+  bl->firstlabel = c->labels->n;
+  bl->firstgoto = c->gotos->n;
+  bl->upvalue = 0;
+  bl->previous = fs->block;
+  fs->block = bl;
+}
+
+/*
+  Leaves a block, closing its captured locals and resolving its breaks
+*/
+static void leave_block(Compiler *c, FunctionState *fs)
+{
+  Block *bl = fs->block;
+  if (bl->previous && bl->upvalue)
+  {
+    int j = jump(c, fs);
+    patch_close(fs, j, bl->nactive);
+    patch_to_here(c, fs, j);
+  }
+  if (bl->loop)
+  {
+    int l = new_label(c, c->labels, "break", 0, fs->pc);
+    find_gotos(c, (Label *)get_from_list(c->labels, l));
+  }
+  fs->block = bl->previous;
+  remove_locals(fs, bl->nactive);
+  fs->freereg = fs->nactive;
+  while (c->labels->n > bl->firstlabel)
+    free(remove_from_list(c->labels, c->labels->n - 1));
+  if (bl->previous)
+    move_gotos_out(c, fs, bl);
+  else if (bl->firstgoto < c->gotos->n)
+  {
+    Label *gt = (Label *)get_from_list(c->gotos, bl->firstgoto);
+    fail_on_line(c, gt->line, strcmp(gt->name, "break") ? "a goto has no visible label" : "a break isn't inside a loop");
+  }
+}
+
+/*
+  Starts compiling a function
+*/
+static FunctionState *open_function(Compiler *c, Block *bl)
+{
+  FunctionState *fs = (FunctionState *)malloc(sizeof(FunctionState));
+  add_to_list(c->functions, fs);
+  fs->f = new_prototype(c);
+  fs->prev = c->fs;
+  fs->block = NULL;
+  fs->active = new_default_list();
+  fs->pc = 0;
+  fs->lasttarget = 0;
+  fs->jpc = NO_JUMP;
+  fs->nactive = 0;
+  fs->freereg = 0;
+  c->fs = fs;
+  enter_block(fs, c, bl, 0);
+  return fs;
+}
+
+/*
+  Finishes compiling a function
+*/
+static void close_function(Compiler *c)
+{
+  FunctionState *fs = c->fs;
+  code_return(c, fs, 0, 0);
+  leave_block(c, fs);
+  c->fs = fs->prev;
+}
+
+// Parsing
+
+static void statement(Compiler *c);
+static void expression(Compiler *c, Expression *v);
+
+/*
+  Reads statements until the end of a block
+*/
+static void statement_list(Compiler *c)
+{
+  while (!block_follows(c, 1))
+  {
+    if (at_token(c, "return"))
+    {
+      statement(c);
+      return;
+    }
+    statement(c);
+  }
+}
+
+/*
+  Reads a field selector, '.' or ':' followed by a name
+*/
+static void field_selector(Compiler *c, Expression *v)
+{
+  FunctionState *fs = c->fs;
+  Expression key;
+  expression_to_any_register_or_upvalue(c, fs, v);
+  next(c);
+  char *name = check_name(c);
+  init_expression(&key, EXP_CONSTANT, string_constant(c, fs, name, strlen(name)));
+  code_indexed(c, fs, v, &key);
+}
+
+/*
+  Reads a bracketed index
+*/
+static void index_expression(Compiler *c, Expression *v)
+{
+  next(c);
+  expression(c, v);
+  expression_to_value(c, c->fs, v);
+  check_next(c, "]");
+}
+
+/*
+  ConstructorState: the state of a table constructor being read
+*/
+typedef struct
+{
+  Expression v;  // Last list item read
+  Expression *t; // Table being built
+  int nh;        // Number of record items
+  int na;        // Number of list items
+  int tostore;   // Number of list items waiting to be stored
+} ConstructorState;
+
+/*
+  Reads a record item, name = value or [key] = value
+*/
+static void record_field(Compiler *c, ConstructorState *cc)
+{
+  FunctionState *fs = c->fs;
+  int reg = fs->freereg;
+  Expression key, val;
+  if (current(c)->kind == LUA_NAME)
+  {
+    char *name = check_name(c);
+    init_expression(&key, EXP_CONSTANT, string_constant(c, fs, name, strlen(name)));
+  }
+  else
+    index_expression(c, &key);
+  cc->nh++;
+  check_next(c, "=");
+  int rkkey = expression_to_rk(c, fs, &key);
+  expression(c, &val);
+  code_abc(c, fs, OP_SETTABLE, cc->t->info, rkkey, expression_to_rk(c, fs, &val));
+  fs->freereg = reg;
+}
+
+/*
+  Puts the last list item in a register, storing the pending items once there are enough of them
+*/
+static void close_list_field(Compiler *c, FunctionState *fs, ConstructorState *cc)
+{
+  if (cc->v.k == EXP_VOID)
+    return;
+  expression_to_next_register(c, fs, &cc->v);
+  cc->v.k = EXP_VOID;
+  if (cc->tostore == FIELDS_PER_FLUSH)
+  {
+    code_set_list(c, fs, cc->t->info, cc->na, cc->tostore);
+    cc->tostore = 0;
+  }
+}
+
+/*
+  Stores the list items still pending at the end of a constructor
+*/
+static void last_list_field(Compiler *c, FunctionState *fs, ConstructorState *cc)
+{
+  if (!cc->tostore)
+    return;
+  if (has_multiple_results(cc->v.k))
+  {
+    set_returns(c, fs, &cc->v, MULTIPLE_RESULTS);
+    code_set_list(c, fs, cc->t->info, cc->na, MULTIPLE_RESULTS);
+    cc->na--;
+  }
+  else
+  {
+    if (cc->v.k != EXP_VOID)
+      expression_to_next_register(c, fs, &cc->v);
+    code_set_list(c, fs, cc->t->info, cc->na, cc->tostore);
+  }
+}
+
+/*
+  Encodes a table size as a float byte, like NEWTABLE takes it
+*/
+static int size_to_float_byte(unsigned int x)
+{
+  int e = 0;
+  if (x < 8)
+    return x;
+  while (x >= (8 << 4))
+  {
+    x = (x + 0xf) >> 4;
+    e += 4;
+  }
+  while (x >= (8 << 1))
+  {
+    x = (x + 1) >> 1;
+    e++;
+  }
+  return ((e + 1) << 3) | ((int)x - 8);
+}
+
+/*
+  Reads a table constructor
+*/
+static void constructor(Compiler *c, Expression *t)
+{
+  FunctionState *fs = c->fs;
+  int pc = code_abc(c, fs, OP_NEWTABLE, 0, 0, 0);
+  ConstructorState cc;
+  cc.na = cc.nh = cc.tostore = 0;
+  cc.t = t;
+  init_expression(t, EXP_RELOCABLE, pc);
+  init_expression(&cc.v, EXP_VOID, 0);
+  expression_to_next_register(c, fs, t);
+  check_next(c, "{");
+  do
+  {
+    if (at_token(c, "}"))
+      break;
+    close_list_field(c, fs, &cc);
+    if (current(c)->kind == LUA_NAME && c->at + 1 < c->nlexemes && c->lexemes[c->at + 1].kind == LUA_SYMBOL &&
+        !strcmp(c->lexemes[c->at + 1].text, "="))
+      record_field(c, &cc);
+    else if (at_token(c, "["))
+      record_field(c, &cc);
+    else
+    {
+      expression(c, &cc.v);
+      cc.na++;
+      cc.tostore++;
+    }
+  } while (test_next(c, ",") || test_next(c, ";"));
+  check_next(c, "}");
+  last_list_field(c, fs, &cc);
+  set_b(fs->f->code + pc, size_to_float_byte(cc.na));
+  set_c(fs->f->code + pc, size_to_float_byte(cc.nh));
+}
+
+/*
+  Reads the parameters of a function
+*/
+static void parameter_list(Compiler *c)
+{
+  FunctionState *fs = c->fs;
+  int nparams = 0;
+  if (!at_token(c, ")"))
+  {
+    do
+    {
+      if (current(c)->kind == LUA_NAME)
+      {
+        new_local(c, check_name(c));
+        nparams++;
+      }
+      else if (test_next(c, "..."))
+        fs->f->vararg = 1;
+      else
+        fail(c, "<name> or '...' expected");
+    } while (!fs->f->vararg && test_next(c, ","));
+  }
+  adjust_locals(c, nparams);
+  fs->f->numparams = fs->nactive;
+  reserve_registers(c, fs, fs->nactive);
+}
+
+/*
+  Reads the parameters and body of a function, and writes a closure for it into e
+*/
+static void body(Compiler *c, Expression *e, int method, int line)
+{
+  Block bl;
+  FunctionState *parent = c->fs;
+  FunctionState *fs = open_function(c, &bl);
+  add_to_list(parent->f->protos, fs->f);
+  fs->f->linedefined = line;
+  check_next(c, "(");
+  if (method)
+  {
+    new_local(c, "self");
+    adjust_locals(c, 1);
+  }
+  parameter_list(c);
+  check_next(c, ")");
+  statement_list(c);
+  fs->f->lastline = current(c)->line;
+  check_next(c, "end");
+  init_expression(e, EXP_RELOCABLE, code_abx(c, parent, OP_CLOSURE, 0, parent->f->protos->n - 1));
+  expression_to_next_register(c, parent, e);
+  close_function(c);
+}
+
+/*
+  Reads a list of expressions and returns how many there were
+  All but the last are put in consecutive registers
+*/
+static int expression_list(Compiler *c, Expression *v)
+{
+  int n = 1;
+  expression(c, v);
+  while (test_next(c, ","))
+  {
+    expression_to_next_register(c, c->fs, v);
+    expression(c, v);
+    n++;
+  }
+  return n;
+}
+
+/*
+  Reads the arguments of a call to f and writes the call
+*/
+static void function_arguments(Compiler *c, Expression *f, int line)
+{
+  FunctionState *fs = c->fs;
+  Expression args;
+  if (test_next(c, "("))
+  {
+    if (at_token(c, ")"))
+      init_expression(&args, EXP_VOID, 0);
+    else
+    {
+      expression_list(c, &args);
+      set_returns(c, fs, &args, MULTIPLE_RESULTS);
+    }
+    check_next(c, ")");
+  }
+  else if (at_token(c, "{"))
+    constructor(c, &args);
+  else if (current(c)->kind == LUA_STRING)
+  {
+    Lexeme *lx = current(c);
+    init_expression(&args, EXP_CONSTANT, string_constant(c, fs, lx->text, lx->length));
+    next(c);
+  }
+  else
+    fail(c, "function arguments expected");
+  int base = f->info;
+  int nparams;
+  if (has_multiple_results(args.k))
+    nparams = MULTIPLE_RESULTS;
+  else
+  {
+    if (args.k != EXP_VOID)
+      expression_to_next_register(c, fs, &args);
+    nparams = fs->freereg - (base + 1);
+  }
+  init_expression(f, EXP_CALL, code_abc(c, fs, OP_CALL, base, nparams + 1, 2));
+  fix_line(fs, line);
+  fs->freereg = base + 1;
+}
+
+/*
+  Reads a name or a parenthesized expression
+*/
+static void primary_expression(Compiler *c, Expression *v)
+{
+  if (at_token(c, "("))
+  {
+    next(c);
+    expression(c, v);
+    check_next(c, ")");
+    discharge_variables(c, c->fs, v);
+  }
+  else if (current(c)->kind == LUA_NAME)
+    single_variable(c, v);
+  else
+    fail(c, "unexpected symbol");
+}
+
+/*
+  Reads a primary expression followed by fields, indexes, method calls and calls
+*/
+static void suffixed_expression(Compiler *c, Expression *v)
+{
+  FunctionState *fs = c->fs;
+  int line = current(c)->line;
+  primary_expression(c, v);
+  while (1)
+  {
+    if (at_token(c, "."))
+      field_selector(c, v);
+    else if (at_token(c, "["))
+    {
+      Expression key;
+      expression_to_any_register_or_upvalue(c, fs, v);
+      index_expression(c, &key);
+      code_indexed(c, fs, v, &key);
+    }
+    else if (at_token(c, ":"))
+    {
+      Expression key;
+      next(c);
+      char *name = check_name(c);
+      init_expression(&key, EXP_CONSTANT, string_constant(c, fs, name, strlen(name)));
+      code_self(c, fs, v, &key);
+      function_arguments(c, v, line);
+    }
+    else if (at_token(c, "(") || at_token(c, "{") || current(c)->kind == LUA_STRING)
+    {
+      expression_to_next_register(c, fs, v);
+      function_arguments(c, v, line);
+    }
+    else
+      return;
+  }
+}
+
+/*
+  Reads a literal, a constructor, a function or a suffixed expression
+*/
+static void simple_expression(Compiler *c, Expression *v)
+{
+  Lexeme *lx = current(c);
+  if (lx->kind == LUA_NUMBER)
+  {
+    init_expression(v, lx->integer ? EXP_INTEGER : EXP_FLOAT, 0);
+    v->ival = lx->ival;
+    v->nval = lx->nval;
+  }
+  else if (lx->kind == LUA_STRING)
+    init_expression(v, EXP_CONSTANT, string_constant(c, c->fs, lx->text, lx->length));
+  else if (at_token(c, "nil"))
+    init_expression(v, EXP_NIL, 0);
+  else if (at_token(c, "true"))
+    init_expression(v, EXP_TRUE, 0);
+  else if (at_token(c, "false"))
+    init_expression(v, EXP_FALSE, 0);
+  else if (at_token(c, "..."))
+  {
+    if (!c->fs->f->vararg)
+      fail(c, "cannot use '...' outside a vararg function");
+    init_expression(v, EXP_VARARG, code_abc(c, c->fs, OP_VARARG, 0, 1, 0));
+  }
+  else if (at_token(c, "{"))
+  {
+    constructor(c, v);
+    return;
+  }
+  else if (at_token(c, "function"))
+  {
+    next(c);
+    body(c, v, 0, current(c)->line);
+    return;
+  }
+  else
+  {
+    suffixed_expression(c, v);
+    return;
+  }
+  next(c);
+}
+
+/*
+  Returns the UN_* operator of the current token
+*/
+static int get_unary_operator(Compiler *c)
+{
+  if (at_token(c, "not"))
+    return UN_NOT;
+  if (at_token(c, "-"))
+    return UN_MINUS;
+  if (at_token(c, "~"))
+    return UN_BNOT;
+  if (at_token(c, "#"))
+    return UN_LEN;
+  return UN_NONE;
+}
+
+/*
+  Returns the BIN_* operator of the current token
+*/
+static int get_binary_operator(Compiler *c)
+{
+  for (int a = 0; a < BIN_NONE; a++)
+  {
+    if (at_token(c, binary_operators[a]))
+      return a;
+  }
+  return BIN_NONE;
+}
+
+/*
+  Reads an expression whose binary operators bind tighter than limit
+  Returns the first operator that doesn't
+*/
+static int subexpression(Compiler *c, Expression *v, int limit)
+{
+  enter_level(c);
+  int uop = get_unary_operator(c);
+  if (uop != UN_NONE)
+  {
+    int line = current(c)->line;
+    next(c);
+    subexpression(c, v, UNARY_PRIORITY);
+    code_prefix(c, c->fs, uop, v, line);
+  }
+  else
+    simple_expression(c, v);
+  int op = get_binary_operator(c);
+  while (op != BIN_NONE && priorities[op][0] > limit)
+  {
+    Expression v2;
+    int line = current(c)->line;
+    next(c);
+    code_infix(c, c->fs, op, v);
+    int next_op = subexpression(c, &v2, priorities[op][1]);
+    code_postfix(c, c->fs, op, v, &v2, line);
+    op = next_op;
+  }
+  c->levels--;
+  return op;
+}
+
+/*
+  Reads an expression
+*/
+static void expression(Compiler *c, Expression *v)
+{
+  subexpression(c, v, 0);
+}
+
+/*
+  Reads a block
+*/
+static void block(Compiler *c)
+{
+  Block bl;
+  enter_block(c->fs, c, &bl, 0);
+  statement_list(c);
+  leave_block(c, c->fs);
+}
+
+/*
+  Moves the values of nexps expressions into nvars registers, dropping extra values and filling missing ones with nil
+*/
+static void adjust_assign(Compiler *c, int nvars, int nexps, Expression *e)
+{
+  FunctionState *fs = c->fs;
+  int extra = nvars - nexps;
+  if (has_multiple_results(e->k))
+  {
+    extra++;
+    if (extra < 0)
+      extra = 0;
+    set_returns(c, fs, e, extra);
+    if (extra > 1)
+      reserve_registers(c, fs, extra - 1);
+  }
+  else
+  {
+    if (e->k != EXP_VOID)
+      expression_to_next_register(c, fs, e);
+    if (extra > 0)
+    {
+      int reg = fs->freereg;
+      reserve_registers(c, fs, extra);
+      code_nil(c, fs, reg, extra);
+    }
+  }
+  if (nexps > nvars)
+    fs->freereg -= nexps - nvars;
+}
+
+/*
+  Assignment: a target of a multiple assignment, linked to the ones before it
+*/
+typedef struct Assignment
+{
+  struct Assignment *prev; // Target before this one
+  Expression v;            // The target
+} Assignment;
+
+/*
+  Copies a local or upvalue to a temporary when an earlier target of the same assignment indexes with it
+  Otherwise assigning it first would change which field the earlier target assigns
+*/
+static void check_conflict(Compiler *c, Assignment *lh, Expression *v)
+{
+  FunctionState *fs = c->fs;
+  int extra = fs->freereg;
+  int conflict = 0;
+  for (; lh; lh = lh->prev)
+  {
+    if (lh->v.k != EXP_INDEXED)
+      continue;
+    if (lh->v.table_kind == v->k && lh->v.table == v->info)
+    {
+      conflict = 1;
+      lh->v.table_kind = EXP_LOCAL;
+      lh->v.table = extra;
+    }
+    if (v->k == EXP_LOCAL && lh->v.key == v->info)
+    {
+      conflict = 1;
+      lh->v.key = extra;
+    }
+  }
+  if (conflict)
+  {
+    code_abc(c, fs, v->k == EXP_LOCAL ? OP_MOVE : OP_GETUPVAL, extra, v->info, 0);
+    reserve_registers(c, fs, 1);
+  }
+}
+
+/*
+  Reads the rest of an assignment to nvars targets, and stores the values from last to first
+*/
+static void assignment(Compiler *c, Assignment *lh, int nvars)
+{
+  Expression e;
+  int k = lh->v.k;
+  if (k != EXP_LOCAL && k != EXP_UPVALUE && k != EXP_INDEXED)
+    fail(c, "syntax error");
+  if (test_next(c, ","))
+  {
+    Assignment nv;
+    nv.prev = lh;
+    suffixed_expression(c, &nv.v);
+    if (nv.v.k != EXP_INDEXED)
+      check_conflict(c, lh, &nv.v);
+    enter_level(c);
+    assignment(c, &nv, nvars + 1);
+    c->levels--;
+  }
+  else
+  {
+    check_next(c, "=");
+    int nexps = expression_list(c, &e);
+    if (nexps != nvars)
+      adjust_assign(c, nvars, nexps, &e);
+    else
+    {
+      set_one_return(c->fs, &e);
+      store_variable(c, c->fs, &lh->v, &e);
+      return;
+    }
+  }
+  init_expression(&e, EXP_REGISTER, c->fs->freereg - 1);
+  store_variable(c, c->fs, &lh->v, &e);
+}
+
+/*
+  Reads a condition and returns the jumps taken when it's false
+*/
+static int condition(Compiler *c)
+{
+  Expression v;
+  expression(c, &v);
+  if (v.k == EXP_NIL)
+    v.k = EXP_FALSE;
+  go_if_true(c, c->fs, &v);
+  return v.f;
+}
+
+/*
+  Writes a goto or break, which stays pending until its label is found
+*/
+static void goto_statement(Compiler *c, int pc)
+{
+  int line = current(c)->line;
+  char *name = "break";
+  if (test_next(c, "goto"))
+    name = check_name(c);
+  else
+    next(c);
+  int g = new_label(c, c->gotos, name, line, pc);
+  find_label(c, g);
+}
+
+/*
+  Reads a label
+*/
+static void label_statement(Compiler *c, char *name, int line)
+{
+  FunctionState *fs = c->fs;
+  for (int a = fs->block->firstlabel; a < c->labels->n; a++)
+  {
+    if (!strcmp(name, ((Label *)get_from_list(c->labels, a))->name))
+      fail(c, "a label is already defined");
+  }
+  check_next(c, "::");
+  int l = new_label(c, c->labels, name, line, get_label(fs));
+  while (at_token(c, ";") || at_token(c, "::"))
+    statement(c);
+
+  // A label at the end of its block is outside the scope of the block's locals
+  if (block_follows(c, 0))
+    ((Label *)get_from_list(c->labels, l))->nactive = fs->block->nactive;
+  find_gotos(c, (Label *)get_from_list(c->labels, l));
+}
+
+/*
+  Reads a while loop
+*/
+static void while_statement(Compiler *c)
+{
+  FunctionState *fs = c->fs;
+  Block bl;
+  next(c);
+  int init = get_label(fs);
+  int exit = condition(c);
+  enter_block(fs, c, &bl, 1);
+  check_next(c, "do");
+  block(c);
+  jump_to(c, fs, init);
+  check_next(c, "end");
+  leave_block(c, fs);
+  patch_to_here(c, fs, exit);
+}
+
+/*
+  Reads a repeat loop, whose condition can see the locals of its body
+*/
+static void repeat_statement(Compiler *c)
+{
+  FunctionState *fs = c->fs;
+  int init = get_label(fs);
+  Block loop, scope;
+  enter_block(fs, c, &loop, 1);
+  enter_block(fs, c, &scope, 0);
+  next(c);
+  statement_list(c);
+  check_next(c, "until");
+  int exit = condition(c);
+  if (scope.upvalue)
+    patch_close(fs, exit, scope.nactive);
+  leave_block(c, fs);
+  patch_list(c, fs, exit, init);
+  leave_block(c, fs);
+}
+
+/*
+  Reads an expression into the next register
+*/
+static void expression_to_next(Compiler *c)
+{
+  Expression e;
+  expression(c, &e);
+  expression_to_next_register(c, c->fs, &e);
+}
+
+/*
+  Reads the body of a for loop, whose control locals start at base
+*/
+static void for_body(Compiler *c, int base, int line, int nvars, int numeric)
+{
+  FunctionState *fs = c->fs;
+  Block bl;
+  adjust_locals(c, 3);
+  check_next(c, "do");
+  int prep = numeric ? code_asbx(c, fs, OP_FORPREP, base, NO_JUMP) : jump(c, fs);
+  enter_block(fs, c, &bl, 0);
+  adjust_locals(c, nvars);
+  reserve_registers(c, fs, nvars);
+  block(c);
+  leave_block(c, fs);
+  patch_to_here(c, fs, prep);
+  int end;
+  if (numeric)
+    end = code_asbx(c, fs, OP_FORLOOP, base, NO_JUMP);
+  else
+  {
+    code_abc(c, fs, OP_TFORCALL, base, 0, nvars);
+    fix_line(fs, line);
+    end = code_asbx(c, fs, OP_TFORLOOP, base + 2, NO_JUMP);
+  }
+  patch_list(c, fs, end, prep + 1);
+  fix_line(fs, line);
+}
+
+/*
+  Reads a numeric for loop
+*/
+static void for_numeric(Compiler *c, char *name, int line)
+{
+  FunctionState *fs = c->fs;
+  int base = fs->freereg;
+  new_local(c, "(for index)");
+  new_local(c, "(for limit)");
+  new_local(c, "(for step)");
+  new_local(c, name);
+  check_next(c, "=");
+  expression_to_next(c);
+  check_next(c, ",");
+  expression_to_next(c);
+  if (test_next(c, ","))
+    expression_to_next(c);
+  else
+  {
+    code_constant(c, fs, fs->freereg, integer_constant(c, fs, 1));
+    reserve_registers(c, fs, 1);
+  }
+  for_body(c, base, line, 1, 1);
+}
+
+/*
+  Reads a generic for loop
+*/
+static void for_list(Compiler *c, char *name)
+{
+  FunctionState *fs = c->fs;
+  Expression e;
+  int nvars = 4;
+  int base = fs->freereg;
+  new_local(c, "(for generator)");
+  new_local(c, "(for state)");
+  new_local(c, "(for control)");
+  new_local(c, name);
+  while (test_next(c, ","))
+  {
+    new_local(c, check_name(c));
+    nvars++;
+  }
+  check_next(c, "in");
+  int line = current(c)->line;
+  adjust_assign(c, 3, expression_list(c, &e), &e);
+  check_stack(c, fs, 3);
+  for_body(c, base, line, nvars - 3, 0);
+}
+
+/*
+  Reads a for loop
+*/
+static void for_statement(Compiler *c, int line)
+{
+  FunctionState *fs = c->fs;
+  Block bl;
+  enter_block(fs, c, &bl, 1);
+  next(c);
+  char *name = check_name(c);
+  if (at_token(c, "="))
+    for_numeric(c, name, line);
+  else if (at_token(c, ",") || at_token(c, "in"))
+    for_list(c, name);
+  else
+    fail(c, "'=' or 'in' expected");
+  check_next(c, "end");
+  leave_block(c, fs);
+}
+
+/*
+  Reads a condition and the block it guards, as part of an if statement
+*/
+static void test_then_block(Compiler *c, int *escapes)
+{
+  FunctionState *fs = c->fs;
+  Block bl;
+  Expression v;
+  int jf;
+  next(c);
+  expression(c, &v);
+  check_next(c, "then");
+
+  // A block that starts with a goto or break jumps straight to its label when the condition holds
+  if (at_token(c, "goto") || at_token(c, "break"))
+  {
+    go_if_false(c, fs, &v);
+    enter_block(fs, c, &bl, 0);
+    goto_statement(c, v.t);
+    while (test_next(c, ";"))
+      ;
+    if (block_follows(c, 0))
+    {
+      leave_block(c, fs);
+      return;
+    }
+    jf = jump(c, fs);
+  }
+  else
+  {
+    go_if_true(c, fs, &v);
+    enter_block(fs, c, &bl, 0);
+    jf = v.f;
+  }
+  statement_list(c);
+  leave_block(c, fs);
+  if (at_token(c, "else") || at_token(c, "elseif"))
+    concat_jumps(c, fs, escapes, jump(c, fs));
+  patch_to_here(c, fs, jf);
+}
+
+/*
+  Reads an if statement
+*/
+static void if_statement(Compiler *c)
+{
+  int escapes = NO_JUMP;
+  test_then_block(c, &escapes);
+  while (at_token(c, "elseif"))
+    test_then_block(c, &escapes);
+  if (test_next(c, "else"))
+    block(c);
+  check_next(c, "end");
+  patch_to_here(c, c->fs, escapes);
+}
+
+/*
+  Reads a function statement, which assigns a function to a variable or field
+*/
+static void function_statement(Compiler *c, int line)
+{
+  Expression v, b;
+  int method = 0;
+  next(c);
+  single_variable(c, &v);
+  while (at_token(c, "."))
+    field_selector(c, &v);
+  if (at_token(c, ":"))
+  {
+    method = 1;
+    field_selector(c, &v);
+  }
+  body(c, &b, method, line);
+  store_variable(c, c->fs, &v, &b);
+  fix_line(c->fs, line);
+}
+
+/*
+  Reads a local function, which can call itself
+*/
+static void local_function(Compiler *c)
+{
+  Expression b;
+  FunctionState *fs = c->fs;
+  new_local(c, check_name(c));
+  adjust_locals(c, 1);
+  body(c, &b, 0, current(c)->line);
+  get_local(fs, b.info)->startpc = fs->pc;
+}
+
+/*
+  Reads a local statement
+*/
+static void local_statement(Compiler *c)
+{
+  int nvars = 0;
+  int nexps = 0;
+  Expression e;
+  do
+  {
+    new_local(c, check_name(c));
+    nvars++;
+  } while (test_next(c, ","));
+  if (test_next(c, "="))
+    nexps = expression_list(c, &e);
+  else
+    init_expression(&e, EXP_VOID, 0);
+  adjust_assign(c, nvars, nexps, &e);
+  adjust_locals(c, nvars);
+}
+
+/*
+  Reads a call or an assignment
+*/
+static void expression_statement(Compiler *c)
+{
+  Assignment v;
+  suffixed_expression(c, &v.v);
+  if (at_token(c, "=") || at_token(c, ","))
+  {
+    v.prev = NULL;
+    assignment(c, &v, 1);
+  }
+  else
+  {
+    if (v.v.k != EXP_CALL)
+      fail(c, "syntax error");
+    set_c(get_instruction(c->fs, &v.v), 1);
+  }
+}
+
+/*
+  Reads a return statement, turning a returned call into a tail call
+*/
+static void return_statement(Compiler *c)
+{
+  FunctionState *fs = c->fs;
+  Expression e;
+  int first = 0;
+  int nret = 0;
+  if (!block_follows(c, 1) && !at_token(c, ";"))
+  {
+    nret = expression_list(c, &e);
+    if (has_multiple_results(e.k))
+    {
+      set_returns(c, fs, &e, MULTIPLE_RESULTS);
+      if (e.k == EXP_CALL && nret == 1)
+        *get_instruction(fs, &e) = (*get_instruction(fs, &e) & ~0x3fu) | OP_TAILCALL;
+      first = fs->nactive;
+      nret = MULTIPLE_RESULTS;
+    }
+    else if (nret == 1)
+      first = expression_to_any_register(c, fs, &e);
+    else
+    {
+      expression_to_next_register(c, fs, &e);
+      first = fs->nactive;
+    }
+  }
+  code_return(c, fs, first, nret);
+  test_next(c, ";");
+}
+
+/*
+  Reads a statement
+*/
+static void statement(Compiler *c)
+{
+  int line = current(c)->line;
+  enter_level(c);
+  if (test_next(c, ";"))
+    ;
+  else if (at_token(c, "if"))
+    if_statement(c);
+  else if (at_token(c, "while"))
+    while_statement(c);
+  else if (test_next(c, "do"))
+  {
+    block(c);
+    check_next(c, "end");
+  }
+  else if (at_token(c, "for"))
+    for_statement(c, line);
+  else if (at_token(c, "repeat"))
+    repeat_statement(c);
+  else if (at_token(c, "function"))
+    function_statement(c, line);
+  else if (test_next(c, "local"))
+  {
+    if (test_next(c, "function"))
+      local_function(c);
+    else
+      local_statement(c);
+  }
+  else if (test_next(c, "::"))
+    label_statement(c, check_name(c), line);
+  else if (test_next(c, "return"))
+    return_statement(c);
+  else if (at_token(c, "break") || at_token(c, "goto"))
+    goto_statement(c, jump(c, c->fs));
+  else
+    expression_statement(c);
+  c->fs->freereg = c->fs->nactive;
+  c->levels--;
+}
+
+// Binary chunk writing
+
+static void dump_bytes(Buffer *b, const void *data, int n)
+{
+  append_to_buffer(b, (const char *)data, n);
+}
+static void dump_byte(Buffer *b, int x)
+{
+  char c = (char)x;
+  dump_bytes(b, &c, 1);
+}
+static void dump_int(Buffer *b, int x)
+{
+  dump_bytes(b, &x, sizeof(int));
+}
+static void dump_string(Buffer *b, const char *s, int n)
+{
+  if (!s)
+  {
+    dump_byte(b, 0);
+    return;
+  }
+  size_t size = (size_t)n + 1;
+  if (size < 0xff)
+    dump_byte(b, (int)size);
+  else
+  {
+    dump_byte(b, 0xff);
+    dump_bytes(b, &size, sizeof(size_t));
+  }
+  dump_bytes(b, s, n);
+}
+
+/*
+  Writes a Prototype the way lua_dump does
+  Only the main function carries the source name, nested ones share it like luac's output
+*/
+static void dump_function(Buffer *b, Prototype *f, const char *source)
+{
+  dump_string(b, source, source ? (int)strlen(source) : 0);
+  dump_int(b, f->linedefined);
+  dump_int(b, f->lastline);
+  dump_byte(b, f->numparams);
+  dump_byte(b, f->vararg);
+  dump_byte(b, f->maxstack);
+  dump_int(b, f->ncode);
+  dump_bytes(b, f->code, sizeof(uint32_t) * f->ncode);
+  dump_int(b, f->constants->n);
+  for (int a = 0; a < f->constants->n; a++)
+  {
+    Constant *k = (Constant *)get_from_list(f->constants, a);
+    dump_byte(b, k->type);
+    if (k->type == CONSTANT_BOOL)
+      dump_byte(b, (int)k->ival);
+    else if (k->type == CONSTANT_FLOAT)
+      dump_bytes(b, &k->nval, sizeof(double));
+    else if (k->type == CONSTANT_INTEGER)
+      dump_bytes(b, &k->ival, sizeof(long long));
+    else if (k->type != CONSTANT_NIL)
+      dump_string(b, k->text, k->length);
+  }
+  dump_int(b, f->upvalues->n);
+  for (int a = 0; a < f->upvalues->n; a++)
+  {
+    Upvalue *up = (Upvalue *)get_from_list(f->upvalues, a);
+    dump_byte(b, up->instack);
+    dump_byte(b, up->index);
+  }
+  dump_int(b, f->protos->n);
+  for (int a = 0; a < f->protos->n; a++)
+    dump_function(b, (Prototype *)get_from_list(f->protos, a), NULL);
+  dump_int(b, f->ncode);
+  dump_bytes(b, f->lines, sizeof(int) * f->ncode);
+  dump_int(b, f->locals->n);
+  for (int a = 0; a < f->locals->n; a++)
+  {
+    LocalVar *var = (LocalVar *)get_from_list(f->locals, a);
+    dump_string(b, var->name, strlen(var->name));
+    dump_int(b, var->startpc);
+    dump_int(b, var->endpc);
+  }
+  dump_int(b, f->upvalues->n);
+  for (int a = 0; a < f->upvalues->n; a++)
+  {
+    Upvalue *up = (Upvalue *)get_from_list(f->upvalues, a);
+    dump_string(b, up->name, strlen(up->name));
+  }
+}
+
+/*
+  Writes the header of a Lua 5.3 binary chunk, which describes the sizes and formats of its values
+*/
+static void dump_header(Buffer *b)
+{
+  long long check_integer = 0x5678;
+  double check_number = 370.5;
+  dump_bytes(b, "\x1bLua", 4);
+  dump_byte(b, 0x53);
+  dump_byte(b, 0);
+  dump_bytes(b, "\x19\x93\r\n\x1a\n", 6);
+  dump_byte(b, sizeof(int));
+  dump_byte(b, sizeof(size_t));
+  dump_byte(b, sizeof(uint32_t));
+  dump_byte(b, sizeof(long long));
+  dump_byte(b, sizeof(double));
+  dump_bytes(b, &check_integer, sizeof(long long));
+  dump_bytes(b, &check_number, sizeof(double));
+}
+
+/*
+  Compiles Lua code into a Lua 5.3 binary chunk, in the format luac5.3 writes
+  The chunk is appended to out, which is left as it was if compilation fails
+  source is the chunk name runtime errors are reported under, as in lua_load
+  Returns 0 and reports an error if the code can't be compiled
+*/
+int compile_bytecode(Buffer *code, const char *source, Buffer *out)
+{
+  Compiler c;
+  Block bl;
+  Expression env;
+  c.fs = NULL;
+  c.at = 0;
+  c.levels = 0;
+  c.labels = new_default_list();
+  c.gotos = new_default_list();
+  c.functions = new_default_list();
+  c.prototypes = new_default_list();
+  read_lexemes(&c, code->data, code->n);
+  int compiled = 0;
+  if (!setjmp(c.failure))
+  {
+    FunctionState *fs = open_function(&c, &bl);
+    fs->f->vararg = 1;
+    init_expression(&env, EXP_LOCAL, 0);
+    new_upvalue(&c, fs, "_ENV", &env);
+    statement_list(&c);
+    if (current(&c)->kind >= 0)
+      fail(&c, "'<eof>' expected");
+    close_function(&c);
+    dump_header(out);
+    dump_byte(out, fs->f->upvalues->n);
+    dump_function(out, fs->f, source);
+    compiled = 1;
+  }
+  for (int a = 0; a < c.nlexemes; a++)
+    free(c.lexemes[a].text);
+  free(c.lexemes);
+  for (int a = 0; a < c.labels->n; a++)
+    free(get_from_list(c.labels, a));
+  for (int a = 0; a < c.gotos->n; a++)
+    free(get_from_list(c.gotos, a));
+  for (int a = 0; a < c.functions->n; a++)
+  {
+    FunctionState *fs = (FunctionState *)get_from_list(c.functions, a);
+    dealloc_list(fs->active);
+    free(fs);
+  }
+  for (int a = 0; a < c.prototypes->n; a++)
+    dealloc_prototype((Prototype *)get_from_list(c.prototypes, a));
+  dealloc_list(c.labels);
+  dealloc_list(c.gotos);
+  dealloc_list(c.functions);
+  dealloc_list(c.prototypes);
+  return compiled;
+}
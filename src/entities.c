@@ -23,6 +23,40 @@ int num_constructors(ClassNode *data)
   return cons;
 }
 
+/*
+  Returns the class or ancestor whose body declares a field or method in the class layout
+  Returns NULL if node is declared outside of the class hierarchy
+*/
+ClassNode *get_declaring_class(ClassNode *data, AstNode *node)
+{
+  for (; data; data = class_exists(data->parent))
+  {
+    for (int a = 0; a < data->ls->n; a++)
+    {
+      if (get_from_list(data->ls, a) == node)
+        return data;
+    }
+  }
+  return NULL;
+}
+
+/*
+  Returns the class or ancestor whose body declares a method or constructor
+  Returns NULL if the method is declared outside of the class hierarchy
+*/
+ClassNode *get_method_class(ClassNode *data, FunctionNode *method)
+{
+  for (; data; data = class_exists(data->parent))
+  {
+    for (int a = 0; a < data->ls->n; a++)
+    {
+      if (((AstNode *)get_from_list(data->ls, a))->data == method)
+        return data;
+    }
+  }
+  return NULL;
+}
+
 /*
   Searches a class's methods for a constructor
   Returns NULL if the class has no custom constructor
@@ -43,135 +77,210 @@ FunctionNode *get_constructor(ClassNode *data)
 }
 
 /*
-  Returns a list of all fields given a AST_CLASS or AST_INTERFACE node
-  The returned list is full of AstNodes
+  Returns the name of a class or interface field
+  Returns NULL for constructors, which are not fields
 */
-List *get_all_expected_fields(AstNode *node)
+static char *get_field_name(AstNode *node)
 {
-  List *ls = new_default_list();
-  if (node->type == AST_CLASS)
+  if (node->type == AST_DEFINE)
+    return ((BinaryNode *)(node->data))->text;
+  FunctionNode *data = (FunctionNode *)(node->data);
+  if (!data->name)
+    return NULL;
+  assert(data->name->type == AST_ID); // Assumes the function's name is AST_ID
+  return (char *)(data->name->data);
+}
+
+/*
+  Returns a Map of every field name in an interface and its ancestors to a FieldNode
+  The Map is built the first time it's requested and then kept on the InterfaceNode
+*/
+Map *get_interface_layout(InterfaceNode *data)
+{
+  if (data->layout)
+    return data->layout;
+  Map *m = new_default_map();
+  for (InterfaceNode *i = data; i; i = interface_exists(i->parent))
   {
-    ClassNode *clas = (ClassNode *)(node->data);
-    append_all(ls, clas->ls);
-    for (int a = 0; a < clas->interfaces->n; a++)
-    {
-      InterfaceNode *inter = interface_exists((char *)get_from_list(clas->interfaces, a));
-      AstNode *node1 = new_node(AST_INTERFACE, -1, inter);
-      append_all(ls, get_all_expected_fields(node1));
-      free(node1);
-    }
-    clas = class_exists(clas->parent);
-    if (clas)
+    for (int a = 0; a < i->ls->n; a++)
     {
-      AstNode *node1 = new_node(AST_CLASS, -1, clas);
-      append_all(ls, get_all_expected_fields(node1));
-      free(node1);
+      AstNode *e = (AstNode *)get_from_list(i->ls, a);
+      char *name = get_field_name(e);
+      if (name && !get_from_map(m, name))
+        put_in_map(m, name, new_field_node(e, get_type(e), -1));
     }
   }
-  else if (node->type == AST_INTERFACE)
+  data->layout = m;
+  return m;
+}
+
+/*
+  Adds a field to a class layout being built
+  Flags the class as colliding if the field shares a name with a field of a different type
+*/
+static void add_to_class_layout(ClassNode *data, char *name, AstNode *node, AstNode *type, int slot)
+{
+  FieldNode *field = (FieldNode *)get_from_map(data->layout, name);
+  if (field)
   {
-    InterfaceNode *inter = (InterfaceNode *)(node->data);
-    while (inter)
-    {
-      append_all(ls, inter->ls);
-      inter = interface_exists(inter->parent);
-    }
+    if (slot >= 0 && (node->type != field->node->type || !typed_match(type, field->type)))
+      data->colliding = 1;
+    return;
   }
-  return ls;
+  put_in_map(data->layout, name, new_field_node(node, type, slot));
 }
 
 /*
-  Collects every method from a class or interface's interface ancestors
-  Travels back in a straight path for interface nodes
-  Travels in a branching path for class nodes
+  Returns a Map of every field name in a class, its ancestors and its interfaces to a FieldNode
+  Class fields come first, youngest class first, and keep their parent's slot when inherited
+  Data fields and methods are numbered separately, so data fields occupy slots 0 to slots-1
+  Interface fields the class doesn't declare come last with a slot of -1
+  The Map is built the first time it's requested and then kept on the ClassNode
 */
-static List *get_interface_ancestor_methods(AstNode *node)
+Map *get_class_layout(ClassNode *data)
 {
-  char *name;
-  List *ls = new_default_list();
-  if (node->type == AST_CLASS)
+  if (data->layout)
+    return data->layout;
+  ClassNode *parent = class_exists(data->parent);
+  Map *inherited = parent ? get_class_layout(parent) : NULL;
+  data->layout = new_default_map();
+  data->slots = parent ? parent->slots : 0;
+  data->method_slots = parent ? parent->method_slots : 0;
+  data->colliding = parent ? parent->colliding : 0;
+  for (int a = 0; a < data->ls->n; a++)
   {
-    ClassNode *c = (ClassNode *)(node->data);
-    AstNode *inode = new_node(AST_INTERFACE, -1, NULL);
-    while (c)
+    AstNode *e = (AstNode *)get_from_list(data->ls, a);
+    char *name = get_field_name(e);
+    if (!name)
+      continue;
+    if (get_from_map(data->layout, name))
     {
-      for (int a = 0; a < c->interfaces->n; a++)
-      {
-        name = (char *)get_from_list(c->interfaces, a);
-        inode->data = interface_exists(name);
-        if (inode->data)
-        {
-          List *ls1 = get_interface_ancestor_methods(inode);
-          append_all(ls, ls1);
-          dealloc_list(ls1);
-        }
-      }
-      c = class_exists(c->parent);
+      add_to_class_layout(data, name, e, get_type(e), 0);
+      continue;
     }
-    free(inode);
+    FieldNode *field = inherited ? (FieldNode *)get_from_map(inherited, name) : NULL;
+    int *slots = e->type == AST_DEFINE ? &(data->slots) : &(data->method_slots);
+    int slot = (field && field->slot >= 0) ? field->slot : (*slots)++;
+    put_in_map(data->layout, name, new_field_node(e, get_type(e), slot));
   }
-  else if (node->type == AST_INTERFACE)
+  for (int a = 0; inherited && a < inherited->n; a++)
   {
-    InterfaceNode *i = (InterfaceNode *)(node->data);
-    while (i)
+    FieldNode *field = (FieldNode *)iterate_from_map(inherited, a);
+    if (field->slot >= 0)
+      add_to_class_layout(data, get_field_name(field->node), field->node, field->type, field->slot);
+  }
+  for (int a = 0; a < data->interfaces->n; a++)
+  {
+    InterfaceNode *inter = interface_exists((char *)get_from_list(data->interfaces, a));
+    Map *m = inter ? get_interface_layout(inter) : NULL;
+    for (int b = 0; m && b < m->n; b++)
     {
-      for (int a = 0; a < i->ls->n; a++)
-        add_to_list(ls, ((AstNode *)get_from_list(i->ls, a))->data);
-      i = interface_exists(i->parent);
+      FieldNode *field = (FieldNode *)iterate_from_map(m, b);
+      add_to_class_layout(data, get_field_name(field->node), field->node, field->type, -1);
     }
   }
-  return ls;
+  for (int a = 0; inherited && a < inherited->n; a++)
+  {
+    FieldNode *field = (FieldNode *)iterate_from_map(inherited, a);
+    if (field->slot < 0)
+      add_to_class_layout(data, get_field_name(field->node), field->node, field->type, -1);
+  }
+  return data->layout;
 }
 
 /*
-  Collects every method from a class and its class ancestors
-  Just goes back through parent classes in a straight path
+  Returns the canonical signature of a method, its name followed by its canonical type
+  The signature is computed once and kept on the FunctionNode
 */
-static List *get_class_ancestor_methods(ClassNode *node)
+static char *get_method_signature(FunctionNode *method)
 {
-  List *ls = new_default_list();
-  while (node)
+  if (!method->signature)
   {
-    for (int a = 0; a < node->ls->n; a++)
-    {
-      AstNode *e = (AstNode *)get_from_list(node->ls, a);
-      if (e->type == AST_FUNCTION)
-        add_to_list(ls, e->data);
-    }
-    node = class_exists(node->parent);
+    assert(method->name->type == AST_ID); // Assumes the method belongs to a class or interface
+    char *name = (char *)(method->name->data);
+    ScratchMark mark = scratch_mark();
+    AstNode *node = new_scratch_node(AST_FUNCTION, -1, method);
+    char *type = canonical_type(get_type(node));
+    scratch_release(mark);
+    method->signature = (char *)malloc(sizeof(char) * (strlen(name) + strlen(type) + 1));
+    sprintf(method->signature, "%s%s", name, type);
+    free(type);
   }
-  return ls;
+  return method->signature;
 }
 
 /*
-  Retrieves all the ancestor methods from a class's ancestor classes and interfaces
-  Then subtracts the two lists, returning any missing implementations in a List
+  Returns a Map of method signatures to the FunctionNodes that implement them
+  Starts from a copy of the parent's table, so overriding methods replace inherited ones
+  The Map is built the first time it's requested and then kept on the ClassNode
+*/
+Map *get_method_table(ClassNode *data)
+{
+  if (data->methods)
+    return data->methods;
+  ClassNode *parent = class_exists(data->parent);
+  Map *inherited = parent ? get_method_table(parent) : NULL;
+  data->methods = new_map(inherited && inherited->n ? inherited->n : 10);
+  for (int a = 0; inherited && a < inherited->n; a++)
+  {
+    FunctionNode *func = (FunctionNode *)iterate_from_map(inherited, a);
+    put_in_map(data->methods, func->signature, func);
+  }
+  for (int a = 0; a < data->ls->n; a++)
+  {
+    AstNode *e = (AstNode *)get_from_list(data->ls, a);
+    if (e->type != AST_FUNCTION)
+      continue;
+    FunctionNode *func = (FunctionNode *)(e->data);
+    if (!func->is_constructor)
+      put_in_map(data->methods, get_method_signature(func), func);
+  }
+  return data->methods;
+}
+
+/*
+  Finds the method in a class or its ancestors that matches the given method
+  Tries an exact signature match first, then falls back to a method with a compatible type
+  overriding is 1 if method overrides the one we're looking for, 0 if method is declared by an interface
+*/
+static FunctionNode *find_class_method(ClassNode *clas, FunctionNode *method, int overriding)
+{
+  FunctionNode *func = (FunctionNode *)get_from_map(get_method_table(clas), get_method_signature(method));
+  if (func)
+    return func;
+  FieldNode *field = (FieldNode *)get_from_map(get_class_layout(clas), (char *)(method->name->data));
+  if (!field || field->slot < 0 || field->node->type != AST_FUNCTION)
+    return NULL;
+  func = (FunctionNode *)(field->node->data);
+  if (overriding)
+    return methods_equivalent(func, method) ? func : NULL;
+  return methods_equivalent(method, func) ? func : NULL;
+}
+
+/*
+  Retrieves every method from a class's ancestor interfaces
+  Then looks each one up in the class's method table, returning any missing implementations in a List
 */
 List *get_missing_class_methods(ClassNode *c)
 {
-  AstNode *node = new_node(AST_CLASS, -1, c);
-  List *missing = get_interface_ancestor_methods(node);
-  List *found = get_class_ancestor_methods(c);
-  free(node);
-  int a = 0;
-  while (a < missing->n)
+  List *missing = new_default_list();
+  for (ClassNode *clas = c; clas; clas = class_exists(clas->parent))
   {
-    int removed = 0;
-    for (int b = 0; b < found->n; b++)
+    for (int a = 0; a < clas->interfaces->n; a++)
     {
-      FunctionNode *f1 = (FunctionNode *)get_from_list(missing, a);
-      FunctionNode *f2 = (FunctionNode *)get_from_list(found, b);
-      if (methods_equivalent(f1, f2))
+      InterfaceNode *inter = interface_exists((char *)get_from_list(clas->interfaces, a));
+      if (!inter)
+        continue;
+      Map *m = get_interface_layout(inter);
+      for (int b = 0; b < m->n; b++)
       {
-        remove_from_list(missing, a);
-        removed = 1;
-        break;
+        AstNode *e = ((FieldNode *)iterate_from_map(m, b))->node;
+        FunctionNode *func = (FunctionNode *)(e->data);
+        if (!find_class_method(c, func, 0))
+          add_to_list(missing, func);
       }
     }
-    if (!removed)
-      a++;
   }
-  dealloc_list(found);
   return missing;
 }
 
@@ -185,111 +294,30 @@ int methods_equivalent(FunctionNode *f1, FunctionNode *f2)
     return 0;
   assert(f1->name->type == AST_ID); // Assumes the two methods belong to classes (name nodes are of type AST_ID)
   assert(f2->name->type == AST_ID); // Assumes the two methods belong to classes (name nodes are of type AST_ID)
-  AstNode *node = new_node(AST_FUNCTION, -1, f1);
-  AstNode *type1 = get_type(node);
-  free(node);
-  node = new_node(AST_FUNCTION, -1, f2);
-  AstNode *type2 = get_type(node);
-  free(node);
+  ScratchMark mark = scratch_mark();
+  AstNode *type1 = get_type(new_scratch_node(AST_FUNCTION, -1, f1));
+  AstNode *type2 = get_type(new_scratch_node(AST_FUNCTION, -1, f2));
+  scratch_release(mark);
   return !strcmp((char *)(f1->name->data), (char *)(f2->name->data)) && typed_match(type1, type2);
 }
 
-/*
-  Returns a List containing all the fields or a class and all its ancestors
-  The youngest subclasses' methods are first in the List
-*/
-List *get_all_class_fields(ClassNode *data)
-{
-  List *ls = new_default_list();
-  while (data)
-  {
-    append_all(ls, data->ls);
-    data = class_exists(data->parent);
-  }
-  return ls;
-}
-
-/*
-  Calculates subclass fields by flattening ancestor fields into a Map
-  ls is a list of ancestor fields (pass result of get_all_class_fields)
-  Returns NULL if multiple fields share the same name but different types
-*/
-Map *collapse_ancestor_class_fields(List *ls)
-{
-  Map *m = new_default_map();
-  for (int a = 0; a < ls->n; a++)
-  {
-    AstNode *node = (AstNode *)get_from_list(ls, a);
-    char *name = NULL;
-    if (node->type == AST_DEFINE)
-      name = ((BinaryNode *)(node->data))->text;
-    if (node->type == AST_FUNCTION)
-    {
-      FunctionNode *data = (FunctionNode *)(node->data);
-      if (!data->name)
-        continue;
-      assert(data->name->type == AST_ID); // Assumes the function's name is AST_ID
-      name = (char *)(data->name->data);
-    }
-    AstNode *e = (AstNode *)get_from_map(m, name);
-    if (e)
-    {
-      AstNode *rtype = get_type(e);
-      AstNode *ltype = get_type(node);
-      if (node->type != e->type || !typed_match(ltype, rtype))
-      {
-        dealloc_map(m);
-        return NULL;
-      }
-    }
-    else
-    {
-      put_in_map(m, name, node);
-    }
-  }
-  return m;
-}
-
 /*
   Grabs the FunctionNode that corresponds to the child class's function
   clas should be the parent of the class who has the function method
 */
 FunctionNode *get_parent_method(ClassNode *clas, FunctionNode *method)
 {
-  while (clas)
+  if (!clas)
+    return NULL;
+  if (method->is_constructor)
   {
-    for (int a = 0; a < clas->ls->n; a++)
+    for (; clas; clas = class_exists(clas->parent))
     {
-      AstNode *e = (AstNode *)get_from_list(clas->ls, a);
-      if (e->type != AST_FUNCTION)
-        continue;
-      FunctionNode *func = (FunctionNode *)(e->data);
-      if (method->is_constructor)
-      {
-        if (func->is_constructor)
-          return func;
-      }
-      else if (func->is_constructor)
-      {
-        continue;
-      }
-      else
-      {
-        assert(method->name->type == AST_ID); // I'm assuming both method->name and func->name are AST_ID types
-        assert(func->name->type == AST_ID);   // I'm assuming both method->name and func->name are AST_ID types
-        if (strcmp((char *)(method->name->data), (char *)(func->name->data)))
-          continue;
-        AstNode *func_type = get_type(e);
-        AstNode *m = new_node(AST_FUNCTION, -1, method);
-        AstNode *method_type = get_type(m);
-        free(m);
-        if (typed_match(func_type, method_type))
-        {
-          return func;
-        }
-      }
+      FunctionNode *func = get_constructor(clas);
+      if (func)
+        return func;
     }
-    clas = class_exists(clas->parent);
+    return NULL;
   }
-  return NULL;
+  return find_class_method(clas, method, 1);
 }
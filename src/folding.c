@@ -0,0 +1,489 @@
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#define UNARY_PRIORITY 12 // Lua 5.3's priority for unary operators
+
+// Kinds of compile time constants
+enum CONSTANTS
+{
+  CONSTANT_NONE,
+  CONSTANT_INT,
+  CONSTANT_FLOAT,
+  CONSTANT_STRING,
+  CONSTANT_BOOL,
+  CONSTANT_NIL
+};
+
+/*
+  FoldNode: an ExprNode along with the constant it evaluates to
+  Also used for the flattened operator sequence, where unary marks prefix operators
+*/
+typedef struct
+{
+  ExprNode expr;
+  int kind;     // CONSTANT_* kind of the value, or CONSTANT_NONE if it isn't known at compile time
+  int unary;    // 1 if this is a prefix operator in the flattened sequence
+  long long i;  // Value of an int or bool constant
+  double f;     // Value of a float constant
+  char *s;      // Contents of a string constant without its delimiters
+  char quote;   // Delimiter of a string constant
+} FoldNode;
+
+static List *sequence; // Flattened operators and operands of the expression being folded
+static int position;   // Index of the next item in the sequence
+
+static FoldNode *fold_sequence(int limit);
+
+static FoldNode *new_fold_node(AstNode *atom, char *op, FoldNode *l, FoldNode *r)
+{
+  FoldNode *node = (FoldNode *)scratch_alloc(sizeof(FoldNode));
+  memset(node, 0, sizeof(FoldNode));
+  node->expr.atom = atom;
+  node->expr.op = op;
+  node->expr.l = (ExprNode *)l;
+  node->expr.r = (ExprNode *)r;
+  return node;
+}
+
+/*
+  Writes the operators and operands under node to the sequence in the order they're emitted
+*/
+static void flatten(AstNode *node)
+{
+  if (node->type == AST_BINARY)
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    flatten(data->l);
+    if (strcmp(data->text, "as"))
+    {
+      add_to_list(sequence, new_fold_node(NULL, data->text, NULL, NULL));
+      flatten(data->r);
+    }
+  }
+  else if (node->type == AST_UNARY)
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    if (strcmp(data->text, "trust"))
+    {
+      FoldNode *op = new_fold_node(NULL, data->text, NULL, NULL);
+      op->unary = 1;
+      add_to_list(sequence, op);
+    }
+    flatten(data->l);
+  }
+  else
+    add_to_list(sequence, new_fold_node(node, NULL, NULL, NULL));
+}
+
+/*
+  Gets the left and right priorities Lua 5.3 gives a binary operator
+*/
+int left_priority(char *op)
+{
+  if (!strcmp(op, "^"))
+    return 14;
+  if (!strcmp(op, "*") || !strcmp(op, "/"))
+    return 11;
+  if (!strcmp(op, "+") || !strcmp(op, "-"))
+    return 10;
+  if (!strcmp(op, ".."))
+    return 9;
+  if (!strcmp(op, "and"))
+    return 2;
+  if (!strcmp(op, "or"))
+    return 1;
+  return 3;
+}
+int right_priority(char *op)
+{
+  if (!strcmp(op, "^"))
+    return 13;
+  if (!strcmp(op, ".."))
+    return 8;
+  return left_priority(op);
+}
+
+/*
+  Copies the constant value of src into dest
+*/
+static void copy_constant(FoldNode *dest, FoldNode *src)
+{
+  dest->kind = src->kind;
+  dest->i = src->i;
+  dest->f = src->f;
+  dest->s = src->s;
+  dest->quote = src->quote;
+}
+
+/*
+  Reads the constant value of a literal with the primitive type given
+  Strings containing escapes are left alone, so the contents of a string constant are its value
+  Negative numbers are read too, since folded literals can be
+*/
+static void read_literal(FoldNode *node, char *text, const char *type)
+{
+  if (!strcmp(type, PRIMITIVE_INT))
+  {
+    if (!strcmp(text, "(-9223372036854775807 - 1)"))
+    {
+      node->kind = CONSTANT_INT;
+      node->i = -9223372036854775807LL - 1;
+      return;
+    }
+    int negative = text[0] == '-';
+    errno = 0;
+    unsigned long long u = strtoull(text + negative, NULL, 10);
+    if (errno || u > 9223372036854775807ULL)
+    {
+      // Lua reads decimal integers that overflow as floats
+      node->kind = CONSTANT_FLOAT;
+      node->f = strtod(text, NULL);
+    }
+    else
+    {
+      node->kind = CONSTANT_INT;
+      node->i = negative ? -(long long)u : (long long)u;
+    }
+  }
+  else if (!strcmp(type, PRIMITIVE_FLOAT))
+  {
+    node->kind = CONSTANT_FLOAT;
+    node->f = strtod(text, NULL);
+  }
+  else if (!strcmp(type, PRIMITIVE_BOOL))
+  {
+    node->kind = CONSTANT_BOOL;
+    node->i = !strcmp(text, "true");
+  }
+  else if (!strcmp(type, PRIMITIVE_NIL))
+    node->kind = CONSTANT_NIL;
+  else if (!strcmp(type, PRIMITIVE_STRING) && !strchr(text, '\\'))
+  {
+    int n = strlen(text);
+    node->kind = CONSTANT_STRING;
+    node->quote = text[0];
+    node->s = (char *)scratch_alloc(n - 1);
+    memcpy(node->s, text + 1, n - 2);
+    node->s[n - 2] = 0;
+  }
+}
+
+/*
+  Reads the constant value of a primitive literal
+*/
+static void fold_primitive(FoldNode *node, StringAstNode *data)
+{
+  if (data->node->type == AST_TYPE_BASIC)
+    read_literal(node, data->text, (char *)(data->node->data));
+}
+
+/*
+  Finds the constant value of an operand, looking through parentheses
+*/
+static void fold_atom(FoldNode *node)
+{
+  AstNode *atom = node->expr.atom;
+  while (atom->type == AST_PAREN)
+    atom = (AstNode *)(atom->data);
+  if (atom->type == AST_PRIMITIVE)
+    fold_primitive(node, (StringAstNode *)(atom->data));
+  else if (atom->type == AST_BINARY || atom->type == AST_UNARY)
+    copy_constant(node, (FoldNode *)fold_expression(atom));
+}
+
+static int is_number(FoldNode *node)
+{
+  return node->kind == CONSTANT_INT || node->kind == CONSTANT_FLOAT;
+}
+static int is_truthy(FoldNode *node)
+{
+  return node->kind != CONSTANT_NIL && !(node->kind == CONSTANT_BOOL && !node->i);
+}
+static double to_float(FoldNode *node)
+{
+  return node->kind == CONSTANT_INT ? (double)node->i : node->f;
+}
+
+/*
+  Stores a float result, giving up on values that have no Lua literal
+*/
+static void set_float(FoldNode *node, double f)
+{
+  if (isinf(f) || isnan(f))
+    return;
+  node->kind = CONSTANT_FLOAT;
+  node->f = f;
+}
+static void set_bool(FoldNode *node, int b)
+{
+  node->kind = CONSTANT_BOOL;
+  node->i = b;
+}
+
+/*
+  Compares an int to a float exactly, the way Lua 5.3 does
+  Returns a negative number, zero, or a positive number like strcmp
+*/
+static int compare_int_float(long long i, double f)
+{
+  if (f >= 9223372036854775808.0)
+    return -1;
+  if (f < -9223372036854775808.0)
+    return 1;
+  double whole = floor(f);
+  long long w = (long long)whole;
+  if (i != w)
+    return i < w ? -1 : 1;
+  return whole < f ? -1 : 0;
+}
+static int compare_numbers(FoldNode *l, FoldNode *r)
+{
+  if (l->kind == CONSTANT_INT && r->kind == CONSTANT_INT)
+    return l->i < r->i ? -1 : l->i > r->i;
+  if (l->kind == CONSTANT_INT)
+    return compare_int_float(l->i, r->f);
+  if (r->kind == CONSTANT_INT)
+    return -compare_int_float(r->i, l->f);
+  return l->f < r->f ? -1 : l->f > r->f;
+}
+
+/*
+  Writes a number the way Lua 5.3's tostring does
+*/
+static char *number_to_string(FoldNode *node)
+{
+  char *s = (char *)scratch_alloc(32);
+  if (node->kind == CONSTANT_INT)
+    sprintf(s, "%lld", node->i);
+  else
+  {
+    sprintf(s, "%.14g", node->f);
+    if (!s[strspn(s, "-0123456789")])
+      strcat(s, ".0");
+  }
+  return s;
+}
+
+/*
+  Evaluates a binary operator whose operands are both constant
+  Leaves the node non-constant when Lua would raise an error or coerce a string, or for an operator it doesn't know
+*/
+static void fold_binary(FoldNode *node, FoldNode *l, FoldNode *r)
+{
+  char *op = node->expr.op;
+  if (!strcmp(op, "and"))
+    copy_constant(node, is_truthy(l) ? r : l);
+  else if (!strcmp(op, "or"))
+    copy_constant(node, is_truthy(l) ? l : r);
+  else if (!strcmp(op, "==") || !strcmp(op, "~="))
+  {
+    int equal;
+    if (is_number(l) && is_number(r))
+      equal = !compare_numbers(l, r);
+    else if (l->kind == CONSTANT_STRING && r->kind == CONSTANT_STRING)
+      equal = !strcmp(l->s, r->s);
+    else if (l->kind != r->kind)
+      equal = 0;
+    else
+      equal = l->kind == CONSTANT_NIL || l->i == r->i;
+    set_bool(node, !strcmp(op, "==") ? equal : !equal);
+  }
+  else if (!strcmp(op, ".."))
+  {
+    if ((l->kind != CONSTANT_STRING && !is_number(l)) || (r->kind != CONSTANT_STRING && !is_number(r)))
+      return;
+    char quote = l->kind == CONSTANT_STRING ? l->quote : r->kind == CONSTANT_STRING ? r->quote : '"';
+    if ((l->kind == CONSTANT_STRING && strchr(l->s, quote)) || (r->kind == CONSTANT_STRING && strchr(r->s, quote)))
+      return;
+    char *ls = l->kind == CONSTANT_STRING ? l->s : number_to_string(l);
+    char *rs = r->kind == CONSTANT_STRING ? r->s : number_to_string(r);
+    node->kind = CONSTANT_STRING;
+    node->quote = quote;
+    node->s = (char *)scratch_alloc(strlen(ls) + strlen(rs) + 1);
+    strcpy(node->s, ls);
+    strcat(node->s, rs);
+  }
+  else if (is_number(l) && is_number(r))
+  {
+    if (!strcmp(op, "<"))
+      set_bool(node, compare_numbers(l, r) < 0);
+    else if (!strcmp(op, "<="))
+      set_bool(node, compare_numbers(l, r) <= 0);
+    else if (!strcmp(op, ">"))
+      set_bool(node, compare_numbers(l, r) > 0);
+    else if (!strcmp(op, ">="))
+      set_bool(node, compare_numbers(l, r) >= 0);
+    else if (!strcmp(op, "/"))
+      set_float(node, to_float(l) / to_float(r));
+    else if (!strcmp(op, "^"))
+      set_float(node, pow(to_float(l), to_float(r)));
+    else if (strcmp(op, "+") && strcmp(op, "-") && strcmp(op, "*"))
+      return;
+    else if (l->kind == CONSTANT_INT && r->kind == CONSTANT_INT)
+    {
+      // Integer arithmetic wraps around on overflow
+      unsigned long long a = (unsigned long long)l->i, b = (unsigned long long)r->i;
+      node->kind = CONSTANT_INT;
+      node->i = (long long)(!strcmp(op, "+") ? a + b : !strcmp(op, "-") ? a - b : a * b);
+    }
+    else
+    {
+      double a = to_float(l), b = to_float(r);
+      set_float(node, !strcmp(op, "+") ? a + b : !strcmp(op, "-") ? a - b : a * b);
+    }
+  }
+}
+
+/*
+  Evaluates a unary operator whose operand is constant
+*/
+static void fold_unary(FoldNode *node, FoldNode *l)
+{
+  char *op = node->expr.op;
+  if (!strcmp(op, "not"))
+    set_bool(node, !is_truthy(l));
+  else if (!strcmp(op, "#") && l->kind == CONSTANT_STRING)
+  {
+    node->kind = CONSTANT_INT;
+    node->i = strlen(l->s);
+  }
+  else if (!strcmp(op, "-") && l->kind == CONSTANT_INT)
+  {
+    node->kind = CONSTANT_INT;
+    node->i = (long long)(0ULL - (unsigned long long)l->i);
+  }
+  else if (!strcmp(op, "-") && l->kind == CONSTANT_FLOAT)
+    set_float(node, -l->f);
+}
+
+/*
+  Writes the Lua literal for a folded operator node
+*/
+static void write_folded(FoldNode *node)
+{
+  char *s;
+  switch (node->kind)
+  {
+  case CONSTANT_INT:
+    s = (char *)scratch_alloc(32);
+    if (node->i == -9223372036854775807LL - 1)
+      strcpy(s, "(-9223372036854775807 - 1)");
+    else
+      sprintf(s, "%lld", node->i);
+    break;
+  case CONSTANT_FLOAT:
+    s = (char *)scratch_alloc(32);
+    sprintf(s, "%.17g", node->f);
+    if (!strpbrk(s, ".e"))
+      strcat(s, ".0");
+    break;
+  case CONSTANT_STRING:
+    s = (char *)scratch_alloc(strlen(node->s) + 3);
+    sprintf(s, "%c%s%c", node->quote, node->s, node->quote);
+    break;
+  case CONSTANT_BOOL:
+    s = node->i ? "true" : "false";
+    break;
+  case CONSTANT_NIL:
+    s = "nil";
+    break;
+  default:
+    return;
+  }
+  node->expr.folded = s;
+}
+
+/*
+  Parses the sequence from the current position the way Lua 5.3 would
+  Only binary operators binding tighter than limit are consumed
+*/
+static FoldNode *fold_sequence(int limit)
+{
+  FoldNode *item = (FoldNode *)get_from_list(sequence, position++);
+  FoldNode *node;
+  if (item->unary)
+  {
+    FoldNode *l = fold_sequence(UNARY_PRIORITY);
+    node = new_fold_node(NULL, item->expr.op, l, NULL);
+    if (l->kind != CONSTANT_NONE)
+      fold_unary(node, l);
+    write_folded(node);
+  }
+  else
+  {
+    node = item;
+    fold_atom(node);
+  }
+  while (position < sequence->n)
+  {
+    char *op = ((FoldNode *)get_from_list(sequence, position))->expr.op;
+    if (left_priority(op) <= limit)
+      break;
+    position++;
+    FoldNode *r = fold_sequence(right_priority(op));
+    FoldNode *l = node;
+    node = new_fold_node(NULL, op, l, r);
+    if (l->kind != CONSTANT_NONE && r->kind != CONSTANT_NONE)
+      fold_binary(node, l, r);
+    write_folded(node);
+  }
+  return node;
+}
+
+/*
+  Rebuilds an operator expression with the precedence Lua 5.3 gives its emitted tokens
+  Subexpressions that are constant get the literal they fold to
+  Everything is allocated in the scratch arena
+*/
+ExprNode *fold_expression(AstNode *node)
+{
+  List *outer_sequence = sequence;
+  int outer_position = position;
+  sequence = new_scratch_list(8);
+  position = 0;
+  flatten(node);
+  FoldNode *expr = fold_sequence(0);
+  sequence = outer_sequence;
+  position = outer_position;
+  return (ExprNode *)expr;
+}
+
+/*
+  Returns 1 if an expression is always truthy, 0 if it's always falsy, or -1 if that isn't known at compile time
+*/
+int constant_truth(AstNode *node)
+{
+  ScratchMark mark = scratch_mark();
+  FoldNode *expr = (FoldNode *)fold_expression(node);
+  int truth = expr->kind == CONSTANT_NONE ? -1 : is_truthy(expr);
+  scratch_release(mark);
+  return truth;
+}
+
+/*
+  Folds an operator applied to literals with the primitive types given, where r is NULL for a unary operator
+  Returns the literal it folds to and sets type to its primitive type, or returns NULL if it doesn't fold
+*/
+char *fold_literals(char *op, char *l, const char *ltype, char *r, const char *rtype, const char **type)
+{
+  static const char *primitives[] = {NULL, PRIMITIVE_INT, PRIMITIVE_FLOAT, PRIMITIVE_STRING, PRIMITIVE_BOOL, PRIMITIVE_NIL};
+  ScratchMark mark = scratch_mark();
+  FoldNode *node = new_fold_node(NULL, op, NULL, NULL);
+  FoldNode *lnode = new_fold_node(NULL, NULL, NULL, NULL);
+  FoldNode *rnode = new_fold_node(NULL, NULL, NULL, NULL);
+  read_literal(lnode, l, ltype);
+  if (r)
+    read_literal(rnode, r, rtype);
+  if (r && lnode->kind != CONSTANT_NONE && rnode->kind != CONSTANT_NONE)
+    fold_binary(node, lnode, rnode);
+  else if (!r && lnode->kind != CONSTANT_NONE)
+    fold_unary(node, lnode);
+  write_folded(node);
+  char *folded = node->expr.folded ? copy_string(node->expr.folded) : NULL;
+  *type = primitives[node->kind];
+  scratch_release(mark);
+  return folded;
+}
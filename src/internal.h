@@ -12,16 +12,20 @@
 typedef struct
 {
   void **items;
+  int scratch; // 1 if the list lives in the scratch arena
   int max;
   int n;
 } List;
 
 List *new_list(int max);
+List *new_scratch_list(int max);
 List *new_default_list();
 void *get_from_list(List *ls, int i);
 void *remove_from_list(List *ls, int i);
+void remove_head_from_list(List *ls, int n);
 void append_all(List *ls, List *ls1);
 void add_to_list(List *ls, void *e);
+void insert_into_list(List *ls, int i, void *e);
 void dealloc_list(List *ls);
 
 /*
@@ -35,7 +39,9 @@ typedef struct
 typedef struct
 {
   Pair *data;
+  int *index;
   int max;
+  int cap;
   int n;
 } Map;
 Map *new_map(int max);
@@ -43,8 +49,43 @@ Map *new_default_map();
 void *get_from_map(Map *m, char *k);
 void *iterate_from_map(Map *m, int i);
 void put_in_map(Map *m, char *k, void *v);
+void truncate_map(Map *m, int n);
 void dealloc_map(Map *m);
 
+/*
+  Buffer: a growable character array used to build output
+*/
+typedef struct
+{
+  char *data;
+  int max;
+  int n;
+} Buffer;
+
+void insert_into_buffer(Buffer *b, int at, const char *str, int n);
+void append_to_buffer(Buffer *b, const char *str, int n);
+void append_string_to_buffer(Buffer *b, const char *str);
+void flush_buffer(Buffer *b, FILE *f);
+Buffer *new_default_buffer();
+void dealloc_buffer(Buffer *b);
+Buffer *new_buffer(int max);
+char *copy_buffer(Buffer *b);
+
+/*
+  ScratchMark: a position in the scratch arena for transient allocations
+*/
+typedef struct
+{
+  int chunk;
+  int used;
+} ScratchMark;
+
+void scratch_release(ScratchMark mark);
+void *scratch_alloc(int size);
+ScratchMark scratch_mark();
+void dealloc_scratch();
+void init_scratch();
+
 /*
   Token: a symbol from the input code utilized by the parser
 */
@@ -55,12 +96,31 @@ typedef struct
   int line;
 } Token;
 
+/*
+  TokenStream: tokenizes a file on demand
+  Holds the tokenizer state between reads
+*/
+typedef struct
+{
+  FILE *file;
+  char *buffer;          // Characters of the same class waiting to become Tokens
+  int length;            // Number of characters in the buffer
+  int char_class;        // Character class of the buffered characters
+  int line;              // Current line in the file
+  int comment;           // 1 if we're within a single line comment
+  int multiline_comment; // 1 if we're within a multiline comment
+  int overflow;          // 1 if a token didn't fit in the buffer
+} TokenStream;
+
 void deallocate_token(Token *token);
 
 // AST node types
-typedef struct
+typedef struct AstNode
 {
+  struct AstNode *cache; // Type derived for this node during the check step
   void *data;
+  int binding; // Binding resolved for AST_ID nodes alongside cache
+  int epoch;   // Type epoch that cache was derived in
   int type;
   int line;
 } AstNode;
@@ -74,9 +134,14 @@ typedef struct
 typedef struct
 {
   int is_constructor; // 1 if the function is a constructor
+  int is_final;       // 1 if the method can't be overridden
+  int direct;         // 1 if the method is also written as a local function for direct and super calls
+  int calls_super;    // 1 if the body contains a super call
   AstNode *functype;  // Overall function type
+  AstNode *inlined;   // Expression written in place of calls to this function, or NULL if it isn't inlined
   AstNode *name;      // An AST_LHS or AST_ID node representing the name, or NULL for constructors
   AstNode *type;      // Return type of the function (part of functype)
+  char *signature;    // Canonical name and type of the method, or NULL if it hasn't been computed yet
   List *body;         // List of AstNodes for the function body
   List *args;         // List of StringAstNodes for function parameters
 } FunctionNode;
@@ -122,10 +187,23 @@ typedef struct
   char *text;
 } BinaryNode;
 
+/*
+  ExprNode: an operator expression rebuilt with Lua's precedence for constant folding
+*/
+typedef struct ExprNode
+{
+  struct ExprNode *l; // Left operand, or the operand of a unary operator
+  struct ExprNode *r; // Right operand, or NULL for unary operators
+  AstNode *atom;      // Operand written as is, or NULL for operators
+  char *folded;       // Literal the operator folds to, or NULL if it isn't constant
+  char *op;           // Operator text, or NULL for operands
+} ExprNode;
+
 typedef struct
 {
   AstNode *type; // Type representing the interface itself
   char *parent;  // Name of parent interface, or NULL if there is none
+  Map *layout;   // Map of field names to FieldNodes, or NULL if it hasn't been built yet
   char *name;    // Name of interface
   List *ls;      // List of AstNodes (AST_FUNCTION nodes)
 } InterfaceNode;
@@ -135,10 +213,27 @@ typedef struct
   List *interfaces; // List of strings
   AstNode *type;    // Type representing the class itself
   char *parent;     // Name of parent class, or NULL if there is none
+  Map *layout;      // Map of field names to FieldNodes, or NULL if it hasn't been built yet
+  Map *methods;     // Map of method signatures to FunctionNodes, or NULL if it hasn't been built yet
   char *name;       // Name of class
   List *ls;         // List of AstNodes
+  int colliding;    // 1 if the class and its ancestors declare the same name with different types
+  int assumed_leaf; // 1 if calls were compiled as direct calls because no class extended this one
+  int is_final;     // 1 if the class can't be extended
+  int children;     // Number of classes that extend this class
+  int declared;     // 1 if the class's shared method table has been written
+  int defined;      // 1 if the class's own methods have been written to its shared method table
+  int method_slots; // Number of method slots in the class layout
+  int slots;        // Number of data field slots in the class layout
 } ClassNode;
 
+typedef struct
+{
+  AstNode *node; // The AST_DEFINE or AST_FUNCTION node that declares this field
+  AstNode *type; // Type of the field
+  int slot;      // Index of the field among its class's data fields or methods, or -1 if only an interface declares it
+} FieldNode;
+
 typedef struct
 {
   AstNode *expr;
@@ -146,7 +241,51 @@ typedef struct
   List *body;
 } IfNode;
 
+// Optimization IR structs
+typedef struct IrValue
+{
+  struct IrValue *object; // Table a VALUE_MEMBER or VALUE_ELEMENT target indexes
+  struct IrValue *key;    // Key a VALUE_ELEMENT target indexes
+  const char *primitive;  // Primitive type of a constant, or of a variable the check step typed as one, or NULL
+  char *text;             // Literal of a constant, or name of a variable or member
+  int kind;               // VALUE_* kind of value
+  int temp;               // Temporary that a VALUE_TEMP reads
+} IrValue;
+
+typedef struct IrBlock
+{
+  List *ops; // IrOps in the order they run
+} IrBlock;
+
+typedef struct
+{
+  IrBlock *body;  // Branch an IR_IF takes when its value is truthy, body of a loop or IR_DO, or the block evaluating the right operand of IR_AND and IR_OR
+  IrBlock *other; // Other branch of an IR_IF, or the block evaluating the condition of an IR_WHILE or IR_REPEAT
+  List *targets;  // IrValues an IR_LOCAL, IR_SET, IR_FORNUM or IR_FORIN assigns
+  List *args;     // IrValues the op reads, in the order Lua evaluates them
+  List *keys;     // Field names of an IR_TABLE's entries, where NULL marks a positional entry
+  char *text;     // Operator, or name of the field an IR_FIELD reads
+  int code;       // IR_* operation
+  int dest;       // Temporary the result is stored in, or -1 if it's discarded
+  int multi;      // 1 if a call's results are all kept, which only its last use in an argument or return list can do
+} IrOp;
+
+typedef struct
+{
+  IrBlock *body; // Statements of the function
+  IrBlock *dead; // Statements the passes found unreachable, kept to measure them
+  int temps;     // Number of temporaries
+} IrFunction;
+
 // Traversal algorithm structs
+typedef struct
+{
+  List *functions; // Names of the top-level functions, in the order they're defined
+  List *globals;   // Names of top-level classes and functions that are read before they're defined
+  Map *reads;      // Names read by the top-level statements scanned so far
+  int locals;      // Number of locals the top-level statements declare
+} ChunkScan;
+
 typedef struct
 {
   AstNode *type; // Type that the registered type is equivalent to
@@ -155,6 +294,15 @@ typedef struct
   int scope;     // The index of the scope where this equivalence was defined
 } EqualTypesNode;
 
+typedef struct
+{
+  char *target; // Name of the type that this typedef points to
+  char *root;   // Cached lowest-level typedef link for target
+  char *name;   // Name of the typedef
+  int version;  // Version of the alias map when root was cached
+  int scope;    // The index of the scope where this typedef was defined
+} AliasNode;
+
 typedef struct
 {
   List *interfaces_registry; // List of InterfaceNodes
@@ -180,8 +328,7 @@ enum STEPS
 {
   STEP_TYPEDEF, // Step for processing type definitions, runs for each scope
   STEP_RELATE,  // Step for processing type relations, runs after typedef step for each scope
-  STEP_CHECK,   // General validation step, runs after relate step for each scope
-  STEP_OUTPUT   // Post-validation step for outputting Lua code, runs once after all validation
+  STEP_CHECK    // General validation step that also buffers Lua code, runs after relate step for each scope
 };
 
 // Enum for all scope types
@@ -192,6 +339,15 @@ enum SCOPE_TYPES
   SCOPE_NONE
 };
 
+// Enum for what an identifier resolves to
+enum BINDINGS
+{
+  BINDING_GLOBAL, // A global variable, or a name that isn't declared anywhere
+  BINDING_LOCAL,  // A variable declared in a function or block scope
+  BINDING_FIELD,  // A field of the class being traversed
+  BINDING_THIS    // The instance of the class being traversed
+};
+
 // Enum for all equivalent type relationships
 enum RELATIONS
 {
@@ -200,6 +356,51 @@ enum RELATIONS
   RL_IMPLEMENTS
 };
 
+// Enum for the kinds of tokens in written Lua code
+enum LUA_TOKENS
+{
+  LUA_NAME,    // Identifier that isn't a keyword
+  LUA_KEYWORD, // Reserved word
+  LUA_NUMBER,  // Numeric literal
+  LUA_STRING,  // Quoted or long bracket string literal
+  LUA_SYMBOL   // Operator or punctuation
+};
+
+// Enum for the kinds of IrValues
+enum IR_VALUES
+{
+  VALUE_CONSTANT, // A Lua literal
+  VALUE_LOCAL,    // A local of the function being lowered
+  VALUE_GLOBAL,   // A global, or a local of an enclosing function
+  VALUE_VARARG,   // The function's variadic arguments
+  VALUE_TEMP,     // A temporary holding an op's result
+  VALUE_MEMBER,   // A named field of a table, only used as an assignment target
+  VALUE_ELEMENT   // An indexed element of a table, only used as an assignment target
+};
+
+// Enum for the operations of the optimization IR
+enum IR_OPS
+{
+  IR_BINARY, // Applies the operator in text to two values
+  IR_UNARY,  // Applies the operator in text to a value
+  IR_AND,    // Evaluates its body only if the first value is truthy
+  IR_OR,     // Evaluates its body only if the first value is falsy
+  IR_CALL,   // Calls the first value with the rest
+  IR_FIELD,  // Reads the field named text from a value
+  IR_INDEX,  // Reads a key from a value
+  IR_TABLE,  // Builds a table from its keys and values
+  IR_LOCAL,  // Declares its targets as locals, assigning its values to them
+  IR_SET,    // Assigns its values to its targets
+  IR_RETURN, // Returns its values
+  IR_BREAK,  // Leaves the innermost loop
+  IR_IF,     // Runs its body if its value is truthy, and the other block otherwise
+  IR_WHILE,  // Runs its other block, then its body while the value it computed is truthy
+  IR_REPEAT, // Runs its body, then its other block, until the value the other block computed is truthy
+  IR_FORNUM, // Runs its body for each number of a numeric for loop
+  IR_FORIN,  // Runs its body for each step of a generic for loop
+  IR_DO      // Runs its body in its own scope
+};
+
 // Enum for all possible tokens
 enum TOKENS
 {
@@ -349,9 +550,11 @@ enum RULES
 
 // Implemented in moonshot.c
 void add_error_internal(int line, const char *msg, va_list args);
+void format_to_buffer(Buffer *b, int indent, const char *msg, va_list args);
 char *format_string(int indent, const char *msg, va_list args);
 void add_error(int line, const char *msg, ...);
 int require_file(char *filename, int step);
+char *get_chunk_name();
 char *collapse_string_list(List *ls);
 void dealloc_token_buffer(List *ls);
 char *strip_quotes(char *str);
@@ -359,10 +562,14 @@ char *copy_string(char *str);
 char *string_from_int(int a);
 
 // Implemented in tokenizer.c
+int read_tokens(TokenStream *ts, List *ls, int n);
+void dealloc_token_stream(TokenStream *ts);
+TokenStream *new_token_stream(FILE *f);
 void dealloc_token(Token *tk);
 List *tokenize(FILE *f);
 
 // Implemented in parser.c
+AstNode *parse_next(TokenStream *ts, List *ls, int *consumed, int *header);
 AstNode *parse(List *ls);
 AstNode *parse_function(AstNode *type, int include_body);
 AstNode *parse_constructor(char *classname);
@@ -405,6 +612,10 @@ AstNode *parse_do();
 // Implemented in nodes.c
 FornumNode *new_fornum_node(char *name, AstNode *num1, AstNode *num2, AstNode *num3, List *body);
 EqualTypesNode *new_equal_types_node(char *name, AstNode *type, int relation, int scope);
+AliasNode *new_alias_node(char *name, char *target, int scope);
+FieldNode *new_field_node(AstNode *node, AstNode *type, int slot);
+void dealloc_layout(Map *layout);
+void dealloc_ast_body(AstNode *node);
 FunctionNode *new_function_node(AstNode *name, AstNode *type, List *args, List *body);
 ClassNode *new_class_node(char *name, char *parent, List *interfaces, List *ls);
 InterfaceNode *new_interface_node(char *name, char *parent, List *ls);
@@ -417,6 +628,7 @@ AstListNode *new_ast_list_node(AstNode *ast, List *list);
 AstAstNode *new_ast_ast_node(AstNode *l, AstNode *r);
 TableNode *new_table_node(List *keys, List *vals);
 BinaryNode *new_unary_node(char *op, AstNode *e);
+AstNode *new_scratch_node(int type, int line, void *data);
 AstNode *new_node(int type, int line, void *data);
 void dealloc_ast_type(AstNode *node);
 void dealloc_ast_node(AstNode *node);
@@ -433,13 +645,14 @@ void push_function_scope(FunctionNode *node);
 void register_interface(InterfaceNode *node);
 InterfaceNode *interface_exists(char *name);
 void register_function(FunctionNode *node);
+StringAstNode *resolve_scoped_var(char *name, int *binding);
 StringAstNode *get_scoped_var(char *name);
 FunctionNode *function_exists(char *name);
 void register_primitive(const char *name);
 int add_scoped_var(StringAstNode *node);
-int field_defined_in_class(char *name);
 void push_class_scope(ClassNode *node);
 void register_class(ClassNode *node);
+ClassNode *class_method_exists(char *name);
 ClassNode *class_exists(char *name);
 FunctionNode *get_function_scope();
 FunctionNode *get_method_scope();
@@ -461,28 +674,92 @@ void quell_expired_scope_equivalences(int scope);
 int is_primitive(AstNode *node, const char *type);
 int types_equivalent(char *name, AstNode *type);
 int compound_type_exists(AstNode *node);
-List *get_equivalent_types(char *name);
+void get_equivalent_types(char *name, List *ls);
 int typed_match(AstNode *l, AstNode *r);
 int is_variadic_function(List *args);
 char *stringify_type(AstNode *node);
+char *canonical_type(AstNode *node);
+FieldNode *get_field_node(AstNode *node);
 AstNode *get_type(AstNode *node);
+int get_binding(AstNode *node);
 char *base_type(char *name);
+void expire_types();
 void print_types_graph();
 void dealloc_types();
 void init_types();
 
 // Implemented in entities.c
+ClassNode *get_declaring_class(ClassNode *data, AstNode *node);
+ClassNode *get_method_class(ClassNode *data, FunctionNode *method);
 FunctionNode *get_parent_method(ClassNode *clas, FunctionNode *method);
 int methods_equivalent(FunctionNode *f1, FunctionNode *f2);
 List *get_missing_class_methods(ClassNode *node);
+Map *get_method_table(ClassNode *data);
 FunctionNode *get_constructor(ClassNode *data);
-Map *collapse_ancestor_class_fields(List *ls);
-List *get_all_expected_fields(AstNode *node);
-List *get_all_class_fields(ClassNode *data);
+Map *get_interface_layout(InterfaceNode *data);
+Map *get_class_layout(ClassNode *data);
 int num_constructors(ClassNode *data);
 
+// Implemented in folding.c
+ExprNode *fold_expression(AstNode *node);
+int constant_truth(AstNode *node);
+int left_priority(char *op);
+int right_priority(char *op);
+char *fold_literals(char *op, char *l, const char *ltype, char *r, const char *rtype, const char **type);
+
+// Implemented in ir.c
+IrValue *new_ir_value(int kind, char *text);
+IrValue *new_ir_temp(int temp);
+IrValue *copy_ir_value(IrValue *v);
+void dealloc_ir_value(IrValue *v);
+IrBlock *new_ir_block();
+IrOp *new_ir_op(int code, char *text);
+void dealloc_ir_op(IrOp *op);
+void dealloc_ir_block(IrBlock *block);
+IrFunction *new_ir_function();
+void dealloc_ir_function(IrFunction *f);
+void count_ir_uses(IrBlock *block, int *uses, IrBlock **homes);
+void fold_ir(IrFunction *f);
+void eliminate_ir(IrFunction *f);
+
+// Implemented in lowering.c
+IrFunction *lower_function(FunctionNode *node, int flags);
+
+// Implemented in printer.c
+void print_ir(IrBlock *block, int temps, Buffer *out, int indents);
+
+// Implemented in minify.c
+int scan_lua_token(const char *code, int a, int n, int *kind);
+void init_minify();
+void reserve_name(char *name);
+void minify_buffer(Buffer *b);
+void dealloc_minify();
+
+// Implemented in bytecode.c
+int compile_bytecode(Buffer *code, const char *source, Buffer *out);
+
+// Implemented in passes.c
+void init_passes();
+void set_pass_options(int flags);
+int pass_enabled(int pass);
+int begin_pass(int pass);
+void end_pass(int outer);
+void run_passes(IrFunction *f);
+const char *get_pass_name(int pass);
+double get_pass_seconds(int pass);
+
 // Implemented in traversal.c
-void traverse(AstNode *node, int step);
+void traverse_declarations(List *ls, ChunkScan *scan);
+ChunkScan *new_chunk_scan();
+void scan_statement(ChunkScan *scan, AstNode *node);
+void dealloc_chunk_scan(ChunkScan *scan);
+void traverse_statement(AstNode *node);
+void end_traverse_stream();
+void traverse(AstNode *node);
+void discard_output();
+int get_eliminated_bytes();
+void flush_output();
+void finish_output();
 void dealloc_traverse();
 void init_traverse();
 int get_num_indents();
@@ -490,6 +767,7 @@ AstNode *any_type_const();
 AstNode *int_type_const();
 AstNode *bool_type_const();
 AstNode *float_type_const();
+void set_options(int flags);
 void set_output(FILE *output);
 void process_node_list(List *ls);
 void process_list_primitive_node(AstNode *node);
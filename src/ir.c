@@ -0,0 +1,494 @@
+#include "./moonshot.h"
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static IrFunction *function; // Function the current pass runs over
+static IrValue **known;      // Constant or other temporary each temporary is known to hold, or NULL
+
+/*
+  Instantiates a value of a VALUE_* kind with a copy of its text
+*/
+IrValue *new_ir_value(int kind, char *text)
+{
+  IrValue *v = (IrValue *)malloc(sizeof(IrValue));
+  memset(v, 0, sizeof(IrValue));
+  v->kind = kind;
+  v->text = text ? copy_string(text) : NULL;
+  v->temp = -1;
+  return v;
+}
+
+/*
+  Instantiates a value that reads a temporary
+*/
+IrValue *new_ir_temp(int temp)
+{
+  IrValue *v = new_ir_value(VALUE_TEMP, NULL);
+  v->temp = temp;
+  return v;
+}
+
+IrValue *copy_ir_value(IrValue *v)
+{
+  IrValue *copy = new_ir_value(v->kind, v->text);
+  copy->object = v->object ? copy_ir_value(v->object) : NULL;
+  copy->key = v->key ? copy_ir_value(v->key) : NULL;
+  copy->primitive = v->primitive;
+  copy->temp = v->temp;
+  return copy;
+}
+
+void dealloc_ir_value(IrValue *v)
+{
+  if (v->object)
+    dealloc_ir_value(v->object);
+  if (v->key)
+    dealloc_ir_value(v->key);
+  free(v->text);
+  free(v);
+}
+
+IrBlock *new_ir_block()
+{
+  IrBlock *block = (IrBlock *)malloc(sizeof(IrBlock));
+  block->ops = new_default_list();
+  return block;
+}
+
+/*
+  Instantiates an IR_* op with a copy of its text, which reads no values and discards its result
+*/
+IrOp *new_ir_op(int code, char *text)
+{
+  IrOp *op = (IrOp *)malloc(sizeof(IrOp));
+  memset(op, 0, sizeof(IrOp));
+  op->code = code;
+  op->text = text ? copy_string(text) : NULL;
+  op->args = new_default_list();
+  op->dest = -1;
+  return op;
+}
+
+/*
+  Deallocates a list of IrValues along with the values
+*/
+static void dealloc_ir_values(List *ls)
+{
+  for (int a = 0; a < ls->n; a++)
+    dealloc_ir_value((IrValue *)get_from_list(ls, a));
+  dealloc_list(ls);
+}
+
+void dealloc_ir_op(IrOp *op)
+{
+  if (op->body)
+    dealloc_ir_block(op->body);
+  if (op->other)
+    dealloc_ir_block(op->other);
+  if (op->targets)
+    dealloc_ir_values(op->targets);
+  if (op->keys)
+  {
+    for (int a = 0; a < op->keys->n; a++)
+      free(get_from_list(op->keys, a));
+    dealloc_list(op->keys);
+  }
+  dealloc_ir_values(op->args);
+  free(op->text);
+  free(op);
+}
+
+void dealloc_ir_block(IrBlock *block)
+{
+  for (int a = 0; a < block->ops->n; a++)
+    dealloc_ir_op((IrOp *)get_from_list(block->ops, a));
+  dealloc_list(block->ops);
+  free(block);
+}
+
+IrFunction *new_ir_function()
+{
+  IrFunction *f = (IrFunction *)malloc(sizeof(IrFunction));
+  f->body = new_ir_block();
+  f->dead = new_ir_block();
+  f->temps = 0;
+  return f;
+}
+
+void dealloc_ir_function(IrFunction *f)
+{
+  dealloc_ir_block(f->body);
+  dealloc_ir_block(f->dead);
+  free(f);
+}
+
+/*
+  Counts a read of a value, along with the values a target indexes with
+*/
+static void count_value(IrValue *v, int *uses, IrBlock **homes, IrBlock *home)
+{
+  if (v->kind == VALUE_TEMP)
+  {
+    uses[v->temp]++;
+    if (homes)
+      homes[v->temp] = home;
+  }
+  if (v->object)
+    count_value(v->object, uses, homes, home);
+  if (v->key)
+    count_value(v->key, uses, homes, home);
+}
+
+/*
+  Counts how many times each temporary is read under a block
+  homes gets the block each one is read from, or can be NULL
+  The right operand of IR_AND and IR_OR and the condition of a loop are read from the block that computes them
+*/
+void count_ir_uses(IrBlock *block, int *uses, IrBlock **homes)
+{
+  for (int a = 0; a < block->ops->n; a++)
+  {
+    IrOp *op = (IrOp *)get_from_list(block->ops, a);
+    for (int b = 0; op->targets && b < op->targets->n; b++)
+      count_value((IrValue *)get_from_list(op->targets, b), uses, homes, block);
+    for (int b = 0; b < op->args->n; b++)
+    {
+      IrBlock *home = block;
+      if ((op->code == IR_AND || op->code == IR_OR) && b == 1)
+        home = op->body;
+      else if (op->code == IR_WHILE || op->code == IR_REPEAT)
+        home = op->other;
+      count_value((IrValue *)get_from_list(op->args, b), uses, homes, home);
+    }
+    if (op->body)
+      count_ir_uses(op->body, uses, homes);
+    if (op->other)
+      count_ir_uses(op->other, uses, homes);
+  }
+}
+
+/*
+  Returns 1 if a constant is truthy
+*/
+static int is_truthy(IrValue *v)
+{
+  return strcmp(v->text, "nil") && strcmp(v->text, "false");
+}
+
+/*
+  Replaces the op at position i of a list with the ops of one of its blocks, then deallocates the op
+*/
+static void splice(List *ls, int i, IrBlock *block)
+{
+  IrOp *op = (IrOp *)remove_from_list(ls, i);
+  for (int a = 0; a < block->ops->n; a++)
+    insert_into_list(ls, i + a, get_from_list(block->ops, a));
+  block->ops->n = 0;
+  dealloc_ir_op(op);
+}
+
+/*
+  Moves the ops of a list from position i on to the unreachable ops of the function
+*/
+static void kill_from(List *ls, int i)
+{
+  while (ls->n > i)
+    add_to_list(function->dead->ops, remove_from_list(ls, i));
+}
+
+/*
+  Replaces the temporaries that hold known values in a list of values
+*/
+static void substitute(List *ls)
+{
+  for (int a = 0; ls && a < ls->n; a++)
+  {
+    IrValue *v = (IrValue *)get_from_list(ls, a);
+    if (v->object)
+    {
+      List *object = new_default_list();
+      add_to_list(object, v->object);
+      if (v->key)
+        add_to_list(object, v->key);
+      substitute(object);
+      v->object = (IrValue *)get_from_list(object, 0);
+      v->key = v->key ? (IrValue *)get_from_list(object, 1) : NULL;
+      dealloc_list(object);
+    }
+    if (v->kind == VALUE_TEMP && known[v->temp])
+    {
+      ls->items[a] = copy_ir_value(known[v->temp]);
+      dealloc_ir_value(v);
+    }
+  }
+}
+
+/*
+  Folds the ops of a block whose operands are constant
+*/
+static void fold_block(IrBlock *block)
+{
+  List *ops = block->ops;
+  for (int a = 0; a < ops->n; a++)
+  {
+    IrOp *op = (IrOp *)get_from_list(ops, a);
+    if (op->body)
+      fold_block(op->body);
+    if (op->other)
+      fold_block(op->other);
+    substitute(op->targets);
+    substitute(op->args);
+    IrValue *l = op->args->n ? (IrValue *)get_from_list(op->args, 0) : NULL;
+    IrValue *r = op->args->n > 1 ? (IrValue *)get_from_list(op->args, 1) : NULL;
+    if ((op->code == IR_BINARY && l->kind == VALUE_CONSTANT && r->kind == VALUE_CONSTANT) ||
+        (op->code == IR_UNARY && l->kind == VALUE_CONSTANT))
+    {
+      const char *type;
+      char *folded = fold_literals(op->text, l->text, l->primitive, r ? r->text : NULL, r ? r->primitive : NULL, &type);
+      if (folded)
+      {
+        known[op->dest] = new_ir_value(VALUE_CONSTANT, folded);
+        known[op->dest]->primitive = type;
+        free(folded);
+        dealloc_ir_op((IrOp *)remove_from_list(ops, a--));
+      }
+    }
+    else if ((op->code == IR_AND || op->code == IR_OR) && l->kind == VALUE_CONSTANT)
+    {
+      // A short circuit that's always taken leaves the right operand out
+      // Otherwise the right operand's ops run in its place, as long as their result can be read later
+      if (is_truthy(l) == (op->code == IR_OR))
+      {
+        known[op->dest] = copy_ir_value(l);
+        dealloc_ir_op((IrOp *)remove_from_list(ops, a--));
+      }
+      else if (r->kind == VALUE_CONSTANT || r->kind == VALUE_TEMP)
+      {
+        known[op->dest] = copy_ir_value(r);
+        int n = op->body->ops->n;
+        splice(ops, a, op->body);
+        a += n - 1;
+      }
+    }
+  }
+}
+
+/*
+  Folds operators applied to constants, and short circuits decided by a constant
+*/
+void fold_ir(IrFunction *f)
+{
+  known = (IrValue **)calloc(f->temps, sizeof(IrValue *));
+  fold_block(f->body);
+  for (int a = 0; a < f->temps; a++)
+  {
+    if (known[a])
+      dealloc_ir_value(known[a]);
+  }
+  free(known);
+  known = NULL;
+}
+
+/*
+  Returns 1 if a block declares a local outside of its nested blocks
+*/
+static int declares_locals(IrBlock *block)
+{
+  for (int a = 0; a < block->ops->n; a++)
+  {
+    if (((IrOp *)get_from_list(block->ops, a))->code == IR_LOCAL)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Leaves out the branches and loops of a block that can never run, and everything after a return or break
+*/
+static void eliminate_block(IrBlock *block)
+{
+  List *ops = block->ops;
+  for (int a = 0; a < ops->n; a++)
+  {
+    IrOp *op = (IrOp *)get_from_list(ops, a);
+    if (op->body)
+      eliminate_block(op->body);
+    if (op->other)
+      eliminate_block(op->other);
+    IrValue *condition = op->args->n ? (IrValue *)get_from_list(op->args, 0) : NULL;
+    if (op->code == IR_IF && condition->kind == VALUE_CONSTANT)
+    {
+      // The branch that's always taken runs in place of the if, keeping its own scope when it declares locals
+      IrBlock *taken = is_truthy(condition) ? op->body : op->other;
+      IrBlock *untaken = is_truthy(condition) ? op->other : op->body;
+      if (untaken)
+        kill_from(untaken->ops, 0);
+      if (taken && declares_locals(taken))
+      {
+        IrOp *scope = new_ir_op(IR_DO, NULL);
+        scope->body = taken;
+        if (taken == op->body)
+          op->body = NULL;
+        else
+          op->other = NULL;
+        dealloc_ir_op(op);
+        ops->items[a] = scope;
+      }
+      else if (taken)
+      {
+        int n = taken->ops->n;
+        splice(ops, a, taken);
+        a += n - 1;
+      }
+      else
+        dealloc_ir_op((IrOp *)remove_from_list(ops, a--));
+    }
+    else if (op->code == IR_WHILE && !op->other->ops->n && condition->kind == VALUE_CONSTANT && !is_truthy(condition))
+      add_to_list(function->dead->ops, remove_from_list(ops, a--));
+    else if (op->code == IR_RETURN || op->code == IR_BREAK)
+      kill_from(ops, a + 1);
+  }
+}
+
+/*
+  Counts a read of a variable by name, along with the variables a target indexes with
+*/
+static void count_name(IrValue *v, Map *names)
+{
+  if (v->kind == VALUE_LOCAL || v->kind == VALUE_GLOBAL)
+    put_in_map(names, v->text, (void *)((intptr_t)get_from_map(names, v->text) + 1));
+  if (v->object)
+    count_name(v->object, names);
+  if (v->key)
+    count_name(v->key, names);
+}
+
+/*
+  Counts the reads of each variable under a block by name, in a map from names to counts
+  Assigning to a variable counts too, since only locals that are never used after their declaration are left out
+*/
+static void count_names(IrBlock *block, Map *names)
+{
+  for (int a = 0; a < block->ops->n; a++)
+  {
+    IrOp *op = (IrOp *)get_from_list(block->ops, a);
+    for (int b = 0; op->code == IR_SET && b < op->targets->n; b++)
+      count_name((IrValue *)get_from_list(op->targets, b), names);
+    for (int b = 0; b < op->args->n; b++)
+      count_name((IrValue *)get_from_list(op->args, b), names);
+    if (op->body)
+      count_names(op->body, names);
+    if (op->other)
+      count_names(op->other, names);
+  }
+}
+
+/*
+  Returns 1 if an op that computes a value can be left out without changing what the function does
+  Equality only calls a metamethod when both sides are tables, so a constant or primitive operand rules it out
+*/
+static int is_pure(IrOp *op)
+{
+  switch (op->code)
+  {
+  case IR_UNARY:
+    return !strcmp(op->text, "not");
+  case IR_BINARY:
+    if (strcmp(op->text, "==") && strcmp(op->text, "~="))
+      return 0;
+    for (int a = 0; a < 2; a++)
+    {
+      IrValue *v = (IrValue *)get_from_list(op->args, a);
+      if (v->primitive)
+        return 1;
+    }
+    return 0;
+  case IR_AND:
+  case IR_OR:
+    return !op->body->ops->n;
+  case IR_TABLE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+  Leaves out the ops under a block whose results are never read and that have no effects
+  Returns 1 if any op was left out
+*/
+static int sweep_block(IrBlock *block, int *uses, IrOp **defs, Map *names)
+{
+  int swept = 0;
+  List *ops = block->ops;
+  for (int a = ops->n - 1; a >= 0; a--)
+  {
+    IrOp *op = (IrOp *)get_from_list(ops, a);
+    if (op->body)
+      swept |= sweep_block(op->body, uses, defs, names);
+    if (op->other)
+      swept |= sweep_block(op->other, uses, defs, names);
+    int unused = op->dest >= 0 && !uses[op->dest] && is_pure(op);
+    if (op->code == IR_LOCAL)
+    {
+      unused = 1;
+      for (int b = 0; b < op->targets->n; b++)
+        unused &= !get_from_map(names, ((IrValue *)get_from_list(op->targets, b))->text);
+      for (int b = 0; b < op->args->n; b++)
+      {
+        IrValue *v = (IrValue *)get_from_list(op->args, b);
+        if (v->kind == VALUE_GLOBAL || (v->kind == VALUE_TEMP && (!defs[v->temp] || !is_pure(defs[v->temp]))))
+          unused = 0;
+      }
+    }
+    if (unused)
+    {
+      dealloc_ir_op((IrOp *)remove_from_list(ops, a));
+      swept = 1;
+    }
+  }
+  return swept;
+}
+
+/*
+  Finds the op that computes each temporary under a block
+*/
+static void find_defs(IrBlock *block, IrOp **defs)
+{
+  for (int a = 0; a < block->ops->n; a++)
+  {
+    IrOp *op = (IrOp *)get_from_list(block->ops, a);
+    if (op->dest >= 0)
+      defs[op->dest] = op;
+    if (op->body)
+      find_defs(op->body, defs);
+    if (op->other)
+      find_defs(op->other, defs);
+  }
+}
+
+/*
+  Leaves out unreachable ops, then the locals and computations whose results are never read
+*/
+void eliminate_ir(IrFunction *f)
+{
+  function = f;
+  eliminate_block(f->body);
+  int swept = 1;
+  while (swept)
+  {
+    int *uses = (int *)calloc(f->temps, sizeof(int));
+    IrOp **defs = (IrOp **)calloc(f->temps, sizeof(IrOp *));
+    Map *names = new_default_map();
+    count_ir_uses(f->body, uses, NULL);
+    find_defs(f->body, defs);
+    count_names(f->body, names);
+    swept = sweep_block(f->body, uses, defs, names);
+    dealloc_map(names);
+    free(defs);
+    free(uses);
+  }
+  function = NULL;
+}
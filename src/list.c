@@ -11,6 +11,21 @@ List *new_list(int max)
   void **items = (void **)malloc(max * sizeof(void *));
   List *ls = (List *)malloc(sizeof(List));
   ls->items = items;
+  ls->scratch = 0;
+  ls->max = max;
+  ls->n = 0;
+  return ls;
+}
+
+/*
+  Instantiates a List that lives in the scratch arena
+  It goes away when the enclosing scratch mark is released, so never deallocate it
+*/
+List *new_scratch_list(int max)
+{
+  List *ls = (List *)scratch_alloc(sizeof(List));
+  ls->items = (void **)scratch_alloc(max * sizeof(void *));
+  ls->scratch = 1;
   ls->max = max;
   ls->n = 0;
   return ls;
@@ -44,6 +59,18 @@ void *remove_from_list(List *ls, int i)
   return e;
 }
 
+/*
+  Removes the first n items from a list
+  The remaining items keep their order
+*/
+void remove_head_from_list(List *ls, int n)
+{
+  assert(n <= ls->n && n >= 0); // Safety check
+  for (int a = n; a < ls->n; a++)
+    ls->items[a - n] = ls->items[a];
+  ls->n -= n;
+}
+
 /*
   Appends an item to a list
   Doubles the list's capacity if it's already full
@@ -52,15 +79,37 @@ void add_to_list(List *ls, void *e)
 {
   if (ls->n == ls->max)
   {
-    void **items = (void **)malloc(ls->max * 2 * sizeof(void *));
-    memcpy(items, ls->items, ls->max * sizeof(void *));
-    free(ls->items);
+    void **items;
+    if (ls->scratch)
+    {
+      items = (void **)scratch_alloc(ls->max * 2 * sizeof(void *));
+      memcpy(items, ls->items, ls->max * sizeof(void *));
+    }
+    else
+    {
+      items = (void **)malloc(ls->max * 2 * sizeof(void *));
+      memcpy(items, ls->items, ls->max * sizeof(void *));
+      free(ls->items);
+    }
     ls->items = items;
     ls->max *= 2;
   }
   ls->items[ls->n++] = e;
 }
 
+/*
+  Inserts an item at the i-th position of a list
+  The items from that position on move back by one
+*/
+void insert_into_list(List *ls, int i, void *e)
+{
+  assert(i <= ls->n && i >= 0); // Safety check
+  add_to_list(ls, NULL);
+  for (int a = ls->n - 1; a > i; a--)
+    ls->items[a] = ls->items[a - 1];
+  ls->items[i] = e;
+}
+
 /*
   Appends every element from ls1 to ls
 */
@@ -78,6 +127,7 @@ void append_all(List *ls, List *ls1)
 */
 void dealloc_list(List *ls)
 {
+  assert(!ls->scratch); // Scratch lists are released with the scratch arena
   free(ls->items);
   free(ls);
 }
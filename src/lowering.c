@@ -0,0 +1,555 @@
+#include "./moonshot.h"
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+static IrFunction *function; // Function being lowered
+static IrBlock *block;       // Block ops are being added to
+static List *locals;         // Names of the locals in scope, innermost last
+static int options;          // OPTION_* flags the function is written with
+static int failed;           // 1 once the function uses something the IR can't represent
+
+static IrValue *lower_expression(AstNode *node, int multi);
+static void lower_block(List *ls);
+
+/*
+  Appends a new op to the current block
+*/
+static IrOp *add_op(int code, char *text)
+{
+  IrOp *op = new_ir_op(code, text);
+  add_to_list(block->ops, op);
+  return op;
+}
+
+/*
+  Stores the result of an op in a new temporary and returns a value that reads it
+*/
+static IrValue *result_of(IrOp *op)
+{
+  op->dest = function->temps++;
+  return new_ir_temp(op->dest);
+}
+
+/*
+  Marks the function as one the IR can't represent, returning a placeholder for the value it was lowering
+*/
+static IrValue *fail()
+{
+  failed = 1;
+  return new_ir_value(VALUE_CONSTANT, "nil");
+}
+
+/*
+  Returns the PRIMITIVE_* name of a type, or NULL if it isn't a primitive one
+*/
+static const char *get_primitive(AstNode *type)
+{
+  static const char *primitives[] = {PRIMITIVE_INT, PRIMITIVE_FLOAT, PRIMITIVE_STRING, PRIMITIVE_BOOL, PRIMITIVE_NIL};
+  for (int a = 0; a < 5; a++)
+  {
+    if (is_primitive(type, primitives[a]))
+      return primitives[a];
+  }
+  return NULL;
+}
+
+/*
+  Returns a value that reads a variable, which is local if the function declares it
+*/
+static IrValue *lower_variable(AstNode *node)
+{
+  char *name = (char *)(node->data);
+  int binding = get_binding(node);
+  if (binding == BINDING_FIELD || binding == BINDING_THIS)
+    return fail();
+  int kind = VALUE_GLOBAL;
+  for (int a = locals->n - 1; a >= 0 && kind == VALUE_GLOBAL; a--)
+  {
+    if (!strcmp((char *)get_from_list(locals, a), name))
+      kind = VALUE_LOCAL;
+  }
+  IrValue *v = new_ir_value(kind, name);
+  v->primitive = get_primitive(get_type(node));
+  return v;
+}
+
+/*
+  Returns the constant key an instance's field is stored under with slots, or NULL if it's stored by name
+*/
+static IrValue *get_slot_key(AstNode *node)
+{
+  FieldNode *field = (options & OPTION_SLOTS) ? get_field_node(node) : NULL;
+  if (!field || field->slot < 0 || field->node->type != AST_DEFINE)
+    return NULL;
+  char slot[16];
+  sprintf(slot, "%i", field->slot + 1);
+  IrValue *key = new_ir_value(VALUE_CONSTANT, slot);
+  key->primitive = PRIMITIVE_INT;
+  return key;
+}
+
+/*
+  Lowers reading a field, where methods shared through metatables would have to be bound to their instance
+*/
+static IrValue *lower_field(AstNode *node)
+{
+  StringAstNode *data = (StringAstNode *)(node->data);
+  FieldNode *method = (options & OPTION_METATABLES) ? get_field_node(node) : NULL;
+  if (method && method->node->type == AST_FUNCTION)
+    return fail();
+  IrValue *object = lower_expression(data->node, 0);
+  IrValue *key = get_slot_key(node);
+  IrOp *op = add_op(key ? IR_INDEX : IR_FIELD, key ? NULL : data->text);
+  add_to_list(op->args, object);
+  if (key)
+    add_to_list(op->args, key);
+  return result_of(op);
+}
+
+/*
+  Lowers the values of a tuple into a list, where the last one keeps all of its values if multi is 1
+*/
+static void lower_tuple(AstNode *node, List *values, int multi)
+{
+  List *ls = ((AstListNode *)(node->data))->list;
+  for (int a = 0; a < ls->n; a++)
+    add_to_list(values, lower_expression((AstNode *)get_from_list(ls, a), multi && a == ls->n - 1));
+}
+
+/*
+  Lowers a call, whose result is discarded if dest is 0
+  Calls to methods that take their instance explicitly aren't represented
+*/
+static IrValue *lower_call(AstNode *node, int multi, int dest)
+{
+  AstAstNode *data = (AstAstNode *)(node->data);
+  FieldNode *field = NULL;
+  if ((options & (OPTION_METATABLES | OPTION_DEVIRTUALIZE)) && data->l->type == AST_FIELD)
+    field = get_field_node(data->l);
+  if (field && field->node->type == AST_FUNCTION)
+    return fail();
+  if ((options & OPTION_METATABLES) && data->l->type == AST_FIELD)
+  {
+    StringAstNode *ldata = (StringAstNode *)(data->l->data);
+    if (get_type(ldata->node)->type == AST_TYPE_ANY && class_method_exists(ldata->text))
+      return fail();
+  }
+  IrValue *callee = lower_expression(data->l, 0);
+  IrOp *op = new_ir_op(IR_CALL, NULL);
+  add_to_list(op->args, callee);
+  if (data->r)
+    lower_tuple(data->r, op->args, 1);
+  add_to_list(block->ops, op);
+  op->multi = multi;
+  if (!dest)
+    return NULL;
+  return result_of(op);
+}
+
+/*
+  Lowers an operator expression rebuilt with Lua's precedence
+  The right operand of a short circuit is computed in a block of its own
+*/
+static IrValue *lower_operators(ExprNode *expr)
+{
+  if (expr->atom)
+    return lower_expression(expr->atom, 0);
+  if (!expr->r)
+  {
+    IrValue *l = lower_operators(expr->l);
+    IrOp *op = add_op(IR_UNARY, expr->op);
+    add_to_list(op->args, l);
+    return result_of(op);
+  }
+  IrValue *l = lower_operators(expr->l);
+  if (!strcmp(expr->op, "and") || !strcmp(expr->op, "or"))
+  {
+    IrOp *op = new_ir_op(!strcmp(expr->op, "and") ? IR_AND : IR_OR, expr->op);
+    IrBlock *outer = block;
+    op->body = new_ir_block();
+    block = op->body;
+    IrValue *r = lower_operators(expr->r);
+    block = outer;
+    add_to_list(op->args, l);
+    add_to_list(op->args, r);
+    add_to_list(block->ops, op);
+    return result_of(op);
+  }
+  IrValue *r = lower_operators(expr->r);
+  IrOp *op = add_op(IR_BINARY, expr->op);
+  add_to_list(op->args, l);
+  add_to_list(op->args, r);
+  return result_of(op);
+}
+
+/*
+  Lowers an expression into ops on the current block and returns the value it evaluates to
+  multi is 1 if a call or ... keeps all of its values, which only the last value of a list can
+*/
+static IrValue *lower_expression(AstNode *node, int multi)
+{
+  switch (node->type)
+  {
+  case AST_PRIMITIVE:
+  {
+    StringAstNode *data = (StringAstNode *)(node->data);
+    const char *primitive = get_primitive(data->node);
+    if (!primitive)
+      return fail();
+    IrValue *v = new_ir_value(VALUE_CONSTANT, data->text);
+    v->primitive = primitive;
+    return v;
+  }
+  case AST_ID:
+    if (!strcmp((char *)(node->data), "..."))
+      return new_ir_value(VALUE_VARARG, "...");
+    return lower_variable(node);
+  case AST_PAREN:
+  {
+    // Parentheses only matter for truncating multiple values, which any use of a temporary does
+    AstNode *inner = (AstNode *)(node->data);
+    if (inner->type == AST_ID && !strcmp((char *)(inner->data), "..."))
+      return fail();
+    return lower_expression(inner, 0);
+  }
+  case AST_BINARY:
+  case AST_UNARY:
+  {
+    ScratchMark mark = scratch_mark();
+    IrValue *v = lower_operators(fold_expression(node));
+    scratch_release(mark);
+    return v;
+  }
+  case AST_CALL:
+    return lower_call(node, multi, 1);
+  case AST_FIELD:
+    return lower_field(node);
+  case AST_SUB:
+  {
+    AstAstNode *data = (AstAstNode *)(node->data);
+    IrValue *object = lower_expression(data->l, 0);
+    IrValue *key = lower_expression(data->r, 0);
+    IrOp *op = add_op(IR_INDEX, NULL);
+    add_to_list(op->args, object);
+    add_to_list(op->args, key);
+    return result_of(op);
+  }
+  case AST_TABLE:
+  {
+    TableNode *data = (TableNode *)(node->data);
+    List *values = new_default_list();
+    for (int a = 0; a < data->vals->n; a++)
+      add_to_list(values, lower_expression((AstNode *)get_from_list(data->vals, a), 0));
+    IrOp *op = add_op(IR_TABLE, NULL);
+    dealloc_list(op->args);
+    op->args = values;
+    op->keys = new_default_list();
+    for (int a = 0; a < data->keys->n; a++)
+      add_to_list(op->keys, copy_string((char *)get_from_list(data->keys, a)));
+    return result_of(op);
+  }
+  case AST_LIST:
+  {
+    List *values = new_default_list();
+    if (node->data)
+      lower_tuple((AstNode *)(node->data), values, 1);
+    IrOp *op = add_op(IR_TABLE, NULL);
+    dealloc_list(op->args);
+    op->args = values;
+    op->keys = new_default_list();
+    for (int a = 0; a < values->n; a++)
+      add_to_list(op->keys, NULL);
+    return result_of(op);
+  }
+  case AST_TUPLE:
+  {
+    List *ls = ((AstListNode *)(node->data))->list;
+    if (ls->n != 1)
+      return fail();
+    return lower_expression((AstNode *)get_from_list(ls, 0), multi);
+  }
+  default:
+    return fail();
+  }
+}
+
+/*
+  Lowers the target of an assignment, computing the tables it indexes first
+*/
+static IrValue *lower_target(AstNode *node)
+{
+  if (node->type == AST_ID)
+    return lower_variable(node);
+  if (node->type == AST_FIELD)
+  {
+    StringAstNode *data = (StringAstNode *)(node->data);
+    FieldNode *method = (options & OPTION_METATABLES) ? get_field_node(node) : NULL;
+    if (method && method->node->type == AST_FUNCTION)
+      return fail();
+    IrValue *object = lower_expression(data->node, 0);
+    IrValue *key = get_slot_key(node);
+    IrValue *v = new_ir_value(key ? VALUE_ELEMENT : VALUE_MEMBER, key ? NULL : data->text);
+    v->object = object;
+    v->key = key;
+    return v;
+  }
+  if (node->type == AST_SUB)
+  {
+    AstAstNode *data = (AstAstNode *)(node->data);
+    IrValue *v = new_ir_value(VALUE_ELEMENT, NULL);
+    v->object = lower_expression(data->l, 0);
+    v->key = lower_expression(data->r, 0);
+    return v;
+  }
+  return fail();
+}
+
+/*
+  Declares a local of the function being lowered, returning the target that assigns it
+*/
+static IrValue *declare_local(char *name)
+{
+  add_to_list(locals, name);
+  return new_ir_value(VALUE_LOCAL, name);
+}
+
+/*
+  Closes the scope of the locals declared since there were n of them
+*/
+static void close_locals(int n)
+{
+  while (locals->n > n)
+    remove_from_list(locals, locals->n - 1);
+}
+
+/*
+  Lowers a list of statements into a new block in a scope of its own
+*/
+static IrBlock *lower_scope(List *ls)
+{
+  IrBlock *outer = block;
+  int num_locals = locals->n;
+  block = new_ir_block();
+  push_scope();
+  lower_block(ls);
+  pop_scope();
+  close_locals(num_locals);
+  IrBlock *inner = block;
+  block = outer;
+  return inner;
+}
+
+/*
+  Lowers one branch of an if chain, where the condition is computed in the current block
+*/
+static void lower_branch(IfNode *data)
+{
+  IrOp *op = new_ir_op(IR_IF, NULL);
+  add_to_list(op->args, lower_expression(data->expr, 0));
+  add_to_list(block->ops, op);
+  op->body = lower_scope(data->body);
+  if (data->next && data->next->type == AST_ELSEIF)
+  {
+    IrBlock *outer = block;
+    op->other = new_ir_block();
+    block = op->other;
+    lower_branch((IfNode *)(data->next->data));
+    block = outer;
+  }
+  else if (data->next)
+    op->other = lower_scope((List *)(data->next->data));
+}
+
+/*
+  Lowers a statement into ops on the current block
+  Scopes are pushed and popped where the check step does, so types are derived the same way
+*/
+static void lower_statement(AstNode *node)
+{
+  switch (node->type)
+  {
+  case AST_DEFINE:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    IrValue *value = data->r ? lower_expression(data->r, 0) : NULL;
+    IrOp *op = add_op(IR_LOCAL, NULL);
+    if (value)
+      add_to_list(op->args, value);
+    op->targets = new_default_list();
+    add_to_list(op->targets, declare_local(data->text));
+    StringAstNode *var = new_string_ast_node(data->text, data->l);
+    if (!add_scoped_var(var))
+      free(var);
+    return;
+  }
+  case AST_LOCAL:
+  {
+    StringAstNode *data = (StringAstNode *)(node->data);
+    if (strchr(data->text, ',') || (data->node && data->node->type == AST_TUPLE))
+    {
+      failed = 1;
+      return;
+    }
+    IrValue *value = data->node ? lower_expression(data->node, 0) : NULL;
+    IrOp *op = add_op(IR_LOCAL, NULL);
+    if (value)
+      add_to_list(op->args, value);
+    op->targets = new_default_list();
+    add_to_list(op->targets, declare_local(data->text));
+    return;
+  }
+  case AST_SET:
+  {
+    AstAstNode *data = (AstAstNode *)(node->data);
+    List *targets = new_default_list();
+    if (data->l->type == AST_LTUPLE)
+    {
+      List *ls = ((AstListNode *)(data->l->data))->list;
+      for (int a = 0; a < ls->n; a++)
+        add_to_list(targets, lower_target((AstNode *)get_from_list(ls, a)));
+    }
+    else
+      add_to_list(targets, lower_target(data->l));
+    IrOp *op = new_ir_op(IR_SET, NULL);
+    op->targets = targets;
+    if (data->r->type == AST_TUPLE)
+      lower_tuple(data->r, op->args, 1);
+    else
+      add_to_list(op->args, lower_expression(data->r, 1));
+    add_to_list(block->ops, op);
+    return;
+  }
+  case AST_CALL:
+  {
+    IrValue *placeholder = lower_call(node, 0, 0);
+    if (placeholder)
+      dealloc_ir_value(placeholder);
+    return;
+  }
+  case AST_RETURN:
+  {
+    IrOp *op = new_ir_op(IR_RETURN, NULL);
+    if (node->data)
+      lower_tuple((AstNode *)(node->data), op->args, 1);
+    add_to_list(block->ops, op);
+    return;
+  }
+  case AST_BREAK:
+    add_op(IR_BREAK, NULL);
+    return;
+  case AST_IF:
+    lower_branch((IfNode *)(node->data));
+    return;
+  case AST_DO:
+  {
+    IrOp *op = add_op(IR_DO, NULL);
+    op->body = lower_scope((List *)(node->data));
+    return;
+  }
+  case AST_WHILE:
+  {
+    AstListNode *data = (AstListNode *)(node->data);
+    IrOp *op = add_op(IR_WHILE, NULL);
+    IrBlock *outer = block;
+    op->other = new_ir_block();
+    block = op->other;
+    add_to_list(op->args, lower_expression(data->node, 0));
+    block = outer;
+    op->body = lower_scope(data->list);
+    return;
+  }
+  case AST_REPEAT:
+  {
+    // The condition can see the body's locals, but the check step derives its type outside of the body's scope
+    AstListNode *data = (AstListNode *)(node->data);
+    IrOp *op = add_op(IR_REPEAT, NULL);
+    IrBlock *outer = block;
+    int num_locals = locals->n;
+    op->body = new_ir_block();
+    block = op->body;
+    push_scope();
+    lower_block(data->list);
+    pop_scope();
+    op->other = new_ir_block();
+    block = op->other;
+    add_to_list(op->args, lower_expression(data->node, 0));
+    close_locals(num_locals);
+    block = outer;
+    IrOp *last = op->body->ops->n ? (IrOp *)get_from_list(op->body->ops, op->body->ops->n - 1) : NULL;
+    if (last && last->code == IR_RETURN)
+      failed = 1;
+    return;
+  }
+  case AST_FORNUM:
+  {
+    FornumNode *data = (FornumNode *)(node->data);
+    IrOp *op = new_ir_op(IR_FORNUM, NULL);
+    add_to_list(op->args, lower_expression(data->num1, 0));
+    add_to_list(op->args, lower_expression(data->num2, 0));
+    if (data->num3)
+      add_to_list(op->args, lower_expression(data->num3, 0));
+    add_to_list(block->ops, op);
+    int num_locals = locals->n;
+    op->targets = new_default_list();
+    add_to_list(op->targets, declare_local(data->name));
+    op->body = lower_scope(data->body);
+    close_locals(num_locals);
+    return;
+  }
+  case AST_FORIN:
+  {
+    ForinNode *data = (ForinNode *)(node->data);
+    IrOp *op = new_ir_op(IR_FORIN, NULL);
+    lower_tuple(data->tuple, op->args, 1);
+    add_to_list(block->ops, op);
+    int num_locals = locals->n;
+    List *ls = ((AstListNode *)(data->lhs->data))->list;
+    op->targets = new_default_list();
+    for (int a = 0; a < ls->n; a++)
+      add_to_list(op->targets, declare_local((char *)(((AstNode *)get_from_list(ls, a))->data)));
+    op->body = lower_scope(data->body);
+    close_locals(num_locals);
+    return;
+  }
+  default:
+    failed = 1;
+  }
+}
+
+/*
+  Lowers the statements of a block, leaving out the ones after a return since Lua won't compile them
+*/
+static void lower_block(List *ls)
+{
+  for (int a = 0; a < ls->n && !failed; a++)
+  {
+    AstNode *e = (AstNode *)get_from_list(ls, a);
+    lower_statement(e);
+    if (e->type == AST_RETURN)
+      break;
+  }
+}
+
+/*
+  Lowers the body of a checked function to the optimization IR, within the function's scope
+  Returns NULL if the body uses something the IR can't represent, like nested functions or methods shared through metatables
+*/
+IrFunction *lower_function(FunctionNode *node, int flags)
+{
+  function = new_ir_function();
+  block = function->body;
+  locals = new_default_list();
+  options = flags;
+  failed = 0;
+  for (int a = 0; a < node->args->n; a++)
+    add_to_list(locals, ((StringAstNode *)get_from_list(node->args, a))->text);
+  lower_block(node->body);
+  dealloc_list(locals);
+  if (failed)
+  {
+    dealloc_ir_function(function);
+    return NULL;
+  }
+  return function;
+}
@@ -3,6 +3,46 @@
 #include <string.h>
 #include <assert.h>
 
+/*
+  Hashes a key string for the Map's index table
+*/
+static unsigned int hash_key(char *k)
+{
+  unsigned int h = 5381;
+  while (*k)
+    h = (h * 33) ^ (unsigned char)(*k++);
+  return h;
+}
+
+/*
+  Returns the index table slot that holds key k
+  Returns the empty slot where k would go if k is not in the map
+*/
+static int find_slot(Map *m, char *k)
+{
+  int mask = m->cap - 1;
+  int slot = hash_key(k) & mask;
+  while (m->index[slot] && strcmp(m->data[m->index[slot] - 1].k, k))
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+/*
+  Rebuilds the index table so that it has room for max entries
+  The table is kept at twice the entry capacity to keep probe sequences short
+*/
+static void rebuild_index(Map *m)
+{
+  int cap = 1;
+  while (cap < m->max * 2)
+    cap *= 2;
+  free(m->index);
+  m->index = (int *)calloc(cap, sizeof(int));
+  m->cap = cap;
+  for (int a = 0; a < m->n; a++)
+    m->index[find_slot(m, m->data[a].k)] = a + 1;
+}
+
 /*
   Instantiates a new Map object with some initial max capacity
 */
@@ -10,9 +50,11 @@ Map *new_map(int max)
 {
   Pair *items = (Pair *)malloc(max * sizeof(Pair));
   Map *m = (Map *)malloc(sizeof(Map));
+  m->index = NULL;
   m->data = items;
   m->max = max;
   m->n = 0;
+  rebuild_index(m);
   return m;
 }
 
@@ -29,17 +71,13 @@ Map *new_default_map()
 */
 void *get_from_map(Map *m, char *k)
 {
-  for (int a = 0; a < m->n; a++)
-  {
-    Pair p = m->data[a];
-    if (!strcmp(p.k, k))
-      return p.v;
-  }
-  return NULL;
+  int i = m->index[find_slot(m, k)];
+  return i ? m->data[i - 1].v : NULL;
 }
 
 /*
   Returns a value at arbitrary position i within a map
+  Entries keep their insertion order
   Used in traversal algorithms
 */
 void *iterate_from_map(Map *m, int i)
@@ -55,14 +93,11 @@ void *iterate_from_map(Map *m, int i)
 */
 void put_in_map(Map *m, char *k, void *v)
 {
-  for (int a = 0; a < m->n; a++)
+  int slot = find_slot(m, k);
+  if (m->index[slot])
   {
-    Pair p = m->data[a];
-    if (!strcmp(p.k, k))
-    {
-      (m->data[a]).v = v;
-      return;
-    }
+    (m->data[m->index[slot] - 1]).v = v;
+    return;
   }
   if (m->n == m->max)
   {
@@ -72,10 +107,37 @@ void put_in_map(Map *m, char *k, void *v)
       tmp[a] = m->data[a];
     free(m->data);
     m->data = tmp;
+    rebuild_index(m);
+    slot = find_slot(m, k);
   }
   m->data[m->n].k = k;
   m->data[m->n].v = v;
-  m->n++;
+  m->index[slot] = ++(m->n);
+}
+
+/*
+  Removes the most recently inserted entries until only n remain
+  Lets a map be used as a stack of scoped definitions
+*/
+void truncate_map(Map *m, int n)
+{
+  assert(n <= m->n && n >= 0); // Safety check
+  while (m->n > n)
+  {
+    int mask = m->cap - 1;
+    int slot = find_slot(m, m->data[--(m->n)].k);
+    m->index[slot] = 0;
+
+    // Shift back any entries that probed past the freed slot
+    int next = (slot + 1) & mask;
+    while (m->index[next])
+    {
+      int i = m->index[next];
+      m->index[next] = 0;
+      m->index[find_slot(m, m->data[i - 1].k)] = i;
+      next = (next + 1) & mask;
+    }
+  }
 }
 
 /*
@@ -84,6 +146,7 @@ void put_in_map(Map *m, char *k, void *v)
 */
 void dealloc_map(Map *m)
 {
+  free(m->index);
   free(m->data);
   free(m);
 }
@@ -0,0 +1,596 @@
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Kinds of nesting the minifier tracks in written Lua code
+enum LUA_CONTEXTS
+{
+  CONTEXT_BLOCK,  // Block or function body, which holds statements and locals
+  CONTEXT_FOR,    // Header of a for loop, whose variables are only visible once its body starts
+  CONTEXT_PAREN,  // Parentheses
+  CONTEXT_SQUARE, // Square brackets
+  CONTEXT_CURLY   // Table constructor
+};
+
+// Kinds of names that come next in a declaration
+enum LUA_DECLARATIONS
+{
+  DECLARE_NONE,   // The next name isn't being declared
+  DECLARE_HIDDEN, // Locals of a local statement or for loop, visible once it ends
+  DECLARE_VISIBLE // Parameters or the name of a local function, visible right away
+};
+
+/*
+  LuaToken: a token of written Lua code
+*/
+typedef struct
+{
+  int start; // Index of the token in the code
+  int n;     // Length of the token
+  int kind;  // LUA_* kind of the token
+} LuaToken;
+
+/*
+  Context: a nesting level of written Lua code
+*/
+typedef struct
+{
+  int type;  // CONTEXT_* type of the nesting
+  int base;  // Number of locals declared outside of it
+  int until; // 1 once the condition of a repeat loop has started, which ends the block
+} Context;
+
+/*
+  MinifiedLocal: a local declared in written Lua code
+*/
+typedef struct
+{
+  char *name; // Name the local was written with
+  int hidden; // 1 until the statement that declares it ends
+} MinifiedLocal;
+
+static const char *keywords[] = {
+    "and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if", "in",
+    "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while"};
+#define NUM_KEYWORDS (int)(sizeof(keywords) / sizeof(char *))
+
+// Globals the written code can read without them appearing in the source
+static const char *builtins[] = {
+    "_G", "_ENV", "_VERSION", "arg", "assert", "bit", "bit32", "collectgarbage", "coroutine", "debug",
+    "dofile", "error", "getfenv", "getmetatable", "io", "ipairs", "jit", "load", "loadfile", "loadstring",
+    "math", "module", "next", "os", "package", "pairs", "pcall", "print", "rawequal", "rawget", "rawlen",
+    "rawset", "require", "select", "self", "setfenv", "setmetatable", "string", "table", "tonumber",
+    "tostring", "type", "unpack", "utf8", "xpcall"};
+#define NUM_BUILTINS (int)(sizeof(builtins) / sizeof(char *))
+
+static Map *reserved;      // Names that locals can't be renamed to, since the code might read them as globals
+static List *short_names;  // Name given to the local in each slot of the stack of visible locals
+static int candidate;      // Index of the next name to consider for short_names
+static List *locals;       // Stack of MinifiedLocals declared in the enclosing contexts
+static List *contexts;     // Stack of Contexts around the code being minified
+static int ended;          // 1 if the last token can end an expression
+static char last;          // Last character written, or 0 if nothing has been written
+static int last_number;    // 1 if the last token written is a number
+
+/*
+  Set up resources used by the minifier
+*/
+void init_minify()
+{
+  reserved = new_default_map();
+  short_names = new_default_list();
+  locals = new_default_list();
+  contexts = new_default_list();
+  candidate = 0;
+  ended = 0;
+  last = 0;
+  last_number = 0;
+  for (int a = 0; a < NUM_KEYWORDS; a++)
+    reserve_name((char *)keywords[a]);
+  for (int a = 0; a < NUM_BUILTINS; a++)
+    reserve_name((char *)builtins[a]);
+  Context *root = (Context *)malloc(sizeof(Context));
+  root->type = CONTEXT_BLOCK;
+  root->base = 0;
+  root->until = 0;
+  add_to_list(contexts, root);
+}
+
+/*
+  Keeps locals from being renamed to a name that the written code might read as a global
+*/
+void reserve_name(char *name)
+{
+  if (!get_from_map(reserved, name))
+  {
+    char *copy = copy_string(name);
+    put_in_map(reserved, copy, copy);
+  }
+}
+
+/*
+  Returns the a-th shortest name, starting with a letter and followed by letters or digits
+*/
+static char *generate_name(int a)
+{
+  static const char *chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  int n = 1;
+  int count = 52;
+  while (a >= count)
+  {
+    a -= count;
+    count *= 62;
+    n++;
+  }
+  char *name = (char *)malloc(sizeof(char) * (n + 1));
+  name[n] = 0;
+  for (int b = n - 1; b > 0; b--)
+  {
+    name[b] = chars[a % 62];
+    a /= 62;
+  }
+  name[0] = chars[a];
+  return name;
+}
+
+/*
+  Returns the name of a local in some slot of the stack of visible locals
+  Locals that are visible at the same time are in different slots, so they can't shadow each other
+*/
+static char *get_short_name(int slot)
+{
+  while (short_names->n <= slot)
+  {
+    char *name = generate_name(candidate++);
+    if (get_from_map(reserved, name))
+      free(name);
+    else
+      add_to_list(short_names, name);
+  }
+  return (char *)get_from_list(short_names, slot);
+}
+
+/*
+  Returns the innermost Context
+*/
+static Context *get_context()
+{
+  return (Context *)get_from_list(contexts, contexts->n - 1);
+}
+
+/*
+  Opens a nesting level in the written code
+*/
+static void push_context(int type)
+{
+  Context *context = (Context *)malloc(sizeof(Context));
+  context->type = type;
+  context->base = locals->n;
+  context->until = 0;
+  add_to_list(contexts, context);
+}
+
+/*
+  Closes the innermost nesting level, along with the locals declared within it
+  The outermost level is never closed
+*/
+static void pop_context()
+{
+  if (contexts->n == 1)
+    return;
+  Context *context = (Context *)remove_from_list(contexts, contexts->n - 1);
+  while (locals->n > context->base)
+  {
+    MinifiedLocal *local = (MinifiedLocal *)remove_from_list(locals, locals->n - 1);
+    free(local->name);
+    free(local);
+  }
+  free(context);
+}
+
+/*
+  Makes the locals of the statement that just ended visible
+  Also closes a repeat loop once its condition has ended
+*/
+static void end_statement()
+{
+  Context *context = get_context();
+  for (int a = context->base; a < locals->n; a++)
+    ((MinifiedLocal *)get_from_list(locals, a))->hidden = 0;
+  if (context->until)
+    pop_context();
+}
+
+/*
+  Declares a local and returns the name it's written with
+*/
+static char *declare_local(char *name, int hidden)
+{
+  MinifiedLocal *local = (MinifiedLocal *)malloc(sizeof(MinifiedLocal));
+  local->name = copy_string(name);
+  local->hidden = hidden;
+  add_to_list(locals, local);
+  return get_short_name(locals->n - 1);
+}
+
+/*
+  Returns the name a visible local is written with, or NULL if the name isn't a visible local
+*/
+static char *resolve_local(char *name)
+{
+  for (int a = locals->n - 1; a >= 0; a--)
+  {
+    MinifiedLocal *local = (MinifiedLocal *)get_from_list(locals, a);
+    if (!local->hidden && !strcmp(local->name, name))
+      return get_short_name(a);
+  }
+  return NULL;
+}
+
+/*
+  Returns 1 if a character can be part of a name
+*/
+static int is_name_char(char c)
+{
+  return c == '_' || ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9');
+}
+
+/*
+  Returns the length of the long bracket that opens at code, or 0 if there isn't one
+*/
+static int get_long_bracket(const char *code)
+{
+  if (code[0] != '[')
+    return 0;
+  int n = 1;
+  while (code[n] == '=')
+    n++;
+  return code[n] == '[' ? n + 1 : 0;
+}
+
+/*
+  Returns the index after the long bracket string that opens at a in code
+*/
+static int skip_long_bracket(const char *code, int a, int n, int open)
+{
+  int level = open - 2;
+  for (a += open; a < n; a++)
+  {
+    if (code[a] != ']')
+      continue;
+    int b = 1;
+    while (b <= level && a + b < n && code[a + b] == '=')
+      b++;
+    if (b == level + 1 && a + b < n && code[a + b] == ']')
+      return a + b + 1;
+  }
+  return n;
+}
+
+/*
+  Returns the length of the Lua token at index a in code, and sets its LUA_* kind
+  Whitespace has a length of 0, and comments have a kind of -1
+*/
+int scan_lua_token(const char *code, int a, int n, int *kind)
+{
+  char c = code[a];
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    return 0;
+  if (c == '-' && a + 1 < n && code[a + 1] == '-')
+  {
+    *kind = -1;
+    int open = get_long_bracket(code + a + 2);
+    if (open)
+      return skip_long_bracket(code, a + 2, n, open) - a;
+    int b = a;
+    while (b < n && code[b] != '\n')
+      b++;
+    return b - a;
+  }
+  if (('0' <= c && c <= '9') || (c == '.' && a + 1 < n && '0' <= code[a + 1] && code[a + 1] <= '9'))
+  {
+    // Matches how Lua reads numerals, including the sign of an exponent
+    *kind = LUA_NUMBER;
+    int hex = c == '0' && a + 1 < n && (code[a + 1] == 'x' || code[a + 1] == 'X');
+    int b = a + 1;
+    while (b < n)
+    {
+      char d = code[b];
+      char prev = code[b - 1];
+      if ((d == '+' || d == '-') && (hex ? (prev == 'p' || prev == 'P') : (prev == 'e' || prev == 'E')))
+        b++;
+      else if (is_name_char(d) || d == '.')
+        b++;
+      else
+        break;
+    }
+    return b - a;
+  }
+  if (is_name_char(c))
+  {
+    int b = a;
+    while (b < n && is_name_char(code[b]))
+      b++;
+    *kind = LUA_NAME;
+    for (int k = 0; k < NUM_KEYWORDS; k++)
+    {
+      if ((int)strlen(keywords[k]) == b - a && !strncmp(code + a, keywords[k], b - a))
+        *kind = LUA_KEYWORD;
+    }
+    return b - a;
+  }
+  if (c == '"' || c == '\'')
+  {
+    *kind = LUA_STRING;
+    int b = a + 1;
+    while (b < n && code[b] != c)
+      b += (code[b] == '\\') ? 2 : 1;
+    return (b < n ? b + 1 : n) - a;
+  }
+  int open = get_long_bracket(code + a);
+  if (open)
+  {
+    *kind = LUA_STRING;
+    return skip_long_bracket(code, a, n, open) - a;
+  }
+  *kind = LUA_SYMBOL;
+  static const char *symbols[] = {"...", "..", "==", "~=", "<=", ">=", "//", "::", "<<", ">>"};
+  for (int s = 0; s < (int)(sizeof(symbols) / sizeof(char *)); s++)
+  {
+    int l = strlen(symbols[s]);
+    if (a + l <= n && !strncmp(code + a, symbols[s], l))
+      return l;
+  }
+  return 1;
+}
+
+/*
+  Splits written Lua code into tokens, leaving out whitespace and comments
+  Returns the number of tokens put in the allocated array at tokens
+*/
+static int scan_tokens(const char *code, int n, LuaToken **tokens)
+{
+  int max = 256;
+  int count = 0;
+  *tokens = (LuaToken *)malloc(sizeof(LuaToken) * max);
+  int a = 0;
+  while (a < n)
+  {
+    int kind = -1;
+    int l = scan_lua_token(code, a, n, &kind);
+    if (kind >= 0)
+    {
+      if (count == max)
+      {
+        max *= 2;
+        *tokens = (LuaToken *)realloc(*tokens, sizeof(LuaToken) * max);
+      }
+      (*tokens)[count].start = a;
+      (*tokens)[count].n = l;
+      (*tokens)[count].kind = kind;
+      count++;
+    }
+    a += l ? l : 1;
+  }
+  return count;
+}
+
+/*
+  Returns 1 if a token is the given keyword or symbol
+*/
+static int is_token(const char *code, LuaToken *tk, const char *text)
+{
+  return tk && tk->kind != LUA_NAME && tk->kind != LUA_STRING && (int)strlen(text) == tk->n &&
+         !strncmp(code + tk->start, text, tk->n);
+}
+
+/*
+  Returns 1 if a token can end an expression
+*/
+static int ends_expression(const char *code, LuaToken *tk)
+{
+  if (tk->kind == LUA_NAME || tk->kind == LUA_NUMBER || tk->kind == LUA_STRING)
+    return 1;
+  return is_token(code, tk, ")") || is_token(code, tk, "]") || is_token(code, tk, "}") || is_token(code, tk, "...") ||
+         is_token(code, tk, "nil") || is_token(code, tk, "true") || is_token(code, tk, "false") ||
+         is_token(code, tk, "end");
+}
+
+/*
+  Returns 1 if a token following the end of an expression has to start a new statement
+*/
+static int starts_statement(const char *code, LuaToken *tk)
+{
+  static const char *starts[] = {"local", "function", "for", "while", "do", "if", "repeat", "return", "break",
+                                 "goto", "end", "else", "elseif", "until", "::", ";"};
+  if (tk->kind == LUA_NAME)
+    return 1;
+  for (int a = 0; a < (int)(sizeof(starts) / sizeof(char *)); a++)
+  {
+    if (is_token(code, tk, starts[a]))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if writing a token starting with c right after the last one would change how they're read
+*/
+static int needs_space(char c)
+{
+  static const char *pairs[] = {"==", "~=", "<=", ">=", "//", "::", "<<", ">>", "..", "--", "[[", "[="};
+  if (!last)
+    return 0;
+  if (is_name_char(last) && is_name_char(c))
+    return 1;
+  if ((last_number || last == '.') && (c == '.' || ('0' <= c && c <= '9')))
+    return 1;
+  for (int a = 0; a < (int)(sizeof(pairs) / sizeof(char *)); a++)
+  {
+    if (pairs[a][0] == last && pairs[a][1] == c)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Appends a token to the minified code, with a space before it if it's needed
+*/
+static void write_token(Buffer *b, const char *text, int n, int number)
+{
+  if (needs_space(text[0]))
+    append_to_buffer(b, " ", 1);
+  append_to_buffer(b, text, n);
+  last = text[n - 1];
+  last_number = number;
+}
+
+/*
+  Rewrites the Lua code in a buffer without indentation or line breaks, and with shorter local names
+  Globals, fields, table keys and labels keep their names
+  Locals declared in earlier calls are still in scope, so code can be minified one top-level statement at a time
+*/
+void minify_buffer(Buffer *b)
+{
+  LuaToken *tokens;
+  char *code = b->data;
+  int count = scan_tokens(code, b->n, &tokens);
+  Buffer *out = new_buffer(b->n + 1);
+  int declaring = DECLARE_NONE; // DECLARE_* kind of the names that come next
+  int params = 0;               // 1 while writing the parameters of a function
+  int header = 0;               // 1 between a function keyword and its parameters
+  int local_function = 0;       // 1 if that function is declared as a local
+  for (int a = 0; a < count; a++)
+  {
+    LuaToken *tk = tokens + a;
+    LuaToken *prev = a ? tk - 1 : NULL;
+    LuaToken *next = a + 1 < count ? tk + 1 : NULL;
+    Context *context = get_context();
+    if (context->type == CONTEXT_BLOCK || context->type == CONTEXT_FOR)
+    {
+      if (is_token(code, tk, ";") || (ended && starts_statement(code, tk)))
+        end_statement();
+    }
+    context = get_context();
+    ended = ends_expression(code, tk);
+    if (tk->kind == LUA_NAME)
+    {
+      char *name = (char *)malloc(sizeof(char) * (tk->n + 1));
+      memcpy(name, code + tk->start, tk->n);
+      name[tk->n] = 0;
+      char *written = NULL;
+      int field = is_token(code, prev, ".") || is_token(code, prev, ":");
+      int label = is_token(code, prev, "goto") || is_token(code, prev, "::");
+      int key = context->type == CONTEXT_CURLY && is_token(code, next, "=") &&
+                (is_token(code, prev, "{") || is_token(code, prev, ",") || is_token(code, prev, ";"));
+      if (field || label || key)
+        written = NULL;
+      else if (header && local_function)
+      {
+        written = declare_local(name, 0);
+        local_function = 0;
+      }
+      else if (declaring != DECLARE_NONE)
+      {
+        written = declare_local(name, declaring == DECLARE_HIDDEN);
+        if (!is_token(code, next, ","))
+          declaring = DECLARE_NONE;
+      }
+      else
+        written = resolve_local(name);
+      write_token(out, written ? written : name, written ? (int)strlen(written) : tk->n, 0);
+      free(name);
+      continue;
+    }
+    write_token(out, code + tk->start, tk->n, tk->kind == LUA_NUMBER);
+    if (!is_token(code, tk, ","))
+      declaring = DECLARE_NONE;
+    if (tk->kind != LUA_KEYWORD && tk->kind != LUA_SYMBOL)
+      continue;
+    if (is_token(code, tk, "local"))
+    {
+      if (is_token(code, next, "function"))
+        local_function = 1;
+      else
+        declaring = DECLARE_HIDDEN;
+    }
+    else if (is_token(code, tk, "function"))
+      header = 1;
+    else if (is_token(code, tk, "for"))
+    {
+      push_context(CONTEXT_FOR);
+      declaring = DECLARE_HIDDEN;
+    }
+    else if (is_token(code, tk, "do"))
+    {
+      if (context->type == CONTEXT_FOR)
+        context->type = CONTEXT_BLOCK;
+      else
+        push_context(CONTEXT_BLOCK);
+    }
+    else if (is_token(code, tk, "then") || is_token(code, tk, "repeat"))
+      push_context(CONTEXT_BLOCK);
+    else if (is_token(code, tk, "else"))
+    {
+      pop_context();
+      push_context(CONTEXT_BLOCK);
+    }
+    else if (is_token(code, tk, "elseif") || is_token(code, tk, "end"))
+      pop_context();
+    else if (is_token(code, tk, "until"))
+      context->until = 1;
+    else if (is_token(code, tk, "("))
+    {
+      if (header)
+      {
+        push_context(CONTEXT_BLOCK);
+        header = 0;
+        params = 1;
+        declaring = DECLARE_VISIBLE;
+      }
+      else
+        push_context(CONTEXT_PAREN);
+    }
+    else if (is_token(code, tk, ")"))
+    {
+      if (params)
+        params = 0;
+      else
+        pop_context();
+    }
+    else if (is_token(code, tk, "["))
+      push_context(CONTEXT_SQUARE);
+    else if (is_token(code, tk, "{"))
+      push_context(CONTEXT_CURLY);
+    else if (is_token(code, tk, "]") || is_token(code, tk, "}"))
+      pop_context();
+  }
+  free(tokens);
+  b->n = 0;
+  append_to_buffer(b, out->data, out->n);
+  dealloc_buffer(out);
+}
+
+/*
+  Deallocate resources used by the minifier
+*/
+void dealloc_minify()
+{
+  while (contexts->n > 1)
+    pop_context();
+  free(remove_from_list(contexts, 0));
+  for (int a = 0; a < locals->n; a++)
+  {
+    MinifiedLocal *local = (MinifiedLocal *)get_from_list(locals, a);
+    free(local->name);
+    free(local);
+  }
+  for (int a = 0; a < reserved->n; a++)
+    free(iterate_from_map(reserved, a));
+  for (int a = 0; a < short_names->n; a++)
+    free(get_from_list(short_names, a));
+  dealloc_map(reserved);
+  dealloc_list(short_names);
+  dealloc_list(locals);
+  dealloc_list(contexts);
+}
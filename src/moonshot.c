@@ -12,6 +12,7 @@ static List *requires;          // List of required files
 static List *errors;            // List of error strings
 static int error_i;             // Index of currently consumed error
 static FILE *_input;            // Input for source code
+static FILE *_output;           // Output for Lua code, or NULL if nothing is written
 
 /*
   Return the number of compilation errors
@@ -21,6 +22,30 @@ int moonshot_num_errors()
   return errors->n;
 }
 
+/*
+  Returns the number of bytes of unreachable Lua code left out of the last compilation
+*/
+int moonshot_eliminated_bytes()
+{
+  return get_eliminated_bytes();
+}
+
+/*
+  Returns the name of a PASS_* optimization pass
+*/
+const char *moonshot_pass_name(int pass)
+{
+  return get_pass_name(pass);
+}
+
+/*
+  Returns the seconds the last compilation spent in a PASS_* optimization pass
+*/
+double moonshot_pass_seconds(int pass)
+{
+  return get_pass_seconds(pass);
+}
+
 /*
   Returns the next error message from compilation
   Returns NULL if there's no more errors
@@ -33,14 +58,14 @@ char *moonshot_next_error()
 }
 
 /*
-  Custom string format function
+  Custom string format function that appends to a buffer
+  Supports %s (string), %i (int) and %t (AST_TYPE_* AstNode)
+  Prefixes each new line with the current indentation if indent is set
 */
-char *format_string(int indent, const char *msg, va_list args)
+void format_to_buffer(Buffer *b, int indent, const char *msg, va_list args)
 {
-  List *ls = new_default_list();
-  char symbol[2] = {0, 0};
-  int n = strlen(msg);
-  for (int a = 0; a < n; a++)
+  int start = 0;
+  for (int a = 0; msg[a]; a++)
   {
     if (indent)
     {
@@ -50,48 +75,50 @@ char *format_string(int indent, const char *msg, va_list args)
       }
       else if (!line_written)
       {
+        append_to_buffer(b, msg + start, a - start);
+        start = a;
         line_written = 1;
-        for (int a = 0; a < get_num_indents(); a++)
-        {
-          char *tab = (char *)malloc(sizeof(char) * 3);
-          sprintf(tab, "\t");
-          add_to_list(ls, tab);
-        }
+        for (int i = get_num_indents(); i > 0; i--)
+          append_to_buffer(b, "\t", 1);
       }
     }
-    if (a < n - 1 && msg[a] == '%')
+    if (msg[a] == '%' && msg[a + 1])
     {
-      if (msg[a + 1] == 's')
-      {
-        char *str = va_arg(args, char *);
-        add_to_list(ls, copy_string(str));
-        a++;
+      char c = msg[a + 1];
+      if (c != 's' && c != 't' && c != 'i')
         continue;
+      append_to_buffer(b, msg + start, a - start);
+      if (c == 's')
+      {
+        append_string_to_buffer(b, va_arg(args, char *));
       }
-      if (msg[a + 1] == 't')
+      else if (c == 't')
       {
-        AstNode *type = (AstNode *)va_arg(args, AstNode *);
-        char *str = stringify_type(type);
-        add_to_list(ls, str);
-        a++;
-        continue;
+        char *str = stringify_type((AstNode *)va_arg(args, AstNode *));
+        append_string_to_buffer(b, str);
+        free(str);
       }
-      if (msg[a + 1] == 'i')
+      else
       {
-        int v = va_arg(args, int);
-        char *str = string_from_int(v);
-        add_to_list(ls, str);
-        a++;
-        continue;
+        char str[16];
+        append_to_buffer(b, str, sprintf(str, "%i", va_arg(args, int)));
       }
+      start = a + 2;
+      a++;
     }
-    symbol[0] = msg[a];
-    add_to_list(ls, copy_string(symbol));
   }
-  char *str = collapse_string_list(ls);
-  for (int a = 0; a < ls->n; a++)
-    free(get_from_list(ls, a));
-  free(ls);
+  append_string_to_buffer(b, msg + start);
+}
+
+/*
+  Custom string format function
+*/
+char *format_string(int indent, const char *msg, va_list args)
+{
+  Buffer *b = new_default_buffer();
+  format_to_buffer(b, indent, msg, args);
+  char *str = copy_buffer(b);
+  dealloc_buffer(b);
   return str;
 }
 
@@ -124,11 +151,12 @@ void add_error_internal(int line, const char *msg, va_list args)
     char *suffix = (char *)malloc(sizeof(char) * (strlen(str) + 9));
     sprintf(suffix, " (line %i)", line);
     add_to_list(ls, suffix);
+    free(str);
   }
   char *err = collapse_string_list(ls);
   for (int a = 0; a < ls->n; a++)
     free(get_from_list(ls, a));
-  free(ls);
+  dealloc_list(ls);
   add_to_list(errors, err);
 }
 
@@ -162,9 +190,15 @@ char *collapse_string_list(List *ls)
   for (int a = 0; a < ls->n; a++)
     l += strlen((char *)get_from_list(ls, a));
   char *copy = (char *)malloc(sizeof(char) * (l + 1));
-  copy[0] = 0;
+  char *end = copy;
   for (int a = 0; a < ls->n; a++)
-    strcat(copy, (char *)get_from_list(ls, a));
+  {
+    char *str = (char *)get_from_list(ls, a);
+    int n = strlen(str);
+    memcpy(end, str, n);
+    end += n;
+  }
+  *end = 0;
   return copy;
 }
 
@@ -204,6 +238,20 @@ char *string_from_int(int a)
   return msg;
 }
 
+/*
+  Keeps the minifier from renaming locals to the names of the first n Tokens
+  The written code could read any of them as a global
+*/
+static void reserve_token_names(List *tokens, int n)
+{
+  for (int a = 0; a < n; a++)
+  {
+    Token *tk = (Token *)get_from_list(tokens, a);
+    if (tk->type == TK_NAME)
+      reserve_name(tk->text);
+  }
+}
+
 /*
   Initializes this module
 */
@@ -245,7 +293,7 @@ void dummy_required_file(char *filename)
     remove_from_list(srcs, srcs->n - 1);
   }
   Require *r = (Require *)malloc(sizeof(Require));
-  r->completed = STEP_OUTPUT;
+  r->completed = STEP_CHECK;
   r->filename = copy;
   r->tokens = NULL;
   r->tree = NULL;
@@ -253,6 +301,23 @@ void dummy_required_file(char *filename)
   add_to_list(srcs, copy);
 }
 
+/*
+  Returns the chunk name Lua reports runtime errors under, the way lua.c and luac name their chunks
+  Returns NULL if the input isn't stdin and no file name was given with dummy_required_file
+*/
+char *get_chunk_name()
+{
+  if (_input == stdin)
+    return copy_string("=stdin");
+  if (!srcs || !srcs->n)
+    return NULL;
+  char *filename = (char *)get_from_list(srcs, 0);
+  char *name = (char *)malloc(strlen(filename) + 2);
+  name[0] = '@';
+  strcpy(name + 1, filename);
+  return name;
+}
+
 /*
   Tokenizes, parses and traverses another file to import external Moon types
   Will only bother if the filename ends in .moon (is Moonshot source code)
@@ -275,8 +340,7 @@ int require_file(char *filename, int step)
     {
       if (r->completed < step)
       {
-        if (step < STEP_OUTPUT)
-          r->completed = step;
+        r->completed = step;
       }
       else
       {
@@ -305,6 +369,7 @@ int require_file(char *filename, int step)
       free(copy);
       return 1;
     }
+    reserve_token_names(ls, ls->n);
     AstNode *root = parse(ls);
     if (!root)
     {
@@ -323,10 +388,8 @@ int require_file(char *filename, int step)
   for (int a = 0; a < requires->n; a++)
   {
     Require *r = (Require *)get_from_list(requires, a);
-    if (!strcmp(r->filename, copy) && (step != STEP_OUTPUT || r->completed < STEP_OUTPUT))
+    if (!strcmp(r->filename, copy))
     {
-      if (step == STEP_OUTPUT)
-        r->completed = STEP_OUTPUT;
       if (r->tree)
       {
         assert(r->tree->type == AST_STMT);
@@ -354,8 +417,10 @@ void moonshot_init()
   requires = NULL;
   errors = NULL;
   _input = NULL;
+  _output = NULL;
   srcs = NULL;
   error_i = 0;
+  set_options(0);
 }
 
 /*
@@ -376,6 +441,16 @@ void moonshot_configure(FILE *input, FILE *output)
 {
   set_output(output);
   _input = input;
+  _output = output;
+}
+
+/*
+  Changes how the compiled Lua code is emitted
+  options is a combination of OPTION_* flags
+*/
+void moonshot_set_options(int options)
+{
+  set_options(options);
 }
 
 /*
@@ -407,13 +482,174 @@ int moonshot_compile()
   }
 
   // AST traversal
+  init_minify();
+  reserve_token_names(ls, ls->n);
   init_traverse();
-  traverse(root, STEP_CHECK);
+  traverse(root);
   if (!errors->n)
-    traverse(root, STEP_OUTPUT);
+  {
+    flush_output();
+    finish_output();
+  }
   dealloc_traverse();
+  dealloc_minify();
   dealloc_requires();
   dealloc_ast_node(root);
   dealloc_token_buffer(ls);
   return (errors->n) ? 0 : 1;
 }
+
+/*
+  Returns 1 if a top-level statement declares types that the whole file can refer to
+*/
+static int is_declaration(AstNode *node)
+{
+  return node->type == AST_CLASS || node->type == AST_INTERFACE || node->type == AST_TYPEDEF || node->type == AST_REQUIRE;
+}
+
+/*
+  Releases the Tokens of a statement that was just parsed from the front of the pending list
+  The first keep Tokens are moved into the kept list since retained AstNodes refer to them
+*/
+static void release_tokens(List *pending, List *kept, int keep, int consumed)
+{
+  for (int a = 0; a < consumed; a++)
+  {
+    Token *tk = (Token *)get_from_list(pending, a);
+    if (a < keep)
+      add_to_list(kept, tk);
+    else
+      dealloc_token(tk);
+  }
+  remove_head_from_list(pending, consumed);
+}
+
+/*
+  Deallocates a list of AstNodes and the list itself
+*/
+static void dealloc_ast_node_list(List *ls)
+{
+  for (int a = 0; a < ls->n; a++)
+    dealloc_ast_node((AstNode *)get_from_list(ls, a));
+  dealloc_list(ls);
+}
+
+/*
+  Copies everything written to a temporary file into out
+*/
+static void copy_staged_output(FILE *staged, FILE *out)
+{
+  char chunk[4096];
+  size_t n;
+  rewind(staged);
+  while ((n = fread(chunk, 1, sizeof(chunk), staged)))
+    fwrite(chunk, 1, n, out);
+}
+
+/*
+  Compiles your configured input one top-level statement at a time
+  The first pass only keeps declarations, which are registered before anything gets checked
+  The second pass parses, checks, writes and frees each statement before reading the next one
+  Global definitions only keep their headers once they've been written, unless their body is inlined
+  Requires a seekable input, and the Lua code is staged in a temporary file so nothing is written if there's an error
+*/
+int moonshot_compile_stream()
+{
+  if (!requires)
+    init_requires();
+  if (errors)
+    dealloc_errors();
+  errors = new_default_list();
+  List *pending = new_default_list();   // Tokens read from the input that haven't been released yet
+  List *kept = new_default_list();      // Tokens that retained AstNodes refer to
+  List *decls = new_default_list();     // Top-level declarations
+  List *headers = new_default_list();   // Global definitions that have been written
+  ChunkScan *scan = new_chunk_scan();   // What the top-level statements define
+  int consumed;
+  int header;
+  AstNode *node;
+
+  // Stage the written statements until the whole input has been checked
+  FILE *staged = _output ? tmpfile() : NULL;
+  if (_output && !staged)
+    add_error(-1, "cannot create a temporary file for the streamed output", NULL);
+  set_output(staged);
+
+  // Collect declarations
+  init_minify();
+  TokenStream *ts = new_token_stream(_input);
+  while ((node = parse_next(ts, pending, &consumed, &header)))
+  {
+    reserve_token_names(pending, consumed);
+    scan_statement(scan, node);
+    if (is_declaration(node))
+    {
+      add_to_list(decls, node);
+      release_tokens(pending, kept, consumed, consumed);
+    }
+    else
+    {
+      dealloc_ast_node(node);
+      release_tokens(pending, kept, 0, consumed);
+    }
+  }
+  dealloc_token_stream(ts);
+  release_tokens(pending, kept, 0, pending->n);
+  if (!errors->n && fseek(_input, 0, SEEK_SET))
+    add_error(-1, "cannot stream an input that isn't seekable", NULL);
+
+  // Check and write each statement
+  init_traverse();
+  if (!errors->n)
+  {
+    traverse_declarations(decls, scan);
+    ts = new_token_stream(_input);
+    int d = 0;
+    while ((node = parse_next(ts, pending, &consumed, &header)))
+    {
+      if (is_declaration(node))
+      {
+        dealloc_ast_node(node);
+        release_tokens(pending, kept, 0, consumed);
+        traverse_statement((AstNode *)get_from_list(decls, d++));
+      }
+      else if (node->type == AST_DEFINE || node->type == AST_FUNCTION)
+      {
+        traverse_statement(node);
+        dealloc_ast_body(node);
+        add_to_list(headers, node);
+        if (node->type == AST_FUNCTION && ((FunctionNode *)(node->data))->inlined)
+          header = consumed;
+        release_tokens(pending, kept, header, consumed);
+      }
+      else
+      {
+        traverse_statement(node);
+        dealloc_ast_node(node);
+        release_tokens(pending, kept, 0, consumed);
+      }
+      if (errors->n)
+        discard_output();
+      else
+        flush_output();
+    }
+    dealloc_token_stream(ts);
+    end_traverse_stream();
+    if (!errors->n)
+      finish_output();
+  }
+  set_output(_output);
+  if (staged && !errors->n)
+    copy_staged_output(staged, _output);
+  if (staged)
+    fclose(staged);
+  dealloc_traverse();
+  dealloc_minify();
+  dealloc_requires();
+  dealloc_ast_node_list(headers);
+  dealloc_ast_node_list(decls);
+  dealloc_chunk_scan(scan);
+  dealloc_token_buffer(pending);
+  dealloc_token_buffer(kept);
+  return (errors->n) ? 0 : 1;
+}
@@ -1,11 +1,48 @@
 #include <stdio.h>
 #define VERSION "0.9.0 (beta)"
 
+// Flags that can be combined and passed to moonshot_set_options
+enum MOONSHOT_OPTIONS
+{
+  OPTION_METATABLES = 1,     // Share one method table per class through __index metatables
+  OPTION_FLATTEN = 2,        // Copy inherited methods into each shared method table at load time
+  OPTION_SLOTS = 4,          // Store class data fields in the array part of instances
+  OPTION_DEVIRTUALIZE = 8,   // Call methods that can't be overridden as local functions
+  OPTION_NO_FOLD = 16,       // Emit constant expressions as written instead of folding them
+  OPTION_HOIST = 32,         // Declare top-level functions and classes as locals and alias hot library globals
+  OPTION_INLINE = 64,        // Write the returned expression of small top-level functions in place of calls
+  OPTION_NO_ELIMINATE = 128, // Keep constant branches and code after a break or goto
+  OPTION_SCALARIZE = 256,    // Replace local instances that never escape with a local per data field
+  OPTION_CSE = 512,          // Read typed field chains used more than once in a run of statements from a local
+  OPTION_MINIFY = 1024,      // Write Lua code without indentation or line breaks, and with the shortest local names
+  OPTION_BYTECODE = 2048,    // Write a precompiled Lua 5.3 binary chunk instead of Lua code
+  OPTION_LOWER = 4096        // Lower function bodies to the optimization IR, optimize them there and print them from it
+};
+
+// Optimization passes, whose time can be read with moonshot_pass_seconds
+enum MOONSHOT_PASSES
+{
+  PASS_FOLD,      // Constant folding, turned off by OPTION_NO_FOLD
+  PASS_ELIMINATE, // Dead code elimination, turned off by OPTION_NO_ELIMINATE
+  PASS_INLINE,    // Inlining, turned on by OPTION_INLINE
+  PASS_HOIST,     // Hoisting, turned on by OPTION_HOIST
+  PASS_SCALARIZE, // Scalar replacement of instances, turned on by OPTION_SCALARIZE
+  PASS_CSE,       // Caching of repeated field chains, turned on by OPTION_CSE
+  PASS_MINIFY,    // Minification of the written Lua code, turned on by OPTION_MINIFY
+  PASS_LOWER,     // Lowering of function bodies to the optimization IR and printing them, turned on by OPTION_LOWER
+  NUM_PASSES
+};
+
 void moonshot_configure(FILE *input, FILE *output);
+void moonshot_set_options(int options);
 void dummy_required_file(char *filename);
 char *moonshot_next_error();
 int moonshot_num_errors();
+int moonshot_eliminated_bytes();
+const char *moonshot_pass_name(int pass);
+double moonshot_pass_seconds(int pass);
 void moonshot_destroy();
+int moonshot_compile_stream();
 int moonshot_compile();
 void moonshot_init();
 void init_requires();
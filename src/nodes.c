@@ -34,6 +34,16 @@ void dealloc_ast_type(AstNode *node)
   free(node);
 }
 
+/*
+  Deallocates a class or interface layout and its FieldNodes
+*/
+void dealloc_layout(Map *layout)
+{
+  for (int a = 0; a < layout->n; a++)
+    free(iterate_from_map(layout, a));
+  dealloc_map(layout);
+}
+
 /*
   Recursively deallocates an AstNode*
 */
@@ -54,10 +64,6 @@ void dealloc_ast_node(AstNode *node)
     }
     dealloc_list(ls);
   }
-  else if (node->type == AST_LTUPLE)
-  {
-    dealloc_list((List *)(node->data));
-  }
   else if (node->type == AST_RETURN || node->type == AST_PAREN || node->type == AST_REQUIRE || node->type == AST_SUPER || node->type == AST_LIST)
   {
     if (node->data)
@@ -81,6 +87,8 @@ void dealloc_ast_node(AstNode *node)
   {
     InterfaceNode *data = (InterfaceNode *)(node->data);
     dealloc_ast_type(data->type);
+    if (data->layout)
+      dealloc_layout(data->layout);
     for (int a = 0; a < data->ls->n; a++)
     {
       AstNode *e = get_from_list(data->ls, a);
@@ -94,6 +102,10 @@ void dealloc_ast_node(AstNode *node)
     ClassNode *data = (ClassNode *)(node->data);
     dealloc_list(data->interfaces);
     dealloc_ast_type(data->type);
+    if (data->layout)
+      dealloc_layout(data->layout);
+    if (data->methods)
+      dealloc_map(data->methods);
     for (int a = 0; a < data->ls->n; a++)
     {
       AstNode *e = get_from_list(data->ls, a);
@@ -107,6 +119,8 @@ void dealloc_ast_node(AstNode *node)
     FunctionNode *data = (FunctionNode *)(node->data);
     if (data->functype)
       dealloc_ast_type(data->functype);
+    if (data->signature)
+      free(data->signature);
     if (data->type)
       dealloc_ast_type(data->type);
     if (data->name)
@@ -139,7 +153,7 @@ void dealloc_ast_node(AstNode *node)
       dealloc_ast_node(data->r);
     free(data);
   }
-  else if (node->type == AST_REPEAT || node->type == AST_WHILE || node->type == AST_TUPLE)
+  else if (node->type == AST_REPEAT || node->type == AST_WHILE || node->type == AST_TUPLE || node->type == AST_LTUPLE)
   {
     AstListNode *data = (AstListNode *)(node->data);
     if (data->node)
@@ -163,6 +177,8 @@ void dealloc_ast_node(AstNode *node)
       AstNode *e = get_from_list(data->body, a);
       dealloc_ast_node(e);
     }
+    dealloc_list(data->body);
+    free(data);
   }
   else if (node->type == AST_CALL || node->type == AST_SET || node->type == AST_SUB)
   {
@@ -215,12 +231,62 @@ void dealloc_ast_node(AstNode *node)
   free(node);
 }
 
+/*
+  Deallocates the parts of a top-level definition that aren't needed once it's been traversed
+  Keeps the names and types that the global scope still refers to, and the bodies of inlined functions
+*/
+void dealloc_ast_body(AstNode *node)
+{
+  if (node->type == AST_FUNCTION)
+  {
+    FunctionNode *data = (FunctionNode *)(node->data);
+    if (data->body && !data->inlined)
+    {
+      for (int a = 0; a < data->body->n; a++)
+      {
+        AstNode *e = (AstNode *)get_from_list(data->body, a);
+        dealloc_ast_node(e);
+      }
+      dealloc_list(data->body);
+      data->body = NULL;
+    }
+  }
+  else if (node->type == AST_DEFINE)
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    if (data->r)
+    {
+      dealloc_ast_node(data->r);
+      data->r = NULL;
+    }
+  }
+}
+
 /*
   Creates a new AstNode
 */
 AstNode *new_node(int type, int line, void *data)
 {
   AstNode *node = (AstNode *)malloc(sizeof(AstNode));
+  node->cache = NULL;
+  node->binding = BINDING_GLOBAL;
+  node->epoch = -1;
+  node->line = line;
+  node->type = type;
+  node->data = data;
+  return node;
+}
+
+/*
+  Creates a new AstNode in the scratch arena
+  Used for throwaway wrapper nodes, never deallocate it
+*/
+AstNode *new_scratch_node(int type, int line, void *data)
+{
+  AstNode *node = (AstNode *)scratch_alloc(sizeof(AstNode));
+  node->cache = NULL;
+  node->binding = BINDING_GLOBAL;
+  node->epoch = -1;
   node->line = line;
   node->type = type;
   node->data = data;
@@ -236,7 +302,12 @@ FunctionNode *new_function_node(AstNode *name, AstNode *type, List *args, List *
 {
   FunctionNode *node = (FunctionNode *)malloc(sizeof(FunctionNode));
   node->is_constructor = 0;
+  node->is_final = 0;
+  node->direct = 0;
+  node->calls_super = 0;
+  node->signature = NULL;
   node->functype = NULL;
+  node->inlined = NULL;
   node->name = name;
   node->args = args;
   node->type = type;
@@ -357,6 +428,7 @@ InterfaceNode *new_interface_node(char *name, char *parent, List *ls)
   InterfaceNode *node = (InterfaceNode *)malloc(sizeof(InterfaceNode));
   node->type = new_node(AST_TYPE_BASIC, -1, name);
   node->parent = parent;
+  node->layout = NULL;
   node->name = name;
   node->ls = ls;
   return node;
@@ -374,7 +446,17 @@ ClassNode *new_class_node(char *name, char *parent, List *interfaces, List *ls)
   node->type = new_node(AST_TYPE_BASIC, -1, name);
   node->interfaces = interfaces;
   node->parent = parent;
+  node->layout = NULL;
+  node->methods = NULL;
+  node->colliding = 0;
+  node->assumed_leaf = 0;
+  node->is_final = 0;
+  node->children = 0;
+  node->declared = 0;
+  node->defined = 0;
   node->name = name;
+  node->method_slots = 0;
+  node->slots = 0;
   node->ls = ls;
   return node;
 }
@@ -405,6 +487,34 @@ EqualTypesNode *new_equal_types_node(char *name, AstNode *type, int relation, in
   return node;
 }
 
+/*
+  Creates an AliasNode, which is used in the typedef alias map
+  These nodes cache the base type of a typedef chain
+*/
+AliasNode *new_alias_node(char *name, char *target, int scope)
+{
+  AliasNode *node = (AliasNode *)malloc(sizeof(AliasNode));
+  node->target = target;
+  node->scope = scope;
+  node->version = -1;
+  node->root = NULL;
+  node->name = name;
+  return node;
+}
+
+/*
+  Creates a FieldNode, which is an entry in a class or interface layout
+  slot should be -1 for fields that only an interface declares
+*/
+FieldNode *new_field_node(AstNode *node, AstNode *type, int slot)
+{
+  FieldNode *field = (FieldNode *)malloc(sizeof(FieldNode));
+  field->node = node;
+  field->type = type;
+  field->slot = slot;
+  return field;
+}
+
 /*
   Creates a BinaryNode for a unary expression
   It also sets the type of this expression based on the operator (op)
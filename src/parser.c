@@ -6,9 +6,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#define UNARY_PRECEDENCE 6 // Precedence level for unary operators
-static List *tokens;       // List of Tokens
-static int _i;             // Index of the Token that's next to be consumed
+#define UNARY_PRECEDENCE 6   // Precedence level for unary operators
+static TokenStream *stream; // Stream that Tokens are pulled from, NULL if all Tokens are already known
+static List *tokens;        // List of Tokens
+static int header_end;      // Index of the Token that ends the header of the parsed definition
+static int _i;              // Index of the Token that's next to be consumed
+static int supers;          // Number of super calls parsed so far
+static AstNode *parse_single_stmt(Token *tk, int *end);
 
 /*
   Wrapper for adding a compilation error
@@ -79,6 +83,7 @@ AstNode *parse(List *ls)
 {
   _i = 0;
   tokens = ls;
+  stream = NULL;
   AstNode *root = parse_stmt();
   if (root)
   {
@@ -96,14 +101,25 @@ AstNode *parse(List *ls)
   return root;
 }
 
+/*
+  Returns 1 if there's a Token at index a
+  Pulls more Tokens from the stream if there is one
+*/
+static int has_token(int a)
+{
+  if (stream && a >= tokens->n)
+    read_tokens(stream, tokens, a);
+  return a < tokens->n;
+}
+
 /*
   Consumes the next non-whitespace Token and returns it
 */
 static Token *consume()
 {
-  while (_i < tokens->n && ((Token *)get_from_list(tokens, _i))->type == TK_SPACE)
+  while (has_token(_i) && ((Token *)get_from_list(tokens, _i))->type == TK_SPACE)
     _i++;
-  return (_i < tokens->n) ? ((Token *)get_from_list(tokens, _i++)) : NULL;
+  return has_token(_i) ? ((Token *)get_from_list(tokens, _i++)) : NULL;
 }
 
 /*
@@ -112,9 +128,9 @@ static Token *consume()
 static Token *check()
 {
   int a = _i;
-  while (a < tokens->n && ((Token *)get_from_list(tokens, a))->type == TK_SPACE)
+  while (has_token(a) && ((Token *)get_from_list(tokens, a))->type == TK_SPACE)
     a++;
-  return (a < tokens->n) ? ((Token *)get_from_list(tokens, a)) : NULL;
+  return has_token(a) ? ((Token *)get_from_list(tokens, a)) : NULL;
 }
 
 /*
@@ -122,7 +138,7 @@ static Token *check()
 */
 static Token *consume_next()
 {
-  if (_i < tokens->n)
+  if (has_token(_i))
     return (Token *)get_from_list(tokens, _i++);
   return NULL;
 }
@@ -132,7 +148,7 @@ static Token *consume_next()
 */
 static Token *check_next()
 {
-  if (_i < tokens->n)
+  if (has_token(_i))
     return (Token *)get_from_list(tokens, _i);
   return NULL;
 }
@@ -145,13 +161,13 @@ static Token *check_ahead(int n)
   int a = _i;
   while (n)
   {
-    while (a < tokens->n && ((Token *)get_from_list(tokens, a))->type == TK_SPACE)
+    while (has_token(a) && ((Token *)get_from_list(tokens, a))->type == TK_SPACE)
       a++;
-    if (n > 1 && a < tokens->n)
+    if (n > 1 && has_token(a))
       a++;
     n--;
   }
-  return (a < tokens->n) ? ((Token *)get_from_list(tokens, a)) : NULL;
+  return has_token(a) ? ((Token *)get_from_list(tokens, a)) : NULL;
 }
 
 /*
@@ -192,10 +208,122 @@ static int precedence(char *op)
   return 0;
 }
 
+/*
+  Parses the next top-level statement from a TokenStream
+  ls holds Tokens that have been read from the stream but not parsed yet
+  consumed is set to the number of Tokens in ls that belong to the statement
+  header is set to the number of those Tokens that the statement's definition header refers to
+  Returns NULL at the end of the stream or if the statement couldn't be parsed
+*/
+AstNode *parse_next(TokenStream *ts, List *ls, int *consumed, int *header)
+{
+  _i = 0;
+  tokens = ls;
+  stream = ts;
+  header_end = -1;
+  AstNode *node = NULL;
+  Token *tk = check();
+  if (tk)
+  {
+    int end = 0;
+    node = parse_single_stmt(tk, &end);
+    if (end)
+      error(tk, "unparsed tokens", NULL);
+  }
+  if (ts->overflow)
+  {
+    add_error(-1, "tokenization buffer overflow", NULL);
+    if (node)
+      dealloc_ast_node(node);
+    node = NULL;
+  }
+  *consumed = _i;
+  *header = header_end < 0 ? 0 : header_end;
+  stream = NULL;
+  return node;
+}
+
 // Statement block parsers
+/*
+  Parses the statement that starts with Token tk
+  Sets end to 1 if tk doesn't start a statement
+*/
+static AstNode *parse_single_stmt(Token *tk, int *end)
+{
+  AstNode *node;
+  if (expect(tk, TK_FUNCTION))
+    node = parse_function(NULL, 1);
+  else if (expect(tk, TK_IF))
+    node = parse_if();
+  else if (expect(tk, TK_SUPER))
+    node = parse_super();
+  else if (expect(tk, TK_CLASS) || expect(tk, TK_FINAL))
+    node = parse_class();
+  else if (expect(tk, TK_INTERFACE))
+    node = parse_interface();
+  else if (expect(tk, TK_TYPEDEF))
+    node = parse_typedef();
+  else if (expect(tk, TK_REQUIRE))
+    node = parse_require();
+  else if (expect(tk, TK_RETURN))
+    node = parse_return();
+  else if (expect(tk, TK_DBCOLON))
+    node = parse_label();
+  else if (expect(tk, TK_LOCAL))
+    node = parse_local();
+  else if (expect(tk, TK_BREAK))
+    node = parse_break();
+  else if (expect(tk, TK_REPEAT))
+    node = parse_repeat();
+  else if (expect(tk, TK_WHILE))
+    node = parse_while();
+  else if (expect(tk, TK_GOTO))
+    node = parse_goto();
+  else if (expect(tk, TK_DO))
+    node = parse_do();
+  else if (specific(tk, TK_BINARY, "*"))
+    node = parse_function_or_define();
+  else if (expect(tk, TK_CONSTRUCTOR))
+    node = error(tk, "invalid constructor without a class", NULL);
+  else if (specific(tk, TK_PAREN, "("))
+  {
+    AstNode *type = parse_type();
+    if (type)
+      node = parse_function(type, 1);
+    else
+      node = NULL;
+  }
+  else if (expect(tk, TK_FOR))
+  {
+    tk = check_ahead(3);
+    if (specific(tk, TK_MISC, ",") || expect(tk, TK_IN))
+      node = parse_forin();
+    else if (specific(tk, TK_MISC, "="))
+      node = parse_fornum();
+    else
+      node = error(tk, "invalid loop", NULL);
+  }
+  else if (expect(tk, TK_NAME) || expect(tk, TK_VAR))
+  {
+    tk = check_ahead(2);
+    if (specific(tk, TK_PAREN, "(") || specific(tk, TK_SQUARE, "[") || specific(tk, TK_MISC, "=") || specific(tk, TK_MISC, ".") || specific(tk, TK_MISC, ","))
+      node = parse_set_or_call();
+    else if (expect(tk, TK_VAR) || expect(tk, TK_NAME))
+      node = parse_function_or_define();
+    else
+      node = error(tk, "invalid statement", NULL);
+  }
+  else
+  {
+    *end = 1;
+    node = NULL;
+  }
+  return node;
+}
 AstNode *parse_stmt()
 {
   int line = -1;
+  int end = 0;
   Token *tk;
   AstNode *node;
   List *ls = new_default_list();
@@ -206,72 +334,9 @@ AstNode *parse_stmt()
       break;
     if (line < 0)
       line = tk->line;
-    if (expect(tk, TK_FUNCTION))
-      node = parse_function(NULL, 1);
-    else if (expect(tk, TK_IF))
-      node = parse_if();
-    else if (expect(tk, TK_SUPER))
-      node = parse_super();
-    else if (expect(tk, TK_CLASS))
-      node = parse_class();
-    else if (expect(tk, TK_INTERFACE))
-      node = parse_interface();
-    else if (expect(tk, TK_TYPEDEF))
-      node = parse_typedef();
-    else if (expect(tk, TK_REQUIRE))
-      node = parse_require();
-    else if (expect(tk, TK_RETURN))
-      node = parse_return();
-    else if (expect(tk, TK_DBCOLON))
-      node = parse_label();
-    else if (expect(tk, TK_LOCAL))
-      node = parse_local();
-    else if (expect(tk, TK_BREAK))
-      node = parse_break();
-    else if (expect(tk, TK_REPEAT))
-      node = parse_repeat();
-    else if (expect(tk, TK_WHILE))
-      node = parse_while();
-    else if (expect(tk, TK_GOTO))
-      node = parse_goto();
-    else if (expect(tk, TK_DO))
-      node = parse_do();
-    else if (specific(tk, TK_BINARY, "*"))
-      node = parse_function_or_define();
-    else if (expect(tk, TK_CONSTRUCTOR))
-      node = error(tk, "invalid constructor without a class", NULL);
-    else if (specific(tk, TK_PAREN, "("))
-    {
-      AstNode *type = parse_type();
-      if (type)
-        node = parse_function(type, 1);
-      else
-        node = NULL;
-    }
-    else if (expect(tk, TK_FOR))
-    {
-      tk = check_ahead(3);
-      if (specific(tk, TK_MISC, ",") || expect(tk, TK_IN))
-        node = parse_forin();
-      else if (specific(tk, TK_MISC, "="))
-        node = parse_fornum();
-      else
-        node = error(tk, "invalid loop", NULL);
-    }
-    else if (expect(tk, TK_NAME) || expect(tk, TK_VAR))
-    {
-      tk = check_ahead(2);
-      if (specific(tk, TK_PAREN, "(") || specific(tk, TK_SQUARE, "[") || specific(tk, TK_MISC, "=") || specific(tk, TK_MISC, ".") || specific(tk, TK_MISC, ","))
-        node = parse_set_or_call();
-      else if (expect(tk, TK_VAR) || expect(tk, TK_NAME))
-        node = parse_function_or_define();
-      else
-        node = error(tk, "invalid statement", NULL);
-    }
-    else
-    {
+    node = parse_single_stmt(tk, &end);
+    if (end)
       break;
-    }
     if (node)
       add_to_list(ls, node);
     else
@@ -290,8 +355,10 @@ AstNode *parse_do()
     return NULL;
   tk = consume();
   if (!expect(tk, TK_END))
-    return error(tk, "unclosed do block", NULL);
-  return new_node(AST_DO, line, (List *)(node->data));
+    FREE_AST_NODE(error(tk, "unclosed do block", NULL), node);
+  List *ls = (List *)(node->data);
+  free(node);
+  return new_node(AST_DO, line, ls);
 }
 
 // Entity parsers (classes and interfaces)
@@ -346,7 +413,13 @@ AstNode *parse_interface()
 AstNode *parse_class()
 {
   char *parent = NULL;
+  int is_final = 0;
   Token *tk = consume();
+  if (expect(tk, TK_FINAL))
+  {
+    is_final = 1;
+    tk = consume();
+  }
   if (!expect(tk, TK_CLASS))
     return error(tk, "invalid class", NULL);
   int line = tk->line;
@@ -391,12 +464,30 @@ AstNode *parse_class()
   while (tk && !expect(tk, TK_END))
   {
     AstNode *node;
+    Token *start = tk;
+    if (expect(tk, TK_FINAL))
+    {
+      consume();
+      tk = check();
+    }
     if (expect(tk, TK_CONSTRUCTOR))
       node = parse_constructor(name);
     else if (expect(tk, TK_FUNCTION))
       node = parse_function(NULL, 1);
     else
       node = parse_function_or_define();
+    if (node && expect(start, TK_FINAL))
+    {
+      if (node->type == AST_FUNCTION && !((FunctionNode *)(node->data))->is_constructor)
+      {
+        ((FunctionNode *)(node->data))->is_final = 1;
+      }
+      else
+      {
+        dealloc_ast_node(node);
+        node = error(start, "only methods can be final in class %s", name);
+      }
+    }
     if (!node)
     {
       for (int a = 0; a < ls->n; a++)
@@ -413,7 +504,9 @@ AstNode *parse_class()
       dealloc_ast_node((AstNode *)get_from_list(ls, a));
     FREE_2_LISTS(error(tk, "invalid class %s", name), interfaces, ls);
   }
-  return new_node(AST_CLASS, line, new_class_node(name, parent, interfaces, ls));
+  ClassNode *data = new_class_node(name, parent, interfaces, ls);
+  data->is_final = is_final;
+  return new_node(AST_CLASS, line, data);
 }
 
 // Type parsers
@@ -545,6 +638,8 @@ AstNode *parse_define(AstNode *type)
     return error(tk, "invalid name for definition", NULL);
   int line = tk->line;
   char *name = tk->text;
+  if (header_end < 0)
+    header_end = _i;
   tk = check();
   if (specific(tk, TK_MISC, "="))
   {
@@ -761,7 +856,10 @@ AstNode *parse_function(AstNode *type, int include_body)
       FREE_AST_NODE(NULL, name);
     return NULL;
   }
+  if (header_end < 0)
+    header_end = _i;
   List *ls = NULL;
+  int start = supers;
   if (include_body)
   {
     AstNode *node = parse_stmt();
@@ -786,7 +884,9 @@ AstNode *parse_function(AstNode *type, int include_body)
     ls = (List *)(node->data);
     free(node);
   }
-  return new_node(AST_FUNCTION, line, new_function_node(name, type, args, ls));
+  FunctionNode *data = new_function_node(name, type, args, ls);
+  data->calls_super = supers != start;
+  return new_node(AST_FUNCTION, line, data);
 }
 AstNode *parse_constructor(char *classname)
 {
@@ -797,6 +897,7 @@ AstNode *parse_constructor(char *classname)
   List *args = parse_function_params();
   if (!args)
     return NULL;
+  int start = supers;
   AstNode *node = parse_stmt();
   if (!node)
     FREE_AST_NODE_LIST(NULL, args);
@@ -805,6 +906,7 @@ AstNode *parse_constructor(char *classname)
     FREE_AST_NODE_LIST(error(tk, "unclosed constructor for class %s", classname), args);
   FunctionNode *data = new_function_node(NULL, new_node(AST_TYPE_BASIC, line, classname), args, (List *)(node->data));
   data->is_constructor = 1;
+  data->calls_super = supers != start;
   free(node);
   return new_node(AST_FUNCTION, line, data);
 }
@@ -844,6 +946,7 @@ AstNode *parse_super()
   if (!expect(tk, TK_SUPER))
     return error(tk, "invalid super method invocation", NULL);
   int line = tk->line;
+  supers++;
   AstNode *args = parse_arg_tuple();
   if (!args)
     return NULL;
@@ -884,7 +987,9 @@ AstNode *parse_repeat()
   AstNode *expr = parse_expr();
   if (!expr)
     FREE_AST_NODE(NULL, body);
-  return new_node(AST_REPEAT, line, new_ast_list_node(expr, (List *)(body->data)));
+  List *ls = (List *)(body->data);
+  free(body);
+  return new_node(AST_REPEAT, line, new_ast_list_node(expr, ls));
 }
 AstNode *parse_while()
 {
@@ -904,7 +1009,9 @@ AstNode *parse_while()
   tk = consume();
   if (!expect(tk, TK_END))
     FREE_2_AST_NODES(error(tk, "unclosed while statement", NULL), expr, body);
-  return new_node(AST_WHILE, line, new_ast_list_node(expr, (List *)(body->data)));
+  List *ls = (List *)(body->data);
+  free(body);
+  return new_node(AST_WHILE, line, new_ast_list_node(expr, ls));
 }
 
 // If statements
@@ -1036,6 +1143,9 @@ AstNode *parse_fornum()
   num2 = (AstNode *)get_from_list(tuple->list, 1);
   if (tuple->list->n == 3)
     num3 = (AstNode *)get_from_list(tuple->list, 2);
+  dealloc_list(tuple->list);
+  free(tuple);
+  free(node);
   tk = consume();
   if (!expect(tk, TK_DO))
   {
@@ -1058,7 +1168,9 @@ AstNode *parse_fornum()
       dealloc_ast_node(num3);
     FREE_2_AST_NODES(error(tk, "unclosed for loop with counter %s", name), num1, num2);
   }
-  return new_node(AST_FORNUM, line, new_fornum_node(name, num1, num2, num3, (List *)(body->data)));
+  List *ls = (List *)(body->data);
+  free(body);
+  return new_node(AST_FORNUM, line, new_fornum_node(name, num1, num2, num3, ls));
 }
 AstNode *parse_forin()
 {
@@ -1107,7 +1219,9 @@ AstNode *parse_forin()
     FREE_AST_NODE_LIST(error(tk, "missing end keyword in for loop", NULL), lhs);
   }
   AstNode *lhs_node = new_node(AST_LTUPLE, line, new_ast_list_node(NULL, lhs));
-  return new_node(AST_FORIN, line, new_forin_node(lhs_node, tuple, (List *)(body->data)));
+  List *ls = (List *)(body->data);
+  free(body);
+  return new_node(AST_FORIN, line, new_forin_node(lhs_node, tuple, ls));
 }
 
 // Label-based statements
@@ -1300,7 +1414,9 @@ AstNode *parse_number()
       return error(tk, "invalid floating point primitive", NULL);
     char *text = (char *)malloc(sizeof(char) * (strlen(first->text) + strlen(tk->text) + 2));
     sprintf(text, "%s.%s", first->text, tk->text);
-    return new_node(AST_PRIMITIVE, first->line, new_primitive_node(text, PRIMITIVE_FLOAT));
+    AstNode *node = new_node(AST_PRIMITIVE, first->line, new_primitive_node(text, PRIMITIVE_FLOAT));
+    free(text);
+    return node;
   }
   return new_node(AST_PRIMITIVE, first->line, new_primitive_node(first->text, PRIMITIVE_INT));
 }
@@ -1383,7 +1499,11 @@ static AstNode *precede_expr_tree(BinaryNode *data)
   if (lp > rp)
   {
     AstNode *l = precede_expr_tree(new_binary_node(data->text, data->l, r->l));
-    return new_node(AST_BINARY, -1, new_binary_node(r->text, l, r->r));
+    AstNode *node = new_node(AST_BINARY, -1, new_binary_node(r->text, l, r->r));
+    free(data->r);
+    free(data);
+    free(r);
+    return node;
   }
   return new_node(AST_BINARY, -1, data);
 }
@@ -0,0 +1,123 @@
+#include "./moonshot.h"
+#include "./internal.h"
+#include <time.h>
+
+/*
+  Pass: an optimization that runs while statements are checked and written, or over lowered functions
+*/
+typedef struct
+{
+  const char *name;          // Name the pass is reported under
+  int option;                // OPTION_* flag that controls the pass
+  int enables;               // 1 if the flag turns the pass on, 0 if it turns it off
+  double seconds;            // Time spent in the pass since init_passes
+  void (*run)(IrFunction *); // Runs the pass over a lowered function, or NULL if it only runs while writing
+} Pass;
+
+static Pass passes[NUM_PASSES] = {
+    {"fold", OPTION_NO_FOLD, 0, 0, fold_ir},
+    {"eliminate", OPTION_NO_ELIMINATE, 0, 0, eliminate_ir},
+    {"inline", OPTION_INLINE, 1, 0, NULL},
+    {"hoist", OPTION_HOIST, 1, 0, NULL},
+    {"scalarize", OPTION_SCALARIZE, 1, 0, NULL},
+    {"cse", OPTION_CSE, 1, 0, NULL},
+    {"minify", OPTION_MINIFY, 1, 0, NULL},
+    {"lower", OPTION_LOWER, 1, 0, NULL},
+};
+static int options;     // OPTION_* flags the passes are enabled by
+static int current;     // PASS_* value of the pass being timed, or -1 if there isn't one
+static double started;  // When the current pass was last entered or resumed
+
+/*
+  Returns the time in seconds from a monotonic clock
+*/
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+  Resets the time measured for every pass
+*/
+void init_passes()
+{
+  for (int a = 0; a < NUM_PASSES; a++)
+    passes[a].seconds = 0;
+  current = -1;
+}
+
+/*
+  Sets the OPTION_* flags that decide which passes run
+*/
+void set_pass_options(int flags)
+{
+  options = flags;
+}
+
+/*
+  Returns 1 if the PASS_* pass should run
+*/
+int pass_enabled(int pass)
+{
+  return ((options & passes[pass].option) != 0) == passes[pass].enables;
+}
+
+/*
+  Starts timing a pass, pausing the one it was entered from
+  Returns the pass that was being timed, which must be given back to end_pass
+*/
+int begin_pass(int pass)
+{
+  double t = now();
+  if (current >= 0)
+    passes[current].seconds += t - started;
+  int outer = current;
+  current = pass;
+  started = t;
+  return outer;
+}
+
+/*
+  Stops timing the current pass and resumes the one begin_pass returned
+*/
+void end_pass(int outer)
+{
+  double t = now();
+  passes[current].seconds += t - started;
+  current = outer;
+  started = t;
+}
+
+/*
+  Runs every enabled pass that works on lowered functions over one, in PASS_* order
+*/
+void run_passes(IrFunction *f)
+{
+  for (int a = 0; a < NUM_PASSES; a++)
+  {
+    if (passes[a].run && pass_enabled(a))
+    {
+      int outer = begin_pass(a);
+      passes[a].run(f);
+      end_pass(outer);
+    }
+  }
+}
+
+/*
+  Returns the name of a PASS_* pass
+*/
+const char *get_pass_name(int pass)
+{
+  return passes[pass].name;
+}
+
+/*
+  Returns the seconds spent in a PASS_* pass since init_passes
+*/
+double get_pass_seconds(int pass)
+{
+  return passes[pass].seconds;
+}
@@ -0,0 +1,488 @@
+#include "./moonshot.h"
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#define UNARY_PRIORITY 12 // Lua 5.3's priority for unary operators
+
+/*
+  Expr: Lua code for a value, along with what decides where it needs parentheses
+*/
+typedef struct
+{
+  char *text;   // Lua code in the scratch arena
+  char *op;     // Binary operator applied last, or NULL
+  int unary;    // 1 if a unary operator is applied last
+  int prefix;   // 1 if the code can be called or indexed as it is
+  int truncate; // 1 if the code is a call that must be wrapped in parentheses to keep one value at the end of a list
+} Expr;
+
+/*
+  Pending: an op whose result is read once, held back to be written where it's read
+*/
+typedef struct
+{
+  IrOp *op;
+  Expr expr;
+} Pending;
+
+static Buffer *out;     // Buffer the Lua code is written to
+static int indents;     // Indentation of the statements being written
+static int *uses;       // Number of reads of each temporary
+static IrBlock **homes; // Block each temporary is read from
+
+static Expr print_ops(List *ops, int from, int to, IrBlock *home, IrValue *result);
+
+/*
+  Concatenates n strings into the scratch arena
+*/
+static char *concat(int n, ...)
+{
+  va_list args;
+  int length = 0;
+  va_start(args, n);
+  for (int a = 0; a < n; a++)
+    length += strlen(va_arg(args, char *));
+  va_end(args);
+  char *str = (char *)scratch_alloc(length + 1);
+  str[0] = 0;
+  va_start(args, n);
+  for (int a = 0; a < n; a++)
+    strcat(str, va_arg(args, char *));
+  va_end(args);
+  return str;
+}
+
+/*
+  Writes a statement on a line of its own
+  Statements starting with a parenthesis are separated from the previous one, which they would otherwise call
+*/
+static void line(char *text)
+{
+  for (int a = 0; a < indents; a++)
+    append_to_buffer(out, "\t", 1);
+  if (text[0] == '(')
+    append_to_buffer(out, ";", 1);
+  append_string_to_buffer(out, text);
+  append_to_buffer(out, "\n", 1);
+}
+
+static char *temp_name(int temp)
+{
+  char *name = (char *)scratch_alloc(16);
+  sprintf(name, "__t%i", temp);
+  return name;
+}
+
+static Expr new_expr(char *text, int prefix)
+{
+  Expr e;
+  memset(&e, 0, sizeof(Expr));
+  e.text = text;
+  e.prefix = prefix;
+  return e;
+}
+
+static Expr paren(Expr e)
+{
+  return new_expr(concat(3, "(", e.text, ")"), 1);
+}
+
+/*
+  Returns an expression that can be called or indexed
+*/
+static Expr prefix_of(Expr e)
+{
+  return e.prefix ? e : paren(e);
+}
+
+/*
+  Returns the Lua code that reads a value
+*/
+static Expr value_expr(IrValue *v)
+{
+  Expr e;
+  switch (v->kind)
+  {
+  case VALUE_CONSTANT:
+    e = new_expr(v->text, v->text[0] == '(');
+    e.unary = v->text[0] == '-';
+    return e;
+  case VALUE_VARARG:
+    return new_expr(v->text, 0);
+  case VALUE_TEMP:
+    return new_expr(temp_name(v->temp), 1);
+  default:
+    return new_expr(v->text, 1);
+  }
+}
+
+/*
+  Applies a binary operator, parenthesizing the operands that would otherwise take it from one another
+*/
+static Expr binary_expr(char *op, Expr l, Expr r)
+{
+  if ((l.op && left_priority(op) > right_priority(l.op)) || (l.unary && left_priority(op) > UNARY_PRIORITY))
+    l = paren(l);
+  if (r.op && left_priority(r.op) <= right_priority(op))
+    r = paren(r);
+  Expr e = new_expr(concat(5, l.text, " ", op, " ", r.text), 0);
+  e.op = op;
+  return e;
+}
+
+static Expr unary_expr(char *op, Expr l)
+{
+  if (l.op && strcmp(l.op, "^"))
+    l = paren(l);
+  Expr e = new_expr(concat(3, op, " ", l.text), 0);
+  e.unary = 1;
+  return e;
+}
+
+/*
+  Joins the expressions of a list, keeping one value of a call at its end that must only have one if truncate is 1
+*/
+static char *list_text(Expr *exprs, int n, int truncate)
+{
+  char *text = "";
+  for (int a = 0; a < n; a++)
+  {
+    Expr e = truncate && a == n - 1 && exprs[a].truncate ? paren(exprs[a]) : exprs[a];
+    text = concat(3, text, a ? "," : "", e.text);
+  }
+  return text;
+}
+
+/*
+  Finds the expressions for the values an op reads
+  Values computed by the most recent held back ops are written in place, as long as they're read in the order they were computed
+*/
+static Expr *resolve(IrValue **values, int n, List *stack)
+{
+  Expr *exprs = (Expr *)scratch_alloc((n + 1) * sizeof(Expr));
+  int open = 1;
+  for (int a = n - 1; a >= 0; a--)
+  {
+    Pending *top = stack->n ? (Pending *)get_from_list(stack, stack->n - 1) : NULL;
+    if (open && values[a]->kind == VALUE_TEMP && top && top->op->dest == values[a]->temp)
+    {
+      exprs[a] = top->expr;
+      stack->n--;
+    }
+    else
+    {
+      exprs[a] = value_expr(values[a]);
+      open &= values[a]->kind != VALUE_TEMP;
+    }
+  }
+  return exprs;
+}
+
+/*
+  Finds the expressions for the values an op reads, where an assignment's targets index with theirs first
+*/
+static Expr *resolve_op(IrOp *op, List *stack, int *n)
+{
+  IrValue **values = (IrValue **)scratch_alloc((2 * (op->targets ? op->targets->n : 0) + op->args->n + 1) * sizeof(IrValue *));
+  *n = 0;
+  for (int a = 0; op->code == IR_SET && a < op->targets->n; a++)
+  {
+    IrValue *target = (IrValue *)get_from_list(op->targets, a);
+    if (target->object)
+      values[(*n)++] = target->object;
+    if (target->key)
+      values[(*n)++] = target->key;
+  }
+  // Conditions of loops and the right operands of short circuits are computed in blocks of their own
+  int num_args = op->args->n;
+  if (op->code == IR_WHILE || op->code == IR_REPEAT)
+    num_args = 0;
+  else if (op->code == IR_AND || op->code == IR_OR)
+    num_args = 1;
+  for (int a = 0; a < num_args; a++)
+    values[(*n)++] = (IrValue *)get_from_list(op->args, a);
+  return resolve(values, *n, stack);
+}
+
+/*
+  Writes the held back ops as locals of their own
+*/
+static void flush(List *stack)
+{
+  for (int a = 0; a < stack->n; a++)
+  {
+    Pending *pending = (Pending *)get_from_list(stack, a);
+    line(concat(4, "local ", temp_name(pending->op->dest), "=", pending->expr.text));
+  }
+  stack->n = 0;
+}
+
+/*
+  Returns 1 if writing ops writes any statements
+*/
+static int writes_statements(List *ops, int from, int to, IrBlock *home, IrValue *result)
+{
+  Buffer *outer = out;
+  out = new_default_buffer();
+  print_ops(ops, from, to, home, result);
+  int n = out->n;
+  dealloc_buffer(out);
+  out = outer;
+  return n > 0;
+}
+
+static void print_block(IrBlock *block)
+{
+  indents++;
+  print_ops(block->ops, 0, block->ops->n, block, NULL);
+  indents--;
+}
+
+/*
+  Writes a short circuit whose right operand takes statements to compute
+*/
+static void print_short_circuit(IrOp *op, Expr l)
+{
+  char *name = temp_name(op->dest);
+  line(concat(4, "local ", name, "=", l.text));
+  line(concat(3, op->code == IR_AND ? "if " : "if not ", name, " then"));
+  indents++;
+  Expr r = print_ops(op->body->ops, 0, op->body->ops->n, op->body, (IrValue *)get_from_list(op->args, 1));
+  line(concat(3, name, "=", r.text));
+  indents--;
+  line("end");
+}
+
+/*
+  Writes an op that computes a value, holding it back if it's read once later in the same block
+*/
+static void print_expression(IrOp *op, List *stack, IrBlock *home)
+{
+  int n;
+  Expr *exprs = resolve_op(op, stack, &n);
+  Expr e;
+  switch (op->code)
+  {
+  case IR_BINARY:
+    e = binary_expr(op->text, exprs[0], exprs[1]);
+    break;
+  case IR_UNARY:
+    e = unary_expr(op->text, exprs[0]);
+    break;
+  case IR_AND:
+  case IR_OR:
+  {
+    IrValue *r = (IrValue *)get_from_list(op->args, 1);
+    if (writes_statements(op->body->ops, 0, op->body->ops->n, op->body, r))
+    {
+      flush(stack);
+      print_short_circuit(op, exprs[0]);
+      return;
+    }
+    e = binary_expr(op->text, exprs[0], print_ops(op->body->ops, 0, op->body->ops->n, op->body, r));
+    break;
+  }
+  case IR_CALL:
+    e = new_expr(concat(4, prefix_of(exprs[0]).text, "(", list_text(exprs + 1, n - 1, 1), ")"), 1);
+    e.truncate = !op->multi;
+    break;
+  case IR_FIELD:
+    e = new_expr(concat(3, prefix_of(exprs[0]).text, ".", op->text), 1);
+    break;
+  case IR_INDEX:
+    e = new_expr(concat(4, prefix_of(exprs[0]).text, "[", exprs[1].text, "]"), 1);
+    break;
+  default:
+  {
+    char *text = "{";
+    for (int a = 0; a < n; a++)
+    {
+      char *key = (char *)get_from_list(op->keys, a);
+      Expr value = a == n - 1 && !key && exprs[a].truncate ? paren(exprs[a]) : exprs[a];
+      text = concat(5, text, a ? "," : "", key ? key : "", key ? "=" : "", value.text);
+    }
+    e = new_expr(concat(2, text, "}"), 0);
+  }
+  }
+  if (op->dest >= 0 && uses[op->dest] == 1 && homes[op->dest] == home)
+  {
+    Pending *pending = (Pending *)scratch_alloc(sizeof(Pending));
+    pending->op = op;
+    pending->expr = e;
+    add_to_list(stack, pending);
+    return;
+  }
+  flush(stack);
+  if (op->code == IR_CALL && (op->dest < 0 || !uses[op->dest]))
+    line(e.text);
+  else
+    line(concat(4, "local ", temp_name(op->dest), "=", e.text));
+}
+
+/*
+  Writes an if, continuing with elseif when the other branch is only another if with a condition written in place
+*/
+static void print_if(IrOp *op, Expr condition, char *keyword)
+{
+  line(concat(3, keyword, condition.text, " then"));
+  print_block(op->body);
+  IrBlock *other = op->other;
+  if (other && other->ops->n)
+  {
+    IrOp *last = (IrOp *)get_from_list(other->ops, other->ops->n - 1);
+    IrValue *next = last->code == IR_IF ? (IrValue *)get_from_list(last->args, 0) : NULL;
+    if (next && !writes_statements(other->ops, 0, other->ops->n - 1, other, next))
+    {
+      print_if(last, print_ops(other->ops, 0, other->ops->n - 1, other, next), "elseif ");
+      return;
+    }
+    line("else");
+    print_block(other);
+  }
+  line("end");
+}
+
+/*
+  Returns the Lua code for the target of an assignment, whose table and key are given
+*/
+static char *target_text(IrValue *target, Expr *object, Expr *key)
+{
+  if (target->kind == VALUE_MEMBER)
+    return concat(3, prefix_of(*object).text, ".", target->text);
+  if (target->kind == VALUE_ELEMENT)
+    return concat(4, prefix_of(*object).text, "[", key->text, "]");
+  return target->text;
+}
+
+/*
+  Writes an op that doesn't compute a value
+*/
+static void print_statement(IrOp *op, List *stack)
+{
+  int n;
+  Expr *exprs = resolve_op(op, stack, &n);
+  flush(stack);
+  char *text = "";
+  int at = 0;
+  switch (op->code)
+  {
+  case IR_LOCAL:
+  case IR_SET:
+    for (int a = 0; a < op->targets->n; a++)
+    {
+      IrValue *target = (IrValue *)get_from_list(op->targets, a);
+      Expr *object = target->object ? exprs + at++ : NULL;
+      Expr *key = target->key ? exprs + at++ : NULL;
+      text = concat(3, text, a ? "," : "", target_text(target, object, key));
+    }
+    if (op->code == IR_LOCAL)
+      text = concat(2, "local ", text);
+    // Extra values are dropped anyway, so a call at the end only has to keep one if there are more targets
+    if (n > at)
+      text = concat(3, text, "=", list_text(exprs + at, n - at, op->targets->n > n - at));
+    line(text);
+    return;
+  case IR_RETURN:
+    line(n ? concat(2, "return ", list_text(exprs, n, 1)) : "return");
+    return;
+  case IR_BREAK:
+    line("break");
+    return;
+  case IR_IF:
+    print_if(op, exprs[0], "if ");
+    return;
+  case IR_WHILE:
+  {
+    // A condition that takes statements to compute is checked at the top of the body instead
+    IrValue *condition = (IrValue *)get_from_list(op->args, 0);
+    List *head = op->other->ops;
+    if (!writes_statements(head, 0, head->n, op->other, condition))
+    {
+      line(concat(3, "while ", print_ops(head, 0, head->n, op->other, condition).text, " do"));
+      print_block(op->body);
+      line("end");
+      return;
+    }
+    line("while true do");
+    indents++;
+    Expr e = print_ops(head, 0, head->n, op->other, condition);
+    line(concat(3, "if ", unary_expr("not", e).text, " then"));
+    indents++;
+    line("break");
+    indents--;
+    line("end");
+    print_ops(op->body->ops, 0, op->body->ops->n, op->body, NULL);
+    indents--;
+    line("end");
+    return;
+  }
+  case IR_REPEAT:
+  {
+    List *tail = op->other->ops;
+    line("repeat");
+    print_block(op->body);
+    indents++;
+    Expr e = print_ops(tail, 0, tail->n, op->other, (IrValue *)get_from_list(op->args, 0));
+    indents--;
+    line(concat(2, "until ", e.text));
+    return;
+  }
+  case IR_FORNUM:
+    text = concat(3, "for ", ((IrValue *)get_from_list(op->targets, 0))->text, "=");
+    line(concat(3, text, list_text(exprs, n, 0), " do"));
+    print_block(op->body);
+    line("end");
+    return;
+  case IR_FORIN:
+    for (int a = 0; a < op->targets->n; a++)
+      text = concat(3, text, a ? "," : "", ((IrValue *)get_from_list(op->targets, a))->text);
+    line(concat(5, "for ", text, " in ", list_text(exprs, n, 1), " do"));
+    print_block(op->body);
+    line("end");
+    return;
+  default:
+    line("do");
+    print_block(op->body);
+    line("end");
+  }
+}
+
+/*
+  Writes a range of ops from a block, returning the expression for a value they compute, which can be NULL
+*/
+static Expr print_ops(List *ops, int from, int to, IrBlock *home, IrValue *result)
+{
+  List *stack = new_scratch_list(8);
+  for (int a = from; a < to; a++)
+  {
+    IrOp *op = (IrOp *)get_from_list(ops, a);
+    if (op->code <= IR_TABLE)
+      print_expression(op, stack, home);
+    else
+      print_statement(op, stack);
+  }
+  Expr e = new_expr(NULL, 0);
+  if (result)
+    e = *resolve(&result, 1, stack);
+  flush(stack);
+  return e;
+}
+
+/*
+  Writes the Lua code for a block of lowered ops, indented by the number of tabs given
+  Temporaries read once are written in place where Lua evaluates them in the same order
+*/
+void print_ir(IrBlock *block, int temps, Buffer *b, int n)
+{
+  ScratchMark mark = scratch_mark();
+  uses = (int *)scratch_alloc((temps + 1) * sizeof(int));
+  homes = (IrBlock **)scratch_alloc((temps + 1) * sizeof(IrBlock *));
+  memset(uses, 0, (temps + 1) * sizeof(int));
+  count_ir_uses(block, uses, homes);
+  out = b;
+  indents = n;
+  print_ops(block->ops, 0, block->ops->n, block, NULL);
+  scratch_release(mark);
+}
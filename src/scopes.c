@@ -11,6 +11,7 @@ static int first;    // Flag to ensure we only register primitive types once
 static Scope *new_scope(int type, void *data)
 {
   Scope *scope = (Scope *)malloc(sizeof(Scope));
+  expire_types();
   scope->interfaces_registry = new_default_list();
   scope->functions_registry = new_default_list();
   scope->classes_registry = new_default_list();
@@ -70,6 +71,7 @@ void push_scope()
 void pop_scope()
 {
   Scope *scope = remove_from_list(scopes, scopes->n - 1);
+  expire_types();
   for (int a = 0; a < scope->defs->n; a++)
   {
     StringAstNode *var = (StringAstNode *)get_from_list(scope->defs, a);
@@ -212,6 +214,7 @@ int add_scoped_var(StringAstNode *node)
     }
   }
   add_to_list(scope->defs, node);
+  expire_types();
   return 1;
 }
 
@@ -238,12 +241,13 @@ StringAstNode *get_scoped_var(char *name)
 }
 
 /*
-  Returns 1 if the given field is defined as a class field
+  Returns the typed variable called name along with what it's bound to
+  Return NULL if no such typed variable exists, which binds it as a global
+  Searches through every scope from innermost to outermost
 */
-int field_defined_in_class(char *name)
+StringAstNode *resolve_scoped_var(char *name, int *binding)
 {
-  StringAstNode *node = get_scoped_var(name);
-  for (int a = scopes->n - 1; a >= 0; a--)
+  for (int a = (scopes->n) - 1; a >= 0; a--)
   {
     Scope *scope = (Scope *)get_from_list(scopes, a);
     for (int b = 0; b < scope->defs->n; b++)
@@ -251,11 +255,16 @@ int field_defined_in_class(char *name)
       StringAstNode *n = (StringAstNode *)get_from_list(scope->defs, b);
       if (!strcmp(n->text, name))
       {
-        return scope->type == SCOPE_CLASS;
+        if (scope->type == SCOPE_CLASS)
+          *binding = strcmp(name, "this") ? BINDING_FIELD : BINDING_THIS;
+        else
+          *binding = a ? BINDING_LOCAL : BINDING_GLOBAL;
+        return n;
       }
     }
   }
-  return 0;
+  *binding = BINDING_GLOBAL;
+  return NULL;
 }
 
 /*
@@ -283,6 +292,7 @@ void register_primitive(const char *name)
   char *type = (char *)malloc(sizeof(char) * (strlen(name) + 1));
   strcpy(type, name);
   add_to_list(scope->types_registry, type);
+  expire_types();
 }
 
 /*
@@ -292,6 +302,7 @@ void register_type(char *name)
 {
   Scope *scope = get_scope();
   add_to_list(scope->types_registry, name);
+  expire_types();
 }
 
 /*
@@ -301,6 +312,7 @@ void register_function(FunctionNode *node)
 {
   Scope *scope = get_scope();
   add_to_list(scope->functions_registry, node);
+  expire_types();
 }
 
 /*
@@ -310,6 +322,7 @@ void register_interface(InterfaceNode *node)
 {
   Scope *scope = get_scope();
   add_to_list(scope->interfaces_registry, node);
+  expire_types();
 }
 
 /*
@@ -319,6 +332,7 @@ void register_class(ClassNode *node)
 {
   Scope *scope = get_scope();
   add_to_list(scope->classes_registry, node);
+  expire_types();
 }
 
 /*
@@ -390,6 +404,29 @@ InterfaceNode *interface_exists(char *name)
   return NULL;
 }
 
+/*
+  Returns a registered ClassNode that has a method called name
+  Returns NULL if no class has such a method
+*/
+ClassNode *class_method_exists(char *name)
+{
+  for (int a = scopes->n - 1; a >= 0; a--)
+  {
+    Scope *scope = (Scope *)get_from_list(scopes, a);
+    List *ls = scope->classes_registry;
+    for (int b = 0; b < ls->n; b++)
+    {
+      ClassNode *node = (ClassNode *)get_from_list(ls, b);
+      FieldNode *field = (FieldNode *)get_from_map(get_class_layout(node), name);
+      if (field && field->node->type == AST_FUNCTION)
+      {
+        return node;
+      }
+    }
+  }
+  return NULL;
+}
+
 /*
   Returns the registered ClassNode if name is a registered class
   Returns NULL if class name does not exist
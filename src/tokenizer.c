@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #define TOKEN_BUFFER_LENGTH 256 // Max length for a token string
 #define KEY_TOKEN(s, t) else if (!strcmp(buffer, s)) tk->type = t;
 #define SPECIAL_TOKEN(s, l, t)                         \
@@ -15,8 +16,6 @@
 static int class_alphanumeric = 0; // Represents the alphanumeric token class
 static int class_whitespace = 1;   // Represents the whitespace token class
 static int class_special = 2;      // Represents the special token class
-static int multiline_comment = 0;  // Flag for tokenizing within a multiline comment
-static int comment = 0;            // Flag for tokenizing within a single line comment
 
 /*
   Get the character class for a char
@@ -41,25 +40,29 @@ void dealloc_token(Token *tk)
 }
 
 /*
-  Generates tokens from a buffer of similarly-classes characters
+  Generates tokens from the stream's buffer of similarly-classes characters
 */
-static void discover_tokens(List *ls, int line, char *buffer, int n, int char_class)
+static void discover_tokens(TokenStream *ts, List *ls)
 {
+  char *buffer = ts->buffer;
+  int char_class = ts->char_class;
+  int line = ts->line;
+  int n = ts->length;
   buffer[n] = 0;
   if (char_class != class_special)
   {
 
     // Comment tokenization
-    if (comment && char_class == class_whitespace)
+    if (ts->comment && char_class == class_whitespace)
     {
       for (int a = 0; a < n; a++)
       {
         if (buffer[a] == '\n')
-          comment = 0;
+          ts->comment = 0;
       }
       return;
     }
-    if (multiline_comment || comment)
+    if (ts->multiline_comment || ts->comment)
       return;
 
     // Whitespace and alphanumeric tokenization
@@ -128,27 +131,27 @@ static void discover_tokens(List *ls, int line, char *buffer, int n, int char_cl
     int a = 0;
     while (a < n)
     {
-      if (multiline_comment)
+      if (ts->multiline_comment)
       {
         if (n - a >= 2 && !strncmp(buffer + a, "]]", 2))
         {
-          multiline_comment = 0;
+          ts->multiline_comment = 0;
           a++;
         }
         a++;
         continue;
       }
-      if (comment)
+      if (ts->comment)
         break;
       if (n - a >= 4 && !strncmp(buffer + a, "--[[", 4))
       {
-        multiline_comment = 1;
+        ts->multiline_comment = 1;
         a += 4;
         continue;
       }
       if (n - a >= 2 && !strncmp(buffer + a, "--", 2))
       {
-        comment = 1;
+        ts->comment = 1;
         break;
       }
       Token *tk = (Token *)malloc(sizeof(Token));
@@ -196,44 +199,83 @@ static void discover_tokens(List *ls, int line, char *buffer, int n, int char_cl
 }
 
 /*
-  Read through some Lua code and tokenize it along the way
-  Returns a list of Tokens
+  Instantiates a TokenStream that tokenizes a file on demand
 */
-List *tokenize(FILE *f)
+TokenStream *new_token_stream(FILE *f)
 {
-  int line = 1;
-  if (!f)
-    return NULL;
-  int current_class = -1;
-  List *ls = new_list(100);
-  char buffer[TOKEN_BUFFER_LENGTH];
-  int i = 0;
-  while (1)
+  TokenStream *ts = (TokenStream *)malloc(sizeof(TokenStream));
+  ts->buffer = (char *)malloc(sizeof(char) * (TOKEN_BUFFER_LENGTH + 1));
+  ts->file = f;
+  ts->length = 0;
+  ts->char_class = -1;
+  ts->line = 1;
+  ts->comment = 0;
+  ts->multiline_comment = 0;
+  ts->overflow = 0;
+  return ts;
+}
+
+/*
+  Reads through the stream and tokenizes it until ls holds more than n Tokens
+  Stops early at the end of the file
+  Returns 0 if a token overflowed the buffer
+*/
+int read_tokens(TokenStream *ts, List *ls, int n)
+{
+  while (ls->n <= n && !ts->overflow)
   {
-    char c = fgetc(f);
-    if (feof(f))
+    char c = fgetc(ts->file);
+    if (feof(ts->file))
     {
-      if (i)
-        discover_tokens(ls, line, buffer, i, current_class);
+      if (ts->length)
+        discover_tokens(ts, ls);
+      ts->length = 0;
       break;
     }
     int char_class = get_char_class(c);
-    if (current_class != -1 && char_class != current_class)
+    if (ts->char_class != -1 && char_class != ts->char_class)
     {
-      discover_tokens(ls, line, buffer, i, current_class);
-      i = 0;
+      discover_tokens(ts, ls);
+      ts->length = 0;
     }
-    current_class = char_class;
+    ts->char_class = char_class;
     if (c == '\n')
-      line++;
-    if (i == TOKEN_BUFFER_LENGTH)
-    {
-      for (int a = 0; a < ls->n; a++)
-        dealloc_token((Token *)get_from_list(ls, a));
-      dealloc_list(ls);
-      return NULL;
-    }
-    buffer[i++] = c;
+      ts->line++;
+    if (ts->length == TOKEN_BUFFER_LENGTH)
+      ts->overflow = 1;
+    else
+      ts->buffer[ts->length++] = c;
+  }
+  return !ts->overflow;
+}
+
+/*
+  Deallocates a TokenStream
+  Does not close the file
+*/
+void dealloc_token_stream(TokenStream *ts)
+{
+  free(ts->buffer);
+  free(ts);
+}
+
+/*
+  Read through some Lua code and tokenize it along the way
+  Returns a list of Tokens
+*/
+List *tokenize(FILE *f)
+{
+  if (!f)
+    return NULL;
+  List *ls = new_list(100);
+  TokenStream *ts = new_token_stream(f);
+  if (!read_tokens(ts, ls, INT_MAX))
+  {
+    for (int a = 0; a < ls->n; a++)
+      dealloc_token((Token *)get_from_list(ls, a));
+    dealloc_list(ls);
+    ls = NULL;
   }
+  dealloc_token_stream(ts);
   return ls;
 }
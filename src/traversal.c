@@ -1,3 +1,4 @@
+#include "./moonshot.h"
 #include "./internal.h"
 #include <assert.h>
 #include <stdarg.h>
@@ -7,26 +8,85 @@
 #define ERROR(cond, line, msg, ...)    \
   if (cond)                            \
   {                                    \
-    assert(step != STEP_OUTPUT);       \
     add_error(line, msg, __VA_ARGS__); \
     return;                            \
   }
-static char *instance_str;  // The variable used for the produced object in constructors
-static FILE *_output;       // The configured output as desired by the developer
-static int step;            // The traversal step you're currently processing
-static int num_indents;     // Number of tabs on the output line
-static AstNode *float_type; // AstNode constant representing the FLOAT type
-static AstNode *bool_type;  // AstNode constant representing the BOOL type
-static AstNode *int_type;   // AstNode constant representing the INT type
-static AstNode *any_type;   // AstNode constant representing the ANY type
+#define OUTPUT_BUFFER_SIZE 65536 // Initial size in bytes of the output buffer
+#define MAX_CHUNK_LOCALS 150     // Most locals the main chunk declares, including the file's own, Lua allows 200 locals per function
+#define HOT_GLOBAL_USES 2        // Weighted reads of a library global before a function aliases it as a local
+#define MAX_INLINE_NODES 16      // Most nodes in the returned expression of a function that's inlined
+
+// States of an if chain as its branches are written
+enum CHAIN_STATES
+{
+  CHAIN_EMPTY, // No branch has been written yet
+  CHAIN_OPEN,  // A conditional branch has been written
+  CHAIN_TAKEN  // A branch that's always taken has been written
+};
+
+static char *instance_str;     // The variable used for the produced object in constructors
+static Buffer *output_buffer;  // Lua code waiting to be committed to the configured output
+static Buffer *lowered;        // Committed Lua code waiting to be compiled to bytecode by finish_output
+static FILE *_output;          // The configured output as desired by the developer
+static int step;               // The traversal step you're currently processing
+static int num_indents;        // Number of tabs on the output line
+static int options;            // OPTION_* flags controlling how Lua code is emitted
+static int eliminated;         // Bytes of unreachable Lua code removed from the output
+static int unreachable;        // 1 once a top-level return has been written
+static int chain;              // CHAIN_* state of the if chain being written
+static int assigning;          // 1 while writing the names a statement assigns to
+
+// Lua library globals that functions can alias as locals when hoisting
+static const char *library_globals[] = {
+    "assert", "collectgarbage", "error", "getmetatable", "ipairs", "next", "pairs", "pcall", "print",
+    "rawequal", "rawget", "rawlen", "rawset", "select", "setmetatable", "tonumber", "tostring", "type",
+    "xpcall", "coroutine", "io", "math", "os", "string", "table", "utf8"};
+#define NUM_LIBRARY_GLOBALS (int)(sizeof(library_globals) / sizeof(char *))
+
+/*
+  HoistState: the library globals read by a function being written with hoisting enabled
+*/
+typedef struct HoistState
+{
+  struct HoistState *parent;          // State of the enclosing function, or NULL for the outermost one
+  int uses[NUM_LIBRARY_GLOBALS];      // Reads of each global, where reads within loops count as hot
+  int assigned[NUM_LIBRARY_GLOBALS];  // 1 if the function or a function within it assigns the global
+  int loops;                          // Number of loops around the code being written
+} HoistState;
+static HoistState *hoisting; // Globals read by the function being written, or NULL if we aren't hoisting
+static AstNode *statement;     // Statement being written, so calls written as statements aren't inlined
+static FunctionNode *inlining; // Function whose returned expression is being written in place of a call
+static List *inline_args;      // Arguments written for the parameters of inlining, or NULL if they're bound to temps
+static List *redefined;        // Names of top-level functions defined more than once, which are never inlined
+static List *block;            // Statements of the innermost block being written
+static int block_at;           // Index in block of the statement being written
+static List *repeat_body;      // Statements of the innermost repeat loop, whose condition can still see their locals
+static AstNode *repeat_until;  // Condition of that repeat loop
+static List *scalars;          // Names of the locals whose instance was replaced by a local per data field
+static char *constructing;     // Name of the scalar replaced local whose constructor is being written, or NULL
+static List *cached_chains;    // Field chains read from a local cache by the statements being written
 
 /*
-  The traversal step of this compiler has 4 phases:
-    typedef, relate, check, output
+  ChainUse: a typed field chain that a run of statements reads fields from
+*/
+typedef struct
+{
+  AstNode *chain; // AST_FIELD node of the chain's first occurrence
+  int depth;      // Number of fields in the chain
+  int uses;       // Number of fields read from the chain
+} ChainUse;
+static AstNode *float_type;    // AstNode constant representing the FLOAT type
+static AstNode *bool_type;     // AstNode constant representing the BOOL type
+static AstNode *int_type;      // AstNode constant representing the INT type
+static AstNode *any_type;      // AstNode constant representing the ANY type
+
+/*
+  The traversal step of this compiler has 3 phases:
+    typedef, relate, check
   The typedef phase is when we traverse through a scope (an AST subtree) and register the types defined there
   The relate phase is where we go through each type and register any equivalencies (since the types need to exist first)
-  The check phase is when we perform general compile-time checks
-  The output phase happen after all checks have been performed, this is when we write Lua code to output
+  The check phase is when we perform general compile-time checks and write Lua code to an in-memory buffer
+  The buffer is only committed to the output once the whole tree has been checked without errors
 */
 
 // Get number of indents
@@ -64,8 +124,24 @@ void init_traverse()
   int_type = new_node(AST_TYPE_BASIC, -1, PRIMITIVE_INT);
   any_type = new_node(AST_TYPE_ANY, -1, NULL);
   sprintf(instance_str, "__obj");
+  output_buffer = new_buffer(OUTPUT_BUFFER_SIZE);
+  lowered = new_default_buffer();
   num_indents = 0;
+  eliminated = 0;
+  unreachable = 0;
+  assigning = 0;
+  hoisting = NULL;
+  statement = NULL;
+  inlining = NULL;
+  redefined = new_default_list();
+  block = NULL;
+  repeat_body = NULL;
+  scalars = new_default_list();
+  constructing = NULL;
+  cached_chains = new_default_list();
+  init_passes();
   preempt_scopes();
+  init_scratch();
   init_types();
   init_scopes();
   push_scope();
@@ -73,12 +149,250 @@ void init_traverse()
 
 /*
   Traverse through a parsed Moonshot AST
-  This function is called twice in the Moonshot compile function
+  Checks the tree and buffers the resulting Lua code in a single pass
+*/
+void traverse(AstNode *root)
+{
+  List *ls = (List *)(root->data);
+  ChunkScan *scan = new_chunk_scan();
+  for (int a = 0; a < ls->n; a++)
+    scan_statement(scan, (AstNode *)get_from_list(ls, a));
+  traverse_declarations(ls, scan);
+  dealloc_chunk_scan(scan);
+  for (int a = 0; a < ls->n; a++)
+    traverse_statement((AstNode *)get_from_list(ls, a));
+  end_traverse_stream();
+}
+
+/*
+  Returns the name a top-level function statement defines, or NULL if it isn't a plain name
+*/
+static char *get_function_name(AstNode *node)
+{
+  if (node->type != AST_FUNCTION)
+    return NULL;
+  AstNode *name = ((FunctionNode *)(node->data))->name;
+  return name && name->type == AST_ID ? (char *)(name->data) : NULL;
+}
+
+/*
+  Adds the names of the variables an AstNode reads or assigns to a map
+  Names are copied, since streamed statements are freed after they're scanned
+*/
+static void collect_reads(AstNode *node, Map *reads)
+{
+  if (!node)
+    return;
+  switch (node->type)
+  {
+  case AST_ID:
+    if (!get_from_map(reads, (char *)(node->data)))
+    {
+      char *name = copy_string((char *)(node->data));
+      put_in_map(reads, name, name);
+    }
+    break;
+  case AST_FIELD:
+  case AST_LOCAL:
+    collect_reads(((StringAstNode *)(node->data))->node, reads);
+    break;
+  case AST_PAREN:
+  case AST_LIST:
+  case AST_RETURN:
+  case AST_REQUIRE:
+  case AST_SUPER:
+    collect_reads((AstNode *)(node->data), reads);
+    break;
+  case AST_UNARY:
+  case AST_BINARY:
+  case AST_DEFINE:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    if (node->type != AST_DEFINE)
+      collect_reads(data->l, reads);
+    if (node->type == AST_DEFINE || (node->type == AST_BINARY && strcmp(data->text, "as")))
+      collect_reads(data->r, reads);
+    break;
+  }
+  case AST_SET:
+  case AST_CALL:
+  case AST_SUB:
+    collect_reads(((AstAstNode *)(node->data))->l, reads);
+    collect_reads(((AstAstNode *)(node->data))->r, reads);
+    break;
+  case AST_TUPLE:
+  case AST_LTUPLE:
+  case AST_REPEAT:
+  case AST_WHILE:
+  {
+    AstListNode *data = (AstListNode *)(node->data);
+    collect_reads(data->node, reads);
+    for (int a = 0; a < data->list->n; a++)
+      collect_reads((AstNode *)get_from_list(data->list, a), reads);
+    break;
+  }
+  case AST_STMT:
+  case AST_DO:
+  case AST_ELSE:
+  {
+    List *ls = (List *)(node->data);
+    for (int a = 0; a < ls->n; a++)
+      collect_reads((AstNode *)get_from_list(ls, a), reads);
+    break;
+  }
+  case AST_TABLE:
+  {
+    List *ls = ((TableNode *)(node->data))->vals;
+    for (int a = 0; a < ls->n; a++)
+      collect_reads((AstNode *)get_from_list(ls, a), reads);
+    break;
+  }
+  case AST_IF:
+  case AST_ELSEIF:
+  {
+    IfNode *data = (IfNode *)(node->data);
+    collect_reads(data->expr, reads);
+    collect_reads(data->next, reads);
+    for (int a = 0; a < data->body->n; a++)
+      collect_reads((AstNode *)get_from_list(data->body, a), reads);
+    break;
+  }
+  case AST_FORNUM:
+  {
+    FornumNode *data = (FornumNode *)(node->data);
+    collect_reads(data->num1, reads);
+    collect_reads(data->num2, reads);
+    collect_reads(data->num3, reads);
+    for (int a = 0; a < data->body->n; a++)
+      collect_reads((AstNode *)get_from_list(data->body, a), reads);
+    break;
+  }
+  case AST_FORIN:
+  {
+    ForinNode *data = (ForinNode *)(node->data);
+    collect_reads(data->tuple, reads);
+    for (int a = 0; a < data->body->n; a++)
+      collect_reads((AstNode *)get_from_list(data->body, a), reads);
+    break;
+  }
+  case AST_FUNCTION:
+  {
+    FunctionNode *data = (FunctionNode *)(node->data);
+    if (data->name && data->name->type != AST_ID)
+      collect_reads(data->name, reads);
+    for (int a = 0; data->body && a < data->body->n; a++)
+      collect_reads((AstNode *)get_from_list(data->body, a), reads);
+    break;
+  }
+  case AST_CLASS:
+  {
+    List *ls = ((ClassNode *)(node->data))->ls;
+    for (int a = 0; a < ls->n; a++)
+      collect_reads((AstNode *)get_from_list(ls, a), reads);
+    break;
+  }
+  }
+}
+
+/*
+  Returns a ChunkScan for collecting what a file's top-level statements define, before any of them is written
+*/
+ChunkScan *new_chunk_scan()
+{
+  ChunkScan *scan = (ChunkScan *)malloc(sizeof(ChunkScan));
+  scan->functions = new_default_list();
+  scan->globals = new_default_list();
+  scan->reads = new_default_map();
+  scan->locals = 0;
+  return scan;
+}
+
+/*
+  Scans the next top-level statement of a file
+  A class or function read by an earlier statement could be a global that already exists, so it isn't hoisted
+*/
+void scan_statement(ChunkScan *scan, AstNode *node)
+{
+  char *name = get_function_name(node);
+  if (!name && node->type == AST_CLASS)
+    name = ((ClassNode *)(node->data))->name;
+  if (name && get_from_map(scan->reads, name))
+    add_to_list(scan->globals, copy_string(name));
+  if (name && node->type == AST_FUNCTION)
+    add_to_list(scan->functions, copy_string(name));
+  scan->locals += node->type == AST_LOCAL;
+  collect_reads(node, scan->reads);
+}
+
+/*
+  Deallocates a ChunkScan along with the names it copied
+*/
+void dealloc_chunk_scan(ChunkScan *scan)
+{
+  for (int a = 0; a < scan->functions->n; a++)
+    free(get_from_list(scan->functions, a));
+  for (int a = 0; a < scan->globals->n; a++)
+    free(get_from_list(scan->globals, a));
+  for (int a = 0; a < scan->reads->n; a++)
+    free(iterate_from_map(scan->reads, a));
+  dealloc_list(scan->functions);
+  dealloc_list(scan->globals);
+  dealloc_map(scan->reads);
+  free(scan);
+}
+
+/*
+  Writes the buffered Lua code to the configured output, minifying it first if that's enabled
+  When writing bytecode, the code is kept for finish_output instead
+  Only called if the traversal didn't produce any errors
+*/
+void flush_output()
+{
+  if (pass_enabled(PASS_MINIFY))
+  {
+    int outer = begin_pass(PASS_MINIFY);
+    minify_buffer(output_buffer);
+    end_pass(outer);
+  }
+  if (options & OPTION_BYTECODE)
+  {
+    append_to_buffer(lowered, output_buffer->data, output_buffer->n);
+    output_buffer->n = 0;
+  }
+  else
+    flush_buffer(output_buffer, _output);
+}
+
+/*
+  Compiles the Lua code flushed so far into a binary chunk and writes it to the configured output
+  Does nothing unless bytecode is being written, and is only called if compilation succeeded
+*/
+void finish_output()
+{
+  if (!(options & OPTION_BYTECODE))
+    return;
+  Buffer *chunk = new_default_buffer();
+  char *source = get_chunk_name();
+  if (compile_bytecode(lowered, source, chunk))
+    flush_buffer(chunk, _output);
+  free(source);
+  dealloc_buffer(chunk);
+}
+
+/*
+  Throws away the buffered Lua code
 */
-void traverse(AstNode *root, int initial_step)
+void discard_output()
 {
-  step = initial_step;
-  process_node_list((List *)(root->data));
+  output_buffer->n = 0;
+}
+
+/*
+  Returns the number of bytes of unreachable Lua code left out of the output
+*/
+int get_eliminated_bytes()
+{
+  return eliminated;
 }
 
 /*
@@ -87,16 +401,31 @@ void traverse(AstNode *root, int initial_step)
 void dealloc_traverse()
 {
   free(instance_str);
+  dealloc_buffer(output_buffer);
+  dealloc_buffer(lowered);
+  dealloc_list(scalars);
+  dealloc_list(cached_chains);
+  dealloc_list(redefined);
   pop_scope();
   assert(get_num_scopes() == 0);
   dealloc_scopes();
   dealloc_types();
+  dealloc_scratch();
   free(any_type);
   free(int_type);
   free(bool_type);
   free(float_type);
 }
 
+/*
+  Sets the OPTION_* flags desired by the developer
+*/
+void set_options(int flags)
+{
+  options = flags;
+  set_pass_options(flags);
+}
+
 /*
   Sets the output to the stream desired by the developer
 */
@@ -110,34 +439,59 @@ void set_output(FILE *output)
 */
 static void indent(int a)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     num_indents += a;
   }
 }
 
 /*
-  Writes a message to the configured output
+  Writes a message to the output buffer
+  Nothing reaches the configured output until flush_output is called
 */
 static void write(const char *msg, ...)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     va_list args;
     va_start(args, msg);
-    char *str = format_string(1, msg, args);
-    fprintf(_output, "%s", str);
-    free(str);
+    format_to_buffer(output_buffer, 1, msg, args);
     va_end(args);
   }
 }
 
+/*
+  Removes the Lua code written since start, since it can never run
+  The code is still checked, so errors in it are reported as usual
+*/
+static void eliminate_output(int start)
+{
+  int outer = begin_pass(PASS_ELIMINATE);
+  eliminated += output_buffer->n - start;
+  output_buffer->n = start;
+  end_pass(outer);
+}
+
+/*
+  Returns 1 if a condition is always truthy, 0 if it's always falsy, and -1 if that isn't known
+  Conditions are never known when dead code elimination is turned off
+*/
+static int known_truth(AstNode *node)
+{
+  if (!pass_enabled(PASS_ELIMINATE))
+    return -1;
+  int outer = begin_pass(PASS_ELIMINATE);
+  int truth = constant_truth(node);
+  end_pass(outer);
+  return truth;
+}
+
 /*
   Prints a newline character after nodes that could either be a value or statement
 */
 static void conditional_newline(AstNode *node)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     if (node->type == AST_FUNCTION)
       write("\n");
@@ -162,81 +516,716 @@ static void conditional_newline(AstNode *node)
 }
 
 /*
-  Canonical traversal method structure:
-  if step==STEP_TYPEDEF
-    do your typedef step
-  else if step==STEP_RELATE
-    do your relate step
-  else
-    push scope
-    do your check and output steps
-    pop scope
-  end
+  Returns 1 if a statement always leaves its block, so the statements after it can't run
 */
+static int ends_block(AstNode *node)
+{
+  return node->type == AST_RETURN || node->type == AST_BREAK || node->type == AST_GOTO;
+}
 
 /*
-  Process a list of AstNodes
-  Usually called once for each scope
+  Starts counting the library globals a function body reads
 */
-void process_node_list(List *ls)
+static void begin_hoisting(HoistState *state)
 {
-  if (step == STEP_CHECK)
+  memset(state, 0, sizeof(HoistState));
+  state->parent = hoisting;
+  hoisting = state;
+}
+
+/*
+  Aliases the library globals a function body read often as locals at the start of the body
+  start is where the body begins in the output, and the body must still be indented
+*/
+static void end_hoisting(HoistState *state, int start)
+{
+  int outer = begin_pass(PASS_HOIST);
+  hoisting = state->parent;
+  Buffer *names = new_default_buffer();
+  for (int a = 0; a < NUM_LIBRARY_GLOBALS; a++)
   {
-    // We need to load up scoped types before we can check this scope
-    step = STEP_TYPEDEF;
-    for (int a = 0; a < ls->n; a++)
-      process_node((AstNode *)get_from_list(ls, a));
+    if (state->uses[a] < HOT_GLOBAL_USES || state->assigned[a])
+      continue;
+    if (names->n)
+      append_to_buffer(names, ",", 1);
+    append_string_to_buffer(names, library_globals[a]);
+  }
+  if (names->n)
+  {
+    Buffer *line = new_default_buffer();
+    for (int a = 0; a < num_indents; a++)
+      append_to_buffer(line, "\t", 1);
+    append_string_to_buffer(line, "local ");
+    append_to_buffer(line, names->data, names->n);
+    append_to_buffer(line, "=", 1);
+    append_to_buffer(line, names->data, names->n);
+    append_to_buffer(line, "\n", 1);
+    insert_into_buffer(output_buffer, start, line->data, line->n);
+    dealloc_buffer(line);
+  }
+  dealloc_buffer(names);
+  end_pass(outer);
+}
 
-    step = STEP_RELATE;
-    for (int a = 0; a < ls->n; a++)
-      process_node((AstNode *)get_from_list(ls, a));
+/*
+  Counts a read or assignment of a global for the functions being hoisted
+  An assignment keeps every enclosing function from aliasing the global, since their alias would capture it
+*/
+static void hoist_global(char *name)
+{
+  for (int a = 0; a < NUM_LIBRARY_GLOBALS; a++)
+  {
+    if (strcmp(name, library_globals[a]))
+      continue;
+    if (!assigning)
+      hoisting->uses[a] += hoisting->loops ? HOT_GLOBAL_USES : 1;
+    for (HoistState *state = hoisting; state && assigning; state = state->parent)
+      state->assigned[a] = 1;
+    return;
+  }
+}
 
-    step = STEP_CHECK;
-    for (int a = 0; a < ls->n; a++)
-      process_node((AstNode *)get_from_list(ls, a));
-    quell_expired_scope_equivalences(get_num_scopes());
+/*
+  Checks and writes the statements of a loop body
+*/
+static void process_loop_body(List *body)
+{
+  if (hoisting)
+    hoisting->loops++;
+  process_node_list(body);
+  if (hoisting)
+    hoisting->loops--;
+}
+
+/*
+  Returns 1 if a field chain only reads data fields of class instances, starting from a local, a global or this
+  Every object in the chain must be statically typed as a class
+*/
+static int is_typed_chain(AstNode *node)
+{
+  AstNode *type = get_type(node);
+  if (type->type != AST_TYPE_BASIC || !class_exists((char *)(type->data)))
+    return 0;
+  if (node->type == AST_ID)
+    return get_binding(node) != BINDING_FIELD;
+  if (node->type != AST_FIELD || !is_typed_chain(((StringAstNode *)(node->data))->node))
+    return 0;
+  FieldNode *field = get_field_node(node);
+  return field && field->node->type == AST_DEFINE;
+}
+
+/*
+  Returns 1 if two field chains read the same fields starting from the same name
+*/
+static int same_chain(AstNode *l, AstNode *r)
+{
+  if (l->type != r->type)
+    return 0;
+  if (l->type == AST_ID)
+    return !strcmp((char *)(l->data), (char *)(r->data));
+  StringAstNode *ldata = (StringAstNode *)(l->data);
+  StringAstNode *rdata = (StringAstNode *)(r->data);
+  return !strcmp(ldata->text, rdata->text) && same_chain(ldata->node, rdata->node);
+}
+
+/*
+  Returns 1 if a chain starts from the name, or reads a field called name when field is 1
+*/
+static int chain_uses_name(AstNode *node, char *name, int field)
+{
+  if (node->type == AST_ID)
+    return !field && !strcmp((char *)(node->data), name);
+  StringAstNode *data = (StringAstNode *)(node->data);
+  return (field && !strcmp(data->text, name)) || chain_uses_name(data->node, name, field);
+}
+
+/*
+  Returns 1 if an expression only reads values, locals, globals and fields, so it can't run code that changes a chain
+*/
+static int is_plain_expression(AstNode *node)
+{
+  switch (node->type)
+  {
+  case AST_PRIMITIVE:
+  case AST_ID:
+    return 1;
+  case AST_PAREN:
+    return is_plain_expression((AstNode *)(node->data));
+  case AST_UNARY:
+    return is_plain_expression(((BinaryNode *)(node->data))->l);
+  case AST_BINARY:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    return is_plain_expression(data->l) && (!strcmp(data->text, "as") || is_plain_expression(data->r));
   }
-  if (step == STEP_OUTPUT)
+  case AST_FIELD:
+    return is_plain_expression(((StringAstNode *)(node->data))->node);
+  case AST_SUB:
+    return is_plain_expression(((AstAstNode *)(node->data))->l) && is_plain_expression(((AstAstNode *)(node->data))->r);
+  case AST_TUPLE:
+  case AST_LTUPLE:
   {
+    List *ls = ((AstListNode *)(node->data))->list;
     for (int a = 0; a < ls->n; a++)
     {
-      AstNode *e = (AstNode *)get_from_list(ls, a);
-      process_node(e);
-      conditional_newline(e);
+      if (!is_plain_expression((AstNode *)get_from_list(ls, a)))
+        return 0;
     }
+    return 1;
+  }
+  default:
+    return 0;
   }
 }
 
 /*
-  Switch for calling a specific traversal method by AstNode type
+  Returns 1 if a statement is an assignment, definition or return of plain expressions
 */
-void process_node(AstNode *node)
+static int is_plain_statement(AstNode *node)
 {
   switch (node->type)
   {
-  case AST_STMT:
-    process_node_list((List *)(node->data));
-    return;
-  case AST_LIST:
-    process_list_primitive_node(node);
-    return;
-  case AST_PRIMITIVE:
-    process_primitive(node);
-    return;
-  case AST_INTERFACE:
-    process_interface(node);
-    return;
-  case AST_FUNCTION:
-    process_function(node);
-    return;
-  case AST_TYPEDEF:
-    process_typedef(node);
-    return;
-  case AST_REQUIRE:
-    process_require(node);
-    return;
+  case AST_SET:
+    return is_plain_expression(((AstAstNode *)(node->data))->l) && is_plain_expression(((AstAstNode *)(node->data))->r);
   case AST_DEFINE:
-    process_define(node);
+    return !((BinaryNode *)(node->data))->r || is_plain_expression(((BinaryNode *)(node->data))->r);
+  case AST_RETURN:
+    return !node->data || is_plain_expression((AstNode *)(node->data));
+  default:
+    return 0;
+  }
+}
+
+/*
+  Returns 1 if assigning to a target could change what one of the chains reads
+*/
+static int changes_chains(AstNode *target, List *uses)
+{
+  if (target->type == AST_LTUPLE)
+  {
+    List *ls = ((AstListNode *)(target->data))->list;
+    for (int a = 0; a < ls->n; a++)
+    {
+      if (changes_chains((AstNode *)get_from_list(ls, a), uses))
+        return 1;
+    }
+    return 0;
+  }
+  if (target->type != AST_ID && target->type != AST_FIELD)
+    return uses->n > 0;
+  int field = target->type == AST_FIELD;
+  char *name = field ? ((StringAstNode *)(target->data))->text : (char *)(target->data);
+  for (int a = 0; a < uses->n; a++)
+  {
+    if (chain_uses_name(((ChainUse *)get_from_list(uses, a))->chain, name, field))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Counts the fields an expression reads from typed field chains
+*/
+static void count_chain_uses(AstNode *node, List *uses)
+{
+  switch (node->type)
+  {
+  case AST_PAREN:
+    count_chain_uses((AstNode *)(node->data), uses);
+    break;
+  case AST_UNARY:
+    count_chain_uses(((BinaryNode *)(node->data))->l, uses);
+    break;
+  case AST_BINARY:
+  {
+    // The right side of and/or might not run, so its chains can't be read ahead of the statement
+    BinaryNode *data = (BinaryNode *)(node->data);
+    count_chain_uses(data->l, uses);
+    if (strcmp(data->text, "as") && strcmp(data->text, "and") && strcmp(data->text, "or"))
+      count_chain_uses(data->r, uses);
+    break;
+  }
+  case AST_SUB:
+    count_chain_uses(((AstAstNode *)(node->data))->l, uses);
+    count_chain_uses(((AstAstNode *)(node->data))->r, uses);
+    break;
+  case AST_TUPLE:
+  case AST_LTUPLE:
+  {
+    List *ls = ((AstListNode *)(node->data))->list;
+    for (int a = 0; a < ls->n; a++)
+      count_chain_uses((AstNode *)get_from_list(ls, a), uses);
+    break;
+  }
+  case AST_FIELD:
+  {
+    AstNode *chain = ((StringAstNode *)(node->data))->node;
+    count_chain_uses(chain, uses);
+    if (chain->type != AST_FIELD || !is_typed_chain(chain))
+      break;
+    for (int a = 0; a < uses->n; a++)
+    {
+      ChainUse *use = (ChainUse *)get_from_list(uses, a);
+      if (same_chain(use->chain, chain))
+      {
+        use->uses++;
+        return;
+      }
+    }
+    ChainUse *use = (ChainUse *)malloc(sizeof(ChainUse));
+    use->chain = chain;
+    use->uses = 1;
+    use->depth = 0;
+    for (AstNode *e = chain; e->type == AST_FIELD; e = ((StringAstNode *)(e->data))->node)
+      use->depth++;
+    add_to_list(uses, use);
+    break;
+  }
+  }
+}
+
+/*
+  Counts the fields that statements from start to end read from typed field chains
+*/
+static List *count_statement_chain_uses(List *ls, int start, int end)
+{
+  List *uses = new_default_list();
+  for (int a = start; a < end; a++)
+  {
+    AstNode *e = (AstNode *)get_from_list(ls, a);
+    if (e->type == AST_SET)
+    {
+      count_chain_uses(((AstAstNode *)(e->data))->l, uses);
+      count_chain_uses(((AstAstNode *)(e->data))->r, uses);
+    }
+    else if (e->type == AST_DEFINE && ((BinaryNode *)(e->data))->r)
+      count_chain_uses(((BinaryNode *)(e->data))->r, uses);
+    else if (e->type == AST_RETURN && e->data)
+      count_chain_uses((AstNode *)(e->data), uses);
+  }
+  return uses;
+}
+
+/*
+  Deallocates a list of ChainUses
+*/
+static void dealloc_chain_uses(List *uses)
+{
+  for (int a = 0; a < uses->n; a++)
+    free(get_from_list(uses, a));
+  dealloc_list(uses);
+}
+
+/*
+  Returns the name of the local that caches a field chain
+*/
+static char *get_chain_name(AstNode *node)
+{
+  Buffer *b = new_default_buffer();
+  List *names = new_default_list();
+  for (; node->type == AST_FIELD; node = ((StringAstNode *)(node->data))->node)
+    add_to_list(names, ((StringAstNode *)(node->data))->text);
+  append_string_to_buffer(b, "__");
+  append_string_to_buffer(b, (char *)(node->data));
+  for (int a = names->n - 1; a >= 0; a--)
+  {
+    append_string_to_buffer(b, "_");
+    append_string_to_buffer(b, (char *)get_from_list(names, a));
+  }
+  char *name = copy_buffer(b);
+  dealloc_list(names);
+  dealloc_buffer(b);
+  return name;
+}
+
+/*
+  Caches the typed field chains that a run of statements from start reads fields from more than once
+  The run ends before the first statement that isn't a plain assignment, definition or return, or that assigns to a chain
+  declared holds the names of the caches the block already declared, which are reused
+  Returns the index of the statement after the run
+*/
+static int cache_chains(List *ls, int start, List *declared)
+{
+  int outer = begin_pass(PASS_CSE);
+  int end = start;
+  while (end < ls->n && is_plain_statement((AstNode *)get_from_list(ls, end)))
+    end++;
+  List *uses = count_statement_chain_uses(ls, start, end);
+  ScratchMark mark = scratch_mark();
+  for (int a = start; a < end; a++)
+  {
+    AstNode *e = (AstNode *)get_from_list(ls, a);
+    AstNode *target = e->type == AST_SET ? ((AstAstNode *)(e->data))->l : NULL;
+    if (e->type == AST_DEFINE)
+      target = new_scratch_node(AST_ID, -1, ((BinaryNode *)(e->data))->text);
+    if (target && changes_chains(target, uses))
+      end = a;
+  }
+  scratch_release(mark);
+  dealloc_chain_uses(uses);
+  uses = count_statement_chain_uses(ls, start, end);
+  int depth = 1;
+  for (int written = 0; written < uses->n; depth++)
+  {
+    for (int a = 0; a < uses->n; a++)
+    {
+      ChainUse *use = (ChainUse *)get_from_list(uses, a);
+      if (use->depth != depth)
+        continue;
+      written++;
+      if (use->uses < 2)
+        continue;
+      char *name = get_chain_name(use->chain);
+      int found = 0;
+      for (int b = 0; b < declared->n && !found; b++)
+        found = !strcmp((char *)get_from_list(declared, b), name);
+      write(found ? "%s=" : "local %s=", name);
+      process_node(use->chain);
+      write("\n");
+      if (found)
+        free(name);
+      else
+        add_to_list(declared, name);
+      add_to_list(cached_chains, use->chain);
+    }
+  }
+  dealloc_chain_uses(uses);
+  end_pass(outer);
+  return end > start ? end : start + 1;
+}
+
+/*
+  Returns 1 if a block has a label, which a goto could jump to past the caches the block declares
+*/
+static int has_label(List *ls)
+{
+  for (int a = 0; a < ls->n; a++)
+  {
+    if (((AstNode *)get_from_list(ls, a))->type == AST_LABEL)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if a field chain is read from a local cache
+*/
+static int is_cached_chain(AstNode *node)
+{
+  for (int a = 0; a < cached_chains->n; a++)
+  {
+    if (same_chain((AstNode *)get_from_list(cached_chains, a), node))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Checks and writes the statements of a block, leaving out the ones that can't run
+  Nothing after a return can run, and nothing after a break or goto can until the next label
+  Statements after a return are always left out, since Lua won't compile them
+*/
+static void process_block(List *ls)
+{
+  int dead = -1; // Where the unreachable statements start in the output
+  int returned = 0;
+  List *outer = block;
+  int outer_at = block_at;
+  int num_scalars = scalars->n;
+  int cached_until = 0;   // Index of the first statement after the run whose chains are cached
+  List *declared = NULL;  // Names of the chain caches declared in this block
+  block = ls;
+  if (pass_enabled(PASS_CSE) && !has_label(ls))
+    declared = new_default_list();
+  for (int a = 0; a < ls->n; a++)
+  {
+    block_at = a;
+    if (declared && a >= cached_until)
+    {
+      while (cached_chains->n)
+        remove_from_list(cached_chains, cached_chains->n - 1);
+      cached_until = cache_chains(ls, a, declared);
+    }
+    AstNode *e = (AstNode *)get_from_list(ls, a);
+    if (dead >= 0 && !returned && e->type == AST_LABEL)
+    {
+      eliminate_output(dead);
+      dead = -1;
+    }
+    statement = e;
+    process_node(e);
+    conditional_newline(e);
+    if (dead < 0 && ends_block(e) && (e->type == AST_RETURN || pass_enabled(PASS_ELIMINATE)))
+    {
+      dead = output_buffer->n;
+      returned = e->type == AST_RETURN;
+    }
+  }
+  if (dead >= 0)
+    eliminate_output(dead);
+  while (scalars->n > num_scalars)
+    remove_from_list(scalars, scalars->n - 1);
+  if (declared)
+  {
+    while (cached_chains->n)
+      remove_from_list(cached_chains, cached_chains->n - 1);
+    for (int a = 0; a < declared->n; a++)
+      free(get_from_list(declared, a));
+    dealloc_list(declared);
+  }
+  block = outer;
+  block_at = outer_at;
+}
+
+/*
+  Returns the name a method or constructor has as part of its local function's name
+*/
+static char *direct_name(FunctionNode *fdata)
+{
+  return fdata->is_constructor ? "constructor" : (char *)(fdata->name->data);
+}
+
+/*
+  Forward declares a local function for the methods of top-level classes
+  Methods that a subclass's super call reaches get one, so the call doesn't repeat their body
+  Calls that can only reach one method are also compiled to call its local function directly
+*/
+static int declare_direct_methods()
+{
+  int n = 0;
+  List *classes = get_scope()->classes_registry;
+  for (int a = 0; a < classes->n; a++)
+  {
+    ClassNode *clas = (ClassNode *)get_from_list(classes, a);
+    ClassNode *parent = class_exists(clas->parent);
+    for (int b = 0; b < clas->ls->n && parent; b++)
+    {
+      AstNode *child = (AstNode *)get_from_list(clas->ls, b);
+      if (child->type != AST_FUNCTION || !((FunctionNode *)(child->data))->calls_super)
+        continue;
+      FunctionNode *method = get_parent_method(parent, (FunctionNode *)(child->data));
+      if (method)
+        method->direct = 1;
+    }
+  }
+  for (int a = 0; a < classes->n; a++)
+  {
+    ClassNode *clas = (ClassNode *)get_from_list(classes, a);
+    for (int b = 0; b < clas->ls->n; b++)
+    {
+      AstNode *child = (AstNode *)get_from_list(clas->ls, b);
+      FunctionNode *fdata = (FunctionNode *)(child->data);
+      if (child->type != AST_FUNCTION)
+        continue;
+      if ((options & OPTION_DEVIRTUALIZE) && !fdata->is_constructor)
+        fdata->direct = 1;
+      if (fdata->direct && n >= MAX_CHUNK_LOCALS)
+        fdata->direct = 0;
+      if (!fdata->direct)
+        continue;
+      write(n++ ? "," : "local ");
+      write("%s__%s", clas->name, direct_name(fdata));
+    }
+  }
+  if (n)
+    write("\n");
+  return n;
+}
+
+/*
+  Returns 1 if a name has to stay global when hoisting
+  That's a library global or a name read before it's defined, since either could already hold a value
+*/
+static int keeps_global(ChunkScan *scan, char *name)
+{
+  for (int a = 0; a < NUM_LIBRARY_GLOBALS; a++)
+  {
+    if (!strcmp(name, library_globals[a]))
+      return 1;
+  }
+  for (int a = 0; a < scan->globals->n; a++)
+  {
+    if (!strcmp(name, (char *)get_from_list(scan->globals, a)))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Forward declares a file's top-level classes and functions as locals when hoisting
+  scan holds what the top-level statements define, and n locals are already declared
+  The file's own top-level locals count against the budget too, and names past it stay global
+*/
+static void declare_chunk_locals(ChunkScan *scan, int n)
+{
+  int declared = 0;
+  n += scan->locals;
+  List *classes = get_scope()->classes_registry;
+  List *functions = scan->functions;
+  for (int a = 0; a < classes->n + functions->n && n < MAX_CHUNK_LOCALS; a++)
+  {
+    char *name;
+    if (a < classes->n)
+      name = ((ClassNode *)get_from_list(classes, a))->name;
+    else
+    {
+      name = (char *)get_from_list(functions, a - classes->n);
+      int b = 0;
+      while (b < a - classes->n && strcmp(name, (char *)get_from_list(functions, b)))
+        b++;
+      if (b < a - classes->n || class_exists(name))
+        continue;
+    }
+    if (keeps_global(scan, name))
+      continue;
+    write(declared++ ? ",%s" : "local %s", name);
+    n++;
+  }
+  if (declared)
+    write("\n");
+}
+
+/*
+  Returns 1 if a top-level function is defined more than once
+*/
+static int is_redefined(char *name)
+{
+  for (int a = 0; a < redefined->n; a++)
+  {
+    if (!strcmp((char *)get_from_list(redefined, a), name))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Finds the top-level functions that are defined more than once
+  Calls can reach either body depending on when they run, so neither can be inlined
+*/
+static void find_redefinitions(List *functions)
+{
+  for (int a = 0; a < functions->n; a++)
+  {
+    char *name = (char *)get_from_list(functions, a);
+    int b = 0;
+    while (b < a && strcmp(name, (char *)get_from_list(functions, b)))
+      b++;
+    if (b < a && !is_redefined(name))
+      add_to_list(redefined, name);
+  }
+}
+
+/*
+  Registers the types from a file's top-level declarations
+  Used when the rest of the file is streamed in one statement at a time
+  scan holds what the file's top-level statements define
+*/
+void traverse_declarations(List *ls, ChunkScan *scan)
+{
+  step = STEP_TYPEDEF;
+  for (int a = 0; a < ls->n; a++)
+    process_node((AstNode *)get_from_list(ls, a));
+
+  step = STEP_RELATE;
+  for (int a = 0; a < ls->n; a++)
+    process_node((AstNode *)get_from_list(ls, a));
+
+  step = STEP_CHECK;
+  find_redefinitions(scan->functions);
+  int n = declare_direct_methods();
+  if (pass_enabled(PASS_HOIST))
+    declare_chunk_locals(scan, n);
+}
+
+/*
+  Checks a single top-level statement and buffers its Lua code
+*/
+void traverse_statement(AstNode *node)
+{
+  int start = output_buffer->n;
+  step = STEP_CHECK;
+  statement = node;
+  process_node(node);
+  conditional_newline(node);
+  if (unreachable)
+    eliminate_output(start);
+  unreachable |= node->type == AST_RETURN;
+}
+
+/*
+  Expires the type equivalences declared by a streamed file
+*/
+void end_traverse_stream()
+{
+  quell_expired_scope_equivalences(get_num_scopes());
+}
+
+/*
+  Canonical traversal method structure:
+  if step==STEP_TYPEDEF
+    do your typedef step
+  else if step==STEP_RELATE
+    do your relate step
+  else
+    push scope
+    do your check step and write Lua code
+    pop scope
+  end
+*/
+
+/*
+  Process a list of AstNodes
+  Usually called once for each scope
+*/
+void process_node_list(List *ls)
+{
+  if (step == STEP_CHECK)
+  {
+    // We need to load up scoped types before we can check this scope
+    step = STEP_TYPEDEF;
+    for (int a = 0; a < ls->n; a++)
+      process_node((AstNode *)get_from_list(ls, a));
+
+    step = STEP_RELATE;
+    for (int a = 0; a < ls->n; a++)
+      process_node((AstNode *)get_from_list(ls, a));
+
+    step = STEP_CHECK;
+    process_block(ls);
+    quell_expired_scope_equivalences(get_num_scopes());
+  }
+}
+
+/*
+  Switch for calling a specific traversal method by AstNode type
+*/
+void process_node(AstNode *node)
+{
+  switch (node->type)
+  {
+  case AST_STMT:
+    process_node_list((List *)(node->data));
+    return;
+  case AST_LIST:
+    process_list_primitive_node(node);
+    return;
+  case AST_PRIMITIVE:
+    process_primitive(node);
+    return;
+  case AST_INTERFACE:
+    process_interface(node);
+    return;
+  case AST_FUNCTION:
+    process_function(node);
+    return;
+  case AST_TYPEDEF:
+    process_typedef(node);
+    return;
+  case AST_REQUIRE:
+    process_require(node);
+    return;
+  case AST_DEFINE:
+    process_define(node);
     return;
   case AST_REPEAT:
     process_repeat(node);
@@ -342,21 +1331,182 @@ void process_interface(AstNode *node)
     }
   }
 }
-void process_class(AstNode *node)
+
+/*
+  Writes the shared method table of a class unless it's already been written
+  A child class can be declared before its parent, so the parent's table may be written early
+*/
+static void declare_method_table(ClassNode *data)
 {
-  ClassNode *data = (ClassNode *)(node->data);
-  if (step == STEP_TYPEDEF)
+  if (!data->declared)
   {
-    ERROR(type_exists(data->name), node->line, "type %s is already declared", data->name);
-    register_type(data->name);
-    register_class(data);
+    write("__%s={}\n", data->name);
+    write("__%s.__index=__%s\n", data->name, data->name);
+    data->declared = 1;
   }
-  else if (step == STEP_RELATE)
-  {
-    if (data->parent)
-    {
+}
+
+/*
+  Writes how an instance's field is indexed, following the instance itself
+  field is the FieldNode from the instance's class layout, or NULL if its class isn't known
+*/
+static void write_field_key(FieldNode *field, char *name)
+{
+  if ((options & OPTION_SLOTS) && field && field->slot >= 0 && field->node->type == AST_DEFINE)
+    write("[%i]", field->slot + 1);
+  else
+    write(".%s", name);
+}
+
+/*
+  Writes the rest of a closure that forwards a method call to the local function declared for it
+  owner is the class that declares the method
+*/
+static void write_direct_delegate(ClassNode *owner, FunctionNode *fdata)
+{
+  List *args = fdata->args;
+  for (int a = 0; args && a < args->n; a++)
+  {
+    if (a)
+      write(",");
+    write("%s", ((StringAstNode *)get_from_list(args, a))->text);
+  }
+  write(")\n");
+  indent(1);
+  write("return %s__%s(%s", owner->name, (char *)(fdata->name->data), instance_str);
+  for (int a = 0; args && a < args->n; a++)
+    write(",%s", ((StringAstNode *)get_from_list(args, a))->text);
+  write(")\n");
+  indent(-1);
+  write("end\n");
+}
+
+/*
+  Returns the class whose local function a method call can be compiled to
+  Returns NULL if the call has to be dispatched through the instance
+*/
+static ClassNode *get_direct_class(AstNode *node, FieldNode *field)
+{
+  FunctionNode *method = (FunctionNode *)(field->node->data);
+  if (!method->direct)
+    return NULL;
+  AstNode *type = get_type(((StringAstNode *)(node->data))->node);
+  ClassNode *clas = class_exists((char *)(type->data));
+  if (!clas || (!method->is_final && !clas->is_final && clas->children))
+    return NULL;
+  if (!method->is_final && !clas->is_final)
+    clas->assumed_leaf = 1;
+  return get_declaring_class(clas, field->node);
+}
+
+/*
+  Returns 1 if a field initializer might read the instance that's being constructed
+  Anything other than values, operators, lookups and calls is assumed to
+*/
+static int reads_instance(AstNode *node)
+{
+  if (!node)
+    return 0;
+  switch (node->type)
+  {
+  case AST_PRIMITIVE:
+    return 0;
+  case AST_ID:
+  {
+    int binding = get_binding(node);
+    return binding == BINDING_FIELD || binding == BINDING_THIS;
+  }
+  case AST_PAREN:
+  case AST_LIST:
+    return reads_instance((AstNode *)(node->data));
+  case AST_FIELD:
+    return reads_instance(((StringAstNode *)(node->data))->node);
+  case AST_UNARY:
+    return reads_instance(((BinaryNode *)(node->data))->l);
+  case AST_BINARY:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    return reads_instance(data->l) || (strcmp(data->text, "as") && reads_instance(data->r));
+  }
+  case AST_CALL:
+  case AST_SUB:
+  {
+    AstAstNode *data = (AstAstNode *)(node->data);
+    return reads_instance(data->l) || reads_instance(data->r);
+  }
+  case AST_TUPLE:
+  {
+    List *ls = ((AstListNode *)(node->data))->list;
+    for (int a = 0; a < ls->n; a++)
+    {
+      if (reads_instance((AstNode *)get_from_list(ls, a)))
+        return 1;
+    }
+    return 0;
+  }
+  case AST_TABLE:
+  {
+    List *vals = ((TableNode *)(node->data))->vals;
+    for (int a = 0; a < vals->n; a++)
+    {
+      if (reads_instance((AstNode *)get_from_list(vals, a)))
+        return 1;
+    }
+    return 0;
+  }
+  default:
+    return 1;
+  }
+}
+
+/*
+  Writes a method's parameters and body, following its opening parenthesis
+  Methods in shared method tables already wrote the instance as their first parameter
+*/
+static void process_method(FunctionNode *fdata, int has_instance)
+{
+  push_function_scope(fdata);
+  if (fdata->args)
+  {
+    for (int a = 0; a < fdata->args->n; a++)
+    {
+      if (a || has_instance)
+        write(",");
+      write("%s", ((StringAstNode *)get_from_list(fdata->args, a))->text);
+    }
+  }
+  write(")\n");
+  indent(1);
+  HoistState state;
+  int start = output_buffer->n;
+  if (pass_enabled(PASS_HOIST))
+    begin_hoisting(&state);
+  process_node_list(fdata->body);
+  if (pass_enabled(PASS_HOIST))
+    end_hoisting(&state, start);
+  indent(-1);
+  write("end\n");
+  pop_scope();
+}
+void process_class(AstNode *node)
+{
+  ClassNode *data = (ClassNode *)(node->data);
+  if (step == STEP_TYPEDEF)
+  {
+    ERROR(type_exists(data->name), node->line, "type %s is already declared", data->name);
+    register_type(data->name);
+    register_class(data);
+  }
+  else if (step == STEP_RELATE)
+  {
+    if (data->parent)
+    {
       ERROR(!class_exists(data->parent), node->line, "parent class %s does not exist", data->parent);
       ERROR(!add_child_type(data->name, data->parent, RL_EXTENDS), node->line, "co-dependent class %s detected", data->name);
+      ClassNode *parent = class_exists(data->parent);
+      ERROR(parent->is_final, node->line, "class %s cannot extend final class %s", data->name, parent->name);
+      ERROR(parent->assumed_leaf, node->line, "class %s cannot extend %s after its method calls were compiled as direct calls", data->name, parent->name);
+      parent->children++;
     }
     for (int a = 0; a < data->interfaces->n; a++)
     {
@@ -367,30 +1517,59 @@ void process_class(AstNode *node)
   }
   else
   {
-    push_class_scope(data);
-    if (step == STEP_CHECK)
-    {
+    Map *fields = get_class_layout(data);
 
-      // Check constructors
-      int num_cons = num_constructors(data);
-      ERROR(num_cons > 1, node->line, "class %s has %i constructors, should have only 1", data->name, num_cons);
+    // Check constructors
+    int num_cons = num_constructors(data);
+    ERROR(num_cons > 1, node->line, "class %s has %i constructors, should have only 1", data->name, num_cons);
 
-      // Check unimplemented methods
-      List *missing = get_missing_class_methods(data);
-      if (missing->n)
+    // Check unimplemented methods
+    List *missing = get_missing_class_methods(data);
+    if (missing->n)
+    {
+      for (int a = 0; a < missing->n; a++)
       {
-        for (int a = 0; a < missing->n; a++)
-        {
-          FunctionNode *f = (FunctionNode *)get_from_list(missing, a);
-          add_error(node->line, "Class %s does not implement method %s", data->name, (char *)(f->name->data));
-        }
+        FunctionNode *f = (FunctionNode *)get_from_list(missing, a);
+        add_error(node->line, "Class %s does not implement method %s", data->name, (char *)(f->name->data));
       }
-      dealloc_list(missing);
     }
-    List *all_fields = get_all_class_fields(data);
-    Map *fields = collapse_ancestor_class_fields(all_fields);
-    dealloc_list(all_fields);
-    ERROR(step == STEP_CHECK && !fields, node->line, "class %s has colliding names", data->name);
+    dealloc_list(missing);
+    ERROR(data->colliding, node->line, "class %s has colliding names", data->name);
+
+    // Classes in function bodies aren't related, so count them as children here
+    ClassNode *parent = class_exists(data->parent);
+    if (parent && class_exists(data->name) != data)
+    {
+      ERROR(parent->is_final, node->line, "class %s cannot extend final class %s", data->name, parent->name);
+      ERROR(parent->assumed_leaf, node->line, "class %s cannot extend %s after its method calls were compiled as direct calls", data->name, parent->name);
+      parent->children++;
+    }
+
+    // Check overridden final methods
+    Map *inherited = parent ? get_class_layout(parent) : NULL;
+    for (int a = 0; inherited && a < data->ls->n; a++)
+    {
+      AstNode *child = (AstNode *)get_from_list(data->ls, a);
+      if (child->type != AST_FUNCTION || ((FunctionNode *)(child->data))->is_constructor)
+        continue;
+      char *funcname = (char *)(((FunctionNode *)(child->data))->name->data);
+      FieldNode *field = (FieldNode *)get_from_map(inherited, funcname);
+      if (field && field->node->type == AST_FUNCTION && ((FunctionNode *)(field->node->data))->is_final)
+        add_error(child->line, "method %s in class %s overrides a final method", funcname, data->name);
+    }
+
+    // Output shared method table
+    if (options & OPTION_METATABLES)
+    {
+      if (data->parent)
+        declare_method_table(class_exists(data->parent));
+      declare_method_table(data);
+      if (data->parent)
+        write("setmetatable(__%s,__%s)\n", data->name, data->parent);
+    }
+
+    // Output class constructor
+    push_class_scope(data);
     write("function %s(", data->name);
     FunctionNode *fdata = get_constructor(data);
     if (fdata)
@@ -405,157 +1584,867 @@ void process_class(AstNode *node)
     }
     write(")\n");
     indent(1);
-    write("local %s={}\n", instance_str);
-    if (fields)
+
+    // Build the instance with a single table constructor so Lua sizes it once
+    // Fields from the first initializer that reads the instance onwards are reserved and then assigned in order
+    // Array slots are written positionally, so a field whose slot is out of order is deferred too
+    int deferred = fields->n;
+    int num_entries = 0;
+    write("local %s=", instance_str);
+    if (options & OPTION_METATABLES)
+      write("setmetatable(");
+    write("{");
+    for (int a = 0; a < fields->n; a++)
     {
-      for (int a = 0; a < fields->n; a++)
+      FieldNode *field = (FieldNode *)iterate_from_map(fields, a);
+      if (field->node->type == AST_DEFINE)
       {
-        AstNode *child = (AstNode *)iterate_from_map(fields, a);
-        if (child->type == AST_DEFINE)
+        BinaryNode *cdata = (BinaryNode *)(field->node->data);
+        if (a < deferred)
         {
-          BinaryNode *cdata = (BinaryNode *)(child->data);
           add_scoped_var(new_string_ast_node(cdata->text, cdata->l));
-          if (cdata->r)
-          {
-            write("%s.%s=", instance_str, cdata->text);
-            process_node(cdata->r);
-          }
-          else
-          {
-            write("%s.%s=nil", instance_str, cdata->text);
-          }
+          if (reads_instance(cdata->r) || ((options & OPTION_SLOTS) && field->slot != num_entries))
+            deferred = a;
+        }
+        if ((options & OPTION_SLOTS) && a >= deferred)
+          continue;
+        if (num_entries++)
+          write(",");
+        if (!(options & OPTION_SLOTS))
+          write("%s=", cdata->text);
+        if (a < deferred && cdata->r)
+          process_node(cdata->r);
+        else
+          write("nil");
+      }
+    }
+    while ((options & OPTION_SLOTS) && num_entries < data->slots)
+      write(num_entries++ ? ",nil" : "nil");
+    write("}");
+    if (options & OPTION_METATABLES)
+      write(",__%s)", data->name);
+    write("\n");
+    for (int a = deferred; a < fields->n; a++)
+    {
+      FieldNode *field = (FieldNode *)iterate_from_map(fields, a);
+      if (field->node->type == AST_DEFINE)
+      {
+        BinaryNode *cdata = (BinaryNode *)(field->node->data);
+        if (a > deferred)
+          add_scoped_var(new_string_ast_node(cdata->text, cdata->l));
+        if (cdata->r)
+        {
+          write("%s", instance_str);
+          write_field_key(field, cdata->text);
+          write("=");
+          process_node(cdata->r);
           write("\n");
         }
       }
     }
-    if (fdata)
+    if (fdata && fdata->direct)
+    {
+      write("%s__constructor(%s", data->name, instance_str);
+      for (int a = 0; a < fdata->args->n; a++)
+        write(",%s", ((StringAstNode *)get_from_list(fdata->args, a))->text);
+      write(")\n");
+    }
+    else if (fdata)
     {
       push_function_scope(fdata);
       process_node_list(fdata->body);
       pop_scope();
     }
-    if (fields)
+    for (int a = 0; a < fields->n && !(options & OPTION_METATABLES); a++)
     {
-      for (int a = 0; a < fields->n; a++)
+      FieldNode *field = (FieldNode *)iterate_from_map(fields, a);
+      AstNode *child = field->node;
+      if (field->slot < 0)
+        continue;
+      if (child->type == AST_FUNCTION)
       {
-        AstNode *child = (AstNode *)iterate_from_map(fields, a);
-        if (child->type == AST_FUNCTION)
+        fdata = (FunctionNode *)(child->data);
+        if (fdata->is_constructor)
+          continue;
+        write("%s.%s=function(", instance_str, (char *)(fdata->name->data));
+        if (fdata->direct && (options & OPTION_DEVIRTUALIZE))
+          write_direct_delegate(get_declaring_class(data, child), fdata);
+        else
+          process_method(fdata, 0);
+      }
+      else if (child->type != AST_DEFINE)
+      {
+        add_error(child->line, "invalid child node in class %s", data->name);
+        break;
+      }
+    }
+    write("return %s\n", instance_str);
+    indent(-1);
+    write("end\n");
+
+    // Output the class's own methods into its shared method table or as local functions
+    for (int a = 0; a < data->ls->n; a++)
+    {
+      AstNode *child = (AstNode *)get_from_list(data->ls, a);
+      if (child->type == AST_FUNCTION)
+      {
+        fdata = (FunctionNode *)(child->data);
+        char *funcname = direct_name(fdata);
+        if (fdata->direct)
         {
-          fdata = (FunctionNode *)(child->data);
-          if (fdata->is_constructor)
-            continue;
-          push_function_scope(fdata);
-          char *funcname = (char *)(fdata->name->data);
-          // add_scoped_var(new_string_ast_node(funcname,get_type(child)));
-          write("%s.%s=function(", instance_str, funcname);
-          if (fdata->args)
-          {
-            for (int a = 0; a < fdata->args->n; a++)
-            {
-              if (a)
-                write(",");
-              char *arg = ((StringAstNode *)get_from_list(fdata->args, a))->text;
-              write("%s", arg);
-            }
-          }
-          write(")\n");
-          indent(1);
-          process_node_list(fdata->body);
-          indent(-1);
-          write("end\n");
-          pop_scope();
+          write("function %s__%s(%s", data->name, funcname, instance_str);
+          process_method(fdata, 1);
+          if ((options & OPTION_METATABLES) && !fdata->is_constructor)
+            write("__%s.%s=%s__%s\n", data->name, funcname, data->name, funcname);
         }
-        else if (child->type != AST_DEFINE)
+        else if (!fdata->is_constructor && (options & OPTION_METATABLES))
         {
-          add_error(child->line, "invalid child node in class %s", data->name);
-          break;
+          write("function __%s.%s(%s", data->name, funcname, instance_str);
+          process_method(fdata, 1);
         }
       }
-      dealloc_map(fields);
+      else if (child->type != AST_DEFINE && (options & OPTION_METATABLES))
+      {
+        add_error(child->line, "invalid child node in class %s", data->name);
+        break;
+      }
+    }
+    data->defined = 1;
+
+    // Copy inherited methods so calls don't walk the __index chain
+    // Methods of ancestors declared further down are still reached through __index
+    for (int a = 0; a < fields->n && (options & OPTION_METATABLES) && (options & OPTION_FLATTEN); a++)
+    {
+      FieldNode *field = (FieldNode *)iterate_from_map(fields, a);
+      if (field->slot < 0 || field->node->type != AST_FUNCTION)
+        continue;
+      ClassNode *owner = get_declaring_class(data, field->node);
+      if (owner != data && owner->defined)
+      {
+        char *funcname = (char *)(((FunctionNode *)(field->node->data))->name->data);
+        write("__%s.%s=__%s.%s\n", data->name, funcname, owner->name, funcname);
+      }
+    }
+    pop_scope();
+  }
+}
+
+/*
+  Traverses through node groups
+*/
+void process_do(AstNode *node)
+{
+  if (step == STEP_CHECK)
+  {
+    push_scope();
+    write("do\n");
+    indent(1);
+    process_node_list((List *)(node->data));
+    indent(-1);
+    write("end\n");
+    pop_scope();
+  }
+}
+
+/*
+  Returns 1 if the provided arguments can be accepted by the function definition
+  target is whatever entity you want represented in any potential error messages
+  func is the AST_FUNCTION node you're calling
+  args_node is the AST_TUPLE node that represents your arguments
+*/
+static int validate_function_parameters(char *target, AstNode *func, AstNode *args_node)
+{
+  if (!func)
+  {
+    if (args_node)
+    {
+      List *args = ((AstListNode *)(args_node->data))->list;
+      return args->n == 0;
+    }
+    return 1;
+  }
+  AstNode *functype = get_type(func);
+  List *funcargs = functype->data ? ((AstListNode *)(functype->data))->list : NULL;
+  if (args_node)
+  {
+    List *args = ((AstListNode *)(args_node->data))->list;
+    if (!funcargs)
+    {
+      add_error(func->line, "too many arguments for %s", target);
+      return 0;
+    }
+    int max = funcargs->n;
+    if (is_variadic_function(funcargs))
+    {
+      if (args->n < funcargs->n - 1)
+      {
+        add_error(func->line, "not enough arguments for %s", target);
+        return 0;
+      }
+      max = funcargs->n - 1;
+    }
+    else if (args->n != funcargs->n)
+    {
+      add_error(func->line, "invalid number of arguments for %s", target);
+      return 0;
+    }
+    for (int a = 0; a < max; a++)
+    {
+      AstNode *type1 = get_type((AstNode *)get_from_list(args, a));
+      AstNode *type2 = (AstNode *)get_from_list(funcargs, a);
+      if (!typed_match(type2, type1))
+      {
+        add_error(func->line, "invalid argument provided for %s", target);
+        return 0;
+      }
+    }
+  }
+  else if (funcargs && funcargs->n && !(funcargs->n == 1 && is_variadic_function(funcargs)))
+  {
+    add_error(func->line, "not enough arguments for %s", target);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+  Checks the arguments of a call against the function it resolves to
+  Returns 1 if they're valid or the function isn't known at compile time
+*/
+static int validate_call(AstNode *node)
+{
+  AstAstNode *data = (AstAstNode *)(node->data);
+  char *name = NULL;
+  AstNode *functype = NULL;
+  AstNode *funcnode = NULL;
+  FunctionNode *func = NULL;
+  int valid = 1;
+  ScratchMark mark = scratch_mark();
+  if (data->l->type == AST_ID)
+  {
+    name = (char *)(data->l->data);
+    func = function_exists(name);
+    if (func)
+    {
+      funcnode = new_scratch_node(AST_FUNCTION, -1, func);
+      functype = get_type(funcnode);
+    }
+    else
+    {
+      ClassNode *clas = class_exists(name);
+      if (clas)
+      {
+        FunctionNode *constructor = get_constructor(clas);
+        if (constructor)
+        {
+          funcnode = new_scratch_node(AST_FUNCTION, -1, constructor);
+          functype = get_type(funcnode);
+        }
+        else
+        {
+          AstListNode *dummy = (AstListNode *)scratch_alloc(sizeof(AstListNode));
+          dummy->node = clas->type;
+          dummy->list = new_scratch_list(1);
+          functype = new_scratch_node(AST_TYPE_FUNC, -1, dummy);
+        }
+      }
+    }
+  }
+  else if (data->l->type == AST_FIELD)
+  {
+    name = ((StringAstNode *)(data->l->data))->text;
+    functype = get_type(data->l);
+  }
+  if (functype)
+  {
+    char *target = (char *)scratch_alloc(sizeof(char) * (strlen(name) + 10));
+    sprintf(target, "function %s", name);
+    valid = validate_function_parameters(target, funcnode, data->r);
+  }
+  scratch_release(mark);
+  return valid;
+}
+
+/*
+  Returns the index of a function's parameter, or -1 if it doesn't have one by that name
+*/
+static int get_parameter_index(FunctionNode *func, char *name)
+{
+  for (int a = 0; a < func->args->n; a++)
+  {
+    if (!strcmp(((StringAstNode *)get_from_list(func->args, a))->text, name))
+      return a;
+  }
+  return -1;
+}
+
+/*
+  Counts the nodes of an expression that could be written in place of a call to func
+  Adds how often each parameter is read to uses, and checks that other names still reach globals at the call site
+  Returns -1 if the expression has something that can't be inlined
+*/
+static int measure_inline(AstNode *node, FunctionNode *func, int *uses)
+{
+  int l = 0, r = 0;
+  switch (node->type)
+  {
+  case AST_PRIMITIVE:
+    return 1;
+  case AST_ID:
+  {
+    char *name = (char *)(node->data);
+    int a = get_parameter_index(func, name);
+    int binding;
+    if (a >= 0 && uses)
+      uses[a]++;
+    else if (a < 0 && uses && (!strncmp(name, "__", 2) || (resolve_scoped_var(name, &binding), binding != BINDING_GLOBAL)))
+      return -1;
+    return 1;
+  }
+  case AST_PAREN:
+    l = measure_inline((AstNode *)(node->data), func, uses);
+    break;
+  case AST_UNARY:
+    l = measure_inline(((BinaryNode *)(node->data))->l, func, uses);
+    break;
+  case AST_BINARY:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    l = measure_inline(data->l, func, uses);
+    r = strcmp(data->text, "as") ? measure_inline(data->r, func, uses) : 0;
+    break;
+  }
+  case AST_FIELD:
+    if (options & OPTION_SLOTS)
+      return -1;
+    l = measure_inline(((StringAstNode *)(node->data))->node, func, uses);
+    break;
+  case AST_SUB:
+    l = measure_inline(((AstAstNode *)(node->data))->l, func, uses);
+    r = measure_inline(((AstAstNode *)(node->data))->r, func, uses);
+    break;
+  default:
+    return -1;
+  }
+  return l < 0 || r < 0 ? -1 : l + r + 1;
+}
+
+/*
+  Marks a top-level function for inlining if its body only returns a small expression of its parameters
+*/
+static void check_inline(FunctionNode *data)
+{
+  if (!data->body || data->body->n != 1 || !data->type || is_redefined((char *)(data->name->data)))
+    return;
+  for (int a = 0; a < data->args->n; a++)
+  {
+    if (!strcmp(((StringAstNode *)get_from_list(data->args, a))->text, "..."))
+      return;
+  }
+  AstNode *ret = (AstNode *)get_from_list(data->body, 0);
+  if (ret->type != AST_RETURN || !ret->data)
+    return;
+  List *values = ((AstListNode *)(((AstNode *)(ret->data))->data))->list;
+  if (values->n != 1)
+    return;
+  AstNode *expr = (AstNode *)get_from_list(values, 0);
+  int outer = begin_pass(PASS_INLINE);
+  int size = measure_inline(expr, data, NULL);
+  end_pass(outer);
+  if (size > 0 && size <= MAX_INLINE_NODES)
+    data->inlined = expr;
+}
+
+/*
+  Returns the function a call can be inlined from, or NULL if it should stay a call
+*/
+static FunctionNode *get_inline_function(AstNode *node)
+{
+  AstAstNode *data = (AstAstNode *)(node->data);
+  if (!pass_enabled(PASS_INLINE) || inlining || data->l->type != AST_ID || get_binding(data->l) != BINDING_GLOBAL)
+    return NULL;
+  FunctionNode *func = function_exists((char *)(data->l->data));
+  if (!func || !func->inlined)
+    return NULL;
+  int outer = begin_pass(PASS_INLINE);
+  int *uses = (int *)calloc(func->args->n + 1, sizeof(int));
+  int size = measure_inline(func->inlined, func, uses);
+  free(uses);
+  end_pass(outer);
+  return size < 0 ? NULL : func;
+}
+
+/*
+  Returns 1 if an argument can be read without side effects
+  Atoms can be written any number of times, and operators over them at most once
+*/
+static int is_pure(AstNode *node, int atom)
+{
+  switch (node->type)
+  {
+  case AST_PRIMITIVE:
+    return 1;
+  case AST_ID:
+    return strcmp((char *)(node->data), "...") != 0;
+  case AST_PAREN:
+    return !atom && is_pure((AstNode *)(node->data), 0);
+  case AST_UNARY:
+    return !atom && is_pure(((BinaryNode *)(node->data))->l, 0);
+  case AST_BINARY:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    return !atom && is_pure(data->l, 0) && (!strcmp(data->text, "as") || is_pure(data->r, 0));
+  }
+  default:
+    return 0;
+  }
+}
+
+/*
+  Returns 1 if a call's arguments need to be bound to temps before the function's expression can use them
+  That's when an argument could have side effects, or isn't an atom and is read more than once
+*/
+static int needs_temps(AstNode *node, FunctionNode *func)
+{
+  AstAstNode *data = (AstAstNode *)(node->data);
+  List *args = data->r ? ((AstListNode *)(data->r->data))->list : NULL;
+  if ((args ? args->n : 0) != func->args->n)
+    return 1;
+  int outer = begin_pass(PASS_INLINE);
+  int *uses = (int *)calloc(func->args->n + 1, sizeof(int));
+  measure_inline(func->inlined, func, uses);
+  int temps = 0;
+  for (int a = 0; a < func->args->n && !temps; a++)
+    temps = !is_pure((AstNode *)get_from_list(args, a), uses[a] > 1);
+  free(uses);
+  end_pass(outer);
+  return temps;
+}
+
+/*
+  Writes the expression of an inlined function in place of a call
+  The arguments are written for each parameter, or the parameters read temps that were already bound
+*/
+static void write_inlined(AstNode *node, FunctionNode *func, int temps)
+{
+  AstAstNode *data = (AstAstNode *)(node->data);
+  inlining = func;
+  inline_args = temps || !data->r ? NULL : ((AstListNode *)(data->r->data))->list;
+  write("(");
+  process_node(func->inlined);
+  write(")");
+  inlining = NULL;
+}
+
+/*
+  Writes a parameter read by an inlined expression
+*/
+static void write_inline_argument(int a)
+{
+  FunctionNode *func = inlining;
+  List *args = inline_args;
+  if (!args)
+  {
+    write("__%s", ((StringAstNode *)get_from_list(func->args, a))->text);
+    return;
+  }
+  AstNode *arg = (AstNode *)get_from_list(args, a);
+  inlining = NULL;
+  if (is_pure(arg, 1))
+    process_node(arg);
+  else
+  {
+    write("(");
+    process_node(arg);
+    write(")");
+  }
+  inlining = func;
+  inline_args = args;
+}
+
+/*
+  Opens a block that binds a call's arguments to temps named after the parameters of an inlined function
+  The statement using the call is written next, followed by close_inline_temps
+*/
+static void write_inline_temps(AstNode *node, FunctionNode *func)
+{
+  AstAstNode *data = (AstAstNode *)(node->data);
+  validate_call(node);
+  write("do\n");
+  indent(1);
+  if (func->args->n)
+  {
+    for (int a = 0; a < func->args->n; a++)
+      write(a ? ",__%s" : "local __%s", ((StringAstNode *)get_from_list(func->args, a))->text);
+    write("=");
+    if (data->r)
+      process_node(data->r);
+    else
+      write("nil");
+    write("\n");
+  }
+}
+static void close_inline_temps()
+{
+  indent(-1);
+  write("end\n");
+}
+
+/*
+  Returns 1 if an expression could read the variable name
+  Anything other than simple operators, calls, fields and indexes is assumed to read it
+*/
+static int mentions(AstNode *node, char *name)
+{
+  switch (node->type)
+  {
+  case AST_PRIMITIVE:
+    return 0;
+  case AST_ID:
+    return !strcmp((char *)(node->data), name);
+  case AST_PAREN:
+    return mentions((AstNode *)(node->data), name);
+  case AST_UNARY:
+    return mentions(((BinaryNode *)(node->data))->l, name);
+  case AST_BINARY:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    return mentions(data->l, name) || (strcmp(data->text, "as") && mentions(data->r, name));
+  }
+  case AST_FIELD:
+    return mentions(((StringAstNode *)(node->data))->node, name);
+  case AST_SUB:
+  case AST_CALL:
+  {
+    AstAstNode *data = (AstAstNode *)(node->data);
+    return mentions(data->l, name) || (data->r && mentions(data->r, name));
+  }
+  case AST_TUPLE:
+  {
+    List *ls = ((AstListNode *)(node->data))->list;
+    for (int a = 0; a < ls->n; a++)
+    {
+      if (mentions((AstNode *)get_from_list(ls, a), name))
+        return 1;
+    }
+    return 0;
+  }
+  default:
+    return 1;
+  }
+}
+
+/*
+  Returns 1 if an expression could read one of the temps bound for the parameters of an inlined function
+*/
+static int mentions_temps(AstNode *node, FunctionNode *func)
+{
+  for (int a = 0; a < func->args->n; a++)
+  {
+    char *text = ((StringAstNode *)get_from_list(func->args, a))->text;
+    char *temp = (char *)malloc(strlen(text) + 3);
+    sprintf(temp, "__%s", text);
+    int found = mentions(node, temp);
+    free(temp);
+    if (found)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if a data field of the instance in name is read or assigned through node
+*/
+static int is_scalar_field(AstNode *node, char *name, Map *layout)
+{
+  StringAstNode *data = (StringAstNode *)(node->data);
+  if (data->node->type != AST_ID || strcmp((char *)(data->node->data), name))
+    return 0;
+  FieldNode *field = (FieldNode *)get_from_map(layout, data->text);
+  return field && field->node->type == AST_DEFINE;
+}
+
+/*
+  Returns 1 if code could use the instance in name other than through its data fields, or declare another name
+  With a constructor, code is its body, which can only read its parameters, globals, and fields through this
+*/
+static int instance_escapes(AstNode *node, char *name, Map *layout, FunctionNode *constructor)
+{
+  if (!node)
+    return 0;
+  switch (node->type)
+  {
+  case AST_NONE:
+  case AST_BREAK:
+  case AST_LABEL:
+  case AST_GOTO:
+  case AST_PRIMITIVE:
+  case AST_TYPE_ANY:
+  case AST_TYPE_VARARG:
+  case AST_TYPE_BASIC:
+  case AST_TYPE_TUPLE:
+  case AST_TYPE_FUNC:
+    return 0;
+  case AST_ID:
+  {
+    char *id = (char *)(node->data);
+    int binding;
+    if (!strcmp(id, name))
+      return 1;
+    if (!constructor || get_parameter_index(constructor, id) >= 0)
+      return 0;
+    resolve_scoped_var(id, &binding);
+    return binding != BINDING_GLOBAL || !strncmp(id, "__", 2) || get_from_map(layout, id);
+  }
+  case AST_FIELD:
+    if (is_scalar_field(node, name, layout))
+      return 0;
+    return instance_escapes(((StringAstNode *)(node->data))->node, name, layout, constructor);
+  case AST_PAREN:
+  case AST_LIST:
+  case AST_RETURN:
+    return instance_escapes((AstNode *)(node->data), name, layout, constructor);
+  case AST_UNARY:
+    return instance_escapes(((BinaryNode *)(node->data))->l, name, layout, constructor);
+  case AST_BINARY:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    return instance_escapes(data->l, name, layout, constructor) || (strcmp(data->text, "as") && instance_escapes(data->r, name, layout, constructor));
+  }
+  case AST_DEFINE:
+  {
+    BinaryNode *data = (BinaryNode *)(node->data);
+    return constructor || !strcmp(data->text, name) || instance_escapes(data->r, name, layout, constructor);
+  }
+  case AST_LOCAL:
+  {
+    StringAstNode *data = (StringAstNode *)(node->data);
+    return constructor || !strcmp(data->text, name) || instance_escapes(data->node, name, layout, constructor);
+  }
+  case AST_SET:
+  case AST_CALL:
+  case AST_SUB:
+  {
+    AstAstNode *data = (AstAstNode *)(node->data);
+    return instance_escapes(data->l, name, layout, constructor) || instance_escapes(data->r, name, layout, constructor);
+  }
+  case AST_TUPLE:
+  case AST_REPEAT:
+  case AST_WHILE:
+  case AST_LTUPLE:
+  {
+    AstListNode *data = (AstListNode *)(node->data);
+    if (instance_escapes(data->node, name, layout, constructor))
+      return 1;
+    node = new_scratch_node(AST_DO, -1, data->list);
+    return instance_escapes(node, name, layout, constructor);
+  }
+  case AST_DO:
+  case AST_ELSE:
+  {
+    List *ls = (List *)(node->data);
+    for (int a = 0; a < ls->n; a++)
+    {
+      if (instance_escapes((AstNode *)get_from_list(ls, a), name, layout, constructor))
+        return 1;
+    }
+    return 0;
+  }
+  case AST_TABLE:
+  {
+    List *ls = ((TableNode *)(node->data))->vals;
+    for (int a = 0; a < ls->n; a++)
+    {
+      if (instance_escapes((AstNode *)get_from_list(ls, a), name, layout, constructor))
+        return 1;
+    }
+    return 0;
+  }
+  case AST_IF:
+  case AST_ELSEIF:
+  {
+    IfNode *data = (IfNode *)(node->data);
+    return instance_escapes(data->expr, name, layout, constructor) || instance_escapes(data->next, name, layout, constructor) ||
+           instance_escapes(new_scratch_node(AST_DO, -1, data->body), name, layout, constructor);
+  }
+  case AST_FORNUM:
+  {
+    FornumNode *data = (FornumNode *)(node->data);
+    return constructor || !strcmp(data->name, name) || instance_escapes(data->num1, name, layout, constructor) ||
+           instance_escapes(data->num2, name, layout, constructor) || instance_escapes(data->num3, name, layout, constructor) ||
+           instance_escapes(new_scratch_node(AST_DO, -1, data->body), name, layout, constructor);
+  }
+  case AST_FORIN:
+  {
+    ForinNode *data = (ForinNode *)(node->data);
+    return constructor || instance_escapes(data->lhs, name, layout, constructor) || instance_escapes(data->tuple, name, layout, constructor) ||
+           instance_escapes(new_scratch_node(AST_DO, -1, data->body), name, layout, constructor);
+  }
+  case AST_FUNCTION:
+  {
+    FunctionNode *data = (FunctionNode *)(node->data);
+    if (constructor || get_parameter_index(data, name) >= 0 || instance_escapes(data->name, name, layout, constructor))
+      return 1;
+    return data->body && instance_escapes(new_scratch_node(AST_DO, -1, data->body), name, layout, constructor);
+  }
+  default:
+    return 1;
+  }
+}
+
+/*
+  Returns the class whose instance a local definition can replace with a local per data field, or NULL if it can't be
+  The instance has to be constructed by the definition and never escape the rest of its block
+  Its class has no parent, constant field initializers, and a constructor that only uses this for its data fields
+*/
+static ClassNode *get_scalar_class(AstNode *node)
+{
+  BinaryNode *data = (BinaryNode *)(node->data);
+  AstNode *call = data->r;
+  if (call && call->type == AST_TUPLE)
+  {
+    List *ls = ((AstListNode *)(call->data))->list;
+    call = ls->n == 1 ? (AstNode *)get_from_list(ls, 0) : NULL;
+  }
+  if (!pass_enabled(PASS_SCALARIZE) || !call || call->type != AST_CALL || get_num_scopes() <= 1 || !block || get_from_list(block, block_at) != node)
+    return NULL;
+  AstNode *callee = ((AstAstNode *)(call->data))->l;
+  if (callee->type != AST_ID || get_binding(callee) != BINDING_GLOBAL || function_exists((char *)(callee->data)))
+    return NULL;
+  ClassNode *clas = class_exists((char *)(callee->data));
+  if (!clas || clas->parent || !strncmp(data->text, "__", 2))
+    return NULL;
+  int outer = begin_pass(PASS_SCALARIZE);
+  ScratchMark mark = scratch_mark();
+  Map *layout = get_class_layout(clas);
+  int escapes = block == repeat_body && mentions(repeat_until, data->text);
+  for (int a = 0; a < layout->n && !escapes; a++)
+  {
+    FieldNode *field = (FieldNode *)iterate_from_map(layout, a);
+    AstNode *value = field->node->type == AST_DEFINE ? ((BinaryNode *)(field->node->data))->r : NULL;
+    if (value && value->type == AST_UNARY)
+      value = ((BinaryNode *)(value->data))->l;
+    escapes = value && value->type != AST_PRIMITIVE;
+  }
+  FunctionNode *constructor = get_constructor(clas);
+  for (int a = 0; constructor && a < constructor->body->n && !escapes; a++)
+    escapes = instance_escapes((AstNode *)get_from_list(constructor->body, a), "this", layout, constructor);
+  for (int a = block_at + 1; a < block->n && !escapes; a++)
+    escapes = instance_escapes((AstNode *)get_from_list(block, a), data->text, layout, NULL);
+  scratch_release(mark);
+  end_pass(outer);
+  return escapes ? NULL : clas;
+}
+
+/*
+  Writes a local definition whose instance is replaced by a local per data field
+  The constructor is written in place, with its parameters bound to the call's arguments
+*/
+static void write_scalar_define(AstNode *node, ClassNode *clas)
+{
+  BinaryNode *data = (BinaryNode *)(node->data);
+  AstNode *call = data->r->type == AST_TUPLE ? (AstNode *)get_from_list(((AstListNode *)(data->r->data))->list, 0) : data->r;
+  AstNode *args = ((AstAstNode *)(call->data))->r;
+  Map *layout = get_class_layout(clas);
+  FunctionNode *constructor = get_constructor(clas);
+  validate_call(call);
+  int num_fields = 0;
+  for (int a = 0; a < layout->n; a++)
+  {
+    FieldNode *field = (FieldNode *)iterate_from_map(layout, a);
+    if (field->node->type == AST_DEFINE)
+      write(num_fields++ ? ",%s__%s" : "local %s__%s", data->text, ((BinaryNode *)(field->node->data))->text);
+  }
+  if (num_fields)
+  {
+    write("=");
+    for (int a = 0, b = 0; a < layout->n; a++)
+    {
+      FieldNode *field = (FieldNode *)iterate_from_map(layout, a);
+      if (field->node->type != AST_DEFINE)
+        continue;
+      AstNode *value = ((BinaryNode *)(field->node->data))->r;
+      if (b++)
+        write(",");
+      if (value)
+        process_node(value);
+      else
+        write("nil");
+    }
+    write("\n");
+  }
+  if (constructor)
+  {
+    write("do\n");
+    indent(1);
+    for (int a = 0; a < constructor->args->n; a++)
+      write(a ? ",%s" : "local %s", ((StringAstNode *)get_from_list(constructor->args, a))->text);
+    if (constructor->args->n)
+    {
+      write("=");
+      if (args)
+        process_node(args);
+      else
+        write("nil");
+      write("\n");
     }
-    write("return %s\n", instance_str);
+    char *outer = constructing;
+    constructing = data->text;
+    push_class_scope(clas);
+    push_function_scope(constructor);
+    process_block(constructor->body);
+    pop_scope();
+    pop_scope();
+    constructing = outer;
     indent(-1);
     write("end\n");
-    pop_scope();
   }
+  add_to_list(scalars, data->text);
 }
 
 /*
-  Traverses through node groups
+  Returns the name of the scalar replaced local that a field's object refers to, or NULL if it isn't one
 */
-void process_do(AstNode *node)
+static char *get_scalar_name(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (node->type != AST_ID)
+    return NULL;
+  char *name = (char *)(node->data);
+  if (constructing && !strcmp(name, "this"))
+    return constructing;
+  for (int a = scalars->n - 1; a >= 0; a--)
   {
-    push_scope();
-    write("do\n");
-    indent(1);
-    process_node_list((List *)(node->data));
-    indent(-1);
-    write("end\n");
-    pop_scope();
+    if (!strcmp((char *)get_from_list(scalars, a), name))
+      return get_binding(node) == BINDING_LOCAL ? name : NULL;
   }
+  return NULL;
 }
 
 /*
-  Returns 1 if the provided arguments can be accepted by the function definition
-  target is whatever entity you want represented in any potential error messages
-  func is the AST_FUNCTION node you're calling
-  args_node is the AST_TUPLE node that represents your arguments
+  Returns the call that makes up an expression, or NULL if it's something else
+  Used to find inlined calls whose arguments have to be bound to temps in a statement of their own
 */
-static int validate_function_parameters(char *target, AstNode *func, AstNode *args_node)
+static AstNode *get_inline_statement_call(AstNode *node)
 {
-  if (!func)
-  {
-    if (args_node)
-    {
-      List *args = ((AstListNode *)(args_node->data))->list;
-      return args->n == 0;
-    }
-    return 1;
-  }
-  AstNode *functype = get_type(func);
-  List *funcargs = functype->data ? ((AstListNode *)(functype->data))->list : NULL;
-  if (args_node)
+  if (node && node->type == AST_TUPLE)
   {
-    List *args = ((AstListNode *)(args_node->data))->list;
-    if (!funcargs)
-    {
-      add_error(func->line, "too many arguments for %s", target);
-      return 0;
-    }
-    int max = funcargs->n;
-    if (is_variadic_function(funcargs))
-    {
-      if (args->n < funcargs->n - 1)
-      {
-        add_error(func->line, "not enough arguments for %s", target);
-        return 0;
-      }
-      max = funcargs->n - 1;
-    }
-    else if (args->n != funcargs->n)
-    {
-      add_error(func->line, "invalid number of arguments for %s", target);
-      return 0;
-    }
-    for (int a = 0; a < max; a++)
-    {
-      AstNode *type1 = get_type((AstNode *)get_from_list(args, a));
-      AstNode *type2 = (AstNode *)get_from_list(funcargs, a);
-      if (!typed_match(type2, type1))
-      {
-        add_error(func->line, "invalid argument provided for %s", target);
-        return 0;
-      }
-    }
+    List *ls = ((AstListNode *)(node->data))->list;
+    node = ls->n == 1 ? (AstNode *)get_from_list(ls, 0) : NULL;
   }
-  else if (funcargs && funcargs->n && !(funcargs->n == 1 && is_variadic_function(funcargs)))
-  {
-    add_error(func->line, "not enough arguments for %s", target);
+  if (!node || node->type != AST_CALL || !get_inline_function(node))
+    return NULL;
+  return needs_temps(node, get_inline_function(node)) ? node : NULL;
+}
+
+/*
+  Returns 1 if a call target is a field of an untyped receiver named like a method shared through metatables
+*/
+static int is_untyped_method_call(AstNode *node)
+{
+  if (!(options & OPTION_METATABLES) || node->type != AST_FIELD)
     return 0;
-  }
-  return 1;
+  StringAstNode *data = (StringAstNode *)(node->data);
+  return get_type(data->node)->type == AST_TYPE_ANY && class_method_exists(data->text);
 }
 
 /*
@@ -564,63 +2453,49 @@ static int validate_function_parameters(char *target, AstNode *func, AstNode *ar
 void process_call(AstNode *node)
 {
   AstAstNode *data = (AstAstNode *)(node->data);
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
-    if (step == STEP_CHECK)
+    FunctionNode *inlined = validate_call(node) && node != statement ? get_inline_function(node) : NULL;
+    if (inlined && !needs_temps(node, inlined))
     {
-      char *name = NULL;
-      AstNode *functype = NULL;
-      AstNode *funcnode = NULL;
-      FunctionNode *func = NULL;
-      AstNode *dummy_constructor_type = NULL;
-      if (data->l->type == AST_ID)
-      {
-        name = (char *)(data->l->data);
-        func = function_exists(name);
-        if (func)
-        {
-          funcnode = new_node(AST_FUNCTION, -1, func);
-          functype = get_type(funcnode);
-        }
-        else
-        {
-          ClassNode *clas = class_exists(name);
-          if (clas)
-          {
-            FunctionNode *constructor = get_constructor(clas);
-            if (constructor)
-            {
-              funcnode = new_node(AST_FUNCTION, -1, constructor);
-              functype = get_type(funcnode);
-            }
-            else
-            {
-              dummy_constructor_type = new_node(AST_TYPE_FUNC, -1, new_ast_list_node(new_node(AST_TYPE_BASIC, -1, name), new_default_list()));
-              functype = dummy_constructor_type;
-            }
-          }
-        }
-      }
-      else if (data->l->type == AST_FIELD)
-      {
-        name = ((StringAstNode *)(data->l->data))->text;
-        functype = get_type(data->l);
-      }
-      if (functype)
+      write_inlined(node, inlined, 0);
+      return;
+    }
+
+    // Calls that can only reach one method go straight to its local function
+    // Otherwise methods in shared method tables take the instance explicitly
+    FieldNode *field = NULL;
+    ClassNode *direct = NULL;
+    if ((options & (OPTION_METATABLES | OPTION_DEVIRTUALIZE)) && data->l->type == AST_FIELD)
+      field = get_field_node(data->l);
+    if (field && field->node->type != AST_FUNCTION)
+      field = NULL;
+    if (field && (options & OPTION_DEVIRTUALIZE))
+      direct = get_direct_class(data->l, field);
+    if (direct)
+    {
+      StringAstNode *ldata = (StringAstNode *)(data->l->data);
+      write("%s__%s(", direct->name, ldata->text);
+      process_node(ldata->node);
+      if (data->r)
       {
-        char *target = (char *)malloc(sizeof(char) * (strlen(name) + 10));
-        sprintf(target, "function %s", name);
-        validate_function_parameters(target, funcnode, data->r);
-        if (dummy_constructor_type)
-        {
-          dealloc_ast_type(dummy_constructor_type);
-        }
-        if (funcnode)
-          free(funcnode);
-        free(target);
+        write(",");
+        process_node(data->r);
       }
+      write(")");
+      return;
+    }
+    // Untyped receivers could be instances too, so calls to a name some class uses for a method pass the receiver
+    if ((field && (options & OPTION_METATABLES)) || is_untyped_method_call(data->l))
+    {
+      StringAstNode *ldata = (StringAstNode *)(data->l->data);
+      process_node(ldata->node);
+      write(":%s", ldata->text);
+    }
+    else
+    {
+      process_node(data->l);
     }
-    process_node(data->l);
     write("(");
     if (data->r)
       process_node(data->r);
@@ -629,33 +2504,40 @@ void process_call(AstNode *node)
 }
 void process_super(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     AstNode *data = (AstNode *)(node->data);
     ClassNode *clas = get_class_scope();
     FunctionNode *func = get_method_scope();
-    if (step == STEP_CHECK)
-    {
-      ERROR(!clas, node->line, "cannot use super methods outside of a class", NULL);
-      ERROR(!func, node->line, "must use super keyword within a class method", NULL);
-      ERROR(!clas->parent, node->line, "cannot use super methods because %s is not a child class", clas->name);
-    }
+    ERROR(!clas, node->line, "cannot use super methods outside of a class", NULL);
+    ERROR(!func, node->line, "must use super keyword within a class method", NULL);
+    ERROR(!clas->parent, node->line, "cannot use super methods because %s is not a child class", clas->name);
     ClassNode *parent = class_exists(clas->parent);
     FunctionNode *method = get_parent_method(parent, func);
-    if (step == STEP_CHECK)
+    if (!func->is_constructor)
+    {
+      assert(func->name->type == AST_ID); // I'm assuming func->name is of type AST_ID
+    }
+    ERROR(!method && func->is_constructor, node->line, "constructor in class %s does not override a super constructor", clas->name);
+    ERROR(!method && !func->is_constructor, node->line, "method %s in class %s does not override a super method", (char *)(func->name->data), clas->name);
+    ScratchMark mark = scratch_mark();
+    char *target = (char *)scratch_alloc(sizeof(char) * (strlen(parent->name) + 22));
+    sprintf(target, "constructor of class %s", parent->name);
+    validate_function_parameters(target, new_scratch_node(AST_FUNCTION, -1, method), data);
+    scratch_release(mark);
+
+    // Call the parent's shared local function when it has one
+    if (method->direct)
     {
-      if (!func->is_constructor)
+      write("%s__%s(%s", get_method_class(parent, method)->name, direct_name(method), instance_str);
+      List *args = data ? ((AstListNode *)(data->data))->list : NULL;
+      for (int a = 0; args && a < args->n; a++)
       {
-        assert(func->name->type == AST_ID); // I'm assuming func->name is of type AST_ID
+        write(",");
+        process_node((AstNode *)get_from_list(args, a));
       }
-      ERROR(!method && func->is_constructor, node->line, "constructor in class %s does not override a super constructor", clas->name);
-      ERROR(!method && !func->is_constructor, node->line, "method %s in class %s does not override a super method", (char *)(func->name->data), clas->name);
-      char *target = (char *)malloc(sizeof(char) * (strlen(parent->name) + 22));
-      sprintf(target, "constructor of class %s", parent->name);
-      AstNode *fnode = new_node(AST_FUNCTION, -1, method);
-      validate_function_parameters(target, fnode, data);
-      free(target);
-      free(fnode);
+      write(")\n");
+      return;
     }
     push_class_scope(parent);
     push_function_scope(method);
@@ -693,53 +2575,111 @@ void process_super(AstNode *node)
   }
 }
 
+/*
+  Writes a field, which is read unless it's the target of an assignment
+*/
+static void write_field(AstNode *node, int read)
+{
+  StringAstNode *data = (StringAstNode *)(node->data);
+  FieldNode *field = NULL;
+  char *scalar = get_scalar_name(data->node);
+  if (scalar)
+  {
+    write("%s__%s", scalar, data->text);
+    return;
+  }
+  if (cached_chains->n && is_cached_chain(node))
+  {
+    char *name = get_chain_name(node);
+    write("%s", name);
+    free(name);
+    return;
+  }
+  // Untyped references keep the named key, since they could be any table
+  if (options & OPTION_SLOTS)
+    field = get_field_node(node);
+
+  // Shared methods take the instance explicitly, so a method read without calling it is bound to its instance
+  FieldNode *method = (options & OPTION_METATABLES) ? get_field_node(node) : NULL;
+  if (method && method->node->type == AST_FUNCTION)
+  {
+    ERROR(!read, node->line, "method %s is shared through a metatable, so it cannot be assigned", data->text);
+    write("(function(%s) return function(...) return %s:%s(...) end end)(", instance_str, instance_str, data->text);
+    process_node(data->node);
+    write(")");
+    return;
+  }
+  process_node(data->node);
+  write_field_key(field, data->text);
+}
+
 /*
   Traverses through miscellaneous value nodes
 */
 void process_set(AstNode *node)
 {
   AstAstNode *data = (AstAstNode *)(node->data);
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
-    if (step == STEP_CHECK)
+    AstNode *tl = get_type(data->l);
+    AstNode *tr = get_type(data->r);
+    if (tr->type == AST_TYPE_TUPLE)
     {
-      AstNode *tl = get_type(data->l);
-      AstNode *tr = get_type(data->r);
-      if (tr->type == AST_TYPE_TUPLE)
-      {
-        List *ls = (List *)(tr->data);
-        if (ls->n == 1)
-          tr = (AstNode *)get_from_list(ls, 0);
-      }
-      ERROR(!typed_match(tl, tr), node->line, "expression of type %t cannot be assigned to variable of type %t", tr, tl);
+      List *ls = (List *)(tr->data);
+      if (ls->n == 1)
+        tr = (AstNode *)get_from_list(ls, 0);
     }
-    process_node(data->l);
+    ERROR(!typed_match(tl, tr), node->line, "expression of type %t cannot be assigned to variable of type %t", tr, tl);
+    AstNode *call = get_inline_statement_call(data->r);
+    // The temps are bound before the target, so only a plain name keeps Lua's order of evaluation
+    FunctionNode *inlined = call && data->l->type == AST_ID && !mentions_temps(data->l, get_inline_function(call)) ? get_inline_function(call) : NULL;
+    if (inlined)
+      write_inline_temps(call, inlined);
+    assigning = data->l->type == AST_ID || data->l->type == AST_LTUPLE;
+    if (data->l->type == AST_FIELD)
+      write_field(data->l, 0);
+    else
+      process_node(data->l);
+    assigning = 0;
     write("=");
-    process_node(data->r);
+    if (inlined)
+      write_inlined(call, inlined, 1);
+    else
+      process_node(data->r);
     write("\n");
+    if (inlined)
+      close_inline_temps();
   }
 }
 void process_return(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
-    if (step == STEP_CHECK)
+    FunctionNode *func = get_function_scope();
+    if (func)
     {
-      FunctionNode *func = get_function_scope();
-      if (func)
+      AstNode *type1 = func->type;
+      AstNode *type2 = node->data ? get_type(node->data) : any_type_const();
+      if (type2->type == AST_TYPE_TUPLE)
       {
-        AstNode *type1 = func->type;
-        AstNode *type2 = node->data ? get_type(node->data) : any_type_const();
-        if (type2->type == AST_TYPE_TUPLE)
+        List *ls = (List *)(type2->data);
+        if (ls->n == 1)
         {
-          List *ls = (List *)(type2->data);
-          if (ls->n == 1)
-          {
-            type2 = (AstNode *)get_from_list(ls, 0);
-          }
+          type2 = (AstNode *)get_from_list(ls, 0);
         }
-        ERROR(!typed_match(type1, type2), node->line, "function of type %t cannot return type %t", type1, type2);
       }
+      ERROR(!typed_match(type1, type2), node->line, "function of type %t cannot return type %t", type1, type2);
+    }
+    AstNode *call = get_inline_statement_call((AstNode *)(node->data));
+    FunctionNode *inlined = call ? get_inline_function(call) : NULL;
+    if (inlined)
+    {
+      write_inline_temps(call, inlined);
+      write("return ");
+      write_inlined(call, inlined, 1);
+      write("\n");
+      close_inline_temps();
+      return;
     }
     write("return");
     if (node->data)
@@ -756,7 +2696,7 @@ void process_return(AstNode *node)
 */
 void process_ltuple(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     AstListNode *data = (AstListNode *)(node->data);
     for (int a = 0; a < data->list->n; a++)
@@ -769,16 +2709,12 @@ void process_ltuple(AstNode *node)
 }
 void process_field(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
-  {
-    StringAstNode *data = (StringAstNode *)(node->data);
-    process_node(data->node);
-    write(".%s", data->text);
-  }
+  if (step == STEP_CHECK)
+    write_field(node, 1);
 }
 void process_sub(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     AstAstNode *data = (AstAstNode *)(node->data);
     process_node(data->l);
@@ -789,16 +2725,35 @@ void process_sub(AstNode *node)
 }
 void process_id(AstNode *node)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     char *var = (char *)(node->data);
-    if (get_class_scope() && !strcmp(var, "this"))
+    int parameter = inlining ? get_parameter_index(inlining, var) : -1;
+    if (parameter >= 0)
+    {
+      write_inline_argument(parameter);
+      return;
+    }
+    int binding = get_binding(node);
+    if (binding == BINDING_GLOBAL && hoisting)
+    {
+      int outer = begin_pass(PASS_HOIST);
+      hoist_global(var);
+      end_pass(outer);
+    }
+    if (binding == BINDING_THIS)
     {
       write("%s", instance_str);
     }
     else
     {
-      if (field_defined_in_class(var))
+      if (binding == BINDING_FIELD && (options & OPTION_SLOTS))
+      {
+        write("%s", instance_str);
+        write_field_key((FieldNode *)get_from_map(get_class_layout(get_class_scope()), var), var);
+        return;
+      }
+      if (binding == BINDING_FIELD)
       {
         write("%s.", instance_str);
       }
@@ -822,7 +2777,7 @@ void process_require(AstNode *node)
 }
 void process_local(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     StringAstNode *data = (StringAstNode *)(node->data);
     write("local %s", data->text);
@@ -836,32 +2791,49 @@ void process_local(AstNode *node)
 }
 void process_define(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     BinaryNode *data = (BinaryNode *)(node->data);
-    if (step == STEP_CHECK)
+    ERROR(!compound_type_exists(data->l), node->line, "reference to nonexistent type %t", data->l);
+    if (data->r)
     {
-      ERROR(!compound_type_exists(data->l), node->line, "reference to nonexistent type %t", data->l);
-      if (data->r)
-      {
-        AstNode *tr = get_type(data->r);
-        ERROR(!typed_match(data->l, tr), node->line, "expression of type %t cannot be assigned to variable of type %t", tr, data->l);
-      }
-      StringAstNode *data1 = new_string_ast_node(data->text, data->l);
-      if (!add_scoped_var(data1))
-      {
-        add_error(node->line, "variable %s was already declared in this scope", data->text);
-        free(data1);
-      }
+      AstNode *tr = get_type(data->r);
+      ERROR(!typed_match(data->l, tr), node->line, "expression of type %t cannot be assigned to variable of type %t", tr, data->l);
+    }
+    AstNode *call = get_inline_statement_call(data->r);
+    FunctionNode *inlined = call && !mentions(call, data->text) && strncmp(data->text, "__", 2) ? get_inline_function(call) : NULL;
+    ClassNode *scalar = inlined ? NULL : get_scalar_class(node);
+    if (scalar)
+      write_scalar_define(node, scalar);
+    else if (inlined)
+    {
+      if (get_num_scopes() > 1)
+        write("local %s\n", data->text);
+      write_inline_temps(call, inlined);
+      write("%s=", data->text);
+      write_inlined(call, inlined, 1);
+      write("\n");
+      close_inline_temps();
     }
-    if (get_num_scopes() > 1)
-      write("local ");
-    write("%s=", data->text);
-    if (data->r)
-      process_node(data->r);
     else
-      write("nil");
-    write("\n");
+    {
+      if (get_num_scopes() > 1)
+        write("local ");
+      write("%s=", data->text);
+      if (data->r)
+        process_node(data->r);
+      else
+        write("nil");
+      write("\n");
+    }
+
+    // The variable only comes into scope after its own initializer
+    StringAstNode *data1 = new_string_ast_node(data->text, data->l);
+    if (!add_scoped_var(data1))
+    {
+      add_error(node->line, "variable %s was already declared in this scope", data->text);
+      free(data1);
+    }
   }
 }
 void process_typedef(AstNode *node)
@@ -879,12 +2851,40 @@ void process_typedef(AstNode *node)
   }
 }
 
+/*
+  Replaces the Lua code written for a function body since start with code printed from its optimization IR
+  The body is lowered in a fresh scope, so names are only declared from where the check step declared them
+  removed is how much unreachable code was left out before the body, since the IR measures its own
+  Bodies the IR can't represent, and ones that inlining, scalar replacement or caching rewrote, keep the code they were written with
+*/
+static void lower_body(FunctionNode *data, int start, int removed)
+{
+  if (moonshot_num_errors() || get_class_scope() || pass_enabled(PASS_INLINE) || pass_enabled(PASS_SCALARIZE) || pass_enabled(PASS_CSE))
+    return;
+  int outer = begin_pass(PASS_LOWER);
+  push_function_scope(data);
+  IrFunction *ir = lower_function(data, options);
+  pop_scope();
+  if (ir)
+  {
+    run_passes(ir);
+    output_buffer->n = start;
+    print_ir(ir->body, ir->temps, output_buffer, num_indents);
+    Buffer *dead = new_default_buffer();
+    print_ir(ir->dead, ir->temps, dead, 0);
+    eliminated = removed + dead->n;
+    dealloc_buffer(dead);
+    dealloc_ir_function(ir);
+  }
+  end_pass(outer);
+}
+
 /*
   Traverses through a function node
 */
 void process_function(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     FunctionNode *data = (FunctionNode *)(node->data);
     write("function");
@@ -893,7 +2893,9 @@ void process_function(AstNode *node)
       if (data->type)
         register_function(data);
       write(" ");
+      assigning = data->name->type == AST_ID;
       process_node(data->name);
+      assigning = 0;
     }
     write("(");
     for (int a = 0; a < data->args->n; a++)
@@ -908,16 +2910,22 @@ void process_function(AstNode *node)
     indent(1);
     if (data->body)
     {
+      int top = get_num_scopes() == 1;
       push_function_scope(data);
       int num_returns = 0;
       for (int a = 0; a < data->body->n; a++)
-      {
-        AstNode *child = (AstNode *)get_from_list(data->body, a);
-        if (child->type == AST_RETURN)
-          num_returns++;
-        process_node(child);
-        conditional_newline(child);
-      }
+        num_returns += ((AstNode *)get_from_list(data->body, a))->type == AST_RETURN;
+      HoistState state;
+      int start = output_buffer->n;
+      int removed = eliminated;
+      if (pass_enabled(PASS_HOIST))
+        begin_hoisting(&state);
+      process_block(data->body);
+      pop_scope();
+      if (pass_enabled(PASS_LOWER))
+        lower_body(data, start, removed);
+      if (pass_enabled(PASS_HOIST))
+        end_hoisting(&state, start);
       if (data->is_constructor)
       {
         ERROR(num_returns, node->line, "constructors cannot have return statements", NULL);
@@ -928,7 +2936,8 @@ void process_function(AstNode *node)
       }
       indent(-1);
       write("end");
-      pop_scope();
+      if (pass_enabled(PASS_INLINE) && top && data->name && data->name->type == AST_ID)
+        check_inline(data);
     }
   }
 }
@@ -938,14 +2947,20 @@ void process_function(AstNode *node)
 */
 void process_repeat(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     AstListNode *data = (AstListNode *)(node->data);
+    List *outer = repeat_body;
+    AstNode *outer_until = repeat_until;
+    repeat_body = data->list;
+    repeat_until = data->node;
     write("repeat\n");
     indent(1);
     push_scope();
-    process_node_list(data->list);
+    process_loop_body(data->list);
     pop_scope();
+    repeat_body = outer;
+    repeat_until = outer_until;
     indent(-1);
     write("until ");
     process_node(data->node);
@@ -954,69 +2969,78 @@ void process_repeat(AstNode *node)
 }
 void process_while(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     AstListNode *data = (AstListNode *)(node->data);
+    int start = output_buffer->n;
     write("while ");
     process_node(data->node);
     write(" do\n");
     indent(1);
     push_scope();
-    process_node_list(data->list);
+    process_loop_body(data->list);
     pop_scope();
     indent(-1);
     write("end\n");
+    if (!known_truth(data->node))
+      eliminate_output(start);
+  }
+}
+
+/*
+  Writes one branch of an if chain, where expr is NULL for an else branch
+  Branches that can never be taken are left out, and one that's always taken ends the chain
+*/
+static void process_branch(AstNode *expr, List *body, AstNode *next)
+{
+  int state = chain;
+  int truth = state == CHAIN_TAKEN ? 0 : expr ? known_truth(expr) : 1;
+  int start = output_buffer->n;
+  if (expr && truth != 1)
+  {
+    write(state == CHAIN_OPEN ? "elseif " : "if ");
+    process_node(expr);
+    write(" then\n");
   }
+  else
+    write(state == CHAIN_OPEN ? "else\n" : "do\n");
+  indent(1);
+  push_scope();
+  process_node_list(body);
+  pop_scope();
+  indent(-1);
+  if (!truth)
+    eliminate_output(start);
+  else
+    state = truth == 1 ? CHAIN_TAKEN : CHAIN_OPEN;
+  chain = state;
+  if (next)
+    process_node(next);
+  else if (state != CHAIN_EMPTY)
+    write("end\n");
 }
 void process_if(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     IfNode *data = (IfNode *)(node->data);
-    write("if ");
-    process_node(data->expr);
-    write(" then\n");
-    indent(1);
-    push_scope();
-    process_node_list(data->body);
-    pop_scope();
-    indent(-1);
-    if (data->next)
-      process_node(data->next);
-    else
-      write("end\n");
+    chain = CHAIN_EMPTY;
+    process_branch(data->expr, data->body, data->next);
   }
 }
 void process_elseif(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     IfNode *data = (IfNode *)(node->data);
-    write("elseif ");
-    process_node(data->expr);
-    write(" then\n");
-    indent(1);
-    push_scope();
-    process_node_list(data->body);
-    pop_scope();
-    indent(-1);
-    if (data->next)
-      process_node(data->next);
-    else
-      write("end\n");
+    process_branch(data->expr, data->body, data->next);
   }
 }
 void process_else(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
-    write("else\n");
-    indent(1);
-    push_scope();
-    process_node_list((List *)(node->data));
-    pop_scope();
-    indent(-1);
-    write("end\n");
+    process_branch(NULL, (List *)(node->data), NULL);
   }
 }
 
@@ -1025,7 +3049,7 @@ void process_else(AstNode *node)
 */
 void process_fornum(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     FornumNode *data = (FornumNode *)(node->data);
     write("for %s=", data->name);
@@ -1040,7 +3064,7 @@ void process_fornum(AstNode *node)
     push_scope();
     write(" do\n");
     indent(1);
-    process_node_list(data->body);
+    process_loop_body(data->body);
     indent(-1);
     write("end\n");
     pop_scope();
@@ -1048,7 +3072,7 @@ void process_fornum(AstNode *node)
 }
 void process_forin(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     ForinNode *data = (ForinNode *)(node->data);
     write("for ");
@@ -1058,7 +3082,7 @@ void process_forin(AstNode *node)
     write(" do\n");
     indent(1);
     push_scope();
-    process_node_list(data->body);
+    process_loop_body(data->body);
     indent(-1);
     write("end\n");
     pop_scope();
@@ -1070,21 +3094,21 @@ void process_forin(AstNode *node)
 */
 void process_break(AstNode *node)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     write("break\n");
   }
 }
 void process_label(AstNode *node)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     write("::%s::\n", (char *)(node->data));
   }
 }
 void process_goto(AstNode *node)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     write("goto %s\n", (char *)(node->data));
   }
@@ -1095,7 +3119,7 @@ void process_goto(AstNode *node)
 */
 void process_table(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     TableNode *data = (TableNode *)(node->data);
     write("{");
@@ -1111,7 +3135,7 @@ void process_table(AstNode *node)
 }
 void process_list_primitive_node(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     AstNode *data = (AstNode *)(node->data);
     write("{");
@@ -1126,14 +3150,14 @@ void process_list_primitive_node(AstNode *node)
 */
 void process_primitive(AstNode *node)
 {
-  if (step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     write("%s", ((StringAstNode *)(node->data))->text);
   }
 }
 void process_tuple(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     AstListNode *data = (AstListNode *)(node->data);
     List *ls = data->list;
@@ -1146,12 +3170,49 @@ void process_tuple(AstNode *node)
   }
 }
 
+/*
+  Writes an operator expression that was rebuilt for constant folding
+*/
+static void write_expression(ExprNode *expr)
+{
+  if (expr->folded)
+    write("%s", expr->folded);
+  else if (expr->atom)
+    process_node(expr->atom);
+  else if (!expr->r)
+  {
+    write("%s ", expr->op);
+    write_expression(expr->l);
+  }
+  else
+  {
+    write_expression(expr->l);
+    write(" %s ", expr->op);
+    write_expression(expr->r);
+  }
+}
+
+/*
+  Writes an operator expression with its constant parts folded
+*/
+static void process_folded(AstNode *node)
+{
+  ScratchMark mark = scratch_mark();
+  int outer = begin_pass(PASS_FOLD);
+  ExprNode *expr = fold_expression(node);
+  end_pass(outer);
+  write_expression(expr);
+  scratch_release(mark);
+}
+
 /*
   Traverses through expression nodes
 */
 void process_unary(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK && pass_enabled(PASS_FOLD))
+    process_folded(node);
+  else if (step == STEP_CHECK)
   {
     BinaryNode *data = (BinaryNode *)(node->data);
     if (strcmp(data->text, "trust"))
@@ -1161,7 +3222,9 @@ void process_unary(AstNode *node)
 }
 void process_binary(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK && pass_enabled(PASS_FOLD))
+    process_folded(node);
+  else if (step == STEP_CHECK)
   {
     BinaryNode *data = (BinaryNode *)(node->data);
     process_node(data->l);
@@ -1174,7 +3237,7 @@ void process_binary(AstNode *node)
 }
 void process_paren(AstNode *node)
 {
-  if (step == STEP_CHECK || step == STEP_OUTPUT)
+  if (step == STEP_CHECK)
   {
     write("(");
     process_node((AstNode *)(node->data));
@@ -3,6 +3,9 @@
 #include <string.h>
 #include <assert.h>
 static List *types_graph; // List of EqualTypesNodes
+static Map *aliases;      // Map of typedef names to AliasNodes, ordered by scope
+static int alias_version; // Incremented whenever the alias map changes
+static int type_epoch;    // Incremented whenever a derived expression type could change
 
 /*
   Initialize the data structures used in this module
@@ -10,6 +13,18 @@ static List *types_graph; // List of EqualTypesNodes
 void init_types()
 {
   types_graph = new_default_list();
+  aliases = new_default_map();
+  alias_version = 0;
+  type_epoch = 0;
+}
+
+/*
+  Invalidates every expression type cached on the AST
+  Called whenever scopes, registries or type relations change
+*/
+void expire_types()
+{
+  type_epoch++;
 }
 
 /*
@@ -20,7 +35,9 @@ void dealloc_types()
   // Quelling scoped type equivalences means there shouldn't be
   // any equivalences left by the time we get here
   assert(types_graph->n == 0);
+  assert(aliases->n == 0);
   dealloc_list(types_graph);
+  dealloc_map(aliases);
 }
 
 /*
@@ -74,30 +91,9 @@ int is_primitive(AstNode *node, const char *type)
 */
 static AstNode *get_type_of_field(char *name, void *data, int is_interface)
 {
-  AstNode *node = new_node(is_interface ? AST_INTERFACE : AST_CLASS, -1, data);
-  List *body = get_all_expected_fields(node);
-  free(node);
-  for (int a = 0; a < body->n; a++)
-  {
-    AstNode *e = (AstNode *)get_from_list(body, a);
-    if (e->type == AST_FUNCTION)
-    {
-      FunctionNode *func = (FunctionNode *)(e->data);
-      if (func->name)
-      {
-        char *funcname = (char *)(func->name->data);
-        if (!strcmp(funcname, name))
-          return get_type(e);
-      }
-    }
-    else
-    {
-      BinaryNode *def = (BinaryNode *)(e->data);
-      if (!strcmp(def->text, name))
-        return def->l;
-    }
-  }
-  return NULL;
+  Map *layout = is_interface ? get_interface_layout((InterfaceNode *)data) : get_class_layout((ClassNode *)data);
+  FieldNode *field = (FieldNode *)get_from_map(layout, name);
+  return field ? field->type : NULL;
 }
 
 // Functions for getting type nodes from various AstNodes
@@ -157,9 +153,10 @@ static AstNode *get_super_type()
   FunctionNode *method = get_method_scope();
   if (!method)
     return any_type_const();
-  AstNode *node = new_node(AST_FUNCTION, -1, method);
+  ScratchMark mark = scratch_mark();
+  AstNode *node = new_scratch_node(AST_FUNCTION, -1, method);
   AstListNode *functype = (AstListNode *)(get_type(node)->data);
-  free(node);
+  scratch_release(mark);
   return functype->node;
 }
 static AstNode *get_call_type(AstAstNode *data)
@@ -184,7 +181,7 @@ static AstNode *get_call_type(AstAstNode *data)
 static AstNode *get_id_type(AstNode *node)
 {
   char *name = (char *)(node->data);
-  StringAstNode *var = get_scoped_var(name);
+  StringAstNode *var = resolve_scoped_var(name, &(node->binding));
   return (var && var->node) ? (var->node) : any_type_const();
 }
 static AstNode *get_field_type(StringAstNode *data)
@@ -244,12 +241,10 @@ static AstNode *get_binary_type(BinaryNode *data)
 }
 
 /*
-  Finds an AST_TYPE_* AstNode for the input AstNode
-  Never free the result of this function, it will be deallocated elsewhere
+  Derives an AST_TYPE_* AstNode for the input AstNode
 */
-AstNode *get_type(AstNode *node)
+static AstNode *derive_type(AstNode *node)
 {
-  int type = node->type;
   switch (node->type)
   {
   case AST_FUNCTION:
@@ -285,6 +280,64 @@ AstNode *get_type(AstNode *node)
   }
 }
 
+/*
+  Finds an AST_TYPE_* AstNode for the input AstNode
+  Types that depend on the surrounding scopes are cached on the node until the next type epoch
+  Never free the result of this function, it will be deallocated elsewhere
+*/
+AstNode *get_type(AstNode *node)
+{
+  switch (node->type)
+  {
+  case AST_FIELD:
+  case AST_BINARY:
+  case AST_CALL:
+  case AST_PAREN:
+  case AST_SUPER:
+  case AST_ID:
+    if (node->epoch != type_epoch)
+    {
+      node->cache = derive_type(node);
+      node->epoch = type_epoch;
+    }
+    return node->cache;
+  default:
+    return derive_type(node);
+  }
+}
+
+/*
+  Returns the FieldNode that an AST_FIELD node accesses
+  NULL if the object isn't statically typed as a class or interface
+*/
+FieldNode *get_field_node(AstNode *node)
+{
+  assert(node->type == AST_FIELD);
+  StringAstNode *data = (StringAstNode *)(node->data);
+  AstNode *ltype = get_type(data->node);
+  if (ltype->type != AST_TYPE_BASIC)
+    return NULL;
+  char *name = (char *)(ltype->data);
+  InterfaceNode *inode = interface_exists(name);
+  if (inode)
+    return (FieldNode *)get_from_map(get_interface_layout(inode), data->text);
+  ClassNode *cnode = class_exists(name);
+  if (cnode)
+    return (FieldNode *)get_from_map(get_class_layout(cnode), data->text);
+  return NULL;
+}
+
+/*
+  Returns what an AST_ID node is bound to
+  The binding is resolved together with the node's type, so it's only looked up again when that expires
+*/
+int get_binding(AstNode *node)
+{
+  assert(node->type == AST_ID);
+  get_type(node);
+  return node->binding;
+}
+
 /*
   Returns 1 if the FunctionNode has a variadic parameter
   args is a list of AST_TYPE_* nodes
@@ -374,23 +427,19 @@ int typed_match(AstNode *l, AstNode *r)
 /*
   Boils a typedef type down into its lowest-level typedef
   Returns the input type if it is already at its lowest typedef link
+  Every alias along the chain caches its result until the alias map changes
 */
 char *base_type(char *name)
 {
-  while (1)
+  AliasNode *node = (AliasNode *)get_from_map(aliases, name);
+  if (!node)
+    return name;
+  if (node->version != alias_version)
   {
-    for (int a = 0; a < types_graph->n; a++)
-    {
-      EqualTypesNode *node = (EqualTypesNode *)get_from_list(types_graph, a);
-      if (node->relation == RL_EQUALS && node->type->type == AST_TYPE_BASIC && !strcmp(node->name, name))
-      {
-        name = (char *)(node->type->data);
-        continue;
-      }
-    }
-    break;
+    node->root = base_type(node->target);
+    node->version = alias_version;
   }
-  return name;
+  return node->root;
 }
 
 /*
@@ -446,26 +495,23 @@ int compound_type_exists(AstNode *node)
 */
 static int path_exists(char *name, AstNode *type)
 {
-  List *ls = get_equivalent_types(name);
+  ScratchMark mark = scratch_mark();
+  List *ls = new_scratch_list(10);
+  get_equivalent_types(name, ls);
   int a = 0;
   while (a < ls->n)
   {
     AstNode *node = get_from_list(ls, a);
     if (typed_match_no_equivalence(node, type))
     {
-      dealloc_list(ls);
+      scratch_release(mark);
       return 1;
     }
     if (node->type == AST_TYPE_BASIC)
-    {
-      List *ls1 = get_equivalent_types((char *)(node->data));
-      for (int b = 0; b < ls1->n; b++)
-        add_to_list(ls, get_from_list(ls1, b));
-      dealloc_list(ls1);
-    }
+      get_equivalent_types((char *)(node->data), ls);
     a++;
   }
-  dealloc_list(ls);
+  scratch_release(mark);
   return 0;
 }
 
@@ -476,7 +522,10 @@ static int path_exists(char *name, AstNode *type)
 int add_child_type(char *child, char *parent, int relation)
 {
   AstNode *r = new_node(AST_TYPE_BASIC, -1, child);
-  return add_type_equivalence(parent, r, relation);
+  if (add_type_equivalence(parent, r, relation))
+    return 1;
+  free(r);
+  return 0;
 }
 
 /*
@@ -488,32 +537,42 @@ int add_type_equivalence(char *name, AstNode *type, int relation)
 {
   if (type->type == AST_TYPE_BASIC)
   {
-    AstNode *r = new_node(AST_TYPE_BASIC, -1, name);
-    char *l = (char *)(type->data);
-    int cycle = path_exists(l, r);
-    free(r);
+    ScratchMark mark = scratch_mark();
+    AstNode *r = new_scratch_node(AST_TYPE_BASIC, -1, name);
+    int cycle = path_exists((char *)(type->data), r);
+    scratch_release(mark);
     if (cycle)
       return 0;
   }
   assert(get_num_scopes() > 0); // Ensure that there is a scope
+  if (types_graph->n)
+  {
+    // Segments must stay ordered by scope for quelling to work
+    EqualTypesNode *top = (EqualTypesNode *)get_from_list(types_graph, types_graph->n - 1);
+    assert(top->scope <= get_num_scopes());
+  }
   add_to_list(types_graph, new_equal_types_node(name, type, relation, get_num_scopes()));
+  if (relation == RL_EQUALS && type->type == AST_TYPE_BASIC && !get_from_map(aliases, name))
+  {
+    put_in_map(aliases, name, new_alias_node(name, (char *)(type->data), get_num_scopes()));
+    alias_version++;
+    type_epoch++;
+  }
   return 1;
 }
 
 /*
-  Returns a List of AST_TYPE_* AstNodes
-  List is full of types that are equivalent to name with 1 degree of separation
+  Appends AST_TYPE_* AstNodes to ls
+  Appends every type that is equivalent to name with 1 degree of separation
 */
-List *get_equivalent_types(char *name)
+void get_equivalent_types(char *name, List *ls)
 {
-  List *ls = new_default_list();
   for (int a = 0; a < types_graph->n; a++)
   {
     EqualTypesNode *node = (EqualTypesNode *)get_from_list(types_graph, a);
     if (!strcmp(node->name, name))
       add_to_list(ls, node->type);
   }
-  return ls;
 }
 
 /*
@@ -529,29 +588,37 @@ int types_equivalent(char *name, AstNode *type)
 /*
   Cleans expired edges from the types equivalency graph
   Expired means we have exited the scope that an equivalence was defined in
+  Edges are only ever added to the innermost scope, so the graph is a stack of
+  per-scope segments and the expired edges are always the ones on top
 */
 void quell_expired_scope_equivalences(int scope)
 {
-  int a = 0;
-  while (a < types_graph->n)
+  while (types_graph->n)
   {
-    EqualTypesNode *node = (EqualTypesNode *)get_from_list(types_graph, a);
+    EqualTypesNode *node = (EqualTypesNode *)get_from_list(types_graph, types_graph->n - 1);
     assert(node->scope <= scope);
-    if (node->scope == scope)
-    {
-      remove_from_list(types_graph, a);
-    }
-    else
-    {
-      a++;
-    }
+    if (node->scope < scope)
+      break;
+    remove_from_list(types_graph, types_graph->n - 1);
+    if (node->relation != RL_EQUALS)
+      free(node->type);
+    free(node);
+  }
+  int n = aliases->n;
+  while (n && ((AliasNode *)iterate_from_map(aliases, n - 1))->scope == scope)
+    free(iterate_from_map(aliases, --n));
+  if (n < aliases->n)
+  {
+    truncate_map(aliases, n);
+    alias_version++;
+    type_epoch++;
   }
 }
 
 /*
   Internal recursive function that helps with type stringification
 */
-static void stringify_type_internal(List *ls, AstNode *node)
+static void stringify_type_internal(List *ls, AstNode *node, int canonical)
 {
   if (!node || node->type == AST_TYPE_ANY)
   {
@@ -563,7 +630,7 @@ static void stringify_type_internal(List *ls, AstNode *node)
   }
   else if (node->type == AST_TYPE_BASIC)
   {
-    add_to_list(ls, node->data);
+    add_to_list(ls, canonical ? base_type((char *)(node->data)) : node->data);
   }
   else if (node->type == AST_TYPE_TUPLE)
   {
@@ -573,7 +640,7 @@ static void stringify_type_internal(List *ls, AstNode *node)
     {
       if (a)
         add_to_list(ls, ",");
-      stringify_type_internal(ls, (AstNode *)get_from_list(tls, a));
+      stringify_type_internal(ls, (AstNode *)get_from_list(tls, a), canonical);
     }
     add_to_list(ls, ")");
   }
@@ -584,37 +651,60 @@ static void stringify_type_internal(List *ls, AstNode *node)
     {
       add_to_list(ls, "*");
     }
-    stringify_type_internal(ls, data->node);
+    stringify_type_internal(ls, data->node, canonical);
     add_to_list(ls, "(");
     for (int a = 0; a < data->list->n; a++)
     {
       if (a)
         add_to_list(ls, ",");
-      stringify_type_internal(ls, (AstNode *)get_from_list(data->list, a));
+      stringify_type_internal(ls, (AstNode *)get_from_list(data->list, a), canonical);
     }
     add_to_list(ls, ")");
   }
 }
 
 /*
-  Converts a AST_TYPE_* AstNode into a string representation
-  Very helpful for error formatting and debugging
+  Joins the pieces of a stringified type into one string
 */
-char *stringify_type(AstNode *node)
+static char *stringify_type_pieces(AstNode *node, int canonical)
 {
   int len = 1;
-  List *ls = new_default_list();
-  stringify_type_internal(ls, node);
+  ScratchMark mark = scratch_mark();
+  List *ls = new_scratch_list(10);
+  stringify_type_internal(ls, node, canonical);
   for (int a = 0; a < ls->n; a++)
     len += strlen((char *)get_from_list(ls, a));
-  char *type = (char *)malloc(sizeof(char) + len);
-  type[0] = 0;
+  char *type = (char *)malloc(sizeof(char) * len);
+  char *end = type;
+  *end = 0;
   for (int a = 0; a < ls->n; a++)
-    strcat(type, (char *)get_from_list(ls, a));
-  dealloc_list(ls);
+  {
+    char *piece = (char *)get_from_list(ls, a);
+    strcpy(end, piece);
+    end += strlen(piece);
+  }
+  scratch_release(mark);
   return type;
 }
 
+/*
+  Converts a AST_TYPE_* AstNode into a string representation
+  Very helpful for error formatting and debugging
+*/
+char *stringify_type(AstNode *node)
+{
+  return stringify_type_pieces(node, 0);
+}
+
+/*
+  Converts a AST_TYPE_* AstNode into a string with every typedef boiled down to its base type
+  Two types with the same canonical string are an exact match
+*/
+char *canonical_type(AstNode *node)
+{
+  return stringify_type_pieces(node, 1);
+}
+
 /*
   Print out types equivalence graph
 */
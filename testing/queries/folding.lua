@@ -0,0 +1,44 @@
+-- Integer arithmetic
+print(60 * 60 * 24)
+print(9223372036854775807 + 1)
+print(0 - 9223372036854775807 - 1)
+print(4611686018427387904 * 2)
+print(- 9223372036854775807 - 2)
+print(10 - 2 - 3)
+
+-- Float arithmetic and division
+print(7 / 2)
+print(8 / 2)
+print(1 / 3)
+print(2 ^ 10)
+print(2 ^ 3 ^ 2)
+print(- 2 ^ 2)
+print(2 ^ - 1)
+print(0.1 + 0.2)
+print(1.5 * 4)
+print(99999999999999999999 + 0)
+print(1 / 0)
+print(0 - 0.0)
+
+-- Strings
+print("ab" .. "cd" .. 'ef')
+print("it's" .. ' "quoted"')
+print(1 .. "")
+print(1.5 .. "x" .. 2.0)
+print(2 ^ 53 .. "")
+print(#"hello")
+print("a\tb" .. "c")
+
+-- Comparisons
+print(1 < 2, 2 <= 1, 3 > 2.5, 3 >= 3.0)
+print(1 == 1.0, 1 ~= 1.0, 9007199254740993 == 9007199254740992.0)
+print("a" == "a", "a" == 'b', nil == false, true ~= false)
+
+-- Logic
+print(not true, not nil, not 0)
+print(1 < 2 and "yes" or "no")
+print(nil and 1, false or nil, 1 and 2, nil or "x")
+
+-- Mixed with variables
+local x = 5
+print(x * (2 + 3), 2 * x + 3 * 4, x * 60 * 60, x .. "a" .. "b")
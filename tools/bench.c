@@ -0,0 +1,78 @@
+#include "../src/moonshot.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#define DEFAULT_RUNS 100 // Number of times each file is compiled
+
+// Output
+static void help()
+{
+  printf("Usage: bench [-n runs] file...\n");
+  printf("  Compiles each file repeatedly and reports Lua emission throughput\n");
+}
+
+/*
+  Compiles a source file into output once
+  Returns the number of compilation errors
+*/
+static int compile(char *source, FILE *output)
+{
+  FILE *input = fopen(source, "r");
+  if (!input)
+    return -1;
+  moonshot_init();
+  moonshot_configure(input, output);
+  init_requires();
+  dummy_required_file(source);
+  moonshot_compile();
+  int n = moonshot_num_errors();
+  moonshot_destroy();
+  fclose(input);
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  int runs = DEFAULT_RUNS;
+  int first = 1;
+  if (argc > 2 && !strcmp(argv[1], "-n"))
+  {
+    runs = atoi(argv[2]);
+    first = 3;
+  }
+  if (first >= argc || runs < 1)
+  {
+    help();
+    return 1;
+  }
+  long total_bytes = 0;
+  double total_seconds = 0;
+  for (int a = first; a < argc; a++)
+  {
+    FILE *output = tmpfile();
+    long bytes = 0;
+    double seconds = 0;
+    for (int b = 0; b < runs; b++)
+    {
+      rewind(output);
+      clock_t start = clock();
+      int errors = compile(argv[a], output);
+      fflush(output);
+      seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+      if (errors)
+      {
+        printf("%s: %s\n", argv[a], errors < 0 ? "could not open file" : "compilation errors");
+        fclose(output);
+        return 1;
+      }
+      bytes += ftell(output);
+    }
+    fclose(output);
+    printf("%-40s %10ld bytes %8.2f MB/s\n", argv[a], bytes / runs, bytes / seconds / 1000000);
+    total_bytes += bytes;
+    total_seconds += seconds;
+  }
+  printf("%-40s %10ld bytes %8.2f MB/s\n", "total", total_bytes / runs, total_bytes / total_seconds / 1000000);
+  return 0;
+}
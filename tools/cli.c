@@ -16,6 +16,7 @@ static void indent(int i, const char *msg)
 static void help()
 {
   indent(0, "Usage: moonshot [options] file\n");
+  indent(2, "a file of - reads source code from stdin\n");
   indent(2, "options include:\n\n");
   indent(0, "Moonshot options\n");
   indent(1, "-o <file>");
@@ -24,12 +25,42 @@ static void help()
   indent(2, "Print Moonshot version\n");
   indent(1, "--print");
   indent(3, "Write Lua code to stdout\n");
+  indent(1, "--stream");
+  indent(2, " Compile one statement at a time to bound memory use\n");
+  indent(1, "--metatables");
+  indent(0, " Share class methods through metatables instead of per-instance closures\n");
+  indent(1, "--flatten");
+  indent(2, "Copy inherited methods into each method table (implies --metatables)\n");
+  indent(1, "--slots");
+  indent(2, "  Store class fields in array slots instead of named keys\n");
+  indent(1, "--devirtualize\n");
+  indent(7, " Call final and leaf class methods as local functions\n");
+  indent(1, "--no-fold");
+  indent(2, "Emit constant expressions as written instead of folding them\n");
+  indent(1, "--no-eliminate\n");
+  indent(7, " Keep constant branches and code after a break or goto\n");
+  indent(1, "--hoist");
+  indent(2, "  Keep top-level functions and classes local and alias hot library globals\n");
+  indent(1, "--inline");
+  indent(2, " Write small top-level functions in place of their calls\n");
+  indent(1, "--scalarize");
+  indent(1, "Replace local instances that never escape with a local per field\n");
+  indent(1, "--cse");
+  indent(4, "Read typed field chains used more than once from a local\n");
+  indent(1, "--lower");
+  indent(3, "Optimize function bodies in a lowered IR and print them from it\n");
+  indent(1, "--minify");
+  indent(2, " Drop indentation and line breaks and give locals the shortest names\n");
+  indent(1, "--bytecode");
+  indent(1, " Write a precompiled Lua 5.3 chunk that loads like luac output\n");
+  indent(1, "--stats");
+  indent(2, "  Report the unreachable code removed and the time spent in each pass\n");
   indent(1, "--help");
   indent(3, " Print usage options\n");
 }
 
 // Argument parsing
-static int check_args(FILE **output, char **source, int argc, char **argv, int a)
+static int check_args(FILE **output, char **source, int *stream, int *stats, int *options, int argc, char **argv, int a)
 {
   if (!strcmp(argv[a], "--version"))
   {
@@ -41,7 +72,67 @@ static int check_args(FILE **output, char **source, int argc, char **argv, int a
     help();
     return 2;
   }
-  if (!strcmp(argv[a], "--print"))
+  if (!strcmp(argv[a], "--stream"))
+  {
+    *stream = 1;
+  }
+  else if (!strcmp(argv[a], "--stats"))
+  {
+    *stats = 1;
+  }
+  else if (!strcmp(argv[a], "--metatables"))
+  {
+    *options |= OPTION_METATABLES;
+  }
+  else if (!strcmp(argv[a], "--flatten"))
+  {
+    *options |= OPTION_METATABLES | OPTION_FLATTEN;
+  }
+  else if (!strcmp(argv[a], "--slots"))
+  {
+    *options |= OPTION_SLOTS;
+  }
+  else if (!strcmp(argv[a], "--devirtualize"))
+  {
+    *options |= OPTION_DEVIRTUALIZE;
+  }
+  else if (!strcmp(argv[a], "--hoist"))
+  {
+    *options |= OPTION_HOIST;
+  }
+  else if (!strcmp(argv[a], "--inline"))
+  {
+    *options |= OPTION_INLINE;
+  }
+  else if (!strcmp(argv[a], "--scalarize"))
+  {
+    *options |= OPTION_SCALARIZE;
+  }
+  else if (!strcmp(argv[a], "--cse"))
+  {
+    *options |= OPTION_CSE;
+  }
+  else if (!strcmp(argv[a], "--lower"))
+  {
+    *options |= OPTION_LOWER;
+  }
+  else if (!strcmp(argv[a], "--minify"))
+  {
+    *options |= OPTION_MINIFY;
+  }
+  else if (!strcmp(argv[a], "--bytecode"))
+  {
+    *options |= OPTION_BYTECODE;
+  }
+  else if (!strcmp(argv[a], "--no-fold"))
+  {
+    *options |= OPTION_NO_FOLD;
+  }
+  else if (!strcmp(argv[a], "--no-eliminate"))
+  {
+    *options |= OPTION_NO_ELIMINATE;
+  }
+  else if (!strcmp(argv[a], "--print"))
   {
     if (*output)
     {
@@ -82,12 +173,15 @@ int main(int argc, char **argv)
 {
   char *source = NULL;
   FILE *output = NULL;
+  int stream = 0;
+  int stats = 0;
+  int options = 0;
   FILE *input = NULL;
 
   // Parse arguments
   for (int a = 1; a < argc; a++)
   {
-    int res = check_args(&output, &source, argc, argv, a);
+    int res = check_args(&output, &source, &stream, &stats, &options, argc, argv, a);
     if (res)
     {
       if (output && output != stdout)
@@ -114,7 +208,7 @@ int main(int argc, char **argv)
     printf("failure to open output stream\n");
     return 1;
   }
-  input = fopen(source, "r");
+  input = strcmp(source, "-") ? fopen(source, "r") : stdin;
   if (!input)
   {
     if (output && output != stdout)
@@ -127,9 +221,13 @@ int main(int argc, char **argv)
   // Compile
   moonshot_init();
   moonshot_configure(input, output);
+  moonshot_set_options(options);
   init_requires();
-  dummy_required_file(source);
-  moonshot_compile();
+  dummy_required_file(input == stdin ? "stdin" : source);
+  if (stream)
+    moonshot_compile_stream();
+  else
+    moonshot_compile();
   int n = moonshot_num_errors();
   if (n == 1)
     printf("Moonshot compiler returned 1 error\n");
@@ -140,6 +238,12 @@ int main(int argc, char **argv)
     error();
     printf("%s\n", moonshot_next_error());
   }
+  if (stats && !n)
+  {
+    fprintf(stderr, "Moonshot removed %i bytes of unreachable code\n", moonshot_eliminated_bytes());
+    for (int a = 0; a < NUM_PASSES; a++)
+      fprintf(stderr, "  %-9s %10.6f s\n", moonshot_pass_name(a), moonshot_pass_seconds(a));
+  }
   if (output != stdout)
     fclose(output);
   if (input != stdin)